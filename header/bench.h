@@ -0,0 +1,57 @@
+#pragma once
+
+#include "profiler.h"
+
+// =======================================
+// Distribution of a measure over the measured frames
+// =======================================
+typedef struct
+{
+    double mean, p50, p95, p99, max;
+} BenchStats;
+
+// =======================================
+// Frame-time benchmark of a headless run
+// - The first nOfWarmupFrames frames are not measured
+// - CPU time: from the start of a frame to its submission;
+//   frame time: until glFinish returns; GPU time and
+//   triangles: from GpuProfiler
+// - Results are written as JSON, and can be compared with
+//   a previous result (the baseline)
+// =======================================
+class FrameBench
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    size_t nOfWarmupFrames;
+
+    // Measured frames, in milliseconds
+    vector<double> cpuTimes, frameTimes;
+
+    // Profiled frames among the measured ones
+    vector<double> gpuTimes, triangles;
+
+    // --------------------------------
+    // Constructor
+    // --------------------------------
+    FrameBench();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void addFrame(size_t, double, double);
+    void addSample(const ProfileSample &);
+    double getTrianglesPerFrame() const;
+    double getTrianglesPerSecond() const;
+    void print();
+    bool writeJson(const string, const string, int, int);
+    bool compare(const string, double);
+};
+
+// =======================================
+// Benchmark utilities
+// =======================================
+BenchStats computeBenchStats(vector<double>);
+bool readJsonNumber(const string &, const string, const string, double &);
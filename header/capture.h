@@ -0,0 +1,96 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+
+#include "common.h"
+
+// Output formats of FrameCapture
+#define CAPTURE_BMP 0 // one .bmp per frame
+#define CAPTURE_PNG 1 // one .png per frame
+#define CAPTURE_RAW 2 // one .raw file, rgb24 frames, top row first
+#define CAPTURE_Y4M 3 // one .y4m file, YUV 4:4:4 frames
+
+// Pixel buffer objects in flight: a frame is read back
+// up to CAPTURE_PBOS - 1 frames after it was drawn
+#define CAPTURE_PBOS 3
+
+// =======================================
+// A frame read back, waiting for a worker
+// =======================================
+typedef struct
+{
+    size_t frame;
+    int buffer;
+} CapturedFrame;
+
+// =======================================
+// Records the framebuffer without stalling the pipeline
+// - glReadPixels writes into a ring of pixel buffer objects,
+//   which are mapped only once their fence has passed
+// - Mapped frames are copied into a fixed pool of buffers and
+//   encoded by worker threads; when the pool is full, the
+//   frame is dropped (or waited for, with isBlocking)
+// - Stream formats are written in frame order
+// =======================================
+class FrameCapture
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Output: file prefix (e.g. "./result/output") and format
+    string prefix;
+    int format;
+    int framesPerSecond;
+    FILE *stream;
+
+    // Size of the captured frames (0 before the first one)
+    int width, height;
+    size_t frameBytes;
+
+    // Ring of pixel buffer objects, and their fences
+    // (NULL when the slot holds no frame)
+    GLuint pbos[CAPTURE_PBOS];
+    GLsync fences[CAPTURE_PBOS];
+    int nextSlot;
+
+    // Buffers of the frames copied out of the pixel buffer objects
+    vector<vector<uint8_t>> buffers;
+    vector<int> freeBuffers;
+    bool isBlocking;
+
+    // Worker threads and their queue
+    vector<std::thread> workers;
+    std::mutex workMutex;
+    std::condition_variable workCondition, freeCondition, writeCondition;
+    std::deque<CapturedFrame> frames;
+    size_t nOfQueued, nOfWritten;
+    bool isStopping;
+
+    // Statistics
+    size_t nOfRead, nOfDropped, nOfStalls;
+    double readTime;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    FrameCapture();
+    FrameCapture(const FrameCapture &) = delete;
+    FrameCapture &operator=(const FrameCapture &) = delete;
+    ~FrameCapture();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void open(const string, int, int = 0, int = 8, int = 60);
+    void close();
+    void readFrame(int, int);
+    void poll();
+    bool retrieve(int, bool);
+    void resize(int, int);
+    void encodeFrames();
+    void writeImage(const uint8_t *, size_t);
+    void writeStream(const uint8_t *, size_t, vector<uint8_t> &);
+    void printStats();
+};
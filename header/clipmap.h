@@ -0,0 +1,76 @@
+#pragma once
+
+#include "tessellator.h"
+
+// Size of the clipOrigins array of tcsQuad.glsl and tesQuad.glsl
+#define MAX_CLIP_LEVELS 8
+
+// =======================================
+// Geometry clipmap of a height map
+// - Level k is clipSize x clipSize texels of mip k (texels
+//   of 2^k x 2^k height map texels), around the eye point
+// - A texel of level k is stored at its coordinate modulo
+//   clipSize (toroidal addressing, sampled with GL_REPEAT),
+//   so moving a level only uploads the strips coming into
+//   view, and nothing is ever copied
+// - The coarsest level covers the whole height map
+// =======================================
+class HeightClipmap
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Source: the height map (power of 2) and its
+    // box-filtered mips 1..nOfLevels - 1
+    const HeightMap *heightMap;
+    vector<HeightMap> mips;
+
+    // Texels per level side (power of 2), and number of levels
+    int clipSize;
+    int nOfLevels;
+
+    // Texel of level k at the (x0, y0) corner of its area
+    // (can be out of the map, the map repeats)
+    vector<ivec2> origins;
+
+    // Upload budget of update, in texels
+    size_t maxTexelsPerUpdate;
+
+    // Statistics of the last update, and of all updates
+    size_t nOfUploadedTexels, nOfUploadCalls, nOfStaleLevels;
+    size_t maxUploadedTexels, nOfUpdates;
+    double totalUploadedTexels;
+
+    // Gathered texels of a strip
+    vector<float> strip;
+
+    // Texture array (one layer per level), and the uniforms
+    // of the program reading it
+    GLuint tboClipmap;
+    int texUnit;
+    GLuint shader;
+    GLint uniIsClipmapped, uniTexClipmap, uniNumClipLevels, uniClipSize, uniClipOrigins, uniHeightSize;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    HeightClipmap();
+    HeightClipmap(const HeightClipmap &) = delete;
+    HeightClipmap &operator=(const HeightClipmap &) = delete;
+    ~HeightClipmap();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    bool build(const HeightMap &, int, int = 0);
+    const HeightMap &getLevel(int) const;
+    ivec2 getTargetOrigin(int, vec2) const;
+    void initTexture(int);
+    void initUniform(GLuint &);
+    void setUniform();
+    void reset(vec2);
+    void update(vec2);
+    void uploadRect(int, ivec2, ivec2);
+    void printStats();
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 // =======================================
 // Headers: order matters
 // =======================================
@@ -6,6 +8,19 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+#include <tuple>
+#include <unordered_map>
+#include <cstddef>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -24,6 +39,36 @@ using namespace glm;
 #define TRIANGLE 0
 #define QUAD 1
 
+// Vertex layouts of a mesh on the GPU
+#define LAYOUT_SEPARATE 0 // de-indexed, one vbo per attribute
+#define LAYOUT_INDEXED 1  // welded, one interleaved vbo + element buffer
+#define LAYOUT_PACKED 2   // as LAYOUT_INDEXED, with 12-byte quantized vertices
+#define LAYOUT_INSTANCED 3 // no vertex data, one instance per patch (grids only)
+#define LAYOUT_LISTED 4    // as LAYOUT_INSTANCED, patches of a GPU-built list (GpuPatchCuller)
+
+// Tessellation metrics of tcsQuad.glsl
+#define TESS_METRIC_DISTANCE 0     // fixed world-space distance bands
+#define TESS_METRIC_SCREEN_ERROR 1 // projected edge length and height error
+
+// Texture unit of texClipmap (HeightClipmap), set even without a
+// clipmap: GL rejects a sampler2DArray on the unit of a sampler2D
+#define CLIPMAP_UNIT 10
+
+// Index of a vt/vn missing in an .obj face
+#define OBJ_NO_INDEX 0xFFFFFFFFu
+
+// Binding points shared by every program
+#define FRAME_UNIFORM_BINDING 0 // uniform block Frame (FrameUniformBuffer)
+#define DRAW_RECORD_BINDING 1   // shader storage block of DrawBatch records
+#define PATCH_BOUNDS_BINDING 2  // world AABBs of the patches (GpuPatchCuller)
+#define PATCH_LIST_BINDING 3    // visible patches, written by the culling pass
+#define PATCH_LEVEL_BINDING 4   // tessellation levels of the visible patches
+#define PATCH_COMMAND_BINDING 5 // indirect command of the visible patches
+#define PATCH_STATS_BINDING 6   // occluded patches and triangles saved
+
+// Vertex attribute set to the baseInstance of a draw (DrawBatch)
+#define BASE_INSTANCE_ATTRIB 3
+
 // =======================================
 // Define a point
 // =======================================
@@ -50,6 +95,199 @@ typedef struct
     GLuint vn1, vn2, vn3, vn4;
 } Face;
 
+// =======================================
+// Interleaved vertex (LAYOUT_INDEXED)
+// =======================================
+typedef struct
+{
+    vec3 pos;
+    vec2 uv;
+    vec3 normal;
+} Vertex;
+
+// =======================================
+// Quantized vertex (LAYOUT_PACKED)
+// - pos: SNORM16 in the bounding box of the mesh,
+//   mapped back by Mesh::dequantize
+// - normal: octahedral encoding, 2 x SNORM8
+// - uv: 2 x half float
+// =======================================
+typedef struct
+{
+    int16_t pos[3];
+    uint16_t normal;
+    uint32_t uv;
+} PackedVertex;
+
+// =======================================
+// Model-space footprint of a quad patch,
+// before the height map displaces it
+// =======================================
+typedef struct
+{
+    vec3 posMin, posMax;
+    vec2 uvMin, uvMax;
+} PatchBounds;
+
+// =======================================
+// Size, modification time and hash of a file
+// =======================================
+typedef struct
+{
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+} FileSignature;
+
+// =======================================
+// Header of a preprocessed mesh (.tmesh)
+// The vertex streams follow the header,
+// ready to be passed to glBufferData
+// =======================================
+#define TMESH_MAGIC 0x48534d54u // "TMSH"
+#define TMESH_VERSION 3
+#define TMESH_MAX_STREAMS 4
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t faceType;
+    int32_t nOfVtxs;
+
+    // Signature of the source .obj
+    uint64_t objSize;
+    int64_t objMtime;
+    uint64_t objHash;
+
+    // Mesh::dequantize (LAYOUT_PACKED)
+    float dequantize[16];
+
+    // Size of each stream in bytes
+    int32_t layout;
+    uint32_t nOfStreams;
+    uint64_t streamBytes[TMESH_MAX_STREAMS];
+} TmeshHeader;
+
+// =======================================
+// Uniform block Frame of the shaders (std140):
+// a vec3 takes 16 bytes, as a vec4, unless a float
+// follows it
+// =======================================
+typedef struct
+{
+    mat4 V;
+    mat4 P;
+    vec4 eyePoint;
+    vec4 lightColor;
+    vec3 lightPosition;
+    float lodScale; // multiplies the tessellation levels (LodController)
+} FrameUniforms;
+
+// =======================================
+// Indirect draw commands (glMultiDraw*Indirect)
+// =======================================
+typedef struct
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+} DrawArraysCommand;
+
+// =======================================
+// Draw calls and state changes (program and vertex array
+// binds, uniform and buffer updates) issued by the draw
+// functions, to compare submission paths
+// =======================================
+typedef struct
+{
+    size_t nOfDrawCalls;
+    size_t nOfStateChanges;
+} DrawCounters;
+
+extern DrawCounters drawCounters;
+
+// =======================================
+// Per-frame uniforms shared by every program
+// - One uniform buffer, bound to FRAME_UNIFORM_BINDING and
+//   updated once per frame, instead of V, P, eyePoint and
+//   the light uploaded to each program at each draw
+// =======================================
+class FrameUniformBuffer
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    GLuint ubo;
+    FrameUniforms data;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    FrameUniformBuffer();
+    FrameUniformBuffer(const FrameUniformBuffer &) = delete;
+    FrameUniformBuffer &operator=(const FrameUniformBuffer &) = delete;
+    ~FrameUniformBuffer();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void init();
+    void update(mat4, mat4, vec3, vec3, vec3, float);
+};
+
+// =======================================
+// Indirect draws of one vertex array, in one call
+// - Every command has a baseInstance: the index of its
+//   record (e.g. a model matrix) in the shader storage
+//   buffer at DRAW_RECORD_BINDING, or any value the
+//   shader needs per draw (e.g. a first patch)
+// - Shaders before OpenGL 4.6 have no gl_BaseInstance: the
+//   attribute BASE_INSTANCE_ATTRIB reads a buffer of
+//   0, 1, 2..., with a divisor larger than any instance
+//   count, so every vertex of a draw gets its baseInstance
+// - Needs OpenGL 4.3 (multi-draw indirect and shader
+//   storage buffers), see isSupported
+// =======================================
+class DrawBatch
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    GLuint vao, ssbo, indirectBuffer, baseInstanceBuffer;
+    GLuint divisor;
+
+    // Records and commands of the next flush
+    size_t recordBytes;
+    vector<char> records;
+    vector<DrawArraysCommand> commands;
+
+    // Values in baseInstanceBuffer, it only grows
+    GLuint nOfBaseInstances;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    DrawBatch();
+    DrawBatch(const DrawBatch &) = delete;
+    DrawBatch &operator=(const DrawBatch &) = delete;
+    ~DrawBatch();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    static bool isSupported();
+    void init(GLuint, GLuint, size_t = 0);
+    GLuint addRecord(const void *);
+    void add(GLuint, GLuint, GLuint, GLuint);
+    void flush(GLenum);
+    void clear();
+    void initBaseInstances(GLuint);
+};
+
 // =======================================
 // Define a mesh
 // =======================================
@@ -66,46 +304,224 @@ class Mesh
     vector<Face> faces;
 
     // OpenGL context
-    GLuint vboVtxs, vboUvs, vboNormals;
+    GLuint vboVtxs, vboUvs, vboNormals, ebo;
     GLuint vao;
     GLuint shader;
-    GLuint tboBase, tboNormal, tboHeight;
-    GLint uniModel, uniView, uniProjection;
-    GLint uniEyePoint, uniLightColor, uniLightPosition;
-    GLint uniTexBase, uniTexNormal, uniTexHeight;
+    GLuint tboBase, tboNormal, tboHeight, tboRoughness;
+    GLint uniModel;
+    GLint uniDequantize, uniNormalPacked, uniGridSize;
+    GLint uniTexBase, uniTexNormal, uniTexHeight, uniTexRoughness;
+    GLint uniTessMetric, uniViewport, uniPixelsPerTriangle, uniMaxPixelError;
 
     // Transformation matrices
     mat4 model, view, projection;
 
+    // Maps quantized positions back to model space
+    // (identity unless the layout is LAYOUT_PACKED)
+    mat4 dequantize;
+
     // Face type of the mesh (triangle or quad)
     int faceType;
 
+    // Vertex layout, and the number of vertices (or indices)
+    // passed to glDrawArrays (or glDrawElements)
+    int layout;
+    GLsizei nOfDrawVtxs;
+
+    // Tessellation metric, and the targets of TESS_METRIC_SCREEN_ERROR
+    // (viewport in pixels, triangle edge and height error in pixels)
+    int tessMetric;
+    vec2 viewport;
+    float pixelsPerTriangle, maxPixelError;
+
+    // Number of patches along x and z (procedural grids only)
+    ivec2 gridSize;
+
+    // Footprint of each quad patch (quad meshes loaded from a file,
+    // grids compute it on the fly)
+    vector<PatchBounds> patchBounds;
+
+    // Scratch arrays of the multi-draw calls
+    vector<GLint> drawFirsts;
+    vector<GLsizei> drawCounts;
+    vector<const void *> drawOffsets;
+
+    // Visible runs of LAYOUT_INSTANCED in one indirect draw,
+    // instead of one draw per run (see DrawBatch::isSupported)
+    bool isBatched;
+    DrawBatch *batch;
+
+    // Preprocessed mesh file and the .obj it was built from
+    string cacheFile;
+    FileSignature objSignature;
+
     // --------------------------------
     // Constructor and destructor
     // --------------------------------
-    Mesh(const string, int);
+    Mesh();
+    Mesh(const string, int, int = LAYOUT_SEPARATE);
     ~Mesh();
+    static Mesh *createGrid(int, int, int = LAYOUT_INDEXED);
 
     // --------------------------------
     // Member functions
     // --------------------------------
+    void buildGrid(int, int);
     void loadObj(const string);
     void loadObjQuad(const string);
+    void loadObjFile(const string, int);
     void initBuffers();
     void initBuffersQuad();
+    void initBuffersIndexed(int);
+    void uploadIndexed(const vector<Vertex> &, const vector<GLuint> &);
+    void weldVertices(int, vector<Vertex> &, vector<GLuint> &) const;
+    void uploadStreams(const void **, const uint64_t *, int, GLsizei);
+    bool loadCache(const string);
+    void saveCache(const void **, const uint64_t *, int, GLsizei);
+    void initPatchBounds(const void **, int, GLsizei);
+    size_t getNumPatches() const;
+    PatchBounds getPatchBounds(size_t) const;
     void initShader();
     void initUniform();
-    void draw(mat4, mat4, mat4, vec3, vec3, vec3, int);
+    void useProgram(mat4, int);
+    void draw(mat4, int, const vector<ivec2> * = NULL);
+    void drawIndirect(mat4, int, GLuint);
     void setTexture(GLuint &, int, const string, FREE_IMAGE_FORMAT);
+    void setHeightTexture(GLuint &, int, const string, FREE_IMAGE_FORMAT);
+};
+
+// =======================================
+// Read-only memory-mapped file
+// =======================================
+class MappedFile
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    const char *data;
+    size_t size;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    bool open(const string);
+    void close();
 };
 
+// =======================================
+// Linked program on disk (glGetProgramBinary),
+// followed by binaryBytes bytes of binary
+// =======================================
+#define PROGRAM_CACHE_MAGIC 0x47525042u // "BPRG"
+#define PROGRAM_CACHE_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key; // shader sources and driver
+    uint32_t binaryFormat;
+    uint32_t binaryBytes;
+} ProgramCacheHeader;
+
+// =======================================
+// Program built (or being built) by ProgramCache
+// =======================================
+typedef struct
+{
+    string files[4]; // vs, fs, tcs, tes ("" if none)
+    uint64_t key;
+    GLuint program;
+    GLuint shaders[4];
+    bool isFromBinary;
+} CachedProgram;
+
+// =======================================
+// Cache of linked shader programs
+// - A program is keyed by a hash of its sources and of the
+//   GL vendor, renderer and version, and saved with
+//   glGetProgramBinary as <directory>/<key>.glbin; a
+//   binary rejected by the driver is compiled again
+// - submit starts a build and returns without waiting;
+//   with GL_KHR_parallel_shader_compile, the driver
+//   compiles the programs submitted together on its own
+//   threads, until get (or any query) needs one of them
+// - buildShader goes through programCache when set
+// =======================================
+class ProgramCache
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Cache directory ("" means compiling every program)
+    string directory;
+    bool hasBinaries, isParallel;
+    uint64_t driverHash;
+
+    // Submitted programs, not checked yet
+    vector<CachedProgram> pending;
+
+    // Statistics
+    size_t nOfLoaded, nOfCompiled, nOfRejected;
+    double waitTime; // milliseconds spent in submit and get
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    ProgramCache();
+    ProgramCache(const ProgramCache &) = delete;
+    ProgramCache &operator=(const ProgramCache &) = delete;
+    ~ProgramCache();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void init(const string);
+    void submit(const string, const string, const string = "", const string = "");
+    GLuint get(const string, const string, const string = "", const string = "");
+    void printStats();
+    bool loadBinary(CachedProgram &);
+    void saveBinary(const CachedProgram &);
+    void compileSources(CachedProgram &);
+    GLuint finish(CachedProgram &);
+    string getBinaryFileName(uint64_t);
+};
+
+extern ProgramCache *programCache;
+
 // =======================================
 // OpenGL utilities
 // =======================================
 string readFile(const string);
 void printLog(GLuint &);
 GLint myGetUniformLocation(GLuint &, string, bool = false);
+void bindFrameUniforms(GLuint);
 GLuint buildShader(string, string, string, string);
+GLuint buildComputeShader(string);
 GLuint compileShader(string, GLenum);
 GLuint linkShader(GLuint, GLuint, GLuint, GLuint);
-void drawPoints(vector<Point> &);
+bool hasGLExtension(const char *);
+bool hasGLVersion(int, int);
+
+// =======================================
+// CPU utilities
+// =======================================
+int getNumThreads(int = 0);
+void parallelFor(size_t, function<void(size_t, size_t)>, int = 0);
+uint64_t hashBytes(const char *, size_t);
+bool getFileSignature(const string, FileSignature &);
+string getCacheFileName(const string);
+bool loadHeightImage(const string, FREE_IMAGE_FORMAT, int &, int &, vector<float> &, GLenum &);
+void printWeldStats(size_t, size_t);
+vec2 octEncode(vec3);
+void packVertices(const vector<Vertex> &, vector<PackedVertex> &, mat4 &);
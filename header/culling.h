@@ -0,0 +1,167 @@
+#pragma once
+
+#include "pyramid.h"
+
+// Texture unit of the depth pyramid (DepthPyramid)
+#define HIZ_UNIT 9
+
+// =======================================
+// Max-depth pyramid of the last frame (Hi-Z)
+// - build copies the depth buffer of the read framebuffer
+//   into level 0, and each level keeps the farthest depth
+//   of the 2 x 2 texels below it (3 at an odd border)
+// - A box is occluded when its nearest depth is behind
+//   every texel under its screen rectangle, read at the
+//   level where the rectangle spans 2 x 2 texels at most
+// - The depth is the one of the previous frame, tested with
+//   its own view-projection matrix: a patch hidden there
+//   is skipped for one frame, even if it is visible now
+// - Needs OpenGL 4.3 (compute shaders), as GpuPatchCuller
+// =======================================
+class DepthPyramid
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    GLuint program;
+    GLuint depthTexture, pyramidTexture;
+    GLint uniLevel;
+
+    // Size of level 0 (the framebuffer), and number of levels
+    ivec2 size;
+    int nOfLevels;
+
+    // View-projection matrix of the depth, and whether build
+    // was called since the last resize
+    mat4 viewProjection;
+    bool isValid;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    DepthPyramid();
+    DepthPyramid(const DepthPyramid &) = delete;
+    DepthPyramid &operator=(const DepthPyramid &) = delete;
+    ~DepthPyramid();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    bool init();
+    void resize(int, int);
+    void build(mat4, int, int);
+};
+
+// =======================================
+// Per-patch view frustum culling
+// =======================================
+class PatchCuller
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Inputs
+    const Mesh &mesh;
+    const HeightPyramid *heightPyramid;
+    float heightScale;
+
+    // Height range of each patch, as (min, max) of texHeight
+    vector<vec2> heightRanges;
+
+    // World-space AABB of each patch, for boundsModel
+    vector<vec3> boundsMin, boundsMax;
+    mat4 boundsModel;
+    bool isBoundsValid;
+
+    // Visible patches of the last update,
+    // as (first patch, number of patches) runs for Mesh::draw
+    vector<ivec2> runs;
+
+    // Statistics of the last update
+    size_t nOfPatches, nOfDrawn, nOfCulled;
+    double seconds;
+
+    // --------------------------------
+    // Constructor
+    // --------------------------------
+    PatchCuller(const Mesh &, const HeightPyramid *);
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void initBounds(mat4, int = 0);
+    void update(mat4, mat4, mat4, int = 0);
+    void printStats();
+};
+
+// =======================================
+// Per-patch frustum culling and tessellation levels on the
+// GPU, before drawing a LAYOUT_LISTED grid (OpenGL 4.3)
+// - A compute pass (csPatchCull.glsl) tests the AABB of every
+//   patch, from PatchCuller::initBounds, against the view frustum
+// - Visible patches are appended to the patch list with the
+//   levels of their edges and interior, computed as in
+//   tcsQuad.glsl, and counted in the instanceCount of a
+//   DrawArraysCommand
+// - Mesh::drawIndirect draws the list without reading it
+//   back: vsPhongListed.glsl and tcsQuadListed.glsl read the
+//   patch ids and the levels
+// - The list is in the order of an atomic counter, so it may
+//   change from frame to frame
+// =======================================
+class GpuPatchCuller
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // AABBs of the patches, uploaded when M changes
+    PatchCuller &culler;
+    mat4 boundsModel;
+    bool isBoundsValid;
+
+    // Depth of the last frame, NULL means no occlusion test
+    const DepthPyramid *depthPyramid;
+
+    // Compute pass, and the buffers at PATCH_BOUNDS_BINDING,
+    // PATCH_LIST_BINDING, PATCH_LEVEL_BINDING,
+    // PATCH_COMMAND_BINDING and PATCH_STATS_BINDING
+    GLuint program;
+    GLuint boundsBuffer, listBuffer, levelBuffer, commandBuffer, statsBuffer;
+    GLint uniModel, uniGridSize, uniPlanes, uniFrustumCulled;
+    GLint uniTessMetric, uniViewport, uniPixelsPerTriangle, uniMaxPixelError;
+    GLint uniOcclusionCulled, uniHiZViewProjection;
+
+    // Statistics of the last readStats: patches outside the
+    // frustum (culled) or behind the depth (occluded), and the
+    // triangles they would have made
+    size_t nOfPatches, nOfDrawn, nOfCulled, nOfOccluded, nOfSavedTriangles;
+
+    // Sums over the frames read by readStats
+    size_t nOfFramesRead, sumOfOccluded, sumOfSavedTriangles;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    GpuPatchCuller(PatchCuller &);
+    GpuPatchCuller(const GpuPatchCuller &) = delete;
+    GpuPatchCuller &operator=(const GpuPatchCuller &) = delete;
+    ~GpuPatchCuller();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    static bool isSupported();
+    bool init(int, int);
+    void update(mat4, mat4, mat4, bool = true);
+    void readStats();
+    void printStats();
+};
+
+// =======================================
+// Culling utilities
+// =======================================
+void getFrustumPlanes(mat4, vec4 *);
+bool isBoxOutside(const vec4 *, vec3, vec3);
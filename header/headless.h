@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+
+// =======================================
+// Camera pose of a path, as in computeMatricesFromInputs
+// =======================================
+typedef struct
+{
+    vec3 eye;
+    float verticalAngle, horizontalAngle;
+} CameraPose;
+
+// =======================================
+// OpenGL context without any window
+// - EGL without surface (EGL_MESA_platform_surfaceless when
+//   available), so it runs without a display server, e.g.
+//   on Mesa llvmpipe
+// - Frames are drawn into a framebuffer object of a fixed
+//   size, which stays bound
+// - EGL handles are kept as void *, EGL headers are only
+//   included by headless.cpp
+// =======================================
+class HeadlessContext
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    void *display;
+    void *context;
+
+    // Framebuffer object and its attachments
+    GLuint fbo, rboColor, rboDepth;
+    int width, height;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    HeadlessContext();
+    HeadlessContext(const HeadlessContext &) = delete;
+    HeadlessContext &operator=(const HeadlessContext &) = delete;
+    ~HeadlessContext();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    bool create(int, int);
+    void initFramebuffer(int, int);
+    void destroy();
+};
+
+// =======================================
+// Camera path utilities
+// =======================================
+bool loadCameraPath(const string, vector<CameraPose> &);
+bool saveCameraPath(const string, const vector<CameraPose> &);
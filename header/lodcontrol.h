@@ -0,0 +1,79 @@
+#pragma once
+
+#include "profiler.h"
+
+// Measure held by LodController
+#define LOD_TARGET_GPU_TIME 0  // GL_TIME_ELAPSED of the draws, in milliseconds
+#define LOD_TARGET_TRIANGLES 1 // GL_PRIMITIVES_GENERATED
+
+// =======================================
+// Feedback on the tessellation levels, to hold a GPU time
+// or a number of triangles per frame
+// - Fed with the samples of GpuProfiler (onSample), which
+//   arrive a few frames late; its output is lodScale, the
+//   factor of every tessellation level (uniform block Frame)
+// - Triangles grow with the square of the levels, so the
+//   scale moves by sqrt(target / measure), at most maxStep
+//   per sample
+// - Hysteresis: the scale only starts moving when the
+//   smoothed measure leaves target +- band (and moved since
+//   the last hold), and stops once it is back within
+//   target +- band / 2
+// - Each overshoot halves the step: when two rounded level
+//   counts straddle the target, the scale settles under it
+// - A sample drawn before the last change is skipped, and
+//   the smoothing restarts after a change
+// =======================================
+class LodController
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Settings
+    int targetType;
+    double target;
+    double band;      // fraction of the target
+    double smoothing; // weight of a new sample
+    float minScale, maxScale, maxStep;
+
+    // State: the scale, the first frame drawn with it, and
+    // whether the next frame is the first one
+    float scale;
+    size_t scaleFrame;
+    bool isScalePending;
+
+    // Smoothed measure since the last change
+    double measure;
+    bool isMeasureValid;
+
+    // Adjusting: largest step and direction of the last one;
+    // holding: the measure when it started
+    bool isAdjusting;
+    float stepLimit;
+    int lastDirection;
+    double heldMeasure;
+
+    // Statistics
+    size_t nOfSamples, nOfStale, nOfInBand, nOfAdjustments;
+    float lowestScale, highestScale;
+
+    // Log: one line per sample (optional)
+    FILE *log;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    LodController(int, double);
+    LodController(const LodController &) = delete;
+    LodController &operator=(const LodController &) = delete;
+    ~LodController();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    bool openLog(const string);
+    float beginFrame(size_t);
+    void addSample(const ProfileSample &);
+    void printStats();
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "common.h"
+
+// Regions of the vertex buffer: the points of a frame are
+// written to one region while the GPU reads the others
+#define POINT_FRAMES 3
+
+// Points of a frame at most (default)
+#define POINT_CAPACITY 4096
+
+// =======================================
+// Interleaved vertex of a point (16 bytes)
+// =======================================
+typedef struct
+{
+    vec3 pos;
+    uint32_t color; // RGBA8, red in the lowest byte
+} PointVertex;
+
+// =======================================
+// Batched point sprites (light markers, debug points)
+// - Points are appended during the frame, and drawn by
+//   flush with a single glDrawArrays
+// - One buffer of POINT_FRAMES regions, created once; a
+//   region is written again only after the fence of its
+//   last draw is signaled
+// - With ARB_buffer_storage (OpenGL 4.4), the buffer is
+//   persistently mapped and add writes into it; otherwise
+//   (macOS) points go to a staging array, uploaded by
+//   flush with glBufferSubData
+// - Nothing is allocated and no GL object is created
+//   after init
+// =======================================
+class PointRenderer
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    GLuint shader, vao, vbo;
+    GLint uniModel, uniView, uniProjection;
+
+    // Points per region, and the region of the current frame
+    size_t capacity;
+    int region;
+    GLsync fences[POINT_FRAMES];
+
+    // Persistently mapped buffer (all regions), or NULL
+    PointVertex *mapped;
+    vector<PointVertex> staging;
+
+    // Points of the current frame: written to the region
+    // once its fence is signaled (isRegionReady)
+    PointVertex *points;
+    size_t nOfPoints;
+    bool isRegionReady;
+
+    // Statistics
+    size_t nOfDropped, nOfWaits;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    PointRenderer();
+    PointRenderer(const PointRenderer &) = delete;
+    PointRenderer &operator=(const PointRenderer &) = delete;
+    ~PointRenderer();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void init(size_t = POINT_CAPACITY);
+    bool add(vec3, vec3);
+    void add(const vector<Point> &);
+    void flush(mat4, mat4, mat4);
+    void waitRegion();
+};
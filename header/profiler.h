@@ -0,0 +1,93 @@
+#pragma once
+
+#include <deque>
+
+#include "common.h"
+
+// Frames of queries in flight: the results of a frame are
+// read PROFILER_FRAMES - 1 frames later, when available
+#define PROFILER_FRAMES 3
+
+// Frames kept for the overlay and the averages
+#define PROFILER_HISTORY 128
+
+// Counters of a profiled frame
+#define PROFILE_PRIMITIVES 0      // GL_PRIMITIVES_GENERATED (tessellator output)
+#define PROFILE_VS_INVOCATIONS 1  // pipeline statistics, ARB_pipeline_statistics_query
+#define PROFILE_TCS_PATCHES 2     // (zero without it)
+#define PROFILE_TES_INVOCATIONS 3 //
+#define PROFILE_CLIP_INPUTS 4     //
+#define PROFILE_CLIP_OUTPUTS 5    //
+#define PROFILE_FS_INVOCATIONS 6  //
+#define PROFILE_COUNTERS 7
+
+// =======================================
+// Results of a profiled frame
+// =======================================
+typedef struct
+{
+    size_t frame;
+    double gpuTime; // GL_TIME_ELAPSED, in milliseconds
+    GLuint64 counters[PROFILE_COUNTERS];
+} ProfileSample;
+
+// =======================================
+// GPU timer and pipeline statistics of the draws
+// - begin and end bracket the draws of a frame with one
+//   query per counter; queries of PROFILER_FRAMES frames
+//   rotate, and results are only read once available,
+//   so the CPU never waits for the GPU
+// - A frame whose queries are still busy is not profiled
+// - Samples go to a CSV file (optional), to the history
+//   drawn by the overlay, and to printStats
+// =======================================
+class GpuProfiler
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Whether pipeline statistics are available
+    bool hasPipelineStats;
+
+    // Queries of every slot: timer, then one per counter
+    GLuint queries[PROFILER_FRAMES][PROFILE_COUNTERS + 1];
+    size_t slotFrames[PROFILER_FRAMES];
+    bool isSlotBusy[PROFILER_FRAMES];
+    int currentSlot;
+    size_t frame;
+
+    // Results
+    std::deque<ProfileSample> history;
+    size_t nOfSamples, nOfSkipped;
+    FILE *csv;
+
+    // Called with every sample, in frame order (optional)
+    function<void(const ProfileSample &)> onSample;
+
+    // Overlay: a graph of the history
+    bool isOverlayOn;
+    GLuint overlayShader, vaoOverlay, vboOverlay;
+    vector<GLfloat> overlayVertices;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    GpuProfiler();
+    GpuProfiler(const GpuProfiler &) = delete;
+    GpuProfiler &operator=(const GpuProfiler &) = delete;
+    ~GpuProfiler();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void init();
+    bool openCsv(const string);
+    void begin();
+    void end();
+    void collect();
+    const ProfileSample *getLastSample() const;
+    void initOverlay();
+    void drawOverlay();
+    void printStats();
+};
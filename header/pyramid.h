@@ -0,0 +1,57 @@
+#pragma once
+
+#include "tessellator.h"
+
+// =======================================
+// Min/max pyramid of a height map
+// - Level 0 is the height map itself
+// - A cell of level k covers 2^k x 2^k texels,
+//   the last row/column covers what is left
+// - Mins and maxs are kept in separate planes,
+//   so every level is built by the same SIMD kernel
+// =======================================
+class HeightPyramid
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    const HeightMap *heightMap;
+    const HeightMap *maxHeightMap;
+    int nOfLevels;
+
+    // Size of each level, in cells
+    vector<ivec2> levelSizes;
+
+    // Planes of level k >= 1 (level 0 reads the texels of
+    // heightMap and maxHeightMap, the same map unless built
+    // from separate min and max maps)
+    vector<vector<float>> mins, maxs;
+
+    // Statistics of the last build
+    int nOfThreads;
+    double seconds;
+
+    // --------------------------------
+    // Constructor
+    // --------------------------------
+    HeightPyramid();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void build(const HeightMap &, int = 0);
+    void build(const HeightMap &, const HeightMap &, int = 0);
+    vec2 getBounds(int, int, int) const;
+    vec2 getTexelRange(int, int, int, int) const;
+    vec2 getRange(vec2, vec2) const;
+    void setTexture(GLuint &, int) const;
+    void printStats();
+};
+
+// =======================================
+// Pyramid utilities
+// =======================================
+void reduceMin2x2(const float *, int, int, float *, int, int);
+void reduceMax2x2(const float *, int, int, float *, int, int);
+void computeRoughness(const HeightMap &, HeightMap &, int = 0);
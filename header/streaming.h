@@ -0,0 +1,137 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+
+#include "pyramid.h"
+
+// =======================================
+// Header of a tiled height map (.htile)
+// - Tiles are stored row by row, each one as
+//   (tileSize + 2 * border)^2 uint16 heights, the border
+//   repeating the neighbouring texels (GL_REPEAT)
+// - A table of (min, max) per tile, border included,
+//   and a box-filtered overview of the whole map follow
+// =======================================
+#define HTILE_MAGIC 0x454c5448u // "HTLE"
+#define HTILE_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+
+    // Size in texels, multiples of tileSize
+    int32_t width, height;
+    int32_t tileSize, border;
+    int32_t nOfTilesX, nOfTilesY;
+
+    // Overview: one texel per overviewStep x overviewStep texels
+    int32_t overviewStep;
+    int32_t overviewWidth, overviewHeight;
+    int32_t reserved;
+
+    // Byte offsets in the file
+    uint64_t tileOffset;
+    uint64_t rangeOffset;
+    uint64_t overviewOffset;
+} HtileHeader;
+
+// Default texture units of the streamed textures (below those of quad)
+#define STREAM_UNIT_TILES 13
+#define STREAM_UNIT_INDIRECTION 12
+#define STREAM_UNIT_OVERVIEW 11
+
+// Residency of a tile
+#define TILE_ABSENT 0
+#define TILE_QUEUED 1   // waiting for the I/O thread
+#define TILE_LOADING 2  // being read by the I/O thread
+#define TILE_LOADED 3   // read, waiting for an atlas slot
+#define TILE_RESIDENT 4 // in the atlas
+
+// =======================================
+// A tile read by the I/O thread
+// =======================================
+typedef struct
+{
+    int tile;
+    vector<uint16_t> texels;
+} LoadedTile;
+
+// =======================================
+// Streams the tiles of a .htile around the camera
+// - Tiles live in the slots of a texture array, and an
+//   indirection texture gives the slot of every tile
+//   (-1 falls back to the overview)
+// - Tiles are read from the memory-mapped file by a
+//   background thread, uploaded by the main thread, and
+//   the least recently wanted tile makes room for a new one
+// =======================================
+class HeightStreamer
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    MappedFile file;
+    HtileHeader header;
+    int tileTexels;
+    size_t tileBytes;
+
+    // Height range of every tile, and their min/max pyramids,
+    // one cell per tile (for culling and CDLOD selection)
+    HeightMap tileMins, tileMaxs;
+    HeightPyramid tilePyramid;
+
+    // Atlas slots (budget), and the slot of every tile
+    int nOfSlots;
+    vector<int> slotTiles;
+    vector<uint64_t> slotLastWanted;
+    vector<int> tileSlots;
+    vector<uint64_t> tileLastWanted;
+    vector<uint8_t> tileStates;
+    uint64_t frame;
+
+    // At most that many uploads per update
+    int maxUploadsPerUpdate;
+
+    // I/O thread and its queues
+    std::thread ioThread;
+    std::mutex ioMutex;
+    std::condition_variable ioCondition;
+    std::deque<int> requests;
+    std::deque<LoadedTile> loadedTiles;
+    bool isStopping;
+
+    // Textures
+    GLuint tboTiles, tboIndirection, tboOverview;
+    int unitTiles, unitIndirection, unitOverview;
+
+    // Statistics
+    size_t nOfWanted, nOfUploads, nOfEvictions, nOfMisses;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    HeightStreamer();
+    HeightStreamer(const HeightStreamer &) = delete;
+    HeightStreamer &operator=(const HeightStreamer &) = delete;
+    ~HeightStreamer();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    bool open(const string, size_t);
+    void close();
+    void initTextures(int, int, int);
+    void update(vec2);
+    void uploadTile(LoadedTile &);
+    int findSlot();
+    void readTiles();
+    void printStats();
+};
+
+// =======================================
+// Streaming utilities
+// =======================================
+bool writeHeightTiles(const string, int, int, int, function<float(int, int)>, int = 0);
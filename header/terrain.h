@@ -0,0 +1,122 @@
+#pragma once
+
+#include "culling.h"
+#include "streaming.h"
+
+// =======================================
+// An area drawn by Terrain::draw
+// =======================================
+typedef struct
+{
+    // World xz of the (x0, z0) corner, and world size
+    vec2 origin;
+    float size;
+
+    // LOD level (0 is the finest), and the tessellation level of
+    // its patches (halved when a quadrant is drawn at its parent's level)
+    int level;
+    int tessLevel;
+} TerrainChunk;
+
+// =======================================
+// Chunk of a batched draw (ChunkRecord of
+// vsTerrainBatched.glsl, std430)
+// =======================================
+typedef struct
+{
+    vec2 origin;
+    float size;
+    int32_t tessLevel;
+    vec2 morphRange;
+    vec2 padding;
+} TerrainDrawRecord;
+
+// =======================================
+// CDLOD quadtree terrain
+// - Every node is drawn with the same grid of patches,
+//   so a node of level k has 2^k times bigger cells than level 0
+// - Nodes are selected by distance: level k is used up to
+//   ranges[k], where cells of level k + 1 are pixelsPerCell on screen
+// - Vertices morph to the grid of the next level before the range
+//   ends, so neighbouring levels meet without cracks
+// =======================================
+class Terrain
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Inputs
+    const HeightPyramid *heightPyramid;
+    float size;
+    float texelSize;
+    float heightScale;
+
+    // World xz to uv of the height map (GL_REPEAT tiles it)
+    vec2 uvScale;
+
+    // Tiled height map streamed around the camera, instead of
+    // texHeight (NULL if not streamed)
+    HeightStreamer *streamer;
+
+    // Quadtree: nOfLevels levels, nodes of nodeSizes[k] world units
+    int nOfLevels;
+    vector<float> nodeSizes;
+
+    // Grid of every node: patchesPerNode^2 patches of tessLevel^2 cells
+    int patchesPerNode;
+    int tessLevel;
+
+    // Selection ranges and morph ranges of every level
+    float pixelsPerCell;
+    float morphStartRatio;
+    vector<float> ranges;
+    vector<vec2> morphRanges;
+
+    // Chunks of the last selection, in quadtree order
+    vector<TerrainChunk> chunks;
+
+    // Statistics of the last selection
+    size_t nOfVisited, nOfCulled;
+    double seconds;
+
+    // Patch grid (LAYOUT_INSTANCED) and its shader
+    Mesh *grid;
+    GLuint shader;
+    GLint uniTexHeight, uniGridSize, uniUvScale, uniHeightScale;
+    GLint uniChunkOrigin, uniChunkSize, uniTessLevel, uniMorphRange;
+    GLint uniIsStreamed, uniTexTiles, uniTexIndirection, uniTexOverview;
+    GLint uniNumTiles, uniTileSize, uniTileBorder;
+
+    // Every chunk in one indirect draw (set before initShader,
+    // which clears it without OpenGL 4.3), instead of one
+    // draw and four uniforms per chunk
+    bool isBatched;
+    DrawBatch *batch;
+
+    // --------------------------------
+    // Constructor and destructor
+    // --------------------------------
+    Terrain(const HeightPyramid *, float, float = 1.f, float = 10.f);
+    ~Terrain();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void initRanges(mat4, vec2);
+    void initShader();
+    void initUniform();
+    void setStreamer(HeightStreamer *);
+    void select(mat4, mat4, vec3);
+    bool selectNode(int, int, int, const vec4 *, vec3);
+    void getNodeBounds(int, int, int, vec3 &, vec3 &) const;
+    void addChunk(vec2, float, int, int);
+    void draw(int);
+    size_t getNumPatches() const;
+    void printStats();
+};
+
+// =======================================
+// Terrain utilities
+// =======================================
+bool isBoxInRange(vec3, vec3, vec3, float);
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "common.h"
+
+// Limits of the fixed-function tessellator
+#define MAX_TESS_LEVEL 64
+
+// =======================================
+// Tessellation levels of a quad patch
+// (same layout as gl_TessLevelOuter/Inner)
+// =======================================
+typedef struct
+{
+    float outer[4];
+    float inner[2];
+} TessLevels;
+
+// =======================================
+// CPU copy of a height map
+// =======================================
+class HeightMap
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    int width, height;
+
+    // Red channel in [0, 1], row 0 is the bottom row
+    // (FreeImage order, also the order glTexImage2D receives)
+    vector<float> texels;
+
+    // --------------------------------
+    // Constructor
+    // --------------------------------
+    HeightMap();
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    bool load(const string, FREE_IMAGE_FORMAT);
+    float texel(int, int) const;
+    float sample(vec2) const;
+    vec2 getRange(vec2, vec2) const;
+    void buildMips(vector<HeightMap> &, int = 0, int = 0) const;
+    float sampleLod(const vector<HeightMap> &, vec2, float) const;
+};
+
+class HeightPyramid;
+
+// =======================================
+// Inputs of the screen-space error metric
+// (uniforms of tcsQuad.glsl)
+// =======================================
+typedef struct
+{
+    mat4 P;
+    vec2 viewport;
+    float pixelsPerTriangle, maxPixelError;
+
+    // Height map (displaced by heightScale),
+    // and min/max pyramid of its roughness
+    float heightScale;
+    const HeightMap *heightMap;
+    const HeightPyramid *roughness;
+
+    // Factor of every level (lodScale of the uniform block Frame)
+    float lodScale;
+} ScreenErrorMetric;
+
+// =======================================
+// CPU reference of tcsQuad.glsl + tesQuad.glsl
+// =======================================
+class Tessellator
+{
+  public:
+    // --------------------------------
+    // Member variables
+    // --------------------------------
+    // Inputs
+    const Mesh &mesh;
+    const HeightMap *heightMap;
+    float heightScale;
+    bool keepVertices;
+
+    // Factor of every level, as LodController sets it (1: none)
+    float lodScale;
+
+    // Mipmaps of heightMap (as glGenerateMipmap), read like
+    // tesQuad.glsl reads texHeight
+    vector<HeightMap> heightMips;
+
+    // TESS_METRIC_DISTANCE or TESS_METRIC_SCREEN_ERROR
+    int metric;
+    ScreenErrorMetric screenError;
+
+    // Per-patch results
+    vector<TessLevels> levels;
+    vector<size_t> vtxOffsets, triOffsets;
+
+    // Tessellated surface (only if keepVertices)
+    vector<vec3> positions;
+    vector<vec2> uvs;
+    vector<vec3> normals;
+    vector<GLuint> indices;
+
+    // Statistics of the last run
+    size_t nOfPatches, nOfVertices, nOfTriangles;
+    vec3 boundsMin, boundsMax;
+    int nOfThreads;
+    double seconds;
+
+    // --------------------------------
+    // Constructor
+    // --------------------------------
+    Tessellator(const Mesh &, const HeightMap *);
+
+    // --------------------------------
+    // Member functions
+    // --------------------------------
+    void run(mat4, vec3, int = 0);
+    void printStats();
+    size_t checkSharedEdges();
+    bool saveObj(const string);
+};
+
+// =======================================
+// Tessellation utilities
+// =======================================
+float getTessLevel(float, float, float = 1.f);
+TessLevels computeTessLevels(const vec3 *, vec3, float = 1.f);
+float getRoughness(const HeightPyramid &, vec2, vec2);
+float getScreenErrorLevel(vec3, vec3, vec2, vec2, float, vec3, const ScreenErrorMetric &);
+TessLevels computeTessLevels(const vec3 *, const vec2 *, vec3, const ScreenErrorMetric &);
+bool roundTessLevels(const TessLevels &, int *, int *);
+void countQuadDomain(const int *, const int *, size_t &, size_t &);
+void tessellateQuadDomain(const int *, const int *, vector<vec2> &, vector<GLuint> &);
+float getHeightLod(const vec2 *, const int *, const int *, vec2, vec2);
@@ -0,0 +1,44 @@
+#version 430
+
+// One level of the max-depth pyramid (DepthPyramid), one invocation
+// per texel: level 0 copies texDepth, the others keep the farthest
+// depth of the texels they cover in the level below
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+uniform int level;
+uniform sampler2D texDepth;
+
+layout(r32f, binding = 0) readonly uniform image2D srcLevel;
+layout(r32f, binding = 1) writeonly uniform image2D dstLevel;
+
+void main()
+{
+    ivec2 dst = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 dstSize = imageSize(dstLevel);
+    if (any(greaterThanEqual(dst, dstSize)))
+    {
+        return;
+    }
+
+    if (level == 0)
+    {
+        imageStore(dstLevel, dst, vec4(texelFetch(texDepth, dst, 0).r));
+        return;
+    }
+
+    // 2 x 2 texels, and the last row or column of an odd level
+    ivec2 srcSize = imageSize(srcLevel);
+    ivec2 last = min(dst * 2 + 1 + ivec2(equal(dst, dstSize - 1)) * (srcSize & 1), srcSize - 1);
+
+    float depth = 0.0;
+    for (int y = dst.y * 2; y <= last.y; y++)
+    {
+        for (int x = dst.x * 2; x <= last.x; x++)
+        {
+            depth = max(depth, imageLoad(srcLevel, ivec2(x, y)).r);
+        }
+    }
+
+    imageStore(dstLevel, dst, vec4(depth));
+}
@@ -0,0 +1,366 @@
+#version 430
+
+// One invocation per patch of a LAYOUT_LISTED grid (GpuPatchCuller):
+// visible patches are appended to the patch list, with the levels
+// tcsQuad.glsl would compute, and counted in the draw command;
+// patches behind the depth of the last frame (DepthPyramid) are
+// only counted
+
+layout(local_size_x = 64) in;
+
+// Uniforms of the frame (FrameUniformBuffer), the same block in every stage
+layout(std140) uniform Frame
+{
+    mat4 V;
+    mat4 P;
+    vec3 eyePoint;
+    vec3 lightColor;
+    vec3 lightPosition;
+    float lodScale;
+};
+
+uniform mat4 M;
+uniform ivec2 gridSize;
+
+// Frustum planes (getFrustumPlanes), and whether to test them
+uniform vec4 planes[6];
+uniform bool isFrustumCulled;
+
+// Max-depth pyramid of the last frame, and its view-projection matrix
+uniform bool isOcclusionCulled;
+uniform sampler2D texHiZ;
+uniform mat4 hiZViewProjection;
+
+// Levels read texHeight, even when tesQuad.glsl reads the clipmap
+uniform sampler2D texHeight;
+
+// Min/max pyramid of the roughness map (HeightPyramid::setTexture),
+// mip level i holds pyramid level i + 1, g = max
+uniform sampler2D texRoughness;
+
+// TESS_METRIC_DISTANCE or TESS_METRIC_SCREEN_ERROR
+uniform int tessMetric;
+
+// Targets of the screen-space error metric
+uniform vec2 viewport;
+uniform float pixelsPerTriangle;
+uniform float maxPixelError;
+
+// Same as "scale" in tesQuad.glsl
+const float heightScale = 10.0;
+
+// World-space AABB of each patch (PatchCuller::boundsMin, boundsMax)
+layout(std430, binding = 2) readonly buffer PatchBounds
+{
+    vec4 bounds[];
+};
+
+layout(std430, binding = 3) writeonly buffer PatchList
+{
+    uint patchIds[];
+};
+
+// Same layout as in tcsQuadListed.glsl
+struct PatchLevel
+{
+    vec4 outer;
+    vec4 inner;
+};
+
+layout(std430, binding = 4) writeonly buffer PatchLevels
+{
+    PatchLevel levels[];
+};
+
+// DrawArraysCommand, instanceCount reset to 0 before the pass
+layout(std430, binding = 5) buffer DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint first;
+    uint baseInstance;
+};
+
+// Occluded patches, and the triangles they would have made
+layout(std430, binding = 6) buffer PatchStats
+{
+    uint nOfOccluded;
+    uint nOfSavedTriangles;
+};
+
+// Corner order of a patch, same as vsPhongInstanced.glsl:
+// (x0, z1), (x1, z1), (x1, z0), (x0, z0)
+const ivec2 corners[4] = ivec2[4](ivec2(0, 1), ivec2(1, 1), ivec2(1, 0), ivec2(0, 0));
+
+vec3 worldPos[4];
+vec2 uv[4];
+
+// ------------------------------------------------------------
+// Test an AABB against the frustum planes (as isBoxOutside)
+// Parameters:
+//   boxMin, boxMax: corners of the AABB
+// Return: true if the box is entirely outside a plane
+// ------------------------------------------------------------
+bool isBoxOutside(vec3 boxMin, vec3 boxMax)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        vec3 n = planes[i].xyz;
+        vec3 p = mix(boxMin, boxMax, greaterThanEqual(n, vec3(0.0)));
+
+        if (dot(n, p) + planes[i].w < 0.0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// ------------------------------------------------------------
+// Test an AABB against the depth of the last frame
+// Parameters:
+//   boxMin, boxMax: corners of the AABB
+// Return: true if the box is behind every texel under its
+//   screen rectangle
+// Remarks: a box crossing the near plane or the border of
+//   the last frame is kept, its depth there is unknown
+// ------------------------------------------------------------
+bool isBoxOccluded(vec3 boxMin, vec3 boxMax)
+{
+    vec3 ndcMin = vec3(1e30);
+    vec3 ndcMax = vec3(-1e30);
+    for (int k = 0; k < 8; k++)
+    {
+        vec3 corner = mix(boxMin, boxMax, bvec3((k & 1) != 0, (k & 2) != 0, (k & 4) != 0));
+        vec4 clip = hiZViewProjection * vec4(corner, 1.0);
+        if (clip.w <= 1e-5)
+        {
+            return false;
+        }
+
+        vec3 ndc = clip.xyz / clip.w;
+        ndcMin = min(ndcMin, ndc);
+        ndcMax = max(ndcMax, ndc);
+    }
+    if (any(lessThan(ndcMin, vec3(-1.0))) || any(greaterThan(ndcMax.xy, vec2(1.0))))
+    {
+        return false;
+    }
+
+    // Texels of level 0 under the rectangle
+    ivec2 size = textureSize(texHiZ, 0);
+    ivec2 t0 = min(ivec2((ndcMin.xy * 0.5 + 0.5) * vec2(size)), size - 1);
+    ivec2 t1 = min(ivec2((ndcMax.xy * 0.5 + 0.5) * vec2(size)), size - 1);
+
+    // Level where they are 2 x 2 texels at most; the last texel
+    // of a level also covers the odd border below it
+    int span = max(t1.x - t0.x, t1.y - t0.y);
+    int level = min(findMSB(span) + 1, textureQueryLevels(texHiZ) - 1);
+    ivec2 levelSize = max(ivec2(size.x >> level, size.y >> level), ivec2(1));
+    ivec2 c0 = min(t0 >> level, levelSize - 1);
+    ivec2 c1 = min(t1 >> level, levelSize - 1);
+
+    // textureLod with texel centers rather than texelFetch and
+    // textureSize, whose lod some drivers take from a single
+    // invocation when it differs across the group
+    float depth = 0.0;
+    for (int y = c0.y; y <= c1.y; y++)
+    {
+        for (int x = c0.x; x <= c1.x; x++)
+        {
+            depth = max(depth, textureLod(texHiZ, (vec2(x, y) + 0.5) / vec2(levelSize), float(level)).r);
+        }
+    }
+
+    // Above the rounding of the depth buffer, so that a patch
+    // never hides itself
+    return ndcMin.z * 0.5 + 0.5 > depth + 1e-6;
+}
+
+// ------------------------------------------------------------
+// Same as in tcsQuad.glsl
+// ------------------------------------------------------------
+float getTessLevel(float dist0, float dist1)
+{
+    float avgDist = (dist0 + dist1) / 2.0;
+
+    float level;
+    if (avgDist <= 2.0)
+    {
+        level = 32.0;
+    }
+    else if (avgDist <= 4.0)
+    {
+        level = 16.0;
+    }
+    else if (avgDist <= 8.0)
+    {
+        level = 8.0;
+    }
+    else if (avgDist <= 16.0)
+    {
+        level = 4.0;
+    }
+    else if (avgDist <= 32.0)
+    {
+        level = 2.0;
+    }
+    else
+    {
+        level = 1.0;
+    }
+
+    return clamp(level * lodScale, 1.0, 64.0);
+}
+
+// ------------------------------------------------------------
+// Same as in tcsQuad.glsl, from texHeight only
+// ------------------------------------------------------------
+float getRoughness(vec2 uvMin, vec2 uvMax)
+{
+    ivec2 size = textureSize(texHeight, 0);
+    ivec2 t0 = clamp(ivec2(floor(uvMin * vec2(size) - 0.5)), ivec2(0), size - 1);
+    ivec2 t1 = clamp(ivec2(floor(uvMax * vec2(size) - 0.5)) + 1, ivec2(0), size - 1);
+
+    // ceil(log2(span)), at least 1 (the first mip level)
+    int span = max(t1.x - t0.x, t1.y - t0.y) + 1;
+    int maxLevel = findMSB(max(size.x, size.y) - 1) + 1;
+    int level = clamp(findMSB(span - 1) + 1, 1, max(maxLevel, 1));
+
+    ivec2 c0 = t0 >> level;
+    ivec2 c1 = t1 >> level;
+
+    float roughness = 0.0;
+    for (int y = c0.y; y <= c1.y; y++)
+    {
+        for (int x = c0.x; x <= c1.x; x++)
+        {
+            roughness = max(roughness, texelFetch(texRoughness, ivec2(x, y), level - 1).g);
+        }
+    }
+
+    return roughness;
+}
+
+// ------------------------------------------------------------
+// Same as in tcsQuad.glsl, from texHeight only
+// ------------------------------------------------------------
+float getScreenErrorLevel(vec3 p0, vec3 p1, vec2 uv0, vec2 uv1, float roughness)
+{
+    p0.y += (textureLod(texHeight, uv0, 0.0).r * 2.0 - 1.0) * heightScale;
+    p1.y += (textureLod(texHeight, uv1, 0.0).r * 2.0 - 1.0) * heightScale;
+
+    // Pixels per world unit at the center of the edge
+    float dist = max(distance(eyePoint, (p0 + p1) * 0.5), 1e-3);
+    float pixelsPerUnit = P[1][1] * viewport.y * 0.5 / dist;
+
+    float lengthLevel = distance(p0, p1) * pixelsPerUnit / pixelsPerTriangle;
+
+    float texels = length((uv1 - uv0) * vec2(textureSize(texHeight, 0)));
+    float error = roughness * 2.0 * heightScale * pixelsPerUnit;
+    float errorLevel = texels * sqrt(error / (4.0 * maxPixelError));
+
+    return clamp(min(min(lengthLevel, errorLevel) * lodScale, texels), 1.0, 64.0);
+}
+
+// ------------------------------------------------------------
+// Same as in tcsQuad.glsl
+// ------------------------------------------------------------
+bool isBefore(vec3 a, vec3 b)
+{
+    return a.x < b.x || (a.x == b.x && (a.y < b.y || (a.y == b.y && a.z < b.z)));
+}
+
+// ------------------------------------------------------------
+// Same as in tcsQuad.glsl: the order of the end points, not
+// precise, is what makes shared edges agree
+// ------------------------------------------------------------
+float getEdgeLevel(int i, int j)
+{
+    if (isBefore(worldPos[j], worldPos[i]))
+    {
+        int k = i;
+        i = j;
+        j = k;
+    }
+
+    precise float level;
+    if (tessMetric == 0)
+    {
+        level = getTessLevel(distance(eyePoint, worldPos[i]), distance(eyePoint, worldPos[j]));
+    }
+    else
+    {
+        vec2 uv0 = uv[i];
+        vec2 uv1 = uv[j];
+        float roughness = getRoughness(min(uv0, uv1), max(uv0, uv1));
+
+        level = getScreenErrorLevel(worldPos[i], worldPos[j], uv0, uv1, roughness);
+    }
+
+    return level;
+}
+
+void main()
+{
+    uint patchId = gl_GlobalInvocationID.x;
+    if (patchId >= uint(gridSize.x * gridSize.y))
+    {
+        return;
+    }
+
+    vec3 boxMin = bounds[patchId * 2].xyz;
+    vec3 boxMax = bounds[patchId * 2 + 1].xyz;
+    if (isFrustumCulled && isBoxOutside(boxMin, boxMax))
+    {
+        return;
+    }
+
+    // Corners, as vsPhongInstanced.glsl outputs them
+    ivec2 cell = ivec2(int(patchId) % gridSize.x, int(patchId) / gridSize.x);
+    for (int k = 0; k < 4; k++)
+    {
+        vec2 t = vec2(cell + corners[k]) / vec2(gridSize);
+        uv[k] = vec2(t.x, 1.0 - t.y);
+        worldPos[k] = (M * vec4(-1.0 + 2.0 * t.x, 0.0, -1.0 + 2.0 * t.y, 1.0)).xyz;
+    }
+
+    PatchLevel level;
+    level.outer = vec4(getEdgeLevel(3, 0), getEdgeLevel(0, 1), getEdgeLevel(1, 2), getEdgeLevel(2, 3));
+
+    if (tessMetric == 0)
+    {
+        float avg = (level.outer.x + level.outer.y + level.outer.z + level.outer.w) * 0.25;
+        level.inner = vec4(avg, avg, 0.0, 0.0);
+    }
+    else
+    {
+        // Interior: mid lines of the patch, with the roughness of the whole patch
+        vec2 uvMin = min(min(uv[0], uv[1]), min(uv[2], uv[3]));
+        vec2 uvMax = max(max(uv[0], uv[1]), max(uv[2], uv[3]));
+        float roughness = getRoughness(uvMin, uvMax);
+
+        float innerU = getScreenErrorLevel((worldPos[3] + worldPos[0]) * 0.5, (worldPos[1] + worldPos[2]) * 0.5,
+                                           (uv[3] + uv[0]) * 0.5, (uv[1] + uv[2]) * 0.5, roughness);
+        float innerV = getScreenErrorLevel((worldPos[0] + worldPos[1]) * 0.5, (worldPos[2] + worldPos[3]) * 0.5,
+                                           (uv[0] + uv[1]) * 0.5, (uv[2] + uv[3]) * 0.5, roughness);
+
+        level.inner = vec4(max(innerU, max(level.outer.y, level.outer.w)),
+                           max(innerV, max(level.outer.x, level.outer.z)), 0.0, 0.0);
+    }
+
+    // Occluded: only count the triangles of its levels
+    // (2 per cell of the interior grid, as equal_spacing rounds up)
+    if (isOcclusionCulled && isBoxOccluded(boxMin, boxMax))
+    {
+        atomicAdd(nOfOccluded, 1u);
+        atomicAdd(nOfSavedTriangles, 2u * uint(ceil(level.inner.x) * ceil(level.inner.y)));
+        return;
+    }
+
+    // Append the patch
+    uint slot = atomicAdd(instanceCount, 1u);
+    patchIds[slot] = patchId;
+    levels[slot] = level;
+}
@@ -6,7 +6,16 @@ in vec3 worldN;
 
 out vec4 outputColor;
 
-uniform vec3 lightPosition;
+// Uniforms of the frame (FrameUniformBuffer), the same block in every stage
+layout(std140) uniform Frame
+{
+    mat4 V;
+    mat4 P;
+    vec3 eyePoint;
+    vec3 lightColor;
+    vec3 lightPosition;
+    float lodScale;
+};
 
 void main()
 {
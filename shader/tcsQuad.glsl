@@ -2,7 +2,43 @@
 
 layout(vertices = 4) out;
 
-uniform vec3 eyePoint;
+// Uniforms of the frame (FrameUniformBuffer), the same block in every stage
+layout(std140) uniform Frame
+{
+    mat4 V;
+    mat4 P;
+    vec3 eyePoint;
+    vec3 lightColor;
+    vec3 lightPosition;
+    float lodScale;
+};
+
+uniform sampler2D texHeight;
+
+// Clipmap of texHeight (HeightClipmap): level k holds clipSize^2
+// texels of mip k from clipOrigins[k], each at its coordinate
+// modulo clipSize
+uniform bool isClipmapped;
+uniform sampler2DArray texClipmap;
+uniform int nOfClipLevels;
+uniform int clipSize;
+uniform ivec2 clipOrigins[8];
+uniform ivec2 heightSize;
+
+// Min/max pyramid of the roughness map (HeightPyramid::setTexture),
+// mip level i holds pyramid level i + 1, g = max
+uniform sampler2D texRoughness;
+
+// TESS_METRIC_DISTANCE or TESS_METRIC_SCREEN_ERROR
+uniform int tessMetric;
+
+// Targets of the screen-space error metric
+uniform vec2 viewport;
+uniform float pixelsPerTriangle;
+uniform float maxPixelError;
+
+// Same as "scale" in tesQuad.glsl
+const float heightScale = 10.0;
 
 in vec3 worldPos[];
 in vec2 uv[];
@@ -16,36 +52,228 @@ out vec3 esInN[];
 // Compute tessellation level based on some distance
 // Parameters:
 //   dist0, dist1: generally, eye-to-adjacent-vertex distances
-// Return: tessellation level
+// Return: tessellation level, times lodScale
 // ------------------------------------------------------------
 float getTessLevel(float dist0, float dist1)
 {
     float avgDist = (dist0 + dist1) / 2.0;
 
+    float level;
     if (avgDist <= 2.0)
     {
-        return 32.0;
+        level = 32.0;
     }
     else if (avgDist <= 4.0)
     {
-        return 16.0;
+        level = 16.0;
     }
     else if (avgDist <= 8.0)
     {
-        return 8.0;
+        level = 8.0;
     }
     else if (avgDist <= 16.0)
     {
-        return 4.0;
+        level = 4.0;
     }
     else if (avgDist <= 32.0)
     {
-        return 2.0;
+        level = 2.0;
+    }
+    else
+    {
+        level = 1.0;
+    }
+
+    return clamp(level * lodScale, 1.0, 64.0);
+}
+
+// ------------------------------------------------------------
+// Get the distance to the border of a clipmap level
+// Parameters:
+//   1. t: texel coordinate in level k
+//   2. k: level
+// Return: distance in texels, negative if bilinear
+//   filtering reads texels outside the level
+// ------------------------------------------------------------
+float getClipDistance(vec2 t, int k)
+{
+    vec2 d = min(t - vec2(clipOrigins[k]) - 0.5, vec2(clipOrigins[k] + clipSize) - 0.5 - t);
+
+    return min(d.x, d.y);
+}
+
+// ------------------------------------------------------------
+// Sample the clipmap like texHeight
+// Parameters:
+//   uv: texture coordinate
+// Return: filtered height, from the finest level around uv
+// Remarks: fades to the next level over the last
+//   clipSize / 8 texels, the coarsest level covers the map
+// ------------------------------------------------------------
+float getClipmapHeight(vec2 uv)
+{
+    float fade = float(clipSize) / 8.0;
+
+    for (int k = 0; k < nOfClipLevels; k++)
+    {
+        vec2 t = uv * vec2(max(heightSize >> k, ivec2(1)));
+        float d = getClipDistance(t, k);
+        bool isCoarsest = (k == nOfClipLevels - 1);
+        if (d < 0.0 && !isCoarsest)
+        {
+            continue;
+        }
+
+        float h = textureLod(texClipmap, vec3(t / float(clipSize), float(k)), 0.0).r;
+        if (d >= fade || isCoarsest)
+        {
+            return h;
+        }
+
+        vec2 tc = uv * vec2(max(heightSize >> (k + 1), ivec2(1)));
+        if (getClipDistance(tc, k + 1) < 0.0)
+        {
+            return h;
+        }
+
+        float hc = textureLod(texClipmap, vec3(tc / float(clipSize), float(k + 1)), 0.0).r;
+        return mix(hc, h, d / fade);
+    }
+
+    return 0.0;
+}
+
+float getHeight(vec2 uv)
+{
+    return isClipmapped ? getClipmapHeight(uv) : textureLod(texHeight, uv, 0.0).r;
+}
+
+// Size of the height map, in texels
+ivec2 getHeightSize()
+{
+    return isClipmapped ? heightSize : textureSize(texHeight, 0);
+}
+
+// ------------------------------------------------------------
+// Get the maximum roughness over a uv rectangle
+// Parameters:
+//   uvMin, uvMax: corners of the rectangle
+// Return: roughness, in height map units per texel
+// Remarks: reads the 2 x 2 cells of the level that covers
+//   the rectangle, like HeightPyramid::getTexelRange
+// ------------------------------------------------------------
+float getRoughness(vec2 uvMin, vec2 uvMax)
+{
+    ivec2 size = getHeightSize();
+    ivec2 t0 = clamp(ivec2(floor(uvMin * vec2(size) - 0.5)), ivec2(0), size - 1);
+    ivec2 t1 = clamp(ivec2(floor(uvMax * vec2(size) - 0.5)) + 1, ivec2(0), size - 1);
+
+    // ceil(log2(span)), at least 1 (the first mip level)
+    int span = max(t1.x - t0.x, t1.y - t0.y) + 1;
+    int maxLevel = findMSB(max(size.x, size.y) - 1) + 1;
+    int level = clamp(findMSB(span - 1) + 1, 1, max(maxLevel, 1));
+
+    ivec2 c0 = t0 >> level;
+    ivec2 c1 = t1 >> level;
+
+    float roughness = 0.0;
+    for (int y = c0.y; y <= c1.y; y++)
+    {
+        for (int x = c0.x; x <= c1.x; x++)
+        {
+            roughness = max(roughness, texelFetch(texRoughness, ivec2(x, y), level - 1).g);
+        }
+    }
+
+    return roughness;
+}
+
+// ------------------------------------------------------------
+// Compute tessellation level from the screen-space error
+// Parameters:
+//   1. p0, p1: world positions of the end points (not displaced)
+//   2. uv0, uv1: uvs of the end points
+//   3. roughness: from getRoughness
+// Return: tessellation level
+// Remarks:
+//   - Segments are at least pixelsPerTriangle long on screen
+//   - A curvature of roughness, split into n segments,
+//     deviates by roughness * (texels / n)^2 / 4 from its
+//     chords; n keeps it under maxPixelError on screen
+//   - lodScale (the same for every edge) multiplies the
+//     level, still never more segments than texels along
+//     the edge
+//   - Only depends on the edge, so two patches sharing it
+//     get the same level
+// ------------------------------------------------------------
+float getScreenErrorLevel(vec3 p0, vec3 p1, vec2 uv0, vec2 uv1, float roughness)
+{
+    p0.y += (getHeight(uv0) * 2.0 - 1.0) * heightScale;
+    p1.y += (getHeight(uv1) * 2.0 - 1.0) * heightScale;
+
+    // Pixels per world unit at the center of the edge
+    float dist = max(distance(eyePoint, (p0 + p1) * 0.5), 1e-3);
+    float pixelsPerUnit = P[1][1] * viewport.y * 0.5 / dist;
+
+    float lengthLevel = distance(p0, p1) * pixelsPerUnit / pixelsPerTriangle;
+
+    float texels = length((uv1 - uv0) * vec2(getHeightSize()));
+    float error = roughness * 2.0 * heightScale * pixelsPerUnit;
+    float errorLevel = texels * sqrt(error / (4.0 * maxPixelError));
+
+    return clamp(min(min(lengthLevel, errorLevel) * lodScale, texels), 1.0, 64.0);
+}
+
+// ------------------------------------------------------------
+// Check the order of two end points
+// Parameters:
+//   a, b: world positions
+// Return: true if a comes first (x, then y, then z)
+// ------------------------------------------------------------
+bool isBefore(vec3 a, vec3 b)
+{
+    return a.x < b.x || (a.x == b.x && (a.y < b.y || (a.y == b.y && a.z < b.z)));
+}
+
+// ------------------------------------------------------------
+// Compute the outer level of an edge, with either metric
+// Parameters:
+//   i, j: control points of the edge
+// Return: tessellation level
+// Remarks:
+//   - The end points are taken in the same order by both
+//     patches of the edge (isBefore), which then run the
+//     same operations on the same values, rather than the
+//     mirrored ones: this is what makes their levels agree
+//   - precise is only a hint on top of it: it covers the
+//     expressions assigned to level, but compilers do not
+//     reliably apply it inside the inlined getTessLevel or
+//     getScreenErrorLevel
+// ------------------------------------------------------------
+float getEdgeLevel(int i, int j)
+{
+    if (isBefore(worldPos[j], worldPos[i]))
+    {
+        int k = i;
+        i = j;
+        j = k;
+    }
+
+    precise float level;
+    if (tessMetric == 0)
+    {
+        level = getTessLevel(distance(eyePoint, worldPos[i]), distance(eyePoint, worldPos[j]));
     }
     else
     {
-        return 1.0;
+        vec2 uv0 = uv[i];
+        vec2 uv1 = uv[j];
+        float roughness = getRoughness(min(uv0, uv1), max(uv0, uv1));
+
+        level = getScreenErrorLevel(worldPos[i], worldPos[j], uv0, uv1, roughness);
     }
+
+    return level;
 }
 
 void main()
@@ -56,19 +284,35 @@ void main()
 
     if (gl_InvocationID == 0)
     {
-        float eyeToVtxDist0 = distance(eyePoint, esInWorldPos[0]);
-        float eyeToVtxDist1 = distance(eyePoint, esInWorldPos[1]);
-        float eyeToVtxDist2 = distance(eyePoint, esInWorldPos[2]);
-        float eyeToVtxDist3 = distance(eyePoint, esInWorldPos[3]);
+        gl_TessLevelOuter[0] = getEdgeLevel(3, 0);
+        gl_TessLevelOuter[1] = getEdgeLevel(0, 1);
+        gl_TessLevelOuter[2] = getEdgeLevel(1, 2);
+        gl_TessLevelOuter[3] = getEdgeLevel(2, 3);
+
+        if (tessMetric == 0)
+        {
+            float avg =
+                (gl_TessLevelOuter[0] + gl_TessLevelOuter[1] + gl_TessLevelOuter[2] + gl_TessLevelOuter[3]) * 0.25;
 
-        gl_TessLevelOuter[0] = getTessLevel(eyeToVtxDist3, eyeToVtxDist0);
-        gl_TessLevelOuter[1] = getTessLevel(eyeToVtxDist0, eyeToVtxDist1);
-        gl_TessLevelOuter[2] = getTessLevel(eyeToVtxDist1, eyeToVtxDist2);
-        gl_TessLevelOuter[3] = getTessLevel(eyeToVtxDist2, eyeToVtxDist3);
+            gl_TessLevelInner[0] = avg;
+            gl_TessLevelInner[1] = avg;
+        }
+        else
+        {
+            // Interior: mid lines of the patch, with the roughness of the whole patch
+            vec2 uvMin = min(min(uv[0], uv[1]), min(uv[2], uv[3]));
+            vec2 uvMax = max(max(uv[0], uv[1]), max(uv[2], uv[3]));
+            float roughness = getRoughness(uvMin, uvMax);
 
-        float avg = (gl_TessLevelOuter[0] + gl_TessLevelOuter[1] + gl_TessLevelOuter[2] + gl_TessLevelOuter[3]) * 0.25;
+            float innerU = getScreenErrorLevel((worldPos[3] + worldPos[0]) * 0.5,
+                                               (worldPos[1] + worldPos[2]) * 0.5,
+                                               (uv[3] + uv[0]) * 0.5, (uv[1] + uv[2]) * 0.5, roughness);
+            float innerV = getScreenErrorLevel((worldPos[0] + worldPos[1]) * 0.5,
+                                               (worldPos[2] + worldPos[3]) * 0.5,
+                                               (uv[0] + uv[1]) * 0.5, (uv[2] + uv[3]) * 0.5, roughness);
 
-        gl_TessLevelInner[0] = avg;
-        gl_TessLevelInner[1] = avg;
+            gl_TessLevelInner[0] = max(innerU, max(gl_TessLevelOuter[1], gl_TessLevelOuter[3]));
+            gl_TessLevelInner[1] = max(innerV, max(gl_TessLevelOuter[0], gl_TessLevelOuter[2]));
+        }
     }
 }
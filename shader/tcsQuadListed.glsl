@@ -0,0 +1,44 @@
+#version 430
+
+layout(vertices = 4) out;
+
+// Levels of the listed patches, computed by csPatchCull.glsl
+// the same way as tcsQuad.glsl
+struct PatchLevel
+{
+    vec4 outer;
+    vec4 inner; // xy
+};
+
+layout(std430, binding = 4) readonly buffer PatchLevels
+{
+    PatchLevel levels[];
+};
+
+in vec3 worldPos[];
+in vec2 uv[];
+in vec3 worldN[];
+flat in int listIndex[];
+
+out vec3 esInWorldPos[];
+out vec2 esInUv[];
+out vec3 esInN[];
+
+void main()
+{
+    esInUv[gl_InvocationID] = uv[gl_InvocationID];
+    esInN[gl_InvocationID] = worldN[gl_InvocationID];
+    esInWorldPos[gl_InvocationID] = worldPos[gl_InvocationID];
+
+    if (gl_InvocationID == 0)
+    {
+        PatchLevel level = levels[listIndex[0]];
+
+        gl_TessLevelOuter[0] = level.outer.x;
+        gl_TessLevelOuter[1] = level.outer.y;
+        gl_TessLevelOuter[2] = level.outer.z;
+        gl_TessLevelOuter[3] = level.outer.w;
+        gl_TessLevelInner[0] = level.inner.x;
+        gl_TessLevelInner[1] = level.inner.y;
+    }
+}
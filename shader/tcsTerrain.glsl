@@ -0,0 +1,36 @@
+#version 400
+
+layout(vertices = 4) out;
+
+in vec2 gridPos[];
+in vec4 chunk[];
+in vec2 chunkMorphRange[];
+
+out vec2 esInGridPos[];
+
+// Chunk of the patch (see vsTerrain.glsl)
+patch out vec4 esChunk;
+patch out vec2 esMorphRange;
+
+void main()
+{
+    esInGridPos[gl_InvocationID] = gridPos[gl_InvocationID];
+
+    if (gl_InvocationID == 0)
+    {
+        esChunk = chunk[0];
+        esMorphRange = chunkMorphRange[0];
+
+        // Same level for every patch of a chunk, so the chunk is a
+        // regular grid and can morph to the grid of the next level
+        float level = chunk[0].w;
+
+        gl_TessLevelOuter[0] = level;
+        gl_TessLevelOuter[1] = level;
+        gl_TessLevelOuter[2] = level;
+        gl_TessLevelOuter[3] = level;
+
+        gl_TessLevelInner[0] = level;
+        gl_TessLevelInner[1] = level;
+    }
+}
@@ -2,10 +2,29 @@
 
 layout(quads, equal_spacing, ccw) in;
 
-uniform mat4 M, V, P;
+// Uniforms of the frame (FrameUniformBuffer), the same block in every stage
+layout(std140) uniform Frame
+{
+    mat4 V;
+    mat4 P;
+    vec3 eyePoint;
+    vec3 lightColor;
+    vec3 lightPosition;
+    float lodScale;
+};
 
 uniform sampler2D texHeight;
 
+// Clipmap of texHeight (HeightClipmap): level k holds clipSize^2
+// texels of mip k from clipOrigins[k], each at its coordinate
+// modulo clipSize
+uniform bool isClipmapped;
+uniform sampler2DArray texClipmap;
+uniform int nOfClipLevels;
+uniform int clipSize;
+uniform ivec2 clipOrigins[8];
+uniform ivec2 heightSize;
+
 in vec3 esInWorldPos[];
 in vec2 esInUv[];
 in vec3 esInN[];
@@ -34,6 +53,115 @@ vec3 interpolate(vec3 v0, vec3 v1, vec3 v2, vec3 v3)
     return res;
 }
 
+// ------------------------------------------------------------
+// Get the distance to the border of a clipmap level
+// Parameters:
+//   1. t: texel coordinate in level k
+//   2. k: level
+// Return: distance in texels, negative if bilinear
+//   filtering reads texels outside the level
+// ------------------------------------------------------------
+float getClipDistance(vec2 t, int k)
+{
+    vec2 d = min(t - vec2(clipOrigins[k]) - 0.5, vec2(clipOrigins[k] + clipSize) - 0.5 - t);
+
+    return min(d.x, d.y);
+}
+
+// ------------------------------------------------------------
+// Sample the clipmap like texHeight
+// Parameters:
+//   uv: texture coordinate
+// Return: filtered height, from the finest level around uv
+// Remarks: fades to the next level over the last
+//   clipSize / 8 texels, the coarsest level covers the map
+// ------------------------------------------------------------
+float getClipmapHeight(vec2 uv)
+{
+    float fade = float(clipSize) / 8.0;
+
+    for (int k = 0; k < nOfClipLevels; k++)
+    {
+        vec2 t = uv * vec2(max(heightSize >> k, ivec2(1)));
+        float d = getClipDistance(t, k);
+        bool isCoarsest = (k == nOfClipLevels - 1);
+        if (d < 0.0 && !isCoarsest)
+        {
+            continue;
+        }
+
+        float h = textureLod(texClipmap, vec3(t / float(clipSize), float(k)), 0.0).r;
+        if (d >= fade || isCoarsest)
+        {
+            return h;
+        }
+
+        vec2 tc = uv * vec2(max(heightSize >> (k + 1), ivec2(1)));
+        if (getClipDistance(tc, k + 1) < 0.0)
+        {
+            return h;
+        }
+
+        float hc = textureLod(texClipmap, vec3(tc / float(clipSize), float(k + 1)), 0.0).r;
+        return mix(hc, h, d / fade);
+    }
+
+    return 0.0;
+}
+
+float getHeight(vec2 uv, float lod)
+{
+    return isClipmapped ? getClipmapHeight(uv) : textureLod(texHeight, uv, lod).r;
+}
+
+// ------------------------------------------------------------
+// Get the mip level of texHeight at this vertex
+// Return: log2 of the texels between neighbouring vertices
+// Remarks:
+//   - A vertex on an edge only depends on the edge (its uvs
+//     and outer level), so both patches of the edge read the
+//     same height; corners read level 0
+//   - Levels are rounded as with equal_spacing
+// ------------------------------------------------------------
+float getHeightLod()
+{
+    float u = gl_TessCoord.x;
+    float v = gl_TessCoord.y;
+    if ((u == 0.0 || u == 1.0) && (v == 0.0 || v == 1.0))
+    {
+        return 0.0;
+    }
+
+    vec2 size = vec2(textureSize(texHeight, 0));
+    float spacing;
+    if (u == 0.0)
+    {
+        spacing = length((esInUv[3] - esInUv[0]) * size) / ceil(clamp(gl_TessLevelOuter[0], 1.0, 64.0));
+    }
+    else if (v == 0.0)
+    {
+        spacing = length((esInUv[1] - esInUv[0]) * size) / ceil(clamp(gl_TessLevelOuter[1], 1.0, 64.0));
+    }
+    else if (u == 1.0)
+    {
+        spacing = length((esInUv[2] - esInUv[1]) * size) / ceil(clamp(gl_TessLevelOuter[2], 1.0, 64.0));
+    }
+    else if (v == 1.0)
+    {
+        spacing = length((esInUv[3] - esInUv[2]) * size) / ceil(clamp(gl_TessLevelOuter[3], 1.0, 64.0));
+    }
+    else
+    {
+        float spacingU = length((esInUv[1] + esInUv[2] - esInUv[0] - esInUv[3]) * 0.5 * size) /
+                         ceil(clamp(gl_TessLevelInner[0], 1.0, 64.0));
+        float spacingV = length((esInUv[3] + esInUv[2] - esInUv[0] - esInUv[1]) * 0.5 * size) /
+                         ceil(clamp(gl_TessLevelInner[1], 1.0, 64.0));
+        spacing = max(spacingU, spacingV);
+    }
+
+    return max(log2(max(spacing, 1e-6)), 0.0);
+}
+
 void main()
 {
     worldPos = interpolate(esInWorldPos[0], esInWorldPos[1], esInWorldPos[2], esInWorldPos[3]);
@@ -41,7 +169,7 @@ void main()
     worldN = interpolate(esInN[0], esInN[1], esInN[2], esInN[3]);
 
     float scale = 10;
-    float offset = texture(texHeight, uv).r * 2.0 - 1.0;
+    float offset = getHeight(uv, getHeightLod()) * 2.0 - 1.0;
     worldPos.y += offset * scale;
 
     gl_Position = P * V * vec4(worldPos, 1.0);
@@ -0,0 +1,113 @@
+#version 400
+
+layout(quads, equal_spacing, ccw) in;
+
+// Uniforms of the frame (FrameUniformBuffer), the same block in every stage
+layout(std140) uniform Frame
+{
+    mat4 V;
+    mat4 P;
+    vec3 eyePoint;
+    vec3 lightColor;
+    vec3 lightPosition;
+    float lodScale;
+};
+
+uniform sampler2D texHeight;
+uniform vec2 uvScale;
+uniform float heightScale;
+
+// Tiled height map streamed by HeightStreamer, instead of texHeight:
+// the slot of every tile in texTiles, -1 if not resident
+uniform bool isStreamed;
+uniform sampler2DArray texTiles;
+uniform isampler2D texIndirection;
+uniform sampler2D texOverview;
+uniform ivec2 nOfTiles;
+uniform int tileSize;
+uniform int tileBorder;
+
+// Patches of a chunk along x and z
+uniform ivec2 gridSize;
+
+in vec2 esInGridPos[];
+
+// Chunk being drawn: origin, size and tessellation level,
+// and distances where vertices start and finish morphing
+// to the grid of the next level
+patch in vec4 esChunk;
+patch in vec2 esMorphRange;
+
+out vec3 worldPos;
+out vec2 uv;
+out vec3 worldN;
+
+vec2 interpolate(vec2 v0, vec2 v1, vec2 v2, vec2 v3)
+{
+    float u = gl_TessCoord.x;
+    float v = gl_TessCoord.y;
+
+    vec2 res = v0 * (1.0 - u) * (1.0 - v) + v1 * u * (1.0 - v) + v2 * u * v + v3 * (1.0 - u) * v;
+
+    return res;
+}
+
+// Same orientation as quad.obj: v goes along -z
+vec2 getUv(vec2 xz)
+{
+    return vec2(xz.x, -xz.y) * uvScale;
+}
+
+// Width of the height map, in texels
+float getMapWidth()
+{
+    return isStreamed ? float(nOfTiles.x * tileSize) : float(textureSize(texHeight, 0).x);
+}
+
+float getStreamedHeight(vec2 uv)
+{
+    // Same texel centers as texHeight, the border of a tile
+    // lets the bilinear filter cross to its neighbours
+    vec2 texel = fract(uv) * vec2(nOfTiles * tileSize);
+    ivec2 tile = min(ivec2(texel) / tileSize, nOfTiles - 1);
+    int slot = texelFetch(texIndirection, tile, 0).r;
+
+    if (slot < 0)
+    {
+        return textureLod(texOverview, uv, 0.0).r;
+    }
+
+    vec2 local = (texel - vec2(tile * tileSize) + float(tileBorder)) / float(tileSize + 2 * tileBorder);
+    return textureLod(texTiles, vec3(local, float(slot)), 0.0).r;
+}
+
+float getHeight(vec2 xz)
+{
+    float h = isStreamed ? getStreamedHeight(getUv(xz)) : textureLod(texHeight, getUv(xz), 0.0).r;
+
+    return (h * 2.0 - 1.0) * heightScale;
+}
+
+void main()
+{
+    // Integer with equal_spacing, up to rounding
+    vec2 gridCoord = floor(interpolate(esInGridPos[0], esInGridPos[1], esInGridPos[2], esInGridPos[3]) + 0.5);
+    float cellSize = esChunk.z / (float(gridSize.x) * esChunk.w);
+    vec2 xz = esChunk.xy + gridCoord * cellSize;
+
+    // Odd vertices slide onto their even neighbour, which is
+    // the grid of the next level once fully morphed
+    float dist = distance(eyePoint, vec3(xz.x, getHeight(xz), xz.y));
+    float morph = clamp((dist - esMorphRange.x) / (esMorphRange.y - esMorphRange.x), 0.0, 1.0);
+    xz -= fract(gridCoord * 0.5) * 2.0 * cellSize * morph;
+
+    worldPos = vec3(xz.x, getHeight(xz), xz.y);
+    uv = getUv(xz);
+
+    // Central differences, one texel apart
+    float e = 1.0 / (uvScale.x * getMapWidth());
+    worldN = normalize(vec3(getHeight(xz - vec2(e, 0.0)) - getHeight(xz + vec2(e, 0.0)), 2.0 * e,
+                            getHeight(xz - vec2(0.0, e)) - getHeight(xz + vec2(0.0, e))));
+
+    gl_Position = P * V * vec4(worldPos, 1.0);
+}
@@ -10,9 +10,28 @@ out vec3 worldN;
 
 uniform mat4 M;
 
+// LAYOUT_PACKED: positions are SNORM16 in the bounding box (Q maps them back),
+// and vtxN.xy is an octahedral-encoded normal
+uniform mat4 Q;
+uniform bool isNormalPacked;
+
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+
+    if (n.z < 0.0)
+    {
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    }
+
+    return normalize(n);
+}
+
 void main()
 {
+    vec3 n = isNormalPacked ? octDecode(vtxN.xy) : vtxN;
+
     uv = texUv;
-    worldPos = (M * vec4(vtxCoord, 1.0)).xyz;
-    worldN = normalize((vec4(vtxN, 1.0) * inverse(M)).xyz);
+    worldPos = (M * Q * vec4(vtxCoord, 1.0)).xyz;
+    worldN = normalize((vec4(n, 1.0) * inverse(M)).xyz);
 }
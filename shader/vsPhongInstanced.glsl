@@ -0,0 +1,33 @@
+#version 330
+
+// No vertex attribute: each instance is one patch of a
+// gridSize.x * gridSize.y grid, and gl_VertexID is its corner
+
+out vec2 uv;
+out vec3 worldPos;
+out vec3 worldN;
+
+uniform mat4 M;
+uniform ivec2 gridSize;
+
+// First patch of the drawn run (frustum culling draws several runs):
+// a constant attribute, or the baseInstance of an indirect draw (DrawBatch)
+layout(location = 3) in uint baseInstance;
+
+// Corner order of a patch, same as quad.obj and Mesh::createGrid:
+// (x0, z1), (x1, z1), (x1, z0), (x0, z0)
+const ivec2 corners[4] = ivec2[4](ivec2(0, 1), ivec2(1, 1), ivec2(1, 0), ivec2(0, 0));
+
+void main()
+{
+    int patchId = gl_InstanceID + int(baseInstance);
+    ivec2 cell = ivec2(patchId % gridSize.x, patchId / gridSize.x);
+    vec2 t = vec2(cell + corners[gl_VertexID]) / vec2(gridSize);
+
+    // Grid covers [-1, 1] in x and z
+    vec3 vtxCoord = vec3(-1.0 + 2.0 * t.x, 0.0, -1.0 + 2.0 * t.y);
+
+    uv = vec2(t.x, 1.0 - t.y);
+    worldPos = (M * vec4(vtxCoord, 1.0)).xyz;
+    worldN = normalize((vec4(0.0, 1.0, 0.0, 1.0) * inverse(M)).xyz);
+}
@@ -0,0 +1,36 @@
+#version 430
+
+// As vsPhongInstanced.glsl, for the patch list of the culling
+// pass (csPatchCull.glsl): instance i draws the i-th listed patch
+
+out vec2 uv;
+out vec3 worldPos;
+out vec3 worldN;
+flat out int listIndex;
+
+uniform mat4 M;
+uniform ivec2 gridSize;
+
+layout(std430, binding = 3) readonly buffer PatchList
+{
+    uint patchIds[];
+};
+
+// Corner order of a patch, same as quad.obj and Mesh::createGrid:
+// (x0, z1), (x1, z1), (x1, z0), (x0, z0)
+const ivec2 corners[4] = ivec2[4](ivec2(0, 1), ivec2(1, 1), ivec2(1, 0), ivec2(0, 0));
+
+void main()
+{
+    int patchId = int(patchIds[gl_InstanceID]);
+    ivec2 cell = ivec2(patchId % gridSize.x, patchId / gridSize.x);
+    vec2 t = vec2(cell + corners[gl_VertexID]) / vec2(gridSize);
+
+    // Grid covers [-1, 1] in x and z
+    vec3 vtxCoord = vec3(-1.0 + 2.0 * t.x, 0.0, -1.0 + 2.0 * t.y);
+
+    uv = vec2(t.x, 1.0 - t.y);
+    worldPos = (M * vec4(vtxCoord, 1.0)).xyz;
+    worldN = normalize((vec4(0.0, 1.0, 0.0, 1.0) * inverse(M)).xyz);
+    listIndex = gl_InstanceID;
+}
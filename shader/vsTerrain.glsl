@@ -0,0 +1,33 @@
+#version 330
+
+// No vertex attribute: each instance is one patch of the
+// gridSize.x * gridSize.y grid of a terrain chunk
+
+out vec2 gridPos;
+out vec4 chunk;
+out vec2 chunkMorphRange;
+
+uniform ivec2 gridSize;
+
+// Chunk being drawn (Terrain::draw), passed on to the
+// tessellation stages: origin, size, tessellation level,
+// and distances where vertices start and finish morphing
+uniform vec2 chunkOrigin;
+uniform float chunkSize;
+uniform int tessLevel;
+uniform vec2 morphRange;
+
+// Corner order of a patch, same as vsPhongInstanced.glsl:
+// (x0, z1), (x1, z1), (x1, z0), (x0, z0)
+const ivec2 corners[4] = ivec2[4](ivec2(0, 1), ivec2(1, 1), ivec2(1, 0), ivec2(0, 0));
+
+void main()
+{
+    ivec2 cell = ivec2(gl_InstanceID % gridSize.x, gl_InstanceID / gridSize.x);
+
+    // In cells of the tessellated chunk grid, (0, 0) at the chunk origin
+    gridPos = vec2((cell + corners[gl_VertexID]) * tessLevel);
+
+    chunk = vec4(chunkOrigin, chunkSize, float(tessLevel));
+    chunkMorphRange = morphRange;
+}
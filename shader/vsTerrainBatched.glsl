@@ -0,0 +1,44 @@
+#version 430
+
+// As vsTerrain.glsl, for every chunk in one indirect draw
+// (DrawBatch): the chunk comes from its record
+
+out vec2 gridPos;
+out vec4 chunk;
+out vec2 chunkMorphRange;
+
+uniform ivec2 gridSize;
+
+// Same layout as TerrainDrawRecord
+struct ChunkRecord
+{
+    vec2 origin;
+    float size;
+    int tessLevel;
+    vec2 morphRange;
+    vec2 padding;
+};
+
+layout(std430, binding = 1) readonly buffer ChunkRecords
+{
+    ChunkRecord chunks[];
+};
+
+// Index of the chunk, the baseInstance of its draw
+layout(location = 3) in uint baseInstance;
+
+// Corner order of a patch, same as vsPhongInstanced.glsl:
+// (x0, z1), (x1, z1), (x1, z0), (x0, z0)
+const ivec2 corners[4] = ivec2[4](ivec2(0, 1), ivec2(1, 1), ivec2(1, 0), ivec2(0, 0));
+
+void main()
+{
+    ChunkRecord record = chunks[baseInstance];
+    ivec2 cell = ivec2(gl_InstanceID % gridSize.x, gl_InstanceID / gridSize.x);
+
+    // In cells of the tessellated chunk grid, (0, 0) at the chunk origin
+    gridPos = vec2((cell + corners[gl_VertexID]) * record.tessLevel);
+
+    chunk = vec4(record.origin, record.size, float(record.tessLevel));
+    chunkMorphRange = record.morphRange;
+}
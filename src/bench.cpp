@@ -0,0 +1,310 @@
+#include "bench.h"
+
+// Measures of the JSON file, and which ones compare checks
+// (a larger value is a regression)
+static const char *benchSeries[3] = {"cpu_ms", "frame_ms", "gpu_ms"};
+static const char *benchCompared[3] = {"mean", "p50", "p95"};
+
+// ================================================
+// FrameBench class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (nothing measured)
+// ---------------------------------------------------------
+FrameBench::FrameBench()
+{
+    nOfWarmupFrames = 0;
+}
+
+// ---------------------------------------------------------
+// Add the times of a frame
+// Parameters:
+//   1. frame: frame number, from 0
+//   2. cpuTime: until the frame is submitted, in milliseconds
+//   3. frameTime: until the GPU is done, in milliseconds
+// ---------------------------------------------------------
+void FrameBench::addFrame(size_t frame, double cpuTime, double frameTime)
+{
+    if (frame < nOfWarmupFrames)
+    {
+        return;
+    }
+
+    cpuTimes.push_back(cpuTime);
+    frameTimes.push_back(frameTime);
+}
+
+// ---------------------------------------------------------
+// Add the results of a profiled frame (GpuProfiler::onSample)
+// Parameters:
+//   sample: GPU time and counters of the frame
+// ---------------------------------------------------------
+void FrameBench::addSample(const ProfileSample &sample)
+{
+    if (sample.frame < nOfWarmupFrames)
+    {
+        return;
+    }
+
+    gpuTimes.push_back(sample.gpuTime);
+    triangles.push_back(double(sample.counters[PROFILE_PRIMITIVES]));
+}
+
+// ---------------------------------------------------------
+// Get the mean number of triangles of a profiled frame
+// ---------------------------------------------------------
+double FrameBench::getTrianglesPerFrame() const
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < triangles.size(); i++)
+    {
+        sum += triangles[i];
+    }
+
+    return triangles.empty() ? 0.0 : sum / double(triangles.size());
+}
+
+// ---------------------------------------------------------
+// Get the triangles drawn per second of frame time
+// ---------------------------------------------------------
+double FrameBench::getTrianglesPerSecond() const
+{
+    double totalTime = 0.0;
+    for (size_t i = 0; i < frameTimes.size(); i++)
+    {
+        totalTime += frameTimes[i];
+    }
+
+    return (totalTime > 0.0) ? getTrianglesPerFrame() * double(frameTimes.size()) / (totalTime * 1e-3) : 0.0;
+}
+
+// ---------------------------------------------------------
+// Print the results
+// ---------------------------------------------------------
+void FrameBench::print()
+{
+    const vector<double> *series[3] = {&cpuTimes, &frameTimes, &gpuTimes};
+
+    std::cout << "bench: " << frameTimes.size() << " frames measured after " << nOfWarmupFrames << " warm-up frames"
+              << '\n';
+    for (int s = 0; s < 3; s++)
+    {
+        BenchStats stats = computeBenchStats(*series[s]);
+        printf("  %-8s mean %8.3f  p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f ms\n", benchSeries[s], stats.mean,
+               stats.p50, stats.p95, stats.p99, stats.max);
+    }
+    printf("  triangles per frame %.0f, per second %.4g\n", getTrianglesPerFrame(), getTrianglesPerSecond());
+    fflush(stdout);
+}
+
+// ---------------------------------------------------------
+// Write the results as JSON
+// Parameters:
+//   1. fileName: output file
+//   2. renderer: GL_RENDERER of the run
+//   3. width: framebuffer width, in pixels
+//   4. height: framebuffer height, in pixels
+// Return: false if the file cannot be written
+// ---------------------------------------------------------
+bool FrameBench::writeJson(const string fileName, const string renderer, int width, int height)
+{
+    FILE *fout = fopen(fileName.c_str(), "w");
+    if (fout == NULL)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+
+    // Quotes and backslashes are the only characters to escape in a renderer name
+    string escaped;
+    for (size_t i = 0; i < renderer.size(); i++)
+    {
+        if (renderer[i] == '"' || renderer[i] == '\\')
+        {
+            escaped += '\\';
+        }
+        escaped += renderer[i];
+    }
+
+    fprintf(fout, "{\n");
+    fprintf(fout, "  \"renderer\": \"%s\",\n", escaped.c_str());
+    fprintf(fout, "  \"width\": %d,\n  \"height\": %d,\n", width, height);
+    fprintf(fout, "  \"warmup_frames\": %zu,\n  \"frames\": %zu,\n", nOfWarmupFrames, frameTimes.size());
+
+    const vector<double> *series[3] = {&cpuTimes, &frameTimes, &gpuTimes};
+    for (int s = 0; s < 3; s++)
+    {
+        BenchStats stats = computeBenchStats(*series[s]);
+        fprintf(fout, "  \"%s\": {\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f},\n",
+                benchSeries[s], stats.mean, stats.p50, stats.p95, stats.p99, stats.max);
+    }
+
+    fprintf(fout, "  \"triangles_per_frame\": %.1f,\n", getTrianglesPerFrame());
+    fprintf(fout, "  \"triangles_per_second\": %.1f\n", getTrianglesPerSecond());
+    fprintf(fout, "}\n");
+    fclose(fout);
+
+    std::cout << fileName << " written" << std::endl;
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Compare the results with a baseline
+// Parameters:
+//   1. fileName: JSON file written by writeJson
+//   2. threshold: tolerated slowdown, in percent
+// Return: false if a time is more than threshold percent
+//   above the baseline, or if the baseline cannot be read
+// Remarks:
+//   - The mean, p50 and p95 of the CPU, frame and GPU times
+//     are compared, except those under 0.05 ms in the
+//     baseline (llvmpipe times nothing on the "GPU")
+//   - A change of triangles per frame is reported, not
+//     failed: it comes with a change of tessellation
+// ---------------------------------------------------------
+bool FrameBench::compare(const string fileName, double threshold)
+{
+    std::ifstream fin(fileName);
+    if (!fin)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << fin.rdbuf();
+    string text = buffer.str();
+
+    const vector<double> *series[3] = {&cpuTimes, &frameTimes, &gpuTimes};
+    bool isPassed = true;
+
+    std::cout << "bench: compared with " << fileName << " (threshold " << threshold << "%)" << '\n';
+    for (int s = 0; s < 3; s++)
+    {
+        BenchStats stats = computeBenchStats(*series[s]);
+        double values[3] = {stats.mean, stats.p50, stats.p95};
+
+        for (int k = 0; k < 3; k++)
+        {
+            double baseline;
+            if (!readJsonNumber(text, benchSeries[s], benchCompared[k], baseline))
+            {
+                std::cout << "  " << benchSeries[s] << " " << benchCompared[k] << ": missing in the baseline" << '\n';
+                isPassed = false;
+                continue;
+            }
+            // Too short to compare (e.g. a software renderer)
+            if (baseline < 0.05)
+            {
+                continue;
+            }
+
+            double change = (values[k] - baseline) / baseline * 100.0;
+            bool isRegressed = change > threshold;
+            isPassed = isPassed && !isRegressed;
+
+            printf("  %-8s %-4s %9.3f -> %9.3f ms (%+6.1f%%)%s\n", benchSeries[s], benchCompared[k], baseline,
+                   values[k], change, isRegressed ? "  REGRESSION" : "");
+        }
+    }
+
+    double baselineTriangles;
+    if (readJsonNumber(text, "", "triangles_per_frame", baselineTriangles) && baselineTriangles > 0.0)
+    {
+        printf("  triangles per frame %.0f -> %.0f (%+.1f%%)\n", baselineTriangles, getTrianglesPerFrame(),
+               (getTrianglesPerFrame() - baselineTriangles) / baselineTriangles * 100.0);
+    }
+
+    std::cout << "bench: " << (isPassed ? "passed" : "FAILED") << std::endl;
+
+    return isPassed;
+}
+
+// ================================================
+// Benchmark utilities
+// ================================================
+
+// ---------------------------------------------------------
+// Compute the distribution of a measure
+// Parameters:
+//   values: one value per frame (copied, to be sorted)
+// Return: mean, percentiles (nearest rank) and max,
+//   all 0 without value
+// ---------------------------------------------------------
+BenchStats computeBenchStats(vector<double> values)
+{
+    BenchStats stats = {0.0, 0.0, 0.0, 0.0, 0.0};
+    if (values.empty())
+    {
+        return stats;
+    }
+
+    std::sort(values.begin(), values.end());
+
+    double sum = 0.0;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        sum += values[i];
+    }
+
+    auto percentile = [&](double p) {
+        size_t rank = size_t(std::ceil(p / 100.0 * double(values.size())));
+        return values[glm::clamp(rank, size_t(1), values.size()) - 1];
+    };
+
+    stats.mean = sum / double(values.size());
+    stats.p50 = percentile(50.0);
+    stats.p95 = percentile(95.0);
+    stats.p99 = percentile(99.0);
+    stats.max = values.back();
+
+    return stats;
+}
+
+// ---------------------------------------------------------
+// Read a number of a JSON file written by writeJson
+// Parameters:
+//   1. text: content of the file
+//   2. object: name of the enclosing object, "" for the top level
+//   3. key: name of the number
+//   4. value: the number
+// Return: false if it is not found
+// Remarks: only handles the flat layout of writeJson,
+//   not JSON in general
+// ---------------------------------------------------------
+bool readJsonNumber(const string &text, const string object, const string key, double &value)
+{
+    size_t begin = 0, end = text.size();
+    if (!object.empty())
+    {
+        begin = text.find("\"" + object + "\"");
+        if (begin == string::npos)
+        {
+            return false;
+        }
+        begin = text.find('{', begin);
+        end = text.find('}', begin);
+        if (begin == string::npos || end == string::npos)
+        {
+            return false;
+        }
+    }
+
+    size_t pos = text.find("\"" + key + "\"", begin);
+    if (pos == string::npos || pos >= end)
+    {
+        return false;
+    }
+    pos = text.find(':', pos);
+    if (pos == string::npos || pos >= end)
+    {
+        return false;
+    }
+
+    const char *start = text.c_str() + pos + 1;
+    char *stop = NULL;
+    value = strtod(start, &stop);
+
+    return stop != start;
+}
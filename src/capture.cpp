@@ -0,0 +1,508 @@
+#include "capture.h"
+
+// ================================================
+// FrameCapture class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (nothing opened)
+// ---------------------------------------------------------
+FrameCapture::FrameCapture()
+{
+    format = CAPTURE_BMP;
+    framesPerSecond = 60;
+    stream = NULL;
+
+    width = 0;
+    height = 0;
+    frameBytes = 0;
+
+    for (int i = 0; i < CAPTURE_PBOS; i++)
+    {
+        pbos[i] = 0;
+        fences[i] = NULL;
+    }
+    nextSlot = 0;
+    isBlocking = false;
+
+    nOfQueued = 0;
+    nOfWritten = 0;
+    isStopping = false;
+
+    nOfRead = 0;
+    nOfDropped = 0;
+    nOfStalls = 0;
+    readTime = 0.0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+FrameCapture::~FrameCapture()
+{
+    close();
+}
+
+// ---------------------------------------------------------
+// Create the pixel buffer objects and start the workers
+// Parameters:
+//   1. outputPrefix: path of the output without extension,
+//      followed by a 4-digit frame number for image formats
+//   2. outputFormat: CAPTURE_BMP, CAPTURE_PNG, CAPTURE_RAW or
+//      CAPTURE_Y4M
+//   3. threads: number of workers, 0 means one per core
+//   4. nOfBuffers: frames waiting for a worker at most
+//   5. fps: frame rate written in a .y4m header
+// Remarks: nothing is allocated for the frames until the
+//   first readFrame, which gives their size
+// ---------------------------------------------------------
+void FrameCapture::open(const string outputPrefix, int outputFormat, int threads, int nOfBuffers, int fps)
+{
+    close();
+
+    prefix = outputPrefix;
+    format = outputFormat;
+    framesPerSecond = glm::max(fps, 1);
+
+    width = height = 0;
+    frameBytes = 0;
+    glGenBuffers(CAPTURE_PBOS, pbos);
+    nextSlot = 0;
+
+    buffers.assign(glm::max(nOfBuffers, 1), vector<uint8_t>());
+    freeBuffers.clear();
+    for (int i = 0; i < int(buffers.size()); i++)
+    {
+        freeBuffers.push_back(i);
+    }
+
+    nOfQueued = nOfWritten = 0;
+    nOfRead = nOfDropped = nOfStalls = 0;
+    readTime = 0.0;
+
+    isStopping = false;
+    int nOfWorkers = glm::min(getNumThreads(threads), int(buffers.size()));
+    for (int i = 0; i < nOfWorkers; i++)
+    {
+        workers.push_back(std::thread(&FrameCapture::encodeFrames, this));
+    }
+}
+
+// ---------------------------------------------------------
+// Read back the frames in flight, wait for the workers,
+// and release everything
+// ---------------------------------------------------------
+void FrameCapture::close()
+{
+    if (pbos[0] == 0)
+    {
+        return;
+    }
+
+    // Nothing recorded is dropped from here on
+    isBlocking = true;
+    for (int i = 0; i < CAPTURE_PBOS; i++)
+    {
+        int slot = (nextSlot + i) % CAPTURE_PBOS;
+        if (fences[slot] != NULL)
+        {
+            retrieve(slot, true);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        isStopping = true;
+    }
+    workCondition.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    workers.clear();
+    isBlocking = false;
+
+    if (stream != NULL)
+    {
+        fclose(stream);
+        stream = NULL;
+    }
+
+    glDeleteBuffers(CAPTURE_PBOS, pbos);
+    for (int i = 0; i < CAPTURE_PBOS; i++)
+    {
+        pbos[i] = 0;
+    }
+    buffers.clear();
+    freeBuffers.clear();
+
+    if (nOfRead > 0)
+    {
+        printStats();
+    }
+}
+
+// ---------------------------------------------------------
+// Start reading back the framebuffer
+// Parameters:
+//   1. w: framebuffer width, in pixels
+//   2. h: framebuffer height, in pixels
+// Remarks:
+//   - Call it before swapping buffers, it reads GL_BACK
+//   - Only waits for the GPU when all the pixel buffer
+//     objects are still in flight (a stall)
+//   - A stream keeps the size of its first frame, frames
+//     of another size are dropped
+// ---------------------------------------------------------
+void FrameCapture::readFrame(int w, int h)
+{
+    if (pbos[0] == 0)
+    {
+        return;
+    }
+
+    if (w != width || h != height)
+    {
+        if (stream != NULL)
+        {
+            nOfDropped++;
+            return;
+        }
+        resize(w, h);
+    }
+    if ((format == CAPTURE_RAW || format == CAPTURE_Y4M) && stream == NULL)
+    {
+        nOfDropped++;
+        return;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // The oldest frame is in this slot
+    int slot = nextSlot;
+    if (fences[slot] != NULL)
+    {
+        nOfStalls++;
+        retrieve(slot, true);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+    glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, (void *)0);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    nextSlot = (slot + 1) % CAPTURE_PBOS;
+    nOfRead++;
+
+    auto endTime = std::chrono::steady_clock::now();
+    readTime += std::chrono::duration<double, std::milli>(endTime - startTime).count();
+}
+
+// ---------------------------------------------------------
+// Hand the frames whose read back is over to the workers
+// Remarks: never waits for the GPU; call it every frame,
+//   even when not recording, so the last frames get out
+// ---------------------------------------------------------
+void FrameCapture::poll()
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    // Oldest first, so frames are queued in order
+    bool isRetrieved = false;
+    for (int i = 0; i < CAPTURE_PBOS; i++)
+    {
+        int slot = (nextSlot + i) % CAPTURE_PBOS;
+        if (fences[slot] == NULL)
+        {
+            continue;
+        }
+        if (!retrieve(slot, false))
+        {
+            break;
+        }
+        isRetrieved = true;
+    }
+
+    if (isRetrieved)
+    {
+        auto endTime = std::chrono::steady_clock::now();
+        readTime += std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    }
+}
+
+// ---------------------------------------------------------
+// Copy a read back frame out of its pixel buffer object
+// Parameters:
+//   1. slot: pixel buffer object holding the frame
+//   2. wait: wait for the fence, or give up if not passed
+// Return: false if the frame is still in flight
+// Remarks: when no buffer is free, the frame is dropped,
+//   unless isBlocking is set
+// ---------------------------------------------------------
+bool FrameCapture::retrieve(int slot, bool wait)
+{
+    if (wait)
+    {
+        while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+        {
+        }
+    }
+    else if (glClientWaitSync(fences[slot], 0, 0) == GL_TIMEOUT_EXPIRED)
+    {
+        return false;
+    }
+    glDeleteSync(fences[slot]);
+    fences[slot] = NULL;
+
+    int buffer = -1;
+    {
+        std::unique_lock<std::mutex> lock(workMutex);
+        if (isBlocking)
+        {
+            freeCondition.wait(lock, [&]() { return !freeBuffers.empty(); });
+        }
+        if (!freeBuffers.empty())
+        {
+            buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
+    }
+    if (buffer < 0)
+    {
+        nOfDropped++;
+        return true;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+    const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes, GL_MAP_READ_BIT);
+    if (pixels != NULL)
+    {
+        memcpy(buffers[buffer].data(), pixels, frameBytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        if (pixels != NULL)
+        {
+            frames.push_back({nOfQueued++, buffer});
+        }
+        else
+        {
+            freeBuffers.push_back(buffer);
+            nOfDropped++;
+        }
+    }
+    workCondition.notify_one();
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Reallocate the pixel buffer objects and the buffers
+// Parameters:
+//   1. w: frame width, in pixels
+//   2. h: frame height, in pixels
+// Remarks: waits until every frame of the old size is
+//   encoded; opens the file of a stream format
+// ---------------------------------------------------------
+void FrameCapture::resize(int w, int h)
+{
+    bool wasBlocking = isBlocking;
+    isBlocking = true;
+    for (int i = 0; i < CAPTURE_PBOS; i++)
+    {
+        int slot = (nextSlot + i) % CAPTURE_PBOS;
+        if (fences[slot] != NULL)
+        {
+            retrieve(slot, true);
+        }
+    }
+    isBlocking = wasBlocking;
+
+    {
+        std::unique_lock<std::mutex> lock(workMutex);
+        freeCondition.wait(lock, [&]() { return freeBuffers.size() == buffers.size(); });
+    }
+
+    width = w;
+    height = h;
+    frameBytes = size_t(width) * height * 4;
+
+    for (int i = 0; i < CAPTURE_PBOS; i++)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        buffers[i].resize(frameBytes);
+    }
+
+    if (format == CAPTURE_RAW || format == CAPTURE_Y4M)
+    {
+        string fileName = prefix + (format == CAPTURE_RAW ? ".raw" : ".y4m");
+        stream = fopen(fileName.c_str(), "wb");
+        if (stream == NULL)
+        {
+            std::cout << "failed to open file : " << fileName << std::endl;
+            return;
+        }
+
+        if (format == CAPTURE_Y4M)
+        {
+            fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, framesPerSecond);
+        }
+        std::cout << "recording " << fileName << " (" << width << " x " << height << ")" << std::endl;
+    }
+}
+
+// ---------------------------------------------------------
+// Body of the worker threads
+// Remarks: on close, the queue is emptied before leaving
+// ---------------------------------------------------------
+void FrameCapture::encodeFrames()
+{
+    vector<uint8_t> converted;
+
+    while (true)
+    {
+        CapturedFrame captured;
+        {
+            std::unique_lock<std::mutex> lock(workMutex);
+            workCondition.wait(lock, [&]() { return isStopping || !frames.empty(); });
+            if (frames.empty())
+            {
+                return;
+            }
+
+            captured = frames.front();
+            frames.pop_front();
+        }
+
+        const uint8_t *pixels = buffers[captured.buffer].data();
+        if (format == CAPTURE_RAW || format == CAPTURE_Y4M)
+        {
+            writeStream(pixels, captured.frame, converted);
+        }
+        else
+        {
+            writeImage(pixels, captured.frame);
+
+            std::lock_guard<std::mutex> lock(workMutex);
+            nOfWritten++;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(workMutex);
+            freeBuffers.push_back(captured.buffer);
+        }
+        freeCondition.notify_all();
+    }
+}
+
+// ---------------------------------------------------------
+// Save a frame as an image
+// Parameters:
+//   1. pixels: BGRA pixels, bottom row first (glReadPixels)
+//   2. frame: frame number, appended to the prefix
+// ---------------------------------------------------------
+void FrameCapture::writeImage(const uint8_t *pixels, size_t frame)
+{
+    // Zero padding
+    // e.g. "output0001.bmp"
+    char number[32];
+    snprintf(number, sizeof(number), "%04zu", frame);
+    string fileName = prefix + number + (format == CAPTURE_PNG ? ".png" : ".bmp");
+
+    // The alpha of the framebuffer is not meant to be seen
+    FIBITMAP *image = FreeImage_ConvertFromRawBits((BYTE *)pixels, width, height, width * 4, 32, FI_RGBA_RED_MASK,
+                                                   FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, FALSE);
+    FIBITMAP *outputImage = FreeImage_ConvertTo24Bits(image);
+
+    if (!FreeImage_Save(format == CAPTURE_PNG ? FIF_PNG : FIF_BMP, outputImage, fileName.c_str(), 0))
+    {
+        std::cout << "failed to save file : " << fileName << std::endl;
+    }
+
+    FreeImage_Unload(outputImage);
+    FreeImage_Unload(image);
+}
+
+// ---------------------------------------------------------
+// Append a frame to the stream file
+// Parameters:
+//   1. pixels: BGRA pixels, bottom row first (glReadPixels)
+//   2. frame: frame number, frames are written in order
+//   3. converted: the frame in the format of the file
+// Remarks: the conversion runs in parallel, the writes
+//   take turns
+// ---------------------------------------------------------
+void FrameCapture::writeStream(const uint8_t *pixels, size_t frame, vector<uint8_t> &converted)
+{
+    size_t nOfPixels = size_t(width) * height;
+    converted.resize(nOfPixels * 3);
+
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *src = pixels + size_t(height - 1 - y) * width * 4;
+        size_t row = size_t(y) * width;
+
+        for (int x = 0; x < width; x++)
+        {
+            int b = src[x * 4], g = src[x * 4 + 1], r = src[x * 4 + 2];
+
+            if (format == CAPTURE_RAW)
+            {
+                uint8_t *dst = &converted[(row + x) * 3];
+                dst[0] = uint8_t(r);
+                dst[1] = uint8_t(g);
+                dst[2] = uint8_t(b);
+            }
+            else
+            {
+                // BT.601, studio range (the default of .y4m readers)
+                converted[row + x] = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                converted[nOfPixels + row + x] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                converted[nOfPixels * 2 + row + x] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(workMutex);
+        writeCondition.wait(lock, [&]() { return nOfWritten == frame; });
+    }
+
+    // Only the thread of this frame is here
+    if (format == CAPTURE_Y4M)
+    {
+        fputs("FRAME\n", stream);
+    }
+    fwrite(converted.data(), 1, converted.size(), stream);
+
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        nOfWritten++;
+    }
+    writeCondition.notify_all();
+}
+
+// ---------------------------------------------------------
+// Print statistics of the recording
+// ---------------------------------------------------------
+void FrameCapture::printStats()
+{
+    size_t written;
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        written = nOfWritten;
+    }
+
+    std::cout << "capture: " << nOfRead << " frames read back, " << written << " written, " << nOfDropped
+              << " dropped, " << nOfStalls << " stalls, main thread "
+              << ((nOfRead > 0) ? readTime / double(nOfRead) : 0.0) << " ms per frame" << std::endl;
+}
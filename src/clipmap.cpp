@@ -0,0 +1,299 @@
+#include "clipmap.h"
+
+// ================================================
+// HeightClipmap class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (nothing built)
+// ---------------------------------------------------------
+HeightClipmap::HeightClipmap()
+{
+    heightMap = NULL;
+    clipSize = 0;
+    nOfLevels = 0;
+    maxTexelsPerUpdate = 16384;
+
+    nOfUploadedTexels = 0;
+    nOfUploadCalls = 0;
+    nOfStaleLevels = 0;
+    maxUploadedTexels = 0;
+    nOfUpdates = 0;
+    totalUploadedTexels = 0.0;
+
+    tboClipmap = 0;
+    texUnit = 0;
+    shader = 0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+HeightClipmap::~HeightClipmap()
+{
+    if (tboClipmap != 0)
+    {
+        glDeleteTextures(1, &tboClipmap);
+    }
+}
+
+// ---------------------------------------------------------
+// Build the mips of a height map
+// Parameters:
+//   1. hm: height map, power-of-2 size, kept by reference
+//   2. size: texels per level side, a power of 2
+//   3. threads: number of threads, 0 means one per core
+// Return: false if a size is not a power of 2
+// Remarks: levels are added until one covers the whole
+//   map, up to MAX_CLIP_LEVELS
+// ---------------------------------------------------------
+bool HeightClipmap::build(const HeightMap &hm, int size, int threads)
+{
+    auto isPowerOf2 = [](int n) { return n > 0 && (n & (n - 1)) == 0; };
+    if (!isPowerOf2(hm.width) || !isPowerOf2(hm.height) || !isPowerOf2(size) || size < 4)
+    {
+        std::cout << "the clipmap and its height map must have power-of-2 sizes" << std::endl;
+        return false;
+    }
+
+    heightMap = &hm;
+    clipSize = size;
+
+    nOfLevels = 1;
+    while (nOfLevels < MAX_CLIP_LEVELS &&
+           ((hm.width >> (nOfLevels - 1)) > clipSize || (hm.height >> (nOfLevels - 1)) > clipSize))
+    {
+        nOfLevels++;
+    }
+
+    hm.buildMips(mips, nOfLevels, threads);
+
+    origins.assign(nOfLevels, ivec2(0));
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Get the source of a level
+// Parameters:
+//   k: level
+// Return: the height map (k = 0) or its mip k
+// ---------------------------------------------------------
+const HeightMap &HeightClipmap::getLevel(int k) const
+{
+    return (k == 0) ? *heightMap : mips[k];
+}
+
+// ---------------------------------------------------------
+// Get the origin that centers a level on a point
+// Parameters:
+//   1. k: level
+//   2. center: uv of the point
+// Return: texel of level k at the (x0, y0) corner
+// ---------------------------------------------------------
+ivec2 HeightClipmap::getTargetOrigin(int k, vec2 center) const
+{
+    const HeightMap &level = getLevel(k);
+    vec2 t = center * vec2(level.width, level.height);
+
+    return ivec2(int(std::floor(t.x)), int(std::floor(t.y))) - clipSize / 2;
+}
+
+// ---------------------------------------------------------
+// Create the texture array read by tesQuad.glsl
+// Parameters:
+//   unit: texture unit (texClipmap)
+// ---------------------------------------------------------
+void HeightClipmap::initTexture(int unit)
+{
+    texUnit = unit;
+
+    glActiveTexture(GL_TEXTURE0 + texUnit);
+    glGenTextures(1, &tboClipmap);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tboClipmap);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, clipSize, clipSize, nOfLevels, 0, GL_RED, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
+// ---------------------------------------------------------
+// Initialize uniforms
+// Parameters:
+//   s: program reading the clipmap (tcsQuad.glsl and tesQuad.glsl)
+// ---------------------------------------------------------
+void HeightClipmap::initUniform(GLuint &s)
+{
+    shader = s;
+    uniIsClipmapped = myGetUniformLocation(shader, "isClipmapped");
+    uniTexClipmap = myGetUniformLocation(shader, "texClipmap");
+    uniNumClipLevels = myGetUniformLocation(shader, "nOfClipLevels");
+    uniClipSize = myGetUniformLocation(shader, "clipSize");
+    uniClipOrigins = myGetUniformLocation(shader, "clipOrigins");
+    uniHeightSize = myGetUniformLocation(shader, "heightSize");
+}
+
+// ---------------------------------------------------------
+// Pass the clipmap and the origins of its levels to the program
+// ---------------------------------------------------------
+void HeightClipmap::setUniform()
+{
+    glUseProgram(shader);
+
+    glUniform1i(uniIsClipmapped, 1);
+    glUniform1i(uniTexClipmap, texUnit);
+    glUniform1i(uniNumClipLevels, nOfLevels);
+    glUniform1i(uniClipSize, clipSize);
+    glUniform2iv(uniClipOrigins, nOfLevels, &origins[0].x);
+    glUniform2i(uniHeightSize, heightMap->width, heightMap->height);
+}
+
+// ---------------------------------------------------------
+// Fill every level around a point, whatever the budget
+// Parameters:
+//   center: uv of the point
+// ---------------------------------------------------------
+void HeightClipmap::reset(vec2 center)
+{
+    for (int k = 0; k < nOfLevels; k++)
+    {
+        origins[k] = getTargetOrigin(k, center);
+        uploadRect(k, origins[k], ivec2(clipSize));
+    }
+}
+
+// ---------------------------------------------------------
+// Move the levels toward a point
+// Parameters:
+//   center: uv of the point (the eye point)
+// Remarks:
+//   - Moving a level by n texels along an axis uploads the
+//     n rows or columns coming into view
+//   - At most maxTexelsPerUpdate texels are uploaded,
+//     coarse levels first: a level out of budget moves
+//     as far as it can and catches up later, the shader
+//     reads the next level where it lags behind
+// ---------------------------------------------------------
+void HeightClipmap::update(vec2 center)
+{
+    nOfUploadedTexels = 0;
+    nOfUploadCalls = 0;
+    nOfStaleLevels = 0;
+
+    for (int k = nOfLevels - 1; k >= 0; k--)
+    {
+        ivec2 target = getTargetOrigin(k, center);
+
+        for (int a = 0; a < 2; a++)
+        {
+            int b = 1 - a;
+            int delta = target[a] - origins[k][a];
+            if (delta == 0)
+            {
+                continue;
+            }
+
+            // A row or column costs clipSize texels, and
+            // moving by clipSize or more replaces the whole level
+            size_t budget = maxTexelsPerUpdate - glm::min(nOfUploadedTexels, maxTexelsPerUpdate);
+            int steps = int(glm::min(size_t(glm::min(std::abs(delta), clipSize)), budget / clipSize));
+            if (steps == 0)
+            {
+                continue;
+            }
+
+            ivec2 rectOrigin, rectSize;
+            rectOrigin[b] = origins[k][b];
+            rectSize[b] = clipSize;
+            rectSize[a] = steps;
+            if (steps == clipSize)
+            {
+                // Jump, nothing of the old area is kept
+                origins[k][a] = target[a];
+                rectOrigin[a] = origins[k][a];
+            }
+            else if (delta > 0)
+            {
+                origins[k][a] += steps;
+                rectOrigin[a] = origins[k][a] + clipSize - steps;
+            }
+            else
+            {
+                origins[k][a] -= steps;
+                rectOrigin[a] = origins[k][a];
+            }
+
+            uploadRect(k, rectOrigin, rectSize);
+        }
+
+        nOfStaleLevels += (origins[k] != target);
+    }
+
+    nOfUpdates++;
+    maxUploadedTexels = glm::max(maxUploadedTexels, nOfUploadedTexels);
+    totalUploadedTexels += double(nOfUploadedTexels);
+}
+
+// ---------------------------------------------------------
+// Upload a rectangle of a level
+// Parameters:
+//   1. k: level
+//   2. rectOrigin: first texel of the rectangle, in level texels
+//   3. rectSize: size of the rectangle, at most clipSize
+// Remarks: split where it wraps around the texture,
+//   so it takes up to 4 glTexSubImage3D calls
+// ---------------------------------------------------------
+void HeightClipmap::uploadRect(int k, ivec2 rectOrigin, ivec2 rectSize)
+{
+    const HeightMap &level = getLevel(k);
+
+    glActiveTexture(GL_TEXTURE0 + texUnit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tboClipmap);
+
+    int y = rectOrigin.y, yEnd = rectOrigin.y + rectSize.y;
+    while (y < yEnd)
+    {
+        int sy = ((y % clipSize) + clipSize) % clipSize;
+        int h = glm::min(yEnd - y, clipSize - sy);
+
+        int x = rectOrigin.x, xEnd = rectOrigin.x + rectSize.x;
+        while (x < xEnd)
+        {
+            int sx = ((x % clipSize) + clipSize) % clipSize;
+            int w = glm::min(xEnd - x, clipSize - sx);
+
+            strip.resize(size_t(w) * h);
+            for (int j = 0; j < h; j++)
+            {
+                for (int i = 0; i < w; i++)
+                {
+                    strip[size_t(j) * w + i] = level.texel(x + i, y + j);
+                }
+            }
+
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, sx, sy, k, w, h, 1, GL_RED, GL_FLOAT, (void *)strip.data());
+            nOfUploadedTexels += strip.size();
+            nOfUploadCalls++;
+
+            x += w;
+        }
+
+        y += h;
+    }
+}
+
+// ---------------------------------------------------------
+// Print statistics of the updates
+// ---------------------------------------------------------
+void HeightClipmap::printStats()
+{
+    double average = (nOfUpdates > 0) ? totalUploadedTexels / double(nOfUpdates) : 0.0;
+
+    std::cout << "clipmap: " << nOfLevels << " levels of " << clipSize << "^2, last update: "
+              << nOfUploadedTexels * sizeof(float) / 1024.0 << " KB in " << nOfUploadCalls
+              << " uploads, stale levels: " << nOfStaleLevels << ", per update: average "
+              << average * sizeof(float) / 1024.0 << " KB, max " << maxUploadedTexels * sizeof(float) / 1024.0
+              << " KB, budget " << maxTexelsPerUpdate * sizeof(float) / 1024.0 << " KB" << std::endl;
+}
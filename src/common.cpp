@@ -1,5 +1,10 @@
 #include "common.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 // ================================================
 // Read file into a string
 // Parameters:
@@ -26,9 +31,15 @@ std::string readFile(const std::string fileName)
 //   3. tcsDir: tessellation control shader file
 //   4. tesDir: tessellation evaluation shader file
 // Return: shader executable
+// Remarks: goes through programCache when it is set
 // =====================================================
 GLuint buildShader(string vsDir, string fsDir, string tcsDir = "", string tesDir = "")
 {
+    if (programCache != NULL)
+    {
+        return programCache->get(vsDir, fsDir, tcsDir, tesDir);
+    }
+
     // For a shader object, 0 means NULL
     GLuint vs, fs, tcs = 0, tes = 0;
     GLint linkOk;
@@ -51,6 +62,40 @@ GLuint buildShader(string vsDir, string fsDir, string tcsDir = "", string tesDir
     return exeShader;
 }
 
+// =====================================================
+// Build a compute shader
+// Parameters:
+//   csDir: compute shader file
+// Return: shader executable, 0 if it fails
+// Remarks: not cached by programCache (OpenGL 4.3 only)
+// =====================================================
+GLuint buildComputeShader(string csDir)
+{
+    GLuint cs = compileShader(csDir, GL_COMPUTE_SHADER);
+    if (cs == 0)
+    {
+        return 0;
+    }
+
+    GLuint exe = glCreateProgram();
+    glAttachShader(exe, cs);
+    glLinkProgram(exe);
+    glDeleteShader(cs);
+
+    GLint linkOk;
+    glGetProgramiv(exe, GL_LINK_STATUS, &linkOk);
+    if (linkOk == GL_FALSE)
+    {
+        std::cout << "Failed to link compute shader program." << std::endl;
+        printLog(exe);
+        glDeleteProgram(exe);
+
+        return 0;
+    }
+
+    return exe;
+}
+
 // ================================================
 // Compile shader file
 // Parameters:
@@ -74,6 +119,9 @@ GLuint compileShader(string fileName, GLenum type)
         case GL_FRAGMENT_SHADER:
             info = "Fragment";
             break;
+        case GL_COMPUTE_SHADER:
+            info = "Compute";
+            break;
     }
 
     // If reading shader file fails
@@ -201,549 +249,2343 @@ GLint myGetUniformLocation(GLuint &prog, string name, bool isWarningOn)
     return location;
 }
 
-// ---------------------------------------------------------
-// Draw points
+// ================================================
+// Bind the uniform block Frame of a program
 // Parameters:
-//   pts: point list
-// ---------------------------------------------------------
-void drawPoints(vector<Point> &pts)
+//   prog: shader program (without the block, nothing is done)
+// ================================================
+void bindFrameUniforms(GLuint prog)
+{
+    GLuint index = glGetUniformBlockIndex(prog, "Frame");
+    if (index != GL_INVALID_INDEX)
+    {
+        glUniformBlockBinding(prog, index, FRAME_UNIFORM_BINDING);
+    }
+}
+
+// ================================================
+// Check an extension of the current context
+// Parameters:
+//   name: extension name, e.g. "GL_ARB_pipeline_statistics_query"
+// Return: true if the context has it
+// ================================================
+bool hasGLExtension(const char *name)
 {
-    int nOfPs = pts.size();
-    GLfloat *aPos = new GLfloat[nOfPs * 3];
-    GLfloat *aColor = new GLfloat[nOfPs * 3];
+    GLint nOfExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &nOfExtensions);
 
-    // Implant data
-    for (size_t i = 0; i < nOfPs; i++)
+    for (GLint i = 0; i < nOfExtensions; i++)
     {
-        // Position
-        Point &p = pts[i];
-        aPos[i * 3 + 0] = p.pos.x;
-        aPos[i * 3 + 1] = p.pos.y;
-        aPos[i * 3 + 2] = p.pos.z;
+        const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        if (extension != NULL && strcmp(extension, name) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// ================================================
+// Check the version of the current context
+// Parameters:
+//   major, minor: OpenGL version, e.g. 4, 3
+// Return: true if the context has at least this version
+// ================================================
+bool hasGLVersion(int major, int minor)
+{
+    GLint contextMajor = 0, contextMinor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &contextMajor);
+    glGetIntegerv(GL_MINOR_VERSION, &contextMinor);
+
+    return contextMajor > major || (contextMajor == major && contextMinor >= minor);
+}
 
-        // Color
-        aColor[i * 3 + 0] = p.color.r;
-        aColor[i * 3 + 1] = p.color.g;
-        aColor[i * 3 + 2] = p.color.b;
+// ================================================
+// Get the number of worker threads
+// Parameters:
+//   nOfThreads: requested number, 0 means one per core
+// Return: number of threads (at least 1)
+// ================================================
+int getNumThreads(int nOfThreads)
+{
+    if (nOfThreads <= 0)
+    {
+        nOfThreads = std::thread::hardware_concurrency();
     }
 
-    // Bind vao
-    GLuint vao;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+    return glm::max(nOfThreads, 1);
+}
+
+// ================================================
+// Run a function over [0, n) on several threads
+// Parameters:
+//   1. n: number of work items
+//   2. func: called as func(begin, end) for each chunk
+//   3. nOfThreads: 0 means one thread per core
+// Remarks: chunks are handed out dynamically,
+//   so items of uneven cost still balance well
+// ================================================
+void parallelFor(size_t n, function<void(size_t, size_t)> func, int nOfThreads)
+{
+    nOfThreads = getNumThreads(nOfThreads);
+
+    // Not worth spawning threads
+    if (nOfThreads == 1 || n < 2)
+    {
+        func(0, n);
+        return;
+    }
 
-    // Bind position vbo
-    GLuint vboPos;
-    glGenBuffers(1, &vboPos);
-    glBindBuffer(GL_ARRAY_BUFFER, vboPos);
-    glBufferData(GL_ARRAY_BUFFER, nOfPs * 3 * sizeof(GLfloat), aPos, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-
-    // Bind color vbo
-    GLuint vboColor;
-    glGenBuffers(1, &vboColor);
-    glBindBuffer(GL_ARRAY_BUFFER, vboColor);
-    glBufferData(GL_ARRAY_BUFFER, nOfPs * 3 * sizeof(GLfloat), aColor, GL_STREAM_DRAW);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-
-    // Draw points
-    glDrawArrays(GL_POINTS, 0, nOfPs);
+    // About 16 chunks per thread
+    size_t grain = glm::max(n / (size_t(nOfThreads) * 16), size_t(1));
+    std::atomic<size_t> next(0);
 
-    // Release
-    delete[] aPos;
-    delete[] aColor;
-    glDeleteBuffers(1, &vboPos);
-    glDeleteBuffers(1, &vboColor);
-    glDeleteVertexArrays(1, &vao);
+    auto worker = [&]() {
+        while (true)
+        {
+            size_t begin = next.fetch_add(grain);
+            if (begin >= n)
+            {
+                break;
+            }
+
+            func(begin, glm::min(begin + grain, n));
+        }
+    };
+
+    vector<std::thread> threads;
+    for (int i = 1; i < nOfThreads; i++)
+    {
+        threads.push_back(std::thread(worker));
+    }
+
+    // The calling thread works as well
+    worker();
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
 }
 
 // ================================================
-// Mesh class definition
+// Hash a block of memory (64-bit, not cryptographic)
+// Parameters:
+//   1. data: memory block
+//   2. size: size in bytes
+// Return: hash value
 // ================================================
+uint64_t hashBytes(const char *data, size_t size)
+{
+    const uint64_t mul = 0xff51afd7ed558ccdull;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
 
-// ---------------------------------------------------------
-// Constructor
+    // 8 bytes at a time
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * mul;
+        h ^= h >> 32;
+    }
+
+    // Remaining bytes
+    for (; i < size; i++)
+    {
+        h = (h ^ uint8_t(data[i])) * mul;
+        h ^= h >> 32;
+    }
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// ================================================
+// Get the size, modification time and hash of a file
 // Parameters:
-//   1. fileName: mesh file
-//   2. type: face type (triangle or quad)
-// ---------------------------------------------------------
-Mesh::Mesh(const string fileName, int type = TRIANGLE)
+//   1. fileName: file
+//   2. sig: signature (output)
+// Return: true if the file could be read
+// ================================================
+bool getFileSignature(const string fileName, FileSignature &sig)
 {
-    faceType = type;
+    sig.size = 0;
+    sig.mtime = 0;
+    sig.hash = 0;
 
-    if (type == TRIANGLE)
+    struct stat st;
+    if (stat(fileName.c_str(), &st) != 0)
     {
-        loadObj(fileName);
-        initBuffers();
+        return false;
     }
-    else if (type == QUAD)
+
+    MappedFile file;
+    if (!file.open(fileName))
     {
-        loadObjQuad(fileName);
-        initBuffersQuad();
+        return false;
     }
 
-    initShader();
-    initUniform();
+    sig.size = file.size;
+    sig.mtime = st.st_mtime;
+    sig.hash = hashBytes(file.data, file.size);
+
+    return true;
 }
 
-// ---------------------------------------------------------
-// Destructor
-// ---------------------------------------------------------
-Mesh::~Mesh()
+// ================================================
+// Get the preprocessed mesh file of an .obj file
+// Parameters:
+//   fileName: .obj file
+// Return: the same path with the .tmesh extension
+// ================================================
+string getCacheFileName(const string fileName)
 {
-    glDeleteBuffers(1, &vboVtxs);
-    glDeleteBuffers(1, &vboUvs);
-    glDeleteBuffers(1, &vboNormals);
-    glDeleteVertexArrays(1, &vao);
+    size_t dot = fileName.find_last_of('.');
+    size_t slash = fileName.find_last_of("/\\");
+
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+    {
+        return fileName + ".tmesh";
+    }
+
+    return fileName.substr(0, dot) + ".tmesh";
+}
+
+// ================================================
+// Load the red channel of a height map image
+// Parameters:
+//   1. fileName: image file
+//   2. imgType: image type
+//   3. width, height: size of the image (output)
+//   4. texels: red channel in [0, 1], row 0 is the bottom
+//      row (output)
+//   5. format: GL_R32F for float images, GL_R16 otherwise,
+//      which holds 8 and 16-bit values exactly (output)
+// Return: true if succeeded
+// ================================================
+bool loadHeightImage(const string fileName, FREE_IMAGE_FORMAT imgType, int &width, int &height,
+                     vector<float> &texels, GLenum &format)
+{
+    FIBITMAP *image = FreeImage_Load(imgType, fileName.c_str());
+    if (image == NULL)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+
+    // Anything else goes through 24 bits, as before
+    FREE_IMAGE_TYPE type = FreeImage_GetImageType(image);
+    if (type != FIT_UINT16 && type != FIT_RGB16 && type != FIT_RGBA16 && type != FIT_FLOAT && type != FIT_RGBF &&
+        type != FIT_RGBAF)
+    {
+        FIBITMAP *converted = FreeImage_ConvertTo24Bits(image);
+        FreeImage_Unload(image);
+        image = converted;
+        type = FIT_BITMAP;
+
+        if (image == NULL)
+        {
+            std::cout << "failed to convert file : " << fileName << std::endl;
+            return false;
+        }
+    }
+
+    width = FreeImage_GetWidth(image);
+    height = FreeImage_GetHeight(image);
+    texels.resize(size_t(width) * height);
+    format = (type == FIT_FLOAT || type == FIT_RGBF || type == FIT_RGBAF) ? GL_R32F : GL_R16;
+
+    for (int y = 0; y < height; y++)
+    {
+        BYTE *line = FreeImage_GetScanLine(image, y);
+        float *row = &texels[size_t(y) * width];
+
+        for (int x = 0; x < width; x++)
+        {
+            switch (type)
+            {
+            case FIT_UINT16:
+                row[x] = ((WORD *)line)[x] / 65535.f;
+                break;
+            case FIT_RGB16:
+                row[x] = ((FIRGB16 *)line)[x].red / 65535.f;
+                break;
+            case FIT_RGBA16:
+                row[x] = ((FIRGBA16 *)line)[x].red / 65535.f;
+                break;
+            case FIT_FLOAT:
+                row[x] = ((float *)line)[x];
+                break;
+            case FIT_RGBF:
+                row[x] = ((FIRGBF *)line)[x].red;
+                break;
+            case FIT_RGBAF:
+                row[x] = ((FIRGBAF *)line)[x].red;
+                break;
+            default:
+                row[x] = line[x * 3 + FI_RGBA_RED] / 255.f;
+                break;
+            }
+        }
+    }
+
+    FreeImage_Unload(image);
+
+    return true;
 }
 
+// ================================================
+// MappedFile class definition
+// ================================================
+
 // ---------------------------------------------------------
-// Initialize shaders
+// Constructor
 // ---------------------------------------------------------
-void Mesh::initShader()
+MappedFile::MappedFile()
 {
-    shader =
-        buildShader("./shader/vsPhong.glsl", "./shader/fsPhong.glsl", "./shader/tcsQuad.glsl", "./shader/tesQuad.glsl");
+    data = NULL;
+    size = 0;
 }
 
 // ---------------------------------------------------------
-// Initialize uniforms
+// Destructor
 // ---------------------------------------------------------
-void Mesh::initUniform()
+MappedFile::~MappedFile()
 {
-    uniModel = myGetUniformLocation(shader, "M");
-    uniView = myGetUniformLocation(shader, "V");
-    uniProjection = myGetUniformLocation(shader, "P");
-    uniEyePoint = myGetUniformLocation(shader, "eyePoint");
-    uniLightColor = myGetUniformLocation(shader, "lightColor");
-    uniLightPosition = myGetUniformLocation(shader, "lightPosition");
-    uniTexBase = myGetUniformLocation(shader, "texBase");
-    uniTexNormal = myGetUniformLocation(shader, "texNormal");
-    uniTexHeight = myGetUniformLocation(shader, "texHeight");
+    close();
 }
 
 // ---------------------------------------------------------
-// Load mesh .obj (for triangle face)
+// Map a whole file into memory (read-only)
 // Parameters:
-//   fileName: mesh file
+//   fileName: file to map
+// Return: true if succeeded
 // ---------------------------------------------------------
-void Mesh::loadObj(const string fileName)
+bool MappedFile::open(const string fileName)
 {
-    std::ifstream fin;
-    fin.open(fileName.c_str());
+    close();
 
-    if (!(fin.good()))
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
     {
-        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
     }
 
-    while (fin.peek() != EOF)
+    struct stat st;
+    if (fstat(fd, &st) != 0)
     {
-        std::string s;
-        fin >> s;
+        ::close(fd);
+        return false;
+    }
 
-        // Vertex coordinate
-        if ("v" == s)
-        {
-            float x, y, z;
-            fin >> x;
-            fin >> y;
-            fin >> z;
-            vertices.push_back(glm::vec3(x, y, z));
-        }
-        // Texture coordinate
-        else if ("vt" == s)
-        {
-            float u, v;
-            fin >> u;
-            fin >> v;
-            uvs.push_back(glm::vec2(u, v));
-        }
-        // Face normal (recorded as vn in obj file)
-        else if ("vn" == s)
+    // mmap does not accept a zero length, an empty file is still valid
+    size = st.st_size;
+    if (size > 0)
+    {
+        void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
         {
-            float x, y, z;
-            fin >> x;
-            fin >> y;
-            fin >> z;
-            faceNormals.push_back(glm::vec3(x, y, z));
+            size = 0;
+            ::close(fd);
+            return false;
         }
-        // Vertices contained in face, and face normal
-        else if ("f" == s)
-        {
-            Face f;
 
-            // v1/vt1/vn1
-            fin >> f.v1;
-            fin.ignore(1);
-            fin >> f.vt1;
-            fin.ignore(1);
-            fin >> f.vn1;
+        data = (const char *)addr;
+        madvise(addr, size, MADV_SEQUENTIAL);
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Unmap the file
+// ---------------------------------------------------------
+void MappedFile::close()
+{
+    if (data != NULL)
+    {
+        munmap((void *)data, size);
+    }
 
-            // v2/vt2/vn2
-            fin >> f.v2;
-            fin.ignore(1);
-            fin >> f.vt2;
-            fin.ignore(1);
-            fin >> f.vn2;
+    data = NULL;
+    size = 0;
+}
 
-            // v3/vt3/vn3
-            fin >> f.v3;
-            fin.ignore(1);
-            fin >> f.vt3;
-            fin.ignore(1);
-            fin >> f.vn3;
+// ================================================
+// ProgramCache class definition
+// ================================================
 
-            // Note:
-            //  v, vt, vn in "v/vt/vn" start from 1,
-            //  but indices of std::vector start from 0,
-            //  so we need minus 1 for all elements
-            f.v1 -= 1;
-            f.vt1 -= 1;
-            f.vn1 -= 1;
+// Used by buildShader when set
+ProgramCache *programCache = NULL;
 
-            f.v2 -= 1;
-            f.vt2 -= 1;
-            f.vn2 -= 1;
+// Shader types of CachedProgram::files
+static const GLenum programStages[4] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER, GL_TESS_CONTROL_SHADER,
+                                        GL_TESS_EVALUATION_SHADER};
 
-            f.v3 -= 1;
-            f.vt3 -= 1;
-            f.vn3 -= 1;
+// ---------------------------------------------------------
+// Constructor (no cache directory)
+// ---------------------------------------------------------
+ProgramCache::ProgramCache()
+{
+    hasBinaries = false;
+    isParallel = false;
+    driverHash = 0;
+
+    nOfLoaded = 0;
+    nOfCompiled = 0;
+    nOfRejected = 0;
+    waitTime = 0.0;
+}
 
-            faces.push_back(f);
-        }
-        else
+// ---------------------------------------------------------
+// Destructor: programs never got are deleted
+// ---------------------------------------------------------
+ProgramCache::~ProgramCache()
+{
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        for (int s = 0; s < 4; s++)
         {
-            continue;
+            glDeleteShader(pending[i].shaders[s]);
         }
+        glDeleteProgram(pending[i].program);
     }
-
-    fin.close();
 }
 
 // ---------------------------------------------------------
-// Load mesh .obj (for quad face)
+// Check what the context supports
 // Parameters:
-//   fileName: mesh file
+//   dir: cache directory, created if missing
+//     ("" means no binary is loaded or saved)
 // ---------------------------------------------------------
-void Mesh::loadObjQuad(const string fileName)
+void ProgramCache::init(const string dir)
 {
-    std::ifstream fin;
-    fin.open(fileName.c_str());
+    directory = dir;
 
-    if (!(fin.good()))
+    // macOS reports no binary format, programs are compiled every time
+    GLint nOfFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nOfFormats);
+    hasBinaries = nOfFormats > 0 && !directory.empty();
+    if (hasBinaries)
     {
-        std::cout << "failed to open file : " << fileName << std::endl;
+        mkdir(directory.c_str(), 0755);
     }
 
-    while (fin.peek() != EOF)
-    {
-        std::string s;
-        fin >> s;
-
-        // Vertex coordinate
-        if ("v" == s)
-        {
-            float x, y, z;
-            fin >> x;
-            fin >> y;
-            fin >> z;
-            vertices.push_back(glm::vec3(x, y, z));
-        }
-        // Texture coordinate
-        else if ("vt" == s)
-        {
-            float u, v;
-            fin >> u;
-            fin >> v;
-            uvs.push_back(glm::vec2(u, v));
-        }
-        // Face normal (recorded as vn in obj file)
-        else if ("vn" == s)
-        {
-            float x, y, z;
-            fin >> x;
-            fin >> y;
-            fin >> z;
-            faceNormals.push_back(glm::vec3(x, y, z));
-        }
-        // Vertices contained in face, and face normal
-        else if ("f" == s)
-        {
-            Face f;
-
-            // v1/vt1/vn1
-            fin >> f.v1;
-            fin.ignore(1);
-            fin >> f.vt1;
-            fin.ignore(1);
-            fin >> f.vn1;
-
-            // v2/vt2/vn2
-            fin >> f.v2;
-            fin.ignore(1);
-            fin >> f.vt2;
-            fin.ignore(1);
-            fin >> f.vn2;
-
-            // v3/vt3/vn3
-            fin >> f.v3;
-            fin.ignore(1);
-            fin >> f.vt3;
-            fin.ignore(1);
-            fin >> f.vn3;
-
-            // v4/vt4/vn4
-            fin >> f.v4;
-            fin.ignore(1);
-            fin >> f.vt4;
-            fin.ignore(1);
-            fin >> f.vn4;
-
-            // Note:
-            //  v, vt, vn in "v/vt/vn" start from 1,
-            //  but indices of std::vector start from 0,
-            //  so we need minus 1 for all elements
-            f.v1 -= 1;
-            f.vt1 -= 1;
-            f.vn1 -= 1;
-
-            f.v2 -= 1;
-            f.vt2 -= 1;
-            f.vn2 -= 1;
-
-            f.v3 -= 1;
-            f.vt3 -= 1;
-            f.vn3 -= 1;
-
-            f.v4 -= 1;
-            f.vt4 -= 1;
-            f.vn4 -= 1;
-
-            faces.push_back(f);
-        }
-        else
-        {
-            continue;
-        }
+    // A binary only fits the driver which produced it
+    string driver;
+    const GLenum names[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+    for (int i = 0; i < 3; i++)
+    {
+        const char *name = (const char *)glGetString(names[i]);
+        driver += (name != NULL) ? name : "";
+        driver += '\n';
     }
+    driverHash = hashBytes(driver.data(), driver.size());
 
-    fin.close();
+    // Let the driver use as many compiler threads as it likes
+    if (hasGLExtension("GL_KHR_parallel_shader_compile"))
+    {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);
+        isParallel = true;
+    }
+    else if (hasGLExtension("GL_ARB_parallel_shader_compile"))
+    {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFFu);
+        isParallel = true;
+    }
 }
 
 // ---------------------------------------------------------
-// Initialize OpenGL buffers (for triangle face)
+// Start building a program, without waiting for it
+// Parameters:
+//   1. vsFile: vertex shader file
+//   2. fsFile: fragment shader file
+//   3. tcsFile: tessellation control shader file ("" if none)
+//   4. tesFile: tessellation evaluation shader file ("" if none)
+// Remarks: nothing is done if the same files are pending
 // ---------------------------------------------------------
-void Mesh::initBuffers()
+void ProgramCache::submit(const string vsFile, const string fsFile, const string tcsFile, const string tesFile)
 {
-    // Write vertex coordinate to array
-    int nOfFaces = faces.size();
+    auto start = std::chrono::steady_clock::now();
 
-    // 3 vertices per face, 3 float per vertex coord, 2 float per tex coord
-    GLfloat *aVtxCoords = new GLfloat[nOfFaces * 3 * 3];
-    GLfloat *aUvs = new GLfloat[nOfFaces * 3 * 2];
-    GLfloat *aNormals = new GLfloat[nOfFaces * 3 * 3];
+    CachedProgram entry;
+    entry.files[0] = vsFile;
+    entry.files[1] = fsFile;
+    entry.files[2] = (tcsFile != "" && tesFile != "") ? tcsFile : "";
+    entry.files[3] = (tcsFile != "" && tesFile != "") ? tesFile : "";
 
-    for (size_t i = 0; i < nOfFaces; i++)
+    for (size_t i = 0; i < pending.size(); i++)
     {
-        // vertex 1
-        int vtxIdx = faces[i].v1;
-        aVtxCoords[i * 9 + 0] = vertices[vtxIdx].x;
-        aVtxCoords[i * 9 + 1] = vertices[vtxIdx].y;
-        aVtxCoords[i * 9 + 2] = vertices[vtxIdx].z;
+        if (std::equal(entry.files, entry.files + 4, pending[i].files))
+        {
+            return;
+        }
+    }
 
-        // Normal for vertex 1
-        int nmlIdx = faces[i].vn1;
-        aNormals[i * 9 + 0] = faceNormals[nmlIdx].x;
-        aNormals[i * 9 + 1] = faceNormals[nmlIdx].y;
-        aNormals[i * 9 + 2] = faceNormals[nmlIdx].z;
+    // Key: the driver, then every stage (its type and source)
+    uint64_t hashes[6] = {PROGRAM_CACHE_VERSION, driverHash};
+    for (int s = 0; s < 4; s++)
+    {
+        string source = (entry.files[s] != "") ? readFile(entry.files[s]) : "";
+        hashes[2 + s] = hashBytes(source.data(), source.size()) ^ (uint64_t(s) << 56);
+    }
+    entry.key = hashBytes((const char *)hashes, sizeof(hashes));
 
-        // Uv for vertex 1
-        int uvIdx = faces[i].vt1;
-        aUvs[i * 6 + 0] = uvs[uvIdx].x;
-        aUvs[i * 6 + 1] = uvs[uvIdx].y;
+    entry.program = glCreateProgram();
+    std::fill(entry.shaders, entry.shaders + 4, 0);
+    entry.isFromBinary = hasBinaries && loadBinary(entry);
+    if (!entry.isFromBinary)
+    {
+        compileSources(entry);
+    }
+    pending.push_back(entry);
 
-        // Vertex 2
-        vtxIdx = faces[i].v2;
-        aVtxCoords[i * 9 + 3] = vertices[vtxIdx].x;
-        aVtxCoords[i * 9 + 4] = vertices[vtxIdx].y;
-        aVtxCoords[i * 9 + 5] = vertices[vtxIdx].z;
+    waitTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-        // Normal for vertex 2
-        nmlIdx = faces[i].vn2;
-        aNormals[i * 9 + 3] = faceNormals[nmlIdx].x;
-        aNormals[i * 9 + 4] = faceNormals[nmlIdx].y;
-        aNormals[i * 9 + 5] = faceNormals[nmlIdx].z;
+// ---------------------------------------------------------
+// Get a built program (submitted first if it is not)
+// Parameters: as submit
+// Return: shader program, 0 if it failed to compile or link
+// ---------------------------------------------------------
+GLuint ProgramCache::get(const string vsFile, const string fsFile, const string tcsFile, const string tesFile)
+{
+    submit(vsFile, fsFile, tcsFile, tesFile);
 
-        // Uv for vertex 2
-        uvIdx = faces[i].vt2;
-        aUvs[i * 6 + 2] = uvs[uvIdx].x;
+    auto start = std::chrono::steady_clock::now();
+
+    string files[4] = {vsFile, fsFile, (tcsFile != "" && tesFile != "") ? tcsFile : "",
+                       (tcsFile != "" && tesFile != "") ? tesFile : ""};
+    GLuint program = 0;
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        if (std::equal(files, files + 4, pending[i].files))
+        {
+            program = finish(pending[i]);
+            pending.erase(pending.begin() + i);
+            break;
+        }
+    }
+
+    waitTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    return program;
+}
+
+// ---------------------------------------------------------
+// Load the binary of a program
+// Parameters:
+//   entry: program to load, key set
+// Return: false if there is no binary of this key
+// Remarks: whether the driver accepts it is only known
+//   from the link status (see finish)
+// ---------------------------------------------------------
+bool ProgramCache::loadBinary(CachedProgram &entry)
+{
+    MappedFile file;
+    if (!file.open(getBinaryFileName(entry.key)) || file.size < sizeof(ProgramCacheHeader))
+    {
+        return false;
+    }
+
+    ProgramCacheHeader header;
+    memcpy(&header, file.data, sizeof(ProgramCacheHeader));
+    if (header.magic != PROGRAM_CACHE_MAGIC || header.version != PROGRAM_CACHE_VERSION || header.key != entry.key ||
+        sizeof(ProgramCacheHeader) + header.binaryBytes != file.size)
+    {
+        return false;
+    }
+
+    glProgramBinary(entry.program, header.binaryFormat, file.data + sizeof(ProgramCacheHeader), header.binaryBytes);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Save the binary of a linked program
+// Parameters:
+//   entry: program compiled from its sources
+// Remarks: written to a temporary file and renamed, as
+//   Mesh::saveCache
+// ---------------------------------------------------------
+void ProgramCache::saveBinary(const CachedProgram &entry)
+{
+    GLint binaryBytes = 0;
+    glGetProgramiv(entry.program, GL_PROGRAM_BINARY_LENGTH, &binaryBytes);
+    if (binaryBytes <= 0)
+    {
+        return;
+    }
+
+    vector<char> binary(binaryBytes);
+    GLenum binaryFormat = 0;
+    glGetProgramBinary(entry.program, binaryBytes, NULL, &binaryFormat, binary.data());
+
+    ProgramCacheHeader header;
+    memset(&header, 0, sizeof(ProgramCacheHeader));
+    header.magic = PROGRAM_CACHE_MAGIC;
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = entry.key;
+    header.binaryFormat = binaryFormat;
+    header.binaryBytes = uint32_t(binaryBytes);
+
+    string fileName = getBinaryFileName(entry.key);
+    string tempFile = fileName + ".tmp";
+    std::ofstream fout(tempFile.c_str(), std::ios::binary);
+    fout.write((const char *)&header, sizeof(ProgramCacheHeader));
+    fout.write(binary.data(), binaryBytes);
+    fout.close();
+
+    if (!fout.good() || rename(tempFile.c_str(), fileName.c_str()) != 0)
+    {
+        std::cout << "failed to write file : " << fileName << std::endl;
+        remove(tempFile.c_str());
+    }
+}
+
+// ---------------------------------------------------------
+// Compile and link a program from its files
+// Parameters:
+//   entry: program to build
+// Remarks: no status is queried, so that the driver can
+//   keep compiling in the background
+// ---------------------------------------------------------
+void ProgramCache::compileSources(CachedProgram &entry)
+{
+    for (int s = 0; s < 4; s++)
+    {
+        if (entry.files[s] == "")
+        {
+            continue;
+        }
+
+        string source = readFile(entry.files[s]);
+        const GLchar *sources[] = {source.c_str()};
+        entry.shaders[s] = glCreateShader(programStages[s]);
+        glShaderSource(entry.shaders[s], 1, sources, NULL);
+        glCompileShader(entry.shaders[s]);
+        glAttachShader(entry.program, entry.shaders[s]);
+    }
+
+    if (hasBinaries)
+    {
+        glProgramParameteri(entry.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(entry.program);
+}
+
+// ---------------------------------------------------------
+// Wait for a submitted program and check it
+// Parameters:
+//   entry: submitted program
+// Return: shader program, 0 if it failed to compile or link
+// Remarks: a rejected binary (e.g. after a driver update)
+//   is compiled from the sources instead
+// ---------------------------------------------------------
+GLuint ProgramCache::finish(CachedProgram &entry)
+{
+    GLint linkOk = GL_FALSE;
+    glGetProgramiv(entry.program, GL_LINK_STATUS, &linkOk);
+
+    if (linkOk == GL_FALSE && entry.isFromBinary)
+    {
+        nOfRejected++;
+        glDeleteProgram(entry.program);
+        entry.program = glCreateProgram();
+        entry.isFromBinary = false;
+        compileSources(entry);
+        glGetProgramiv(entry.program, GL_LINK_STATUS, &linkOk);
+    }
+
+    // Same messages as compileShader and linkShader
+    if (linkOk == GL_FALSE)
+    {
+        for (int s = 0; s < 4; s++)
+        {
+            GLint compileOk = GL_TRUE;
+            if (entry.shaders[s] != 0)
+            {
+                glGetShaderiv(entry.shaders[s], GL_COMPILE_STATUS, &compileOk);
+            }
+            if (compileOk == GL_FALSE)
+            {
+                std::cout << entry.files[s] << " : Fail to compile." << std::endl;
+                printLog(entry.shaders[s]);
+            }
+        }
+        std::cout << "Failed to link shader program." << std::endl;
+        printLog(entry.program);
+    }
+
+    // Shaders are not needed once linked
+    for (int s = 0; s < 4; s++)
+    {
+        if (entry.shaders[s] != 0)
+        {
+            glDetachShader(entry.program, entry.shaders[s]);
+            glDeleteShader(entry.shaders[s]);
+            entry.shaders[s] = 0;
+        }
+    }
+
+    if (linkOk == GL_FALSE)
+    {
+        glDeleteProgram(entry.program);
+        entry.program = 0;
+        return 0;
+    }
+
+    if (entry.isFromBinary)
+    {
+        nOfLoaded++;
+    }
+    else
+    {
+        nOfCompiled++;
+        if (hasBinaries)
+        {
+            saveBinary(entry);
+        }
+    }
+
+    return entry.program;
+}
+
+// ---------------------------------------------------------
+// Get the binary file of a key
+// ---------------------------------------------------------
+string ProgramCache::getBinaryFileName(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.glbin", (unsigned long long)key);
+
+    return directory + name;
+}
+
+// ---------------------------------------------------------
+// Print how the programs were built
+// ---------------------------------------------------------
+void ProgramCache::printStats()
+{
+    std::cout << "programs: " << nOfLoaded << " loaded, " << nOfCompiled << " compiled";
+    if (nOfRejected > 0)
+    {
+        std::cout << " (" << nOfRejected << " binaries rejected)";
+    }
+    std::cout << ", " << waitTime << " ms" << (isParallel ? ", parallel compile" : "")
+              << (hasBinaries ? "" : ", no binary cache") << std::endl;
+}
+
+// ================================================
+// FrameUniformBuffer class definition
+// ================================================
+
+// Counted by the draw functions, reset by the caller
+DrawCounters drawCounters = {0, 0};
+
+// ---------------------------------------------------------
+// Constructor (no buffer yet)
+// ---------------------------------------------------------
+FrameUniformBuffer::FrameUniformBuffer()
+{
+    ubo = 0;
+    data = FrameUniforms();
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+FrameUniformBuffer::~FrameUniformBuffer()
+{
+    glDeleteBuffers(1, &ubo);
+}
+
+// ---------------------------------------------------------
+// Create the buffer and bind it to FRAME_UNIFORM_BINDING
+// ---------------------------------------------------------
+void FrameUniformBuffer::init()
+{
+    glGenBuffers(1, &ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, ubo);
+}
+
+// ---------------------------------------------------------
+// Update the uniforms of the frame
+// Parameters:
+//   1. V, P: view and projection matrices
+//   2. eye: eye point
+//   3. lightColor, lightPosition: lighting
+//   4. lodScale: factor of the tessellation levels, 1 as set
+//      by the metric
+// ---------------------------------------------------------
+void FrameUniformBuffer::update(mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPosition, float lodScale)
+{
+    data.V = V;
+    data.P = P;
+    data.eyePoint = vec4(eye, 1.f);
+    data.lightColor = vec4(lightColor, 1.f);
+    data.lightPosition = lightPosition;
+    data.lodScale = lodScale;
+
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &data);
+    drawCounters.nOfStateChanges++;
+}
+
+// ================================================
+// DrawBatch class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (no buffer yet)
+// ---------------------------------------------------------
+DrawBatch::DrawBatch()
+{
+    vao = 0;
+    ssbo = 0;
+    indirectBuffer = 0;
+    baseInstanceBuffer = 0;
+    divisor = 1;
+    recordBytes = 0;
+    nOfBaseInstances = 0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+DrawBatch::~DrawBatch()
+{
+    glDeleteBuffers(1, &ssbo);
+    glDeleteBuffers(1, &indirectBuffer);
+    glDeleteBuffers(1, &baseInstanceBuffer);
+}
+
+// ---------------------------------------------------------
+// Check whether the context can draw batches
+// Return: true with OpenGL 4.3 or later
+// ---------------------------------------------------------
+bool DrawBatch::isSupported()
+{
+    return hasGLVersion(4, 3);
+}
+
+// ---------------------------------------------------------
+// Create the buffers
+// Parameters:
+//   1. vertexArray: vertex array of every draw, gets the
+//      BASE_INSTANCE_ATTRIB attribute
+//   2. maxInstances: instances of a draw at most
+//   3. bytes: size of a record (std430), 0 if none
+// ---------------------------------------------------------
+void DrawBatch::init(GLuint vertexArray, GLuint maxInstances, size_t bytes)
+{
+    vao = vertexArray;
+    divisor = glm::max(maxInstances, 1u);
+    recordBytes = bytes;
+
+    glGenBuffers(1, &indirectBuffer);
+    if (recordBytes > 0)
+    {
+        glGenBuffers(1, &ssbo);
+    }
+    glGenBuffers(1, &baseInstanceBuffer);
+    initBaseInstances(256);
+}
+
+// ---------------------------------------------------------
+// Add the record of a draw
+// Parameters:
+//   record: recordBytes bytes, as laid out in the shader
+// Return: its index, the baseInstance of its draw
+// ---------------------------------------------------------
+GLuint DrawBatch::addRecord(const void *record)
+{
+    records.insert(records.end(), (const char *)record, (const char *)record + recordBytes);
+
+    return GLuint(records.size() / recordBytes - 1);
+}
+
+// ---------------------------------------------------------
+// Add a draw
+// Parameters:
+//   1. count: vertices of an instance
+//   2. instanceCount: instances (at most the divisor of init)
+//   3. first: first vertex
+//   4. baseInstance: read by the shader (BASE_INSTANCE_ATTRIB)
+// ---------------------------------------------------------
+void DrawBatch::add(GLuint count, GLuint instanceCount, GLuint first, GLuint baseInstance)
+{
+    commands.push_back({count, instanceCount, first, baseInstance});
+}
+
+// ---------------------------------------------------------
+// Draw every command with one call, then clear them
+// Parameters:
+//   mode: primitive type, e.g. GL_PATCHES
+// Remarks: the program and the vertex array must be bound;
+//   buffers are reallocated by glBufferData, so the draws
+//   of the previous frame may still read the old storage
+// ---------------------------------------------------------
+void DrawBatch::flush(GLenum mode)
+{
+    if (commands.empty())
+    {
+        return;
+    }
+
+    GLuint maxBaseInstance = 0;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        maxBaseInstance = glm::max(maxBaseInstance, commands[i].baseInstance);
+    }
+    if (maxBaseInstance >= nOfBaseInstances)
+    {
+        initBaseInstances(glm::max(maxBaseInstance + 1, nOfBaseInstances * 2));
+    }
+
+    if (recordBytes > 0)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, records.size(), records.data(), GL_STREAM_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_RECORD_BINDING, ssbo);
+        drawCounters.nOfStateChanges += 2;
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawArraysCommand), commands.data(),
+                 GL_STREAM_DRAW);
+    glMultiDrawArraysIndirect(mode, 0, GLsizei(commands.size()), 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    drawCounters.nOfStateChanges++;
+    drawCounters.nOfDrawCalls++;
+
+    clear();
+}
+
+// ---------------------------------------------------------
+// Drop the records and commands not drawn
+// ---------------------------------------------------------
+void DrawBatch::clear()
+{
+    records.clear();
+    commands.clear();
+}
+
+// ---------------------------------------------------------
+// Fill baseInstanceBuffer with 0, 1, 2... and point the
+// BASE_INSTANCE_ATTRIB attribute of the vertex array to it
+// Parameters:
+//   n: number of values
+// Remarks: binds the vertex array
+// ---------------------------------------------------------
+void DrawBatch::initBaseInstances(GLuint n)
+{
+    vector<GLuint> values(n);
+    for (GLuint i = 0; i < n; i++)
+    {
+        values[i] = i;
+    }
+    nOfBaseInstances = n;
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, baseInstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, n * sizeof(GLuint), values.data(), GL_STATIC_DRAW);
+    glVertexAttribIPointer(BASE_INSTANCE_ATTRIB, 1, GL_UNSIGNED_INT, 0, (void *)0);
+    glVertexAttribDivisor(BASE_INSTANCE_ATTRIB, divisor);
+    glEnableVertexAttribArray(BASE_INSTANCE_ATTRIB);
+}
+
+// ================================================
+// Mesh class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (empty mesh)
+// Remarks: no OpenGL resource is created,
+//   so CPU-side tools can call loadObj/loadObjQuad
+//   without a context
+// ---------------------------------------------------------
+Mesh::Mesh()
+{
+    faceType = QUAD;
+    layout = LAYOUT_SEPARATE;
+    gridSize = ivec2(0, 0);
+    dequantize = mat4(1.f);
+    tessMetric = TESS_METRIC_SCREEN_ERROR;
+    viewport = vec2(WINDOW_WIDTH, WINDOW_HEIGHT);
+    pixelsPerTriangle = 64.f;
+    maxPixelError = 350.f;
+    vboVtxs = vboUvs = vboNormals = ebo = 0;
+    tboRoughness = 0;
+    vao = 0;
+    shader = 0;
+    nOfDrawVtxs = 0;
+    isBatched = false;
+    batch = NULL;
+}
+
+// ---------------------------------------------------------
+// Constructor
+// Parameters:
+//   1. fileName: mesh file
+//   2. type: face type (triangle or quad)
+//   3. vtxLayout: how vertices are stored on the GPU
+// ---------------------------------------------------------
+Mesh::Mesh(const string fileName, int type = TRIANGLE, int vtxLayout)
+{
+    faceType = type;
+    layout = vtxLayout;
+    gridSize = ivec2(0, 0);
+    dequantize = mat4(1.f);
+    tessMetric = TESS_METRIC_SCREEN_ERROR;
+    viewport = vec2(WINDOW_WIDTH, WINDOW_HEIGHT);
+    pixelsPerTriangle = 64.f;
+    maxPixelError = 350.f;
+    vboVtxs = vboUvs = vboNormals = ebo = 0;
+    tboRoughness = 0;
+    vao = 0;
+    isBatched = false;
+    batch = NULL;
+
+    // Reuse the preprocessed streams if the .obj has not changed
+    if (!loadCache(fileName))
+    {
+        if (type == TRIANGLE)
+        {
+            loadObj(fileName);
+        }
+        else if (type == QUAD)
+        {
+            loadObjQuad(fileName);
+        }
+
+        int nOfCorners = (type == QUAD) ? 4 : 3;
+        if (layout == LAYOUT_INDEXED || layout == LAYOUT_PACKED)
+        {
+            initBuffersIndexed(nOfCorners);
+        }
+        else if (type == TRIANGLE)
+        {
+            initBuffers();
+        }
+        else if (type == QUAD)
+        {
+            initBuffersQuad();
+        }
+    }
+
+    initShader();
+    initUniform();
+}
+
+// ---------------------------------------------------------
+// Create a flat grid of quad patches in memory
+// Parameters:
+//   1. nx, nz: number of patches along x and z
+//   2. vtxLayout: how vertices are stored on the GPU
+// Return: the mesh, covering [-1, 1] in x and z
+// Remarks:
+//   - Same vertex order and uv orientation as quad.obj,
+//     which is what tcsQuad.glsl and tesQuad.glsl expect
+//   - Rows are filled by several threads, and no .obj is
+//     parsed or cached
+//   - LAYOUT_INSTANCED (and LAYOUT_LISTED) keeps no vertex
+//     data at all, neither on the CPU nor on the GPU
+// ---------------------------------------------------------
+Mesh *Mesh::createGrid(int nx, int nz, int vtxLayout)
+{
+    nx = glm::max(nx, 1);
+    nz = glm::max(nz, 1);
+
+    Mesh *mesh = new Mesh();
+    mesh->layout = vtxLayout;
+    mesh->gridSize = ivec2(nx, nz);
+
+    // Every patch corner comes from gl_InstanceID and gl_VertexID,
+    // so nothing but an empty vao is needed
+    if (vtxLayout == LAYOUT_INSTANCED || vtxLayout == LAYOUT_LISTED)
+    {
+        glGenVertexArrays(1, &mesh->vao);
+        mesh->nOfDrawVtxs = 4;
+
+        mesh->initShader();
+        mesh->initUniform();
+
+        return mesh;
+    }
+
+    mesh->buildGrid(nx, nz);
+
+    if (vtxLayout == LAYOUT_INDEXED || vtxLayout == LAYOUT_PACKED)
+    {
+        // Already welded: one vertex per grid point
+        vector<Vertex> vtxs(mesh->vertices.size());
+        vector<GLuint> indices(mesh->faces.size() * 4);
+
+        parallelFor(vtxs.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                vtxs[i].pos = mesh->vertices[i];
+                vtxs[i].uv = mesh->uvs[i];
+                vtxs[i].normal = mesh->faceNormals[0];
+            }
+        });
+        parallelFor(mesh->faces.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                const Face &f = mesh->faces[i];
+                indices[i * 4 + 0] = f.v1;
+                indices[i * 4 + 1] = f.v2;
+                indices[i * 4 + 2] = f.v3;
+                indices[i * 4 + 3] = f.v4;
+            }
+        });
+
+        mesh->uploadIndexed(vtxs, indices);
+    }
+    else
+    {
+        mesh->initBuffersQuad();
+    }
+
+    mesh->initShader();
+    mesh->initUniform();
+
+    return mesh;
+}
+
+// ---------------------------------------------------------
+// Fill the vertices and faces of a flat grid (no OpenGL)
+// Parameters:
+//   nx, nz: number of patches along x and z
+// Remarks: what createGrid uploads, also used by tessref
+// ---------------------------------------------------------
+void Mesh::buildGrid(int nx, int nz)
+{
+    size_t rowVtxs = size_t(nx) + 1;
+    vertices.resize(rowVtxs * (nz + 1));
+    uvs.resize(rowVtxs * (nz + 1));
+    faceNormals.assign(1, vec3(0.f, 1.f, 0.f));
+    faces.resize(size_t(nx) * nz);
+
+    // Vertex (i, j) is shared by up to 4 patches, and its
+    // v and vt indices are the same
+    parallelFor(nz + 1, [&](size_t begin, size_t end) {
+        for (size_t j = begin; j < end; j++)
+        {
+            for (size_t i = 0; i < rowVtxs; i++)
+            {
+                size_t idx = j * rowVtxs + i;
+                vertices[idx] = vec3(-1.f + 2.f * i / nx, 0.f, -1.f + 2.f * j / nz);
+                uvs[idx] = vec2(float(i) / nx, 1.f - float(j) / nz);
+            }
+        }
+    });
+
+    // Corner order of a patch: (x0, z1), (x1, z1), (x1, z0), (x0, z0)
+    parallelFor(nz, [&](size_t begin, size_t end) {
+        for (size_t j = begin; j < end; j++)
+        {
+            for (size_t i = 0; i < size_t(nx); i++)
+            {
+                Face &f = faces[j * nx + i];
+                f.v4 = f.vt4 = GLuint(j * rowVtxs + i);
+                f.v3 = f.vt3 = f.v4 + 1;
+                f.v2 = f.vt2 = f.v3 + rowVtxs;
+                f.v1 = f.vt1 = f.v2 - 1;
+                f.vn1 = f.vn2 = f.vn3 = f.vn4 = 0;
+            }
+        }
+    });
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+Mesh::~Mesh()
+{
+    // Nothing was uploaded (CPU-only mesh)
+    if (vao == 0)
+    {
+        return;
+    }
+
+    delete batch;
+
+    glDeleteBuffers(1, &vboVtxs);
+    glDeleteBuffers(1, &vboUvs);
+    glDeleteBuffers(1, &vboNormals);
+    glDeleteBuffers(1, &ebo);
+    glDeleteVertexArrays(1, &vao);
+}
+
+// ---------------------------------------------------------
+// Initialize shaders
+// ---------------------------------------------------------
+void Mesh::initShader()
+{
+    // Patch corners computed from the grid coordinate
+    string vsFile = (layout == LAYOUT_INSTANCED) ? "./shader/vsPhongInstanced.glsl" : "./shader/vsPhong.glsl";
+    string tcsFile = "./shader/tcsQuad.glsl";
+
+    // Patches and levels read from the list of the culling pass
+    if (layout == LAYOUT_LISTED)
+    {
+        vsFile = "./shader/vsPhongListed.glsl";
+        tcsFile = "./shader/tcsQuadListed.glsl";
+    }
+
+    shader = buildShader(vsFile, "./shader/fsPhong.glsl", tcsFile, "./shader/tesQuad.glsl");
+}
+
+// ---------------------------------------------------------
+// Initialize uniforms
+// ---------------------------------------------------------
+void Mesh::initUniform()
+{
+    uniModel = myGetUniformLocation(shader, "M");
+    uniDequantize = myGetUniformLocation(shader, "Q");
+    uniNormalPacked = myGetUniformLocation(shader, "isNormalPacked");
+    uniGridSize = myGetUniformLocation(shader, "gridSize");
+    uniTexBase = myGetUniformLocation(shader, "texBase");
+    uniTexNormal = myGetUniformLocation(shader, "texNormal");
+    uniTexHeight = myGetUniformLocation(shader, "texHeight");
+    uniTexRoughness = myGetUniformLocation(shader, "texRoughness");
+    uniTessMetric = myGetUniformLocation(shader, "tessMetric");
+    uniViewport = myGetUniformLocation(shader, "viewport");
+    uniPixelsPerTriangle = myGetUniformLocation(shader, "pixelsPerTriangle");
+    uniMaxPixelError = myGetUniformLocation(shader, "maxPixelError");
+
+    glUseProgram(shader);
+    glUniform1i(myGetUniformLocation(shader, "texClipmap"), CLIPMAP_UNIT);
+    bindFrameUniforms(shader);
+}
+
+// ---------------------------------------------------------
+// Load mesh .obj (for triangle face)
+// Parameters:
+//   fileName: mesh file
+// ---------------------------------------------------------
+void Mesh::loadObj(const string fileName)
+{
+    loadObjFile(fileName, 3);
+}
+
+// ---------------------------------------------------------
+// Load mesh .obj (for quad face)
+// Parameters:
+//   fileName: mesh file
+// ---------------------------------------------------------
+void Mesh::loadObjQuad(const string fileName)
+{
+    loadObjFile(fileName, 4);
+}
+
+// ---------------------------------------------------------
+// Number of v, vt, vn and f lines in a part of an .obj file
+// ---------------------------------------------------------
+typedef struct
+{
+    size_t v, vt, vn, f;
+} ObjCounts;
+
+// ---------------------------------------------------------
+// Skip spaces and tabs
+// ---------------------------------------------------------
+static const char *skipSpaces(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+
+    return p;
+}
+
+// ---------------------------------------------------------
+// Go to the first character of the next line
+// ---------------------------------------------------------
+static const char *nextLine(const char *p, const char *end)
+{
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+
+    return (eol == NULL) ? end : eol + 1;
+}
+
+// ---------------------------------------------------------
+// Parse a float, p is moved past it
+// Return: false if there is no number at p
+// ---------------------------------------------------------
+static bool parseFloat(const char *&p, const char *end, float &value)
+{
+    p = skipSpaces(p, end);
+    if (p < end && *p == '+')
+    {
+        p++;
+    }
+
+#if defined(__cpp_lib_to_chars)
+    std::from_chars_result res = std::from_chars(p, end, value);
+    if (res.ec != std::errc())
+    {
+        return false;
+    }
+    p = res.ptr;
+
+    return true;
+#else
+    // Fallback for standard libraries without floating-point from_chars
+    const char *start = p;
+    bool negative = (p < end && *p == '-');
+    p += negative ? 1 : 0;
+
+    uint64_t mantissa = 0;
+    int exponent = 0, nOfDigits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, nOfDigits++)
+    {
+        if (mantissa < 1000000000000000000ull)
+            mantissa = mantissa * 10 + (*p - '0');
+        else
+            exponent++;
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, nOfDigits++)
+        {
+            if (mantissa < 1000000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (nOfDigits == 0)
+    {
+        p = start;
+        return false;
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        int e = 0;
+        std::from_chars_result res = std::from_chars(p + 1 + (p + 1 < end && p[1] == '+'), end, e);
+        if (res.ec == std::errc())
+        {
+            exponent += e;
+            p = res.ptr;
+        }
+    }
+
+    double result = double(mantissa) * std::pow(10.0, exponent);
+    value = float(negative ? -result : result);
+
+    return true;
+#endif
+}
+
+// ---------------------------------------------------------
+// Parse an .obj index, p is moved past it
+// Parameters:
+//   1. p, end: text
+//   2. count: number of elements defined before this line,
+//      used to resolve negative (relative) indices
+//   3. total: number of elements in the whole file
+//   4. index: 0-based index (output)
+// Return: false if there is no valid index at p, or if it
+//   is out of range
+// ---------------------------------------------------------
+static bool parseIndex(const char *&p, const char *end, size_t count, size_t total, GLuint &index)
+{
+    long value = 0;
+    std::from_chars_result res = std::from_chars(p, end, value);
+    if (res.ec != std::errc() || value == 0)
+    {
+        return false;
+    }
+    p = res.ptr;
+
+    // v, vt, vn start from 1, and -1 refers to the last element
+    long idx = (value > 0) ? value - 1 : long(count) + value;
+    if (idx < 0 || size_t(idx) >= total)
+    {
+        return false;
+    }
+    index = GLuint(idx);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Count the v, vt, vn and f lines of a chunk
+// ---------------------------------------------------------
+static ObjCounts countObjLines(const char *p, const char *end)
+{
+    ObjCounts c = {0, 0, 0, 0};
+
+    for (; p < end; p = nextLine(p, end))
+    {
+        p = skipSpaces(p, end);
+        if (end - p < 2)
+        {
+            continue;
+        }
+
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+            c.v++;
+        else if (p[0] == 'v' && p[1] == 't')
+            c.vt++;
+        else if (p[0] == 'v' && p[1] == 'n')
+            c.vn++;
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+            c.f++;
+    }
+
+    return c;
+}
+
+// ---------------------------------------------------------
+// Load mesh .obj
+// Parameters:
+//   1. fileName: mesh file
+//   2. nOfCorners: 3 for triangle faces, 4 for quad faces
+// Remarks:
+//   - The file is memory-mapped and split into chunks at
+//     line boundaries. A first pass counts the lines of each
+//     chunk, so every array is allocated once and every chunk
+//     knows where to write; a second pass parses all chunks
+//     in parallel.
+//   - Faces can be v, v/vt, v//vn or v/vt/vn, with positive
+//     or negative indices. A missing vt or vn points to a
+//     default element appended at the end of uvs/faceNormals.
+//   - Faces with another number of corners, or with an index
+//     out of the v/vt/vn lists of the file, are skipped.
+// ---------------------------------------------------------
+void Mesh::loadObjFile(const string fileName, int nOfCorners)
+{
+    MappedFile file;
+    if (!file.open(fileName))
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return;
+    }
+
+    const char *text = file.data;
+    const char *textEnd = file.data + file.size;
+
+    // Split into chunks of at least 1 MB, a few per thread
+    int nOfThreads = getNumThreads();
+    size_t nOfChunks = glm::min(size_t(nOfThreads) * 4, file.size / (1 << 20) + 1);
+    vector<const char *> chunkBegin(nOfChunks + 1);
+    chunkBegin[0] = text;
+    chunkBegin[nOfChunks] = textEnd;
+    for (size_t i = 1; i < nOfChunks; i++)
+    {
+        const char *p = text + file.size * i / nOfChunks;
+        p = glm::max(p, chunkBegin[i - 1]);
+        chunkBegin[i] = (p == text) ? p : nextLine(p - 1, textEnd);
+    }
+
+    // Pass 1: count lines of each chunk
+    vector<ObjCounts> offsets(nOfChunks + 1);
+    parallelFor(
+        nOfChunks,
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                offsets[i + 1] = countObjLines(chunkBegin[i], chunkBegin[i + 1]);
+            }
+        },
+        nOfThreads);
+
+    // Prefix sums: where each chunk writes
+    offsets[0] = {vertices.size(), uvs.size(), faceNormals.size(), faces.size()};
+    for (size_t i = 0; i < nOfChunks; i++)
+    {
+        offsets[i + 1].v += offsets[i].v;
+        offsets[i + 1].vt += offsets[i].vt;
+        offsets[i + 1].vn += offsets[i].vn;
+        offsets[i + 1].f += offsets[i].f;
+    }
+
+    // Every index is checked against the final counts
+    const ObjCounts &totals = offsets[nOfChunks];
+
+    size_t firstFace = faces.size();
+    vertices.resize(offsets[nOfChunks].v);
+    uvs.resize(offsets[nOfChunks].vt);
+    faceNormals.resize(offsets[nOfChunks].vn);
+    faces.resize(offsets[nOfChunks].f);
+    vector<char> badFaces(faces.size() - firstFace, 0);
+
+    // Pass 2: parse each chunk into its slots
+    std::atomic<bool> missingUv(false), missingNormal(false);
+    parallelFor(
+        nOfChunks,
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                ObjCounts c = offsets[i];
+                const char *lineEnd = chunkBegin[i + 1];
+                bool chunkMissingUv = false, chunkMissingNormal = false;
+
+                for (const char *p = chunkBegin[i]; p < lineEnd; p = nextLine(p, lineEnd))
+                {
+                    p = skipSpaces(p, lineEnd);
+                    if (lineEnd - p < 2)
+                    {
+                        continue;
+                    }
+
+                    // Vertex coordinate
+                    if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+                    {
+                        vec3 &vtx = vertices[c.v++];
+                        p += 1;
+                        parseFloat(p, lineEnd, vtx.x);
+                        parseFloat(p, lineEnd, vtx.y);
+                        parseFloat(p, lineEnd, vtx.z);
+                    }
+                    // Texture coordinate
+                    else if (p[0] == 'v' && p[1] == 't')
+                    {
+                        vec2 &uv = uvs[c.vt++];
+                        p += 2;
+                        parseFloat(p, lineEnd, uv.x);
+                        parseFloat(p, lineEnd, uv.y);
+                    }
+                    // Face normal (recorded as vn in obj file)
+                    else if (p[0] == 'v' && p[1] == 'n')
+                    {
+                        vec3 &n = faceNormals[c.vn++];
+                        p += 2;
+                        parseFloat(p, lineEnd, n.x);
+                        parseFloat(p, lineEnd, n.y);
+                        parseFloat(p, lineEnd, n.z);
+                    }
+                    // Vertices contained in face, and face normal
+                    else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+                    {
+                        size_t faceIdx = c.f++;
+                        Face &f = faces[faceIdx];
+                        GLuint *vs[4] = {&f.v1, &f.v2, &f.v3, &f.v4};
+                        GLuint *vts[4] = {&f.vt1, &f.vt2, &f.vt3, &f.vt4};
+                        GLuint *vns[4] = {&f.vn1, &f.vn2, &f.vn3, &f.vn4};
+                        int corner = 0;
+                        bool ok = true;
+
+                        p += 1;
+                        while (ok)
+                        {
+                            p = skipSpaces(p, lineEnd);
+                            if (p >= lineEnd || *p == '\n' || *p == '\r' || *p == '#')
+                            {
+                                break;
+                            }
+                            if (corner == nOfCorners)
+                            {
+                                ok = false;
+                                break;
+                            }
+
+                            GLuint v = 0, vt = OBJ_NO_INDEX, vn = OBJ_NO_INDEX;
+                            ok = parseIndex(p, lineEnd, c.v, totals.v, v);
+
+                            // v/vt, v//vn, v/vt/vn
+                            if (ok && p < lineEnd && *p == '/')
+                            {
+                                p++;
+                                if (p < lineEnd && *p != '/')
+                                {
+                                    ok = parseIndex(p, lineEnd, c.vt, totals.vt, vt);
+                                }
+                                if (ok && p < lineEnd && *p == '/')
+                                {
+                                    p++;
+                                    ok = parseIndex(p, lineEnd, c.vn, totals.vn, vn);
+                                }
+                            }
+
+                            *vs[corner] = v;
+                            *vts[corner] = vt;
+                            *vns[corner] = vn;
+                            chunkMissingUv = chunkMissingUv || (vt == OBJ_NO_INDEX);
+                            chunkMissingNormal = chunkMissingNormal || (vn == OBJ_NO_INDEX);
+                            corner++;
+                        }
+
+                        badFaces[faceIdx - firstFace] = !(ok && corner == nOfCorners);
+                    }
+                }
+
+                // Shared flags, written once per chunk
+                if (chunkMissingUv)
+                {
+                    missingUv = true;
+                }
+                if (chunkMissingNormal)
+                {
+                    missingNormal = true;
+                }
+            }
+        },
+        nOfThreads);
+
+    // Drop faces that could not be used
+    size_t nOfBadFaces = std::count(badFaces.begin(), badFaces.end(), 1);
+    if (nOfBadFaces > 0)
+    {
+        size_t dst = firstFace;
+        for (size_t i = firstFace; i < faces.size(); i++)
+        {
+            if (!badFaces[i - firstFace])
+            {
+                faces[dst++] = faces[i];
+            }
+        }
+        faces.resize(dst);
+
+        std::cout << fileName << " : skipped " << nOfBadFaces << " face(s) without " << nOfCorners
+                  << " valid corners" << std::endl;
+    }
+
+    // Point missing vt/vn to default elements
+    if (missingUv || missingNormal)
+    {
+        GLuint defaultUv = uvs.size();
+        GLuint defaultNormal = faceNormals.size();
+        if (missingUv)
+        {
+            uvs.push_back(vec2(0.f, 0.f));
+        }
+        if (missingNormal)
+        {
+            faceNormals.push_back(vec3(0.f, 1.f, 0.f));
+        }
+
+        for (size_t i = firstFace; i < faces.size(); i++)
+        {
+            Face &f = faces[i];
+            GLuint *vts[4] = {&f.vt1, &f.vt2, &f.vt3, &f.vt4};
+            GLuint *vns[4] = {&f.vn1, &f.vn2, &f.vn3, &f.vn4};
+            for (int k = 0; k < nOfCorners; k++)
+            {
+                *vts[k] = (*vts[k] == OBJ_NO_INDEX) ? defaultUv : *vts[k];
+                *vns[k] = (*vns[k] == OBJ_NO_INDEX) ? defaultNormal : *vns[k];
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------
+// Initialize OpenGL buffers (for triangle face)
+// ---------------------------------------------------------
+void Mesh::initBuffers()
+{
+    // Write vertex coordinate to array
+    int nOfFaces = faces.size();
+
+    // 3 vertices per face, 3 float per vertex coord, 2 float per tex coord
+    GLfloat *aVtxCoords = new GLfloat[nOfFaces * 3 * 3];
+    GLfloat *aUvs = new GLfloat[nOfFaces * 3 * 2];
+    GLfloat *aNormals = new GLfloat[nOfFaces * 3 * 3];
+
+    for (size_t i = 0; i < nOfFaces; i++)
+    {
+        // vertex 1
+        int vtxIdx = faces[i].v1;
+        aVtxCoords[i * 9 + 0] = vertices[vtxIdx].x;
+        aVtxCoords[i * 9 + 1] = vertices[vtxIdx].y;
+        aVtxCoords[i * 9 + 2] = vertices[vtxIdx].z;
+
+        // Normal for vertex 1
+        int nmlIdx = faces[i].vn1;
+        aNormals[i * 9 + 0] = faceNormals[nmlIdx].x;
+        aNormals[i * 9 + 1] = faceNormals[nmlIdx].y;
+        aNormals[i * 9 + 2] = faceNormals[nmlIdx].z;
+
+        // Uv for vertex 1
+        int uvIdx = faces[i].vt1;
+        aUvs[i * 6 + 0] = uvs[uvIdx].x;
+        aUvs[i * 6 + 1] = uvs[uvIdx].y;
+
+        // Vertex 2
+        vtxIdx = faces[i].v2;
+        aVtxCoords[i * 9 + 3] = vertices[vtxIdx].x;
+        aVtxCoords[i * 9 + 4] = vertices[vtxIdx].y;
+        aVtxCoords[i * 9 + 5] = vertices[vtxIdx].z;
+
+        // Normal for vertex 2
+        nmlIdx = faces[i].vn2;
+        aNormals[i * 9 + 3] = faceNormals[nmlIdx].x;
+        aNormals[i * 9 + 4] = faceNormals[nmlIdx].y;
+        aNormals[i * 9 + 5] = faceNormals[nmlIdx].z;
+
+        // Uv for vertex 2
+        uvIdx = faces[i].vt2;
+        aUvs[i * 6 + 2] = uvs[uvIdx].x;
         aUvs[i * 6 + 3] = uvs[uvIdx].y;
 
-        // Vertex 3
-        vtxIdx = faces[i].v3;
-        aVtxCoords[i * 9 + 6] = vertices[vtxIdx].x;
-        aVtxCoords[i * 9 + 7] = vertices[vtxIdx].y;
-        aVtxCoords[i * 9 + 8] = vertices[vtxIdx].z;
+        // Vertex 3
+        vtxIdx = faces[i].v3;
+        aVtxCoords[i * 9 + 6] = vertices[vtxIdx].x;
+        aVtxCoords[i * 9 + 7] = vertices[vtxIdx].y;
+        aVtxCoords[i * 9 + 8] = vertices[vtxIdx].z;
+
+        // Normal for vertex 3
+        nmlIdx = faces[i].vn3;
+        aNormals[i * 9 + 6] = faceNormals[nmlIdx].x;
+        aNormals[i * 9 + 7] = faceNormals[nmlIdx].y;
+        aNormals[i * 9 + 8] = faceNormals[nmlIdx].z;
+
+        // Uv for vertex 3
+        uvIdx = faces[i].vt3;
+        aUvs[i * 6 + 4] = uvs[uvIdx].x;
+        aUvs[i * 6 + 5] = uvs[uvIdx].y;
+    }
+
+    // Upload, then keep a copy for the next launch
+    const void *streams[3] = {aVtxCoords, aUvs, aNormals};
+    uint64_t streamBytes[3] = {sizeof(GLfloat) * nOfFaces * 3 * 3, sizeof(GLfloat) * nOfFaces * 3 * 2,
+                               sizeof(GLfloat) * nOfFaces * 3 * 3};
+    uploadStreams(streams, streamBytes, 3, nOfFaces * 3);
+    saveCache(streams, streamBytes, 3, nOfFaces * 3);
+
+    // Release resource
+    delete[] aVtxCoords;
+    delete[] aUvs;
+    delete[] aNormals;
+}
+
+// ---------------------------------------------------------
+// Initialize OpenGL buffers (for quad face)
+// ---------------------------------------------------------
+void Mesh::initBuffersQuad()
+{
+    // Write vertex coordinate to array
+    int nOfFaces = faces.size();
+
+    // 4 vertices per face, 3 float per vertex coord, 2 float per tex coord
+    GLfloat *aVtxCoords = new GLfloat[nOfFaces * 4 * 3];
+    GLfloat *aUvs = new GLfloat[nOfFaces * 4 * 2];
+    GLfloat *aNormals = new GLfloat[nOfFaces * 4 * 3];
+
+    for (size_t i = 0; i < nOfFaces; i++)
+    {
+        // Vertex 1
+        int vtxIdx = faces[i].v1;
+        aVtxCoords[i * 12 + 0] = vertices[vtxIdx].x;
+        aVtxCoords[i * 12 + 1] = vertices[vtxIdx].y;
+        aVtxCoords[i * 12 + 2] = vertices[vtxIdx].z;
+
+        // Normal for vertex 1
+        int nmlIdx = faces[i].vn1;
+        aNormals[i * 12 + 0] = faceNormals[nmlIdx].x;
+        aNormals[i * 12 + 1] = faceNormals[nmlIdx].y;
+        aNormals[i * 12 + 2] = faceNormals[nmlIdx].z;
+
+        // Uv for vertex 1
+        int uvIdx = faces[i].vt1;
+        aUvs[i * 8 + 0] = uvs[uvIdx].x;
+        aUvs[i * 8 + 1] = uvs[uvIdx].y;
+
+        // Vertex 2
+        vtxIdx = faces[i].v2;
+        aVtxCoords[i * 12 + 3] = vertices[vtxIdx].x;
+        aVtxCoords[i * 12 + 4] = vertices[vtxIdx].y;
+        aVtxCoords[i * 12 + 5] = vertices[vtxIdx].z;
+
+        // Normal for vertex 2
+        nmlIdx = faces[i].vn2;
+        aNormals[i * 12 + 3] = faceNormals[nmlIdx].x;
+        aNormals[i * 12 + 4] = faceNormals[nmlIdx].y;
+        aNormals[i * 12 + 5] = faceNormals[nmlIdx].z;
+
+        // Uv for vertex 2
+        uvIdx = faces[i].vt2;
+        aUvs[i * 8 + 2] = uvs[uvIdx].x;
+        aUvs[i * 8 + 3] = uvs[uvIdx].y;
+
+        // Vertex 3
+        vtxIdx = faces[i].v3;
+        aVtxCoords[i * 12 + 6] = vertices[vtxIdx].x;
+        aVtxCoords[i * 12 + 7] = vertices[vtxIdx].y;
+        aVtxCoords[i * 12 + 8] = vertices[vtxIdx].z;
+
+        // Normal for vertex 3
+        nmlIdx = faces[i].vn3;
+        aNormals[i * 12 + 6] = faceNormals[nmlIdx].x;
+        aNormals[i * 12 + 7] = faceNormals[nmlIdx].y;
+        aNormals[i * 12 + 8] = faceNormals[nmlIdx].z;
+
+        // Uv for vertex 3
+        uvIdx = faces[i].vt3;
+        aUvs[i * 8 + 4] = uvs[uvIdx].x;
+        aUvs[i * 8 + 5] = uvs[uvIdx].y;
+
+        // Vertex 4
+        vtxIdx = faces[i].v4;
+        aVtxCoords[i * 12 + 9] = vertices[vtxIdx].x;
+        aVtxCoords[i * 12 + 10] = vertices[vtxIdx].y;
+        aVtxCoords[i * 12 + 11] = vertices[vtxIdx].z;
+
+        // Normal for vertex 4
+        nmlIdx = faces[i].vn4;
+        aNormals[i * 12 + 9] = faceNormals[nmlIdx].x;
+        aNormals[i * 12 + 10] = faceNormals[nmlIdx].y;
+        aNormals[i * 12 + 11] = faceNormals[nmlIdx].z;
+
+        // Uv for vertex 4
+        uvIdx = faces[i].vt4;
+        aUvs[i * 8 + 6] = uvs[uvIdx].x;
+        aUvs[i * 8 + 7] = uvs[uvIdx].y;
+    }
+
+    // Upload, then keep a copy for the next launch
+    const void *streams[3] = {aVtxCoords, aUvs, aNormals};
+    uint64_t streamBytes[3] = {sizeof(GLfloat) * nOfFaces * 4 * 3, sizeof(GLfloat) * nOfFaces * 4 * 2,
+                               sizeof(GLfloat) * nOfFaces * 4 * 3};
+    uploadStreams(streams, streamBytes, 3, nOfFaces * 4);
+    saveCache(streams, streamBytes, 3, nOfFaces * 4);
+
+    // Release resource
+    delete[] aVtxCoords;
+    delete[] aUvs;
+    delete[] aNormals;
+}
+
+// ---------------------------------------------------------
+// Weld face corners with the same v/vt/vn indices
+// Parameters:
+//   1. nOfCorners: 3 for triangle faces, 4 for quad faces
+//   2. vtxs: unique interleaved vertices (output)
+//   3. indices: nOfCorners indices per face (output)
+// ---------------------------------------------------------
+void Mesh::weldVertices(int nOfCorners, vector<Vertex> &vtxs, vector<GLuint> &indices) const
+{
+    // Key: v, vt and vn indices of a corner
+    typedef std::tuple<GLuint, GLuint, GLuint> CornerKey;
+    struct CornerKeyHash
+    {
+        size_t operator()(const CornerKey &k) const
+        {
+            uint64_t h = std::get<0>(k) * 0x9e3779b97f4a7c15ull;
+            h ^= (std::get<1>(k) + 0x632be59bd9b4e019ull + (h << 6) + (h >> 2)) * 0xff51afd7ed558ccdull;
+            h ^= (std::get<2>(k) + 0x8cb92ba72f3d8dd7ull + (h << 6) + (h >> 2)) * 0xc4ceb9fe1a85ec53ull;
+            return size_t(h ^ (h >> 32));
+        }
+    };
+
+    std::unordered_map<CornerKey, GLuint, CornerKeyHash> welded;
+    welded.reserve(vertices.size() * 2);
+
+    vtxs.clear();
+    vtxs.reserve(vertices.size());
+    indices.resize(faces.size() * nOfCorners);
+
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        const Face &f = faces[i];
+        const GLuint vs[4] = {f.v1, f.v2, f.v3, f.v4};
+        const GLuint vts[4] = {f.vt1, f.vt2, f.vt3, f.vt4};
+        const GLuint vns[4] = {f.vn1, f.vn2, f.vn3, f.vn4};
+
+        for (int k = 0; k < nOfCorners; k++)
+        {
+            CornerKey key(vs[k], vts[k], vns[k]);
+            auto found = welded.find(key);
+
+            if (found == welded.end())
+            {
+                Vertex vtx;
+                vtx.pos = vertices[vs[k]];
+                vtx.uv = uvs[vts[k]];
+                vtx.normal = faceNormals[vns[k]];
+
+                found = welded.insert(std::make_pair(key, GLuint(vtxs.size()))).first;
+                vtxs.push_back(vtx);
+            }
+
+            indices[i * nOfCorners + k] = found->second;
+        }
+    }
+}
+
+// ---------------------------------------------------------
+// Print how much memory the indexed layout saves
+// Parameters:
+//   1. nOfCorners: number of face corners (de-indexed vertices)
+//   2. nOfUnique: number of welded vertices
+// Remarks: fetch bandwidth assumes every unique vertex is
+//   read once per frame (best case of the vertex cache)
+// ---------------------------------------------------------
+void printWeldStats(size_t nOfCorners, size_t nOfUnique)
+{
+    double separate = double(nOfCorners) * sizeof(Vertex);
+    double indexed = double(nOfUnique) * sizeof(Vertex) + double(nOfCorners) * sizeof(GLuint);
+    double mb = 1024.0 * 1024.0;
+
+    std::cout << "welded " << nOfCorners << " corners into " << nOfUnique << " vertices" << '\n';
+    std::cout << "  separate vbos: " << separate / mb << " MB" << '\n';
+    std::cout << "  indexed vbo + ebo: " << indexed / mb << " MB (" << (separate - indexed) / mb << " MB saved, "
+              << 100.0 * (1.0 - indexed / separate) << "%)" << '\n';
+    std::cout << "  vertex fetch per frame: " << separate / mb << " MB -> " << indexed / mb << " MB" << std::endl;
+}
+
+// ---------------------------------------------------------
+// Initialize OpenGL buffers (indexed, interleaved)
+// Parameters:
+//   nOfCorners: 3 for triangle faces, 4 for quad faces
+// ---------------------------------------------------------
+void Mesh::initBuffersIndexed(int nOfCorners)
+{
+    vector<Vertex> vtxs;
+    vector<GLuint> indices;
+    weldVertices(nOfCorners, vtxs, indices);
+    printWeldStats(indices.size(), vtxs.size());
+
+    uploadIndexed(vtxs, indices);
+}
+
+// ---------------------------------------------------------
+// Upload welded vertices (LAYOUT_INDEXED or LAYOUT_PACKED)
+// Parameters:
+//   1. vtxs: unique vertices
+//   2. indices: corner indices of every face
+// ---------------------------------------------------------
+void Mesh::uploadIndexed(const vector<Vertex> &vtxs, const vector<GLuint> &indices)
+{
+    // Upload, then keep a copy for the next launch
+    const void *streams[2] = {vtxs.data(), indices.data()};
+    uint64_t streamBytes[2] = {sizeof(Vertex) * vtxs.size(), sizeof(GLuint) * indices.size()};
+
+    // Quantize the welded vertices
+    vector<PackedVertex> packedVtxs;
+    if (layout == LAYOUT_PACKED)
+    {
+        packVertices(vtxs, packedVtxs, dequantize);
+        streams[0] = packedVtxs.data();
+        streamBytes[0] = sizeof(PackedVertex) * packedVtxs.size();
+
+        std::cout << "  packed vbo: " << streamBytes[0] / (1024.0 * 1024.0) << " MB (" << sizeof(PackedVertex)
+                  << " bytes per vertex)" << std::endl;
+    }
+
+    uploadStreams(streams, streamBytes, 2, indices.size());
+    saveCache(streams, streamBytes, 2, indices.size());
+}
+
+// ---------------------------------------------------------
+// Encode a unit vector with the octahedral mapping
+// Parameters:
+//   n: unit vector
+// Return: 2D coordinate in [-1, 1]
+// Remarks: decoded by octDecode() in vsPhong.glsl
+// ---------------------------------------------------------
+vec2 octEncode(vec3 n)
+{
+    n /= (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+
+    if (n.z >= 0.f)
+    {
+        return vec2(n.x, n.y);
+    }
+
+    // Fold the lower hemisphere over the diagonals
+    vec2 signs = vec2(n.x >= 0.f ? 1.f : -1.f, n.y >= 0.f ? 1.f : -1.f);
+
+    return vec2((1.f - std::abs(n.y)) * signs.x, (1.f - std::abs(n.x)) * signs.y);
+}
+
+// ---------------------------------------------------------
+// Quantize vertices into the 12-byte layout
+// Parameters:
+//   1. vtxs: full precision vertices
+//   2. packedVtxs: quantized vertices (output)
+//   3. Q: matrix mapping SNORM16 positions back to
+//      model space (output)
+// ---------------------------------------------------------
+void packVertices(const vector<Vertex> &vtxs, vector<PackedVertex> &packedVtxs, mat4 &Q)
+{
+    // Bounding box of the positions
+    vec3 minPos(FLT_MAX), maxPos(-FLT_MAX);
+    for (size_t i = 0; i < vtxs.size(); i++)
+    {
+        minPos = min(minPos, vtxs[i].pos);
+        maxPos = max(maxPos, vtxs[i].pos);
+    }
+
+    // A flat axis (e.g. y of a terrain grid) keeps a unit extent
+    vec3 center = (minPos + maxPos) * 0.5f;
+    vec3 extent = (maxPos - minPos) * 0.5f;
+    for (int k = 0; k < 3; k++)
+    {
+        extent[k] = (extent[k] > 0.f) ? extent[k] : 1.f;
+    }
 
-        // Normal for vertex 3
-        nmlIdx = faces[i].vn3;
-        aNormals[i * 9 + 6] = faceNormals[nmlIdx].x;
-        aNormals[i * 9 + 7] = faceNormals[nmlIdx].y;
-        aNormals[i * 9 + 8] = faceNormals[nmlIdx].z;
+    Q = scale(translate(mat4(1.f), center), extent);
 
-        // Uv for vertex 3
-        uvIdx = faces[i].vt3;
-        aUvs[i * 6 + 4] = uvs[uvIdx].x;
-        aUvs[i * 6 + 5] = uvs[uvIdx].y;
+    packedVtxs.resize(vtxs.size());
+    for (size_t i = 0; i < vtxs.size(); i++)
+    {
+        const Vertex &vtx = vtxs[i];
+        PackedVertex &packed = packedVtxs[i];
+
+        vec3 unitPos = (vtx.pos - center) / extent;
+        for (int k = 0; k < 3; k++)
+        {
+            packed.pos[k] = int16_t(packSnorm1x16(unitPos[k]));
+        }
+        packed.normal = packSnorm2x8(octEncode(normalize(vtx.normal)));
+        packed.uv = packHalf2x16(vtx.uv);
     }
+}
 
+// ---------------------------------------------------------
+// Upload vertex streams and set up the vao
+// Parameters:
+//   1. streams: vertex coordinates, uvs and normals
+//   2. streamBytes: size of each stream
+//   3. nOfStreams: number of streams
+//   4. nOfVtxs: number of vertices to draw
+// Remarks:
+//   - LAYOUT_SEPARATE: stream i goes to attribute location i
+//   - LAYOUT_INDEXED, LAYOUT_PACKED: stream 0 is the
+//     interleaved vbo, stream 1 the element buffer
+// ---------------------------------------------------------
+void Mesh::uploadStreams(const void **streams, const uint64_t *streamBytes, int nOfStreams, GLsizei nOfVtxs)
+{
     // Vao
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
 
-    // Vbo for vertex
-    glGenBuffers(1, &vboVtxs);
-    glBindBuffer(GL_ARRAY_BUFFER, vboVtxs);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * nOfFaces * 3 * 3, aVtxCoords, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-
-    // Vbo for texture
-    glGenBuffers(1, &vboUvs);
-    glBindBuffer(GL_ARRAY_BUFFER, vboUvs);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * nOfFaces * 3 * 2, aUvs, GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-
-    // Vbo for normal
-    glGenBuffers(1, &vboNormals);
-    glBindBuffer(GL_ARRAY_BUFFER, vboNormals);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * nOfFaces * 3 * 3, aNormals, GL_STATIC_DRAW);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(2);
+    if (layout == LAYOUT_PACKED && nOfStreams == 2)
+    {
+        // SNORM16 position, octahedral SNORM8 normal, half-float uv
+        GLsizei stride = sizeof(PackedVertex);
+        glGenBuffers(1, &vboVtxs);
+        glBindBuffer(GL_ARRAY_BUFFER, vboVtxs);
+        glBufferData(GL_ARRAY_BUFFER, streamBytes[0], streams[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, stride, (void *)offsetof(PackedVertex, pos));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void *)offsetof(PackedVertex, uv));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 2, GL_BYTE, GL_TRUE, stride, (void *)offsetof(PackedVertex, normal));
+        glEnableVertexAttribArray(2);
+
+        // Element buffer, recorded in the vao
+        glGenBuffers(1, &ebo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, streamBytes[1], streams[1], GL_STATIC_DRAW);
+    }
+    else if (layout == LAYOUT_INDEXED && nOfStreams == 2)
+    {
+        // Interleaved vbo
+        glGenBuffers(1, &vboVtxs);
+        glBindBuffer(GL_ARRAY_BUFFER, vboVtxs);
+        glBufferData(GL_ARRAY_BUFFER, streamBytes[0], streams[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, pos));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, uv));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, normal));
+        glEnableVertexAttribArray(2);
+
+        // Element buffer, recorded in the vao
+        glGenBuffers(1, &ebo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, streamBytes[1], streams[1], GL_STATIC_DRAW);
+    }
+    else
+    {
+        GLuint *vbos[3] = {&vboVtxs, &vboUvs, &vboNormals};
+        GLint nOfComponents[3] = {3, 2, 3};
+
+        // One vbo per stream
+        for (int i = 0; i < nOfStreams && i < 3; i++)
+        {
+            glGenBuffers(1, vbos[i]);
+            glBindBuffer(GL_ARRAY_BUFFER, *vbos[i]);
+            glBufferData(GL_ARRAY_BUFFER, streamBytes[i], streams[i], GL_STATIC_DRAW);
+            glVertexAttribPointer(i, nOfComponents[i], GL_FLOAT, GL_FALSE, 0, 0);
+            glEnableVertexAttribArray(i);
+        }
+    }
+
+    nOfDrawVtxs = nOfVtxs;
 
-    // Release resource
-    delete[] aVtxCoords;
-    delete[] aUvs;
-    delete[] aNormals;
+    // Grids compute their patch bounds on the fly
+    if (faceType == QUAD && gridSize.x == 0)
+    {
+        initPatchBounds(streams, nOfStreams, nOfVtxs);
+    }
 }
 
 // ---------------------------------------------------------
-// Initialize OpenGL buffers (for quad face)
+// Compute the footprint of every quad patch
+// Parameters:
+//   1. streams: vertex streams, as passed to uploadStreams
+//   2. nOfStreams: number of streams
+//   3. nOfVtxs: number of vertices (or indices) to draw
+// Remarks: read from the GPU-ready streams, so it also works
+//   when the streams come from a .tmesh and faces is empty
 // ---------------------------------------------------------
-void Mesh::initBuffersQuad()
+void Mesh::initPatchBounds(const void **streams, int nOfStreams, GLsizei nOfVtxs)
 {
-    // Write vertex coordinate to array
-    int nOfFaces = faces.size();
+    size_t nOfPatches = size_t(nOfVtxs) / 4;
+    patchBounds.resize(nOfPatches);
 
-    // 4 vertices per face, 3 float per vertex coord, 2 float per tex coord
-    GLfloat *aVtxCoords = new GLfloat[nOfFaces * 4 * 3];
-    GLfloat *aUvs = new GLfloat[nOfFaces * 4 * 2];
-    GLfloat *aNormals = new GLfloat[nOfFaces * 4 * 3];
+    if (nOfStreams < 2)
+    {
+        patchBounds.clear();
+        return;
+    }
 
-    for (size_t i = 0; i < nOfFaces; i++)
+    const GLuint *indices = (const GLuint *)streams[1];
+
+    parallelFor(nOfPatches, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            PatchBounds &b = patchBounds[i];
+            b.posMin = vec3(FLT_MAX);
+            b.posMax = vec3(-FLT_MAX);
+            b.uvMin = vec2(FLT_MAX);
+            b.uvMax = vec2(-FLT_MAX);
+
+            for (size_t k = i * 4; k < i * 4 + 4; k++)
+            {
+                vec3 pos;
+                vec2 uv;
+
+                if (layout == LAYOUT_PACKED)
+                {
+                    const PackedVertex &vtx = ((const PackedVertex *)streams[0])[indices[k]];
+                    vec3 unitPos(unpackSnorm1x16(uint16_t(vtx.pos[0])), unpackSnorm1x16(uint16_t(vtx.pos[1])),
+                                 unpackSnorm1x16(uint16_t(vtx.pos[2])));
+                    pos = vec3(dequantize * vec4(unitPos, 1.f));
+                    uv = unpackHalf2x16(vtx.uv);
+                }
+                else if (layout == LAYOUT_INDEXED)
+                {
+                    const Vertex &vtx = ((const Vertex *)streams[0])[indices[k]];
+                    pos = vtx.pos;
+                    uv = vtx.uv;
+                }
+                else
+                {
+                    // One vec3 and one vec2 per face corner
+                    pos = ((const vec3 *)streams[0])[k];
+                    uv = ((const vec2 *)streams[1])[k];
+                }
+
+                b.posMin = min(b.posMin, pos);
+                b.posMax = max(b.posMax, pos);
+                b.uvMin = min(b.uvMin, uv);
+                b.uvMax = max(b.uvMax, uv);
+            }
+        }
+    });
+}
+
+// ---------------------------------------------------------
+// Get the number of quad patches
+// ---------------------------------------------------------
+size_t Mesh::getNumPatches() const
+{
+    if (gridSize.x > 0)
     {
-        // Vertex 1
-        int vtxIdx = faces[i].v1;
-        aVtxCoords[i * 12 + 0] = vertices[vtxIdx].x;
-        aVtxCoords[i * 12 + 1] = vertices[vtxIdx].y;
-        aVtxCoords[i * 12 + 2] = vertices[vtxIdx].z;
+        return size_t(gridSize.x) * gridSize.y;
+    }
 
-        // Normal for vertex 1
-        int nmlIdx = faces[i].vn1;
-        aNormals[i * 12 + 0] = faceNormals[nmlIdx].x;
-        aNormals[i * 12 + 1] = faceNormals[nmlIdx].y;
-        aNormals[i * 12 + 2] = faceNormals[nmlIdx].z;
+    return patchBounds.size();
+}
 
-        // Uv for vertex 1
-        int uvIdx = faces[i].vt1;
-        aUvs[i * 8 + 0] = uvs[uvIdx].x;
-        aUvs[i * 8 + 1] = uvs[uvIdx].y;
+// ---------------------------------------------------------
+// Get the footprint of a quad patch
+// Parameters:
+//   i: patch index, in drawing order
+// Return: model-space bounds and uv rectangle
+// ---------------------------------------------------------
+PatchBounds Mesh::getPatchBounds(size_t i) const
+{
+    if (gridSize.x == 0)
+    {
+        return patchBounds[i];
+    }
 
-        // Vertex 2
-        vtxIdx = faces[i].v2;
-        aVtxCoords[i * 12 + 3] = vertices[vtxIdx].x;
-        aVtxCoords[i * 12 + 4] = vertices[vtxIdx].y;
-        aVtxCoords[i * 12 + 5] = vertices[vtxIdx].z;
+    // Same vertex positions and uvs as createGrid
+    int x = int(i % gridSize.x);
+    int z = int(i / gridSize.x);
+    vec2 t0 = vec2(x, z) / vec2(gridSize);
+    vec2 t1 = vec2(x + 1, z + 1) / vec2(gridSize);
 
-        // Normal for vertex 2
-        nmlIdx = faces[i].vn2;
-        aNormals[i * 12 + 3] = faceNormals[nmlIdx].x;
-        aNormals[i * 12 + 4] = faceNormals[nmlIdx].y;
-        aNormals[i * 12 + 5] = faceNormals[nmlIdx].z;
+    PatchBounds b;
+    b.posMin = vec3(-1.f + 2.f * t0.x, 0.f, -1.f + 2.f * t0.y);
+    b.posMax = vec3(-1.f + 2.f * t1.x, 0.f, -1.f + 2.f * t1.y);
+    b.uvMin = vec2(t0.x, 1.f - t1.y);
+    b.uvMax = vec2(t1.x, 1.f - t0.y);
 
-        // Uv for vertex 2
-        uvIdx = faces[i].vt2;
-        aUvs[i * 8 + 2] = uvs[uvIdx].x;
-        aUvs[i * 8 + 3] = uvs[uvIdx].y;
+    return b;
+}
 
-        // Vertex 3
-        vtxIdx = faces[i].v3;
-        aVtxCoords[i * 12 + 6] = vertices[vtxIdx].x;
-        aVtxCoords[i * 12 + 7] = vertices[vtxIdx].y;
-        aVtxCoords[i * 12 + 8] = vertices[vtxIdx].z;
+// ---------------------------------------------------------
+// Load the preprocessed mesh (.tmesh) next to an .obj
+// Parameters:
+//   fileName: .obj file
+// Return: true if the cache was valid and uploaded
+// Remarks:
+//   - The cache is mapped into memory and its pages are
+//     passed straight to glBufferData
+//   - A cache whose streams do not match its header (e.g.
+//     corrupted, or edited by hand) is rejected, so the
+//     .obj is parsed again
+// ---------------------------------------------------------
+bool Mesh::loadCache(const string fileName)
+{
+    cacheFile = getCacheFileName(fileName);
 
-        // Normal for vertex 3
-        nmlIdx = faces[i].vn3;
-        aNormals[i * 12 + 6] = faceNormals[nmlIdx].x;
-        aNormals[i * 12 + 7] = faceNormals[nmlIdx].y;
-        aNormals[i * 12 + 8] = faceNormals[nmlIdx].z;
+    if (!getFileSignature(fileName, objSignature))
+    {
+        return false;
+    }
 
-        // Uv for vertex 3
-        uvIdx = faces[i].vt3;
-        aUvs[i * 8 + 4] = uvs[uvIdx].x;
-        aUvs[i * 8 + 5] = uvs[uvIdx].y;
+    MappedFile file;
+    if (!file.open(cacheFile) || file.size < sizeof(TmeshHeader))
+    {
+        return false;
+    }
 
-        // Vertex 4
-        vtxIdx = faces[i].v4;
-        aVtxCoords[i * 12 + 9] = vertices[vtxIdx].x;
-        aVtxCoords[i * 12 + 10] = vertices[vtxIdx].y;
-        aVtxCoords[i * 12 + 11] = vertices[vtxIdx].z;
+    TmeshHeader header;
+    memcpy(&header, file.data, sizeof(TmeshHeader));
 
-        // Normal for vertex 4
-        nmlIdx = faces[i].vn4;
-        aNormals[i * 12 + 9] = faceNormals[nmlIdx].x;
-        aNormals[i * 12 + 10] = faceNormals[nmlIdx].y;
-        aNormals[i * 12 + 11] = faceNormals[nmlIdx].z;
+    // Stale or incompatible cache
+    if (header.magic != TMESH_MAGIC || header.version != TMESH_VERSION || header.faceType != faceType ||
+        header.layout != layout ||
+        header.objSize != objSignature.size || header.objMtime != objSignature.mtime ||
+        header.objHash != objSignature.hash || header.nOfStreams > TMESH_MAX_STREAMS)
+    {
+        return false;
+    }
 
-        // Uv for vertex 4
-        uvIdx = faces[i].vt4;
-        aUvs[i * 8 + 6] = uvs[uvIdx].x;
-        aUvs[i * 8 + 7] = uvs[uvIdx].y;
+    // Streams follow the header
+    const void *streams[TMESH_MAX_STREAMS];
+    uint64_t offset = sizeof(TmeshHeader);
+    for (uint32_t i = 0; i < header.nOfStreams; i++)
+    {
+        streams[i] = file.data + offset;
+        offset += header.streamBytes[i];
     }
 
-    // Vao
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+    if (offset != file.size)
+    {
+        return false;
+    }
 
-    // Vbo for vertex
-    glGenBuffers(1, &vboVtxs);
-    glBindBuffer(GL_ARRAY_BUFFER, vboVtxs);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * nOfFaces * 4 * 3, aVtxCoords, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-
-    // Vbo for texture
-    glGenBuffers(1, &vboUvs);
-    glBindBuffer(GL_ARRAY_BUFFER, vboUvs);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * nOfFaces * 4 * 2, aUvs, GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-
-    // Vbo for normal
-    glGenBuffers(1, &vboNormals);
-    glBindBuffer(GL_ARRAY_BUFFER, vboNormals);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * nOfFaces * 4 * 3, aNormals, GL_STATIC_DRAW);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(2);
+    // The hashes only cover the .obj: the streams must hold
+    // nOfVtxs vertices, or nOfVtxs indices of their vertices
+    bool isIndexed = (layout == LAYOUT_INDEXED || layout == LAYOUT_PACKED);
+    if (header.nOfVtxs < 0 || header.nOfStreams != (isIndexed ? 2u : 3u))
+    {
+        return false;
+    }
 
-    // Release resource
-    delete[] aVtxCoords;
-    delete[] aUvs;
-    delete[] aNormals;
+    uint64_t nOfVtxs = uint64_t(header.nOfVtxs);
+    if (isIndexed)
+    {
+        if (nOfVtxs * sizeof(GLuint) > header.streamBytes[1])
+        {
+            return false;
+        }
+
+        size_t vertexBytes = (layout == LAYOUT_PACKED) ? sizeof(PackedVertex) : sizeof(Vertex);
+        uint64_t nOfVertices = header.streamBytes[0] / vertexBytes;
+        const GLuint *indices = (const GLuint *)streams[1];
+        std::atomic<bool> isOutOfRange(false);
+        parallelFor(nOfVtxs, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++)
+            {
+                if (indices[k] >= nOfVertices)
+                {
+                    isOutOfRange = true;
+                    return;
+                }
+            }
+        });
+
+        if (isOutOfRange)
+        {
+            return false;
+        }
+    }
+    else if (nOfVtxs * sizeof(vec3) > header.streamBytes[0] || nOfVtxs * sizeof(vec2) > header.streamBytes[1] ||
+             nOfVtxs * sizeof(vec3) > header.streamBytes[2])
+    {
+        return false;
+    }
+
+    dequantize = make_mat4(header.dequantize);
+    uploadStreams(streams, header.streamBytes, header.nOfStreams, header.nOfVtxs);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Save the vertex streams as a preprocessed mesh (.tmesh)
+// Parameters:
+//   1. streams: vertex streams, as passed to uploadStreams
+//   2. streamBytes: size of each stream
+//   3. nOfStreams: number of streams
+//   4. nOfVtxs: number of vertices to draw
+// Remarks: written to a temporary file and renamed,
+//   so a crash never leaves a truncated cache behind
+// ---------------------------------------------------------
+void Mesh::saveCache(const void **streams, const uint64_t *streamBytes, int nOfStreams, GLsizei nOfVtxs)
+{
+    // The .obj could not be read
+    if (cacheFile == "" || objSignature.size == 0)
+    {
+        return;
+    }
+
+    TmeshHeader header;
+    memset(&header, 0, sizeof(TmeshHeader));
+    header.magic = TMESH_MAGIC;
+    header.version = TMESH_VERSION;
+    header.faceType = faceType;
+    header.layout = layout;
+    header.nOfVtxs = nOfVtxs;
+    header.nOfStreams = nOfStreams;
+    header.objSize = objSignature.size;
+    header.objMtime = objSignature.mtime;
+    header.objHash = objSignature.hash;
+    memcpy(header.dequantize, value_ptr(dequantize), sizeof(header.dequantize));
+    for (int i = 0; i < nOfStreams; i++)
+    {
+        header.streamBytes[i] = streamBytes[i];
+    }
+
+    string tempFile = cacheFile + ".tmp";
+    std::ofstream fout(tempFile.c_str(), std::ios::binary);
+    fout.write((const char *)&header, sizeof(TmeshHeader));
+    for (int i = 0; i < nOfStreams; i++)
+    {
+        fout.write((const char *)streams[i], streamBytes[i]);
+    }
+    fout.close();
+
+    if (!fout.good() || rename(tempFile.c_str(), cacheFile.c_str()) != 0)
+    {
+        std::cout << "failed to write file : " << cacheFile << std::endl;
+        remove(tempFile.c_str());
+    }
 }
 
 // ---------------------------------------------------------
@@ -760,7 +2602,14 @@ void Mesh::setTexture(GLuint &tbo, int texUnit, const string texDir, FREE_IMAGE_
     glActiveTexture(GL_TEXTURE0 + texUnit);
 
     // Create texture image
-    FIBITMAP *texImage = FreeImage_ConvertTo24Bits(FreeImage_Load(imgType, texDir.c_str()));
+    FIBITMAP *srcImage = FreeImage_Load(imgType, texDir.c_str());
+    if (srcImage == NULL)
+    {
+        std::cout << "failed to open file : " << texDir << std::endl;
+        return;
+    }
+    FIBITMAP *texImage = FreeImage_ConvertTo24Bits(srcImage);
+    FreeImage_Unload(srcImage);
 
     // Bind texture image to tbo
     glGenTextures(1, &tbo);
@@ -774,35 +2623,193 @@ void Mesh::setTexture(GLuint &tbo, int texUnit, const string texDir, FREE_IMAGE_
 }
 
 // ---------------------------------------------------------
-// Draw mesh
+// Set the height map of the mesh
 // Parameters:
-//   1. M, V, P: transformation matrices
-//   2. eye: eye point
-//   3. lightColor, lightPosition: lighting
-//   4. uniHeight: height map uniform
+//   1. tbo: texture buffer object
+//   2. texUnit: texture unit
+//   3. texDir: height map image file
+//   4. imgType: image type
+// Remarks:
+//   - Only the red channel is kept (the shaders read .r),
+//     as GL_R16, or GL_R32F for float images
+//   - 8-bit images are widened to 16 bits, so filtered
+//     heights are not rounded to 8 bits between texels
+//   - Mipmaps are built for tesQuad.glsl, which picks a
+//     level from the tessellation levels
+// ---------------------------------------------------------
+void Mesh::setHeightTexture(GLuint &tbo, int texUnit, const string texDir, FREE_IMAGE_FORMAT imgType)
+{
+    int width, height;
+    vector<float> texels;
+    GLenum format;
+    if (!loadHeightImage(texDir, imgType, width, height, texels, format))
+    {
+        return;
+    }
+
+    // Select a texture unit
+    glActiveTexture(GL_TEXTURE0 + texUnit);
+
+    glGenTextures(1, &tbo);
+    glBindTexture(GL_TEXTURE_2D, tbo);
+    if (format == GL_R32F)
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, (void *)texels.data());
+    }
+    else
+    {
+        vector<uint16_t> values(texels.size());
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            values[i] = uint16_t(glm::clamp(texels[i], 0.f, 1.f) * 65535.f + 0.5f);
+        }
+
+        // Rows of an odd width are not 4-byte aligned
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, width, height, 0, GL_RED, GL_UNSIGNED_SHORT, (void *)values.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+// ---------------------------------------------------------
+// Bind the shader program and update its uniforms
+// Parameters:
+//   1. M: model matrix
+//   2. uniHeight: height map uniform
 // ---------------------------------------------------------
-void Mesh::draw(mat4 M, mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPosition, int uniHeight)
+void Mesh::useProgram(mat4 M, int uniHeight)
 {
-    // Bind shader program
     glUseProgram(shader);
 
-    // Update uniforms
     glUniformMatrix4fv(uniModel, 1, GL_FALSE, value_ptr(M));
-    glUniformMatrix4fv(uniView, 1, GL_FALSE, value_ptr(V));
-    glUniformMatrix4fv(uniProjection, 1, GL_FALSE, value_ptr(P));
-    glUniform3fv(uniEyePoint, 1, value_ptr(eye));
-    glUniform3fv(uniLightColor, 1, value_ptr(lightColor));
-    glUniform3fv(uniLightPosition, 1, value_ptr(lightPosition));
+    glUniformMatrix4fv(uniDequantize, 1, GL_FALSE, value_ptr(dequantize));
+    glUniform1i(uniNormalPacked, layout == LAYOUT_PACKED);
+    glUniform2i(uniGridSize, gridSize.x, gridSize.y);
     glUniform1i(uniTexHeight, uniHeight);
+    glUniform1i(uniTessMetric, tessMetric);
+    glUniform2fv(uniViewport, 1, value_ptr(viewport));
+    glUniform1f(uniPixelsPerTriangle, pixelsPerTriangle);
+    glUniform1f(uniMaxPixelError, maxPixelError);
+    drawCounters.nOfStateChanges += 10;
+}
+
+// ---------------------------------------------------------
+// Draw mesh
+// Parameters:
+//   1. M: model matrix
+//   2. uniHeight: height map uniform
+//   3. runs: patches to draw, as (first patch, number of
+//      patches) runs; NULL draws every patch
+// Remarks:
+//   - V, P, the eye point and the light come from the
+//     uniform block Frame (FrameUniformBuffer::update)
+//   - LAYOUT_LISTED is drawn by drawIndirect
+// ---------------------------------------------------------
+void Mesh::draw(mat4 M, int uniHeight, const vector<ivec2> *runs)
+{
+    useProgram(M, uniHeight);
 
     // Draw mesh
+    // The patch size (3 or 4) is set by glPatchParameteri
     glBindVertexArray(vao);
-    if (faceType == QUAD)
+    drawCounters.nOfStateChanges++;
+    if (runs == NULL)
+    {
+        if (layout == LAYOUT_INDEXED || layout == LAYOUT_PACKED)
+        {
+            glDrawElements(GL_PATCHES, nOfDrawVtxs, GL_UNSIGNED_INT, 0);
+        }
+        else if (layout == LAYOUT_INSTANCED)
+        {
+            glVertexAttribI4ui(BASE_INSTANCE_ATTRIB, 0, 0, 0, 0);
+            glDrawArraysInstanced(GL_PATCHES, 0, nOfDrawVtxs, gridSize.x * gridSize.y);
+            drawCounters.nOfStateChanges++;
+        }
+        else
+        {
+            glDrawArrays(GL_PATCHES, 0, nOfDrawVtxs);
+        }
+        drawCounters.nOfDrawCalls++;
+
+        return;
+    }
+
+    // Only the visible runs of patches
+    if (layout == LAYOUT_INSTANCED)
+    {
+        // One instanced draw per run, the shader adds the first
+        // patch (BASE_INSTANCE_ATTRIB)
+        if (isBatched)
+        {
+            if (batch == NULL)
+            {
+                batch = new DrawBatch();
+                batch->init(vao, GLuint(gridSize.x * gridSize.y));
+            }
+            for (size_t i = 0; i < runs->size(); i++)
+            {
+                batch->add(nOfDrawVtxs, (*runs)[i].y, 0, (*runs)[i].x);
+            }
+            batch->flush(GL_PATCHES);
+
+            return;
+        }
+
+        for (size_t i = 0; i < runs->size(); i++)
+        {
+            glVertexAttribI4ui(BASE_INSTANCE_ATTRIB, (*runs)[i].x, 0, 0, 0);
+            glDrawArraysInstanced(GL_PATCHES, 0, nOfDrawVtxs, (*runs)[i].y);
+        }
+        drawCounters.nOfStateChanges += runs->size();
+        drawCounters.nOfDrawCalls += runs->size();
+
+        return;
+    }
+
+    drawFirsts.resize(runs->size());
+    drawCounts.resize(runs->size());
+    drawOffsets.resize(runs->size());
+    for (size_t i = 0; i < runs->size(); i++)
     {
-        glDrawArrays(GL_PATCHES, 0, faces.size() * 4);
+        drawFirsts[i] = (*runs)[i].x * 4;
+        drawCounts[i] = (*runs)[i].y * 4;
+        drawOffsets[i] = (const void *)(size_t(drawFirsts[i]) * sizeof(GLuint));
     }
-    else if (faceType == TRIANGLE)
+
+    if (layout == LAYOUT_INDEXED || layout == LAYOUT_PACKED)
+    {
+        glMultiDrawElements(GL_PATCHES, drawCounts.data(), GL_UNSIGNED_INT, drawOffsets.data(), GLsizei(runs->size()));
+    }
+    else
     {
-        glDrawArrays(GL_PATCHES, 0, faces.size() * 3);
+        glMultiDrawArrays(GL_PATCHES, drawFirsts.data(), drawCounts.data(), GLsizei(runs->size()));
     }
+    drawCounters.nOfDrawCalls++;
+}
+
+// ---------------------------------------------------------
+// Draw the patch list of a culling pass (LAYOUT_LISTED)
+// Parameters:
+//   1. M: model matrix, as passed to the culling pass
+//   2. uniHeight: height map uniform
+//   3. commandBuffer: DrawArraysCommand written on the GPU,
+//      one instance per listed patch
+// Remarks: the list and the levels are read from the
+//   buffers at PATCH_LIST_BINDING and PATCH_LEVEL_BINDING,
+//   the CPU never knows how many patches are drawn
+// ---------------------------------------------------------
+void Mesh::drawIndirect(mat4 M, int uniHeight, GLuint commandBuffer)
+{
+    useProgram(M, uniHeight);
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    glDrawArraysIndirect(GL_PATCHES, (void *)0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    drawCounters.nOfStateChanges++;
+    drawCounters.nOfDrawCalls++;
 }
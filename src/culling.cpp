@@ -0,0 +1,591 @@
+#include "culling.h"
+
+// ================================================
+// PatchCuller class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor
+// Parameters:
+//   1. m: quad mesh, or a grid from Mesh::createGrid
+//   2. hp: min/max pyramid of texHeight, NULL means a flat terrain
+// Remarks: the height range of each patch is computed once,
+//   the height map does not change while drawing
+// ---------------------------------------------------------
+PatchCuller::PatchCuller(const Mesh &m, const HeightPyramid *hp) : mesh(m)
+{
+    heightPyramid = hp;
+
+    // Same as "scale" in tesQuad.glsl
+    heightScale = 10.f;
+
+    isBoundsValid = false;
+    nOfPatches = mesh.getNumPatches();
+    nOfDrawn = nOfPatches;
+    nOfCulled = 0;
+    seconds = 0.0;
+
+    heightRanges.resize(nOfPatches);
+    parallelFor(nOfPatches, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            PatchBounds b = mesh.getPatchBounds(i);
+            heightRanges[i] = (heightPyramid != NULL) ? heightPyramid->getRange(b.uvMin, b.uvMax) : vec2(0.5f);
+        }
+    });
+}
+
+// ---------------------------------------------------------
+// Compute the world-space AABB of every patch
+// Parameters:
+//   1. M: model matrix (as passed to Mesh::draw)
+//   2. threads: number of threads, 0 means one per core
+// Remarks: tesQuad.glsl displaces worldPos.y after M,
+//   by (h * 2 - 1) * heightScale
+// ---------------------------------------------------------
+void PatchCuller::initBounds(mat4 M, int threads)
+{
+    boundsMin.resize(nOfPatches);
+    boundsMax.resize(nOfPatches);
+
+    parallelFor(
+        nOfPatches,
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                PatchBounds b = mesh.getPatchBounds(i);
+
+                // Transform the 8 corners of the flat patch box
+                vec3 worldMin(FLT_MAX), worldMax(-FLT_MAX);
+                for (int k = 0; k < 8; k++)
+                {
+                    vec3 corner((k & 1) ? b.posMax.x : b.posMin.x, (k & 2) ? b.posMax.y : b.posMin.y,
+                                (k & 4) ? b.posMax.z : b.posMin.z);
+                    vec3 worldCorner = vec3(M * vec4(corner, 1.f));
+                    worldMin = min(worldMin, worldCorner);
+                    worldMax = max(worldMax, worldCorner);
+                }
+
+                // Height displacement
+                worldMin.y += (heightRanges[i].x * 2.f - 1.f) * heightScale;
+                worldMax.y += (heightRanges[i].y * 2.f - 1.f) * heightScale;
+
+                boundsMin[i] = worldMin;
+                boundsMax[i] = worldMax;
+            }
+        },
+        threads);
+
+    boundsModel = M;
+    isBoundsValid = true;
+}
+
+// ---------------------------------------------------------
+// Find the patches inside the view frustum
+// Parameters:
+//   1. M, V, P: transformation matrices (as passed to Mesh::draw)
+//   2. threads: number of threads, 0 means one per core
+// Remarks:
+//   - AABBs are only recomputed when M changes
+//   - Patches are tested in blocks, and each block keeps its
+//     own runs, so the result is in drawing order
+// ---------------------------------------------------------
+void PatchCuller::update(mat4 M, mat4 V, mat4 P, int threads)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    if (!isBoundsValid || M != boundsModel)
+    {
+        initBounds(M, threads);
+    }
+
+    vec4 planes[6];
+    getFrustumPlanes(P * V, planes);
+
+    // About 16 blocks per thread
+    size_t nOfBlocks = glm::max(glm::min(nOfPatches, size_t(getNumThreads(threads)) * 16), size_t(1));
+    size_t blockSize = (nOfPatches + nOfBlocks - 1) / nOfBlocks;
+    vector<vector<ivec2>> blockRuns(nOfBlocks);
+    vector<size_t> blockDrawn(nOfBlocks, 0);
+
+    parallelFor(
+        nOfBlocks,
+        [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; b++)
+            {
+                size_t first = b * blockSize;
+                size_t last = glm::min(first + blockSize, nOfPatches);
+                vector<ivec2> &blockRun = blockRuns[b];
+
+                for (size_t i = first; i < last; i++)
+                {
+                    if (isBoxOutside(planes, boundsMin[i], boundsMax[i]))
+                    {
+                        continue;
+                    }
+
+                    // Extend the current run, or start a new one
+                    if (!blockRun.empty() && size_t(blockRun.back().x + blockRun.back().y) == i)
+                    {
+                        blockRun.back().y++;
+                    }
+                    else
+                    {
+                        blockRun.push_back(ivec2(int(i), 1));
+                    }
+                    blockDrawn[b]++;
+                }
+            }
+        },
+        threads);
+
+    // Concatenate, merging runs across block boundaries
+    runs.clear();
+    nOfDrawn = 0;
+    for (size_t b = 0; b < nOfBlocks; b++)
+    {
+        for (size_t r = 0; r < blockRuns[b].size(); r++)
+        {
+            ivec2 run = blockRuns[b][r];
+
+            if (!runs.empty() && runs.back().x + runs.back().y == run.x)
+            {
+                runs.back().y += run.y;
+            }
+            else
+            {
+                runs.push_back(run);
+            }
+        }
+        nOfDrawn += blockDrawn[b];
+    }
+    nOfCulled = nOfPatches - nOfDrawn;
+
+    auto endTime = std::chrono::steady_clock::now();
+    seconds = std::chrono::duration<double>(endTime - startTime).count();
+}
+
+// ---------------------------------------------------------
+// Print statistics of the last update
+// ---------------------------------------------------------
+void PatchCuller::printStats()
+{
+    std::cout << "patches: " << nOfPatches << ", drawn: " << nOfDrawn << ", culled: " << nOfCulled
+              << ", draw calls: " << runs.size() << ", time: " << seconds * 1000.0 << " ms" << std::endl;
+}
+
+// ================================================
+// GpuPatchCuller class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (no GL object yet)
+// Parameters:
+//   c: culler of a LAYOUT_LISTED grid, gives the AABBs
+// ---------------------------------------------------------
+GpuPatchCuller::GpuPatchCuller(PatchCuller &c) : culler(c)
+{
+    isBoundsValid = false;
+    depthPyramid = NULL;
+
+    program = 0;
+    boundsBuffer = listBuffer = levelBuffer = commandBuffer = statsBuffer = 0;
+    uniModel = uniGridSize = uniPlanes = uniFrustumCulled = -1;
+    uniTessMetric = uniViewport = uniPixelsPerTriangle = uniMaxPixelError = -1;
+    uniOcclusionCulled = uniHiZViewProjection = -1;
+
+    nOfPatches = culler.nOfPatches;
+    nOfDrawn = nOfPatches;
+    nOfCulled = nOfOccluded = nOfSavedTriangles = 0;
+    nOfFramesRead = sumOfOccluded = sumOfSavedTriangles = 0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+GpuPatchCuller::~GpuPatchCuller()
+{
+    glDeleteBuffers(1, &boundsBuffer);
+    glDeleteBuffers(1, &listBuffer);
+    glDeleteBuffers(1, &levelBuffer);
+    glDeleteBuffers(1, &commandBuffer);
+    glDeleteBuffers(1, &statsBuffer);
+    glDeleteProgram(program);
+}
+
+// ---------------------------------------------------------
+// Check whether the context can run the compute pass
+// Return: true with OpenGL 4.3 or later
+// ---------------------------------------------------------
+bool GpuPatchCuller::isSupported()
+{
+    return hasGLVersion(4, 3);
+}
+
+// ---------------------------------------------------------
+// Build the compute pass and create its buffers
+// Parameters:
+//   1. unitHeight: texture unit of texHeight
+//   2. unitRoughness: texture unit of texRoughness
+// Return: false if the compute shader does not build
+// Remarks: the buffers stay bound to their binding points,
+//   no other program uses them
+// ---------------------------------------------------------
+bool GpuPatchCuller::init(int unitHeight, int unitRoughness)
+{
+    program = buildComputeShader("./shader/csPatchCull.glsl");
+    if (program == 0)
+    {
+        return false;
+    }
+
+    uniModel = myGetUniformLocation(program, "M");
+    uniGridSize = myGetUniformLocation(program, "gridSize");
+    uniPlanes = myGetUniformLocation(program, "planes");
+    uniFrustumCulled = myGetUniformLocation(program, "isFrustumCulled");
+    uniTessMetric = myGetUniformLocation(program, "tessMetric");
+    uniViewport = myGetUniformLocation(program, "viewport");
+    uniPixelsPerTriangle = myGetUniformLocation(program, "pixelsPerTriangle");
+    uniMaxPixelError = myGetUniformLocation(program, "maxPixelError");
+    uniOcclusionCulled = myGetUniformLocation(program, "isOcclusionCulled");
+    uniHiZViewProjection = myGetUniformLocation(program, "hiZViewProjection");
+
+    glUseProgram(program);
+    glUniform1i(myGetUniformLocation(program, "texHeight"), unitHeight);
+    glUniform1i(myGetUniformLocation(program, "texRoughness"), unitRoughness);
+    glUniform1i(myGetUniformLocation(program, "texHiZ"), HIZ_UNIT);
+    bindFrameUniforms(program);
+
+    // A (min, max) pair of vec4 per patch, and the worst case
+    // of every patch in the list
+    glGenBuffers(1, &boundsBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, nOfPatches * 2 * sizeof(vec4), NULL, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PATCH_BOUNDS_BINDING, boundsBuffer);
+
+    glGenBuffers(1, &listBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, listBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, nOfPatches * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PATCH_LIST_BINDING, listBuffer);
+
+    glGenBuffers(1, &levelBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, levelBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, nOfPatches * 2 * sizeof(vec4), NULL, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PATCH_LEVEL_BINDING, levelBuffer);
+
+    glGenBuffers(1, &commandBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(DrawArraysCommand), NULL, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PATCH_COMMAND_BINDING, commandBuffer);
+
+    // Occluded patches, triangles saved
+    glGenBuffers(1, &statsBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PATCH_STATS_BINDING, statsBuffer);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Run the compute pass: list the visible patches and their
+// levels, for Mesh::drawIndirect
+// Parameters:
+//   1. M, V, P: transformation matrices (as passed to
+//      Mesh::drawIndirect)
+//   2. isFrustumCulled: false lists every patch (levels only)
+// Remarks:
+//   - The eye point comes from the uniform block Frame, the
+//     metric and its targets from the mesh of the culler
+//   - Patches are also tested against depthPyramid, once it
+//     holds a frame (and isFrustumCulled)
+// ---------------------------------------------------------
+void GpuPatchCuller::update(mat4 M, mat4 V, mat4 P, bool isFrustumCulled)
+{
+    const Mesh &mesh = culler.mesh;
+
+    // Same AABBs as the CPU culler
+    if (!culler.isBoundsValid || M != culler.boundsModel)
+    {
+        culler.initBounds(M);
+    }
+    if (!isBoundsValid || culler.boundsModel != boundsModel)
+    {
+        vector<vec4> bounds(nOfPatches * 2);
+        for (size_t i = 0; i < nOfPatches; i++)
+        {
+            bounds[i * 2] = vec4(culler.boundsMin[i], 1.f);
+            bounds[i * 2 + 1] = vec4(culler.boundsMax[i], 1.f);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bounds.size() * sizeof(vec4), bounds.data());
+
+        boundsModel = culler.boundsModel;
+        isBoundsValid = true;
+    }
+
+    vec4 planes[6];
+    getFrustumPlanes(P * V, planes);
+
+    // Empty list, 4 vertices per patch
+    DrawArraysCommand command = {GLuint(mesh.nOfDrawVtxs), 0, 0, 0};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(command), &command);
+
+    GLuint stats[2] = {0, 0};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(stats), stats);
+
+    bool isOcclusionCulled = isFrustumCulled && depthPyramid != NULL && depthPyramid->isValid;
+    if (isOcclusionCulled)
+    {
+        glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+        glBindTexture(GL_TEXTURE_2D, depthPyramid->pyramidTexture);
+    }
+
+    glUseProgram(program);
+    glUniformMatrix4fv(uniModel, 1, GL_FALSE, value_ptr(M));
+    glUniform2i(uniGridSize, mesh.gridSize.x, mesh.gridSize.y);
+    glUniform4fv(uniPlanes, 6, value_ptr(planes[0]));
+    glUniform1i(uniFrustumCulled, isFrustumCulled);
+    glUniform1i(uniTessMetric, mesh.tessMetric);
+    glUniform2fv(uniViewport, 1, value_ptr(mesh.viewport));
+    glUniform1f(uniPixelsPerTriangle, mesh.pixelsPerTriangle);
+    glUniform1f(uniMaxPixelError, mesh.maxPixelError);
+    glUniform1i(uniOcclusionCulled, isOcclusionCulled);
+    if (isOcclusionCulled)
+    {
+        glUniformMatrix4fv(uniHiZViewProjection, 1, GL_FALSE, value_ptr(depthPyramid->viewProjection));
+    }
+    drawCounters.nOfStateChanges += isOcclusionCulled ? 13 : 12;
+
+    glDispatchCompute(GLuint((nOfPatches + 63) / 64), 1, 1);
+
+    // The list is read by the draw, the count by the indirect command
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+// ---------------------------------------------------------
+// Read back the statistics of the last update, and add them
+// to the sums
+// Remarks: waits for the compute pass, only for statistics
+// ---------------------------------------------------------
+void GpuPatchCuller::readStats()
+{
+    DrawArraysCommand command = {0, 0, 0, 0};
+    GLuint stats[2] = {0, 0};
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(command), &command);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(stats), stats);
+
+    nOfDrawn = command.instanceCount;
+    nOfOccluded = stats[0];
+    nOfSavedTriangles = stats[1];
+    nOfCulled = nOfPatches - nOfDrawn - nOfOccluded;
+
+    nOfFramesRead++;
+    sumOfOccluded += nOfOccluded;
+    sumOfSavedTriangles += nOfSavedTriangles;
+}
+
+// ---------------------------------------------------------
+// Print statistics of the last readStats
+// ---------------------------------------------------------
+void GpuPatchCuller::printStats()
+{
+    std::cout << "patches: " << nOfPatches << ", drawn: " << nOfDrawn << ", culled: " << nOfCulled
+              << ", occluded: " << nOfOccluded << " (compute pass), draw calls: 1" << std::endl;
+    if (depthPyramid != NULL && nOfFramesRead > 0)
+    {
+        std::cout << "occlusion: " << nOfOccluded << " patches, " << nOfSavedTriangles
+                  << " triangles saved (mean of " << nOfFramesRead << " frames: "
+                  << double(sumOfOccluded) / nOfFramesRead << " patches, "
+                  << double(sumOfSavedTriangles) / nOfFramesRead << " triangles)" << std::endl;
+    }
+}
+
+// ================================================
+// DepthPyramid class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (no GL object yet)
+// ---------------------------------------------------------
+DepthPyramid::DepthPyramid()
+{
+    program = 0;
+    depthTexture = pyramidTexture = 0;
+    uniLevel = -1;
+
+    size = ivec2(0);
+    nOfLevels = 0;
+    viewProjection = mat4(1.f);
+    isValid = false;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+DepthPyramid::~DepthPyramid()
+{
+    glDeleteTextures(1, &depthTexture);
+    glDeleteTextures(1, &pyramidTexture);
+    glDeleteProgram(program);
+}
+
+// ---------------------------------------------------------
+// Build the compute shader of the levels
+// Return: false if it does not build
+// ---------------------------------------------------------
+bool DepthPyramid::init()
+{
+    program = buildComputeShader("./shader/csDepthPyramid.glsl");
+    if (program == 0)
+    {
+        return false;
+    }
+
+    uniLevel = myGetUniformLocation(program, "level");
+    glUseProgram(program);
+    glUniform1i(myGetUniformLocation(program, "texDepth"), HIZ_UNIT);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// (Re)create the textures for a framebuffer size
+// Parameters:
+//   width, height: size of the framebuffer
+// Remarks: the pyramid holds no frame until the next build
+// ---------------------------------------------------------
+void DepthPyramid::resize(int width, int height)
+{
+    glDeleteTextures(1, &depthTexture);
+    glDeleteTextures(1, &pyramidTexture);
+
+    size = glm::max(ivec2(width, height), ivec2(1));
+    nOfLevels = 1;
+    while ((glm::max(size.x, size.y) >> nOfLevels) > 0)
+    {
+        nOfLevels++;
+    }
+
+    glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+
+    // Copy of the depth buffer, in the format of the default
+    // framebuffer so that glCopyTexSubImage2D does not convert
+    glGenTextures(1, &depthTexture);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, size.x, size.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &pyramidTexture);
+    glBindTexture(GL_TEXTURE_2D, pyramidTexture);
+    glTexStorage2D(GL_TEXTURE_2D, nOfLevels, GL_R32F, size.x, size.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    isValid = false;
+}
+
+// ---------------------------------------------------------
+// Build the pyramid from the depth buffer just drawn
+// Parameters:
+//   1. VP: view-projection matrix of the frame (P * V)
+//   2. width, height: size of the framebuffer
+// Remarks: reads the depth of the read framebuffer, before
+//   it is swapped
+// ---------------------------------------------------------
+void DepthPyramid::build(mat4 VP, int width, int height)
+{
+    if (program == 0)
+    {
+        return;
+    }
+    if (ivec2(width, height) != size || depthTexture == 0)
+    {
+        resize(width, height);
+    }
+
+    glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, size.x, size.y);
+
+    glUseProgram(program);
+    for (int level = 0; level < nOfLevels; level++)
+    {
+        ivec2 levelSize = glm::max(ivec2(size.x >> level, size.y >> level), ivec2(1));
+
+        glUniform1i(uniLevel, level);
+        glBindImageTexture(0, pyramidTexture, glm::max(level - 1, 0), GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, pyramidTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute(GLuint((levelSize.x + 7) / 8), GLuint((levelSize.y + 7) / 8), 1);
+
+        // The next level reads this one
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    drawCounters.nOfStateChanges += 1 + 3 * nOfLevels;
+
+    viewProjection = VP;
+    isValid = true;
+}
+
+// ================================================
+// Culling utilities
+// ================================================
+
+// ---------------------------------------------------------
+// Extract the frustum planes of a view-projection matrix
+// Parameters:
+//   1. VP: P * V
+//   2. planes: 6 planes (n, d), n pointing inside,
+//      so dot(n, p) + d >= 0 for a point p inside
+// Remarks: Gribb-Hartmann, for OpenGL clip space
+// ---------------------------------------------------------
+void getFrustumPlanes(mat4 VP, vec4 *planes)
+{
+    // Rows of VP (glm matrices are column-major)
+    vec4 rows[4];
+    for (int i = 0; i < 4; i++)
+    {
+        rows[i] = vec4(VP[0][i], VP[1][i], VP[2][i], VP[3][i]);
+    }
+
+    planes[0] = rows[3] + rows[0]; // left
+    planes[1] = rows[3] - rows[0]; // right
+    planes[2] = rows[3] + rows[1]; // bottom
+    planes[3] = rows[3] - rows[1]; // top
+    planes[4] = rows[3] + rows[2]; // near
+    planes[5] = rows[3] - rows[2]; // far
+}
+
+// ---------------------------------------------------------
+// Test an AABB against frustum planes
+// Parameters:
+//   1. planes: 6 planes from getFrustumPlanes
+//   2. boxMin, boxMax: corners of the AABB
+// Return: true if the box is entirely outside a plane
+// Remarks: conservative, a box crossing two planes
+//   outside a frustum corner is kept
+// ---------------------------------------------------------
+bool isBoxOutside(const vec4 *planes, vec3 boxMin, vec3 boxMax)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        // Corner of the box farthest along the plane normal
+        vec3 n = vec3(planes[i]);
+        vec3 p(n.x >= 0.f ? boxMax.x : boxMin.x, n.y >= 0.f ? boxMax.y : boxMin.y, n.z >= 0.f ? boxMax.z : boxMin.z);
+
+        if (dot(n, p) + planes[i].w < 0.f)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,254 @@
+#include "headless.h"
+
+#ifndef __APPLE__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// ================================================
+// HeadlessContext class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (no context)
+// ---------------------------------------------------------
+HeadlessContext::HeadlessContext()
+{
+    display = NULL;
+    context = NULL;
+
+    fbo = 0;
+    rboColor = 0;
+    rboDepth = 0;
+    width = 0;
+    height = 0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+HeadlessContext::~HeadlessContext()
+{
+    destroy();
+}
+
+// ---------------------------------------------------------
+// Create a core profile context and make it current
+// Parameters:
+//   1. major: OpenGL major version
+//   2. minor: OpenGL minor version
+// Return: true if succeeded
+// Remarks: GL functions must be loaded (glewInit) before
+//   initFramebuffer
+// ---------------------------------------------------------
+bool HeadlessContext::create(int major, int minor)
+{
+#ifdef __APPLE__
+    std::cout << "headless rendering needs EGL, which macOS does not have" << std::endl;
+    return false;
+#else
+    destroy();
+
+    // Surfaceless platform first, it needs no display server
+    EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != NULL)
+    {
+        eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (eglDisplay == EGL_NO_DISPLAY)
+    {
+        eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, NULL, NULL))
+    {
+        std::cout << "failed to initialize EGL" << std::endl;
+        return false;
+    }
+    display = eglDisplay;
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        std::cout << "EGL has no desktop OpenGL" << std::endl;
+        destroy();
+        return false;
+    }
+
+    // Nothing is drawn to an EGL surface, any config will do
+    EGLConfig config = (EGLConfig)0;
+    EGLint nOfConfigs = 0;
+    const EGLint configAttributes[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    eglChooseConfig(eglDisplay, configAttributes, &config, 1, &nOfConfigs);
+
+    const EGLint contextAttributes[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                        major,
+                                        EGL_CONTEXT_MINOR_VERSION,
+                                        minor,
+                                        EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                        EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                        EGL_NONE};
+    EGLContext eglContext = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+    if (eglContext == EGL_NO_CONTEXT)
+    {
+        std::cout << "failed to create an OpenGL " << major << "." << minor << " context" << std::endl;
+        destroy();
+        return false;
+    }
+    context = eglContext;
+
+    if (!eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext))
+    {
+        std::cout << "EGL has no surfaceless context" << std::endl;
+        destroy();
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+// ---------------------------------------------------------
+// Create the framebuffer object and bind it
+// Parameters:
+//   1. w: width, in pixels
+//   2. h: height, in pixels
+// ---------------------------------------------------------
+void HeadlessContext::initFramebuffer(int w, int h)
+{
+    width = w;
+    height = h;
+
+    glGenRenderbuffers(1, &rboColor);
+    glBindRenderbuffer(GL_RENDERBUFFER, rboColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glGenRenderbuffers(1, &rboDepth);
+    glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rboColor);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rboDepth);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cout << "incomplete framebuffer : " << width << " x " << height << std::endl;
+    }
+
+    glViewport(0, 0, width, height);
+}
+
+// ---------------------------------------------------------
+// Release the framebuffer object and the context
+// ---------------------------------------------------------
+void HeadlessContext::destroy()
+{
+#ifndef __APPLE__
+    if (context != NULL)
+    {
+        if (fbo != 0)
+        {
+            glDeleteFramebuffers(1, &fbo);
+            glDeleteRenderbuffers(1, &rboColor);
+            glDeleteRenderbuffers(1, &rboDepth);
+            fbo = rboColor = rboDepth = 0;
+        }
+
+        eglMakeCurrent((EGLDisplay)display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext((EGLDisplay)display, (EGLContext)context);
+        context = NULL;
+    }
+
+    if (display != NULL)
+    {
+        eglTerminate((EGLDisplay)display);
+        display = NULL;
+    }
+#endif
+}
+
+// ================================================
+// Camera path utilities
+// ================================================
+
+// ---------------------------------------------------------
+// Load a camera path
+// Parameters:
+//   1. fileName: one pose per line, "x y z vertical horizontal"
+//      (eye point, then angles in radians), '#' starts a comment
+//   2. path: poses, one per frame
+// Return: false if the file cannot be read or has no pose
+// ---------------------------------------------------------
+bool loadCameraPath(const string fileName, vector<CameraPose> &path)
+{
+    std::ifstream fin(fileName);
+    if (!fin)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+
+    path.clear();
+    string line;
+    int lineNumber = 0;
+    while (std::getline(fin, line))
+    {
+        lineNumber++;
+
+        size_t comment = line.find('#');
+        if (comment != string::npos)
+        {
+            line.resize(comment);
+        }
+        if (line.find_first_not_of(" \t\r") == string::npos)
+        {
+            continue;
+        }
+
+        CameraPose pose;
+        std::istringstream sin(line);
+        if (!(sin >> pose.eye.x >> pose.eye.y >> pose.eye.z >> pose.verticalAngle >> pose.horizontalAngle))
+        {
+            std::cout << fileName << ":" << lineNumber << ": expected x y z vertical horizontal" << std::endl;
+            return false;
+        }
+        path.push_back(pose);
+    }
+
+    if (path.empty())
+    {
+        std::cout << "empty camera path : " << fileName << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Save a camera path (as read by loadCameraPath)
+// Parameters:
+//   1. fileName: output file
+//   2. path: poses, one per frame
+// Return: false if the file cannot be written
+// ---------------------------------------------------------
+bool saveCameraPath(const string fileName, const vector<CameraPose> &path)
+{
+    FILE *fout = fopen(fileName.c_str(), "w");
+    if (fout == NULL)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+
+    fprintf(fout, "# eye.x eye.y eye.z verticalAngle horizontalAngle\n");
+    for (size_t i = 0; i < path.size(); i++)
+    {
+        fprintf(fout, "%.6f %.6f %.6f %.6f %.6f\n", path[i].eye.x, path[i].eye.y, path[i].eye.z,
+                path[i].verticalAngle, path[i].horizontalAngle);
+    }
+    fclose(fout);
+
+    return true;
+}
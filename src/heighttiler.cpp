@@ -0,0 +1,112 @@
+// Converter to tiled height maps (.htile), streamed by HeightStreamer.
+// The input is either an image (red channel, as texHeight), or a
+// synthetic map of any size, computed texel by texel so that a
+// 65536 x 65536 map never has to fit in memory.
+//
+// Usage:
+//   ./heighttiler -out file.htile [-in image.png | -synthetic n] [-tile n] [-threads n]
+#include "streaming.h"
+
+// ========================================================
+// Height of texel (x, y) of an n x n synthetic map,
+// a few octaves of waves, down to a period of 8 texels
+// ========================================================
+float getSyntheticHeight(int x, int y, int n)
+{
+    double u = double(x) / n, v = double(y) / n;
+    double h = 0.0, amplitude = 0.25;
+
+    for (int o = 1; o <= n / 8; o *= 2)
+    {
+        h += amplitude * std::sin(6.283185307 * o * u + o) * std::cos(6.283185307 * o * v - o);
+        amplitude *= 0.55;
+    }
+
+    return float(0.5 + h);
+}
+
+// ========================================================
+// Main function
+// ========================================================
+int main(int argc, char const *argv[])
+{
+    string inName, outName;
+    int syntheticSize = 0;
+    int tileSize = 256;
+    int nOfThreads = 0;
+
+    // Parse arguments
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "-in" && i + 1 < argc)
+        {
+            inName = argv[++i];
+        }
+        else if (arg == "-out" && i + 1 < argc)
+        {
+            outName = argv[++i];
+        }
+        else if (arg == "-synthetic" && i + 1 < argc)
+        {
+            syntheticSize = glm::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "-tile" && i + 1 < argc)
+        {
+            tileSize = atoi(argv[++i]);
+        }
+        else if (arg == "-threads" && i + 1 < argc)
+        {
+            nOfThreads = atoi(argv[++i]);
+        }
+        else
+        {
+            std::cout << "unknown argument : " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (outName.empty() || (inName.empty() == (syntheticSize == 0)))
+    {
+        std::cout << "usage: ./heighttiler -out file.htile [-in image.png | -synthetic n] [-tile n] [-threads n]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    bool isWritten;
+    int width, height;
+    if (syntheticSize > 0)
+    {
+        width = height = syntheticSize;
+        isWritten = writeHeightTiles(
+            outName, width, height, tileSize, [&](int x, int y) { return getSyntheticHeight(x, y, syntheticSize); },
+            nOfThreads);
+    }
+    else
+    {
+        HeightMap heightMap;
+        if (!heightMap.load(inName, FreeImage_GetFileType(inName.c_str(), 0)))
+        {
+            return EXIT_FAILURE;
+        }
+
+        width = heightMap.width;
+        height = heightMap.height;
+        isWritten = writeHeightTiles(
+            outName, width, height, tileSize, [&](int x, int y) { return heightMap.texel(x, y); }, nOfThreads);
+    }
+
+    if (!isWritten)
+    {
+        return EXIT_FAILURE;
+    }
+
+    auto endTime = std::chrono::steady_clock::now();
+    std::cout << outName << ": " << width << " x " << height << ", tiles of " << tileSize << "^2, "
+              << std::chrono::duration<double>(endTime - startTime).count() << " s" << std::endl;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+#include "lodcontrol.h"
+
+// ================================================
+// LodController class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor
+// Parameters:
+//   1. type: LOD_TARGET_GPU_TIME or LOD_TARGET_TRIANGLES
+//   2. value: target, in milliseconds or triangles per frame
+// Remarks: starts from lodScale 1, the levels of the metric
+// ---------------------------------------------------------
+LodController::LodController(int type, double value)
+{
+    targetType = type;
+    target = glm::max(value, 1e-3);
+    band = 0.1;
+    smoothing = 0.5;
+    minScale = 0.125f;
+    maxScale = 4.f;
+    maxStep = 1.25f;
+
+    scale = 1.f;
+    scaleFrame = 0;
+    isScalePending = false;
+
+    measure = 0.0;
+    isMeasureValid = false;
+
+    isAdjusting = false;
+    stepLimit = maxStep;
+    lastDirection = 0;
+    heldMeasure = 0.0;
+
+    nOfSamples = nOfStale = nOfInBand = nOfAdjustments = 0;
+    lowestScale = highestScale = scale;
+
+    log = NULL;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+LodController::~LodController()
+{
+    if (log != NULL)
+    {
+        fclose(log);
+    }
+}
+
+// ---------------------------------------------------------
+// Write the state after every sample to a CSV file
+// Parameters:
+//   fileName: output file
+// Return: false if the file cannot be written
+// ---------------------------------------------------------
+bool LodController::openLog(const string fileName)
+{
+    log = fopen(fileName.c_str(), "w");
+    if (log == NULL)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+
+    fprintf(log, "frame,measure,smoothed,target,scale,state\n");
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Get the scale of a frame, before its uniforms are updated
+// Parameters:
+//   frame: frame number, as GpuProfiler numbers it
+// Return: lodScale of the frame
+// ---------------------------------------------------------
+float LodController::beginFrame(size_t frame)
+{
+    if (isScalePending)
+    {
+        scaleFrame = frame;
+        isScalePending = false;
+    }
+
+    return scale;
+}
+
+// ---------------------------------------------------------
+// Update the scale with a profiled frame (GpuProfiler::onSample)
+// Parameters:
+//   sample: GPU time and counters of the frame
+// Remarks: the new scale is used from the next beginFrame
+// ---------------------------------------------------------
+void LodController::addSample(const ProfileSample &sample)
+{
+    // Drawn with an older scale
+    if (isScalePending || sample.frame < scaleFrame)
+    {
+        nOfStale++;
+        return;
+    }
+
+    double value =
+        (targetType == LOD_TARGET_GPU_TIME) ? sample.gpuTime : double(sample.counters[PROFILE_PRIMITIVES]);
+    measure = isMeasureValid ? measure + smoothing * (value - measure) : value;
+    isMeasureValid = true;
+    nOfSamples++;
+
+    double error = (measure - target) / target;
+    if (std::fabs(error) <= band)
+    {
+        nOfInBand++;
+    }
+
+    if (!isAdjusting)
+    {
+        // Not for a target the levels cannot reach, until the
+        // view changes
+        if (std::fabs(error) > band && std::fabs(measure - heldMeasure) > band * 0.5 * target)
+        {
+            isAdjusting = true;
+            stepLimit = maxStep;
+            lastDirection = 0;
+        }
+    }
+    else if (std::fabs(error) <= band * 0.5 || (stepLimit < 1.02f && error <= 0.0))
+    {
+        isAdjusting = false;
+        heldMeasure = measure;
+    }
+
+    if (isAdjusting)
+    {
+        // Nothing drawn: as far above as allowed
+        float step = (measure > 0.0) ? float(std::sqrt(target / measure)) : maxStep;
+        int direction = (step > 1.f) ? 1 : -1;
+        if (lastDirection != 0 && direction != lastDirection)
+        {
+            stepLimit = 1.f + (stepLimit - 1.f) * 0.5f;
+        }
+        lastDirection = direction;
+
+        float newScale = glm::clamp(scale * glm::clamp(step, 1.f / stepLimit, stepLimit), minScale, maxScale);
+        if (newScale != scale)
+        {
+            scale = newScale;
+            isScalePending = true;
+            isMeasureValid = false;
+            nOfAdjustments++;
+            lowestScale = glm::min(lowestScale, scale);
+            highestScale = glm::max(highestScale, scale);
+        }
+    }
+
+    if (log != NULL)
+    {
+        fprintf(log, "%zu,%.4f,%.4f,%.4f,%.4f,%s\n", sample.frame, value, measure, target, scale,
+                isAdjusting ? "adjusting" : "holding");
+    }
+}
+
+// ---------------------------------------------------------
+// Print the state and how well the target was held
+// ---------------------------------------------------------
+void LodController::printStats()
+{
+    const char *unit = (targetType == LOD_TARGET_GPU_TIME) ? " ms" : " triangles";
+
+    std::cout << "lod: scale " << scale << " (" << lowestScale << " to " << highestScale << "), target " << target
+              << unit << ", smoothed " << measure << unit << ", " << (isAdjusting ? "adjusting" : "holding") << '\n';
+    std::cout << "  " << nOfAdjustments << " adjustments, " << nOfInBand << " of " << nOfSamples
+              << " samples within " << band * 100.0 << "%, " << nOfStale << " skipped (older scale)" << std::endl;
+}
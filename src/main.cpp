@@ -1,15 +1,102 @@
-#include "common.h"
+#include "bench.h"
+#include "capture.h"
+#include "clipmap.h"
+#include "headless.h"
+#include "lodcontrol.h"
+#include "points.h"
+#include "profiler.h"
+#include "terrain.h"
 
 // Main window
 GLFWwindow *window;
 
+// GPU timer and pipeline statistics of the draws
+GpuProfiler *profiler = NULL;
+string profileName;
+
+// Linked shader programs saved between runs (empty means none saved)
+string programCacheName = "./shader/cache";
+
+// Per-frame uniforms shared by the programs, and multi-draw of
+// the terrain chunks and patch runs (OpenGL 4.3)
+FrameUniformBuffer *frameUniforms = NULL;
+bool isBatchOn = true;
+
+// Offscreen rendering of a camera path, instead of the window
+bool isHeadless = false;
+HeadlessContext headless;
+int frameWidth = WINDOW_WIDTH, frameHeight = WINDOW_HEIGHT;
+string cameraPathName;
+vector<CameraPose> cameraPath;
+
+// Frame-time benchmark of the camera path (0 measured frames means one pass)
+size_t nOfWarmupFrames = 0, nOfMeasuredFrames = 0;
+string benchName, baselineName;
+double benchThreshold = 5.0;
+
+// Poses of the interactive camera, saved on exit (empty means not saved)
+string recordPathName;
+vector<CameraPose> recordedPath;
+
 // Frame control
 bool saveTrigger = false;
-int frameNumber = 0;
+
+// Recording of the frames (Y)
+int captureFormat = CAPTURE_BMP;
+int captureThreads = 0;
+bool isCaptureOn = false;
+FrameCapture *capture = NULL;
 
 // The mesh used to perform tessellation
 Mesh *quad;
 
+// Procedural patch grid (0 means loading quad.obj)
+int gridWidth = 0, gridDepth = 0;
+int gridLayout = LAYOUT_INDEXED;
+
+// Per-patch frustum culling
+HeightMap heightMap;
+HeightPyramid heightPyramid;
+PatchCuller *culler;
+bool isCullingOn = true;
+
+// Culling and tessellation levels in a compute pass (LAYOUT_LISTED),
+// and occlusion culling against the depth of the last frame
+GpuPatchCuller *gpuCuller = NULL;
+DepthPyramid *depthPyramid = NULL;
+bool isHiZOn = false;
+
+// Filled triangles instead of the wireframe (F)
+bool isFillOn = false;
+
+// Tessellation metric
+HeightMap roughnessMap;
+HeightPyramid roughnessPyramid;
+int tessMetric = TESS_METRIC_SCREEN_ERROR;
+float pixelsPerTriangle = 64.f, maxPixelError = 350.f;
+bool isMeasureOn = false;
+
+// Levels scaled to hold a GPU time or a triangle count (no
+// target means the levels of the metric)
+LodController *lodController = NULL;
+int lodTargetType = -1;
+double lodTarget = 0.0, lodBand = 10.0;
+string lodLogName;
+
+// Clipmap of the height map read by quad (0 means texHeight)
+int clipSize = 0;
+size_t clipBudget = 64;
+HeightClipmap *clipmap = NULL;
+
+// CDLOD terrain drawn instead of quad (0 means no terrain)
+float terrainSize = 0.f;
+Terrain *terrain = NULL;
+
+// Tiled height map streamed for the terrain (empty means texHeight)
+string tilesName;
+size_t tileBudget = 256;
+HeightStreamer *streamer = NULL;
+
 // ================================================
 // Camera settings
 // ================================================
@@ -29,8 +116,7 @@ vec3 up = vec3(0.f, 1.f, 0.f);
 // Point light
 // ================================================
 vector<Point> pts;
-GLuint pointShader;
-GLint uniPointM, uniPointV, uniPointP;
+PointRenderer *pointRenderer = NULL;
 vec3 lightPosition = vec3(0, 4.f, 0);
 vec3 lightColor = vec3(1.f, 1.f, 1.f);
 
@@ -38,83 +124,508 @@ vec3 lightColor = vec3(1.f, 1.f, 1.f);
 // Member functions
 // ================================================
 void computeMatricesFromInputs();
+void setCameraPose(const CameraPose &);
+void getFramebufferSize(int &, int &);
+mat4 getViewMatrix(vec3, float, float);
+vec2 getQuadUv(mat4, vec3);
+void measurePrimitives();
 void keyCallback(GLFWwindow *, int, int, int, int);
 void init();
 void initGL();
+void initHeadlessGL();
+void initGLState();
+void initPrograms();
 void initOther();
 void initMatrix();
 void initQuad();
+void initTerrain();
 void initPointLight();
 void releaseResource();
 
 int main(int argc, char **argv)
 {
+    // Options
+    //   -grid nx nz: draw a procedural grid of nx * nz patches instead of quad.obj
+    //   -instanced: draw the grid without vertex buffers (LAYOUT_INSTANCED)
+    //   -nocull: draw every patch, even outside the view frustum
+    //   -gpucull: as -instanced, culling and tessellation levels in a compute pass (LAYOUT_LISTED)
+    //   -hiz: as -gpucull, and skip the patches hidden in the depth of the last frame
+    //   -fill: draw filled triangles instead of the wireframe (F toggles it)
+    //   -metric distance|error: tessellation metric (default: error)
+    //   -pixels n: target triangle edge on screen, in pixels (error metric)
+    //   -error n: tolerated height error on screen, in pixels (error metric)
+    //   -measure: print the primitives generated on fixed camera poses, then exit
+    //   -lodtarget ms|triangles n: scale the quad levels to hold n ms of GPU time or n triangles per frame
+    //   -lodband n: no change while within n percent of the target (default: 10)
+    //   -lodlog file.csv: write the state of the level controller at every profiled frame
+    //   -clipmap n: read quad heights from a clipmap of n x n texels per level
+    //   -clipbudget n: kilobytes uploaded to the clipmap per frame at most (default: 64)
+    //   -terrain size: draw a CDLOD terrain of size x size world units (one per texel)
+    //   -tiles file.htile: stream the terrain heights from a tiled height map (see heighttiler)
+    //   -budget n: megabytes of height tiles kept on the GPU (default: 256)
+    //   -capture bmp|png|raw|y4m: format of the frames recorded with Y (default: bmp)
+    //   -capturethreads n: threads encoding the recorded frames (default: one per core)
+    //   -headless path.txt: render the camera path offscreen (EGL), one pose per frame, then exit
+    //   -size w h: framebuffer size of -headless (default: 800 600)
+    //   -recordpath path.txt: save the poses of the interactive camera, one per frame
+    //   -profile file.csv: write the GPU time and pipeline statistics of every frame
+    //   -warmup n: frames of -headless before the measured ones (default: 0)
+    //   -frames n: measured frames of -headless, looping over the path (default: the path once)
+    //   -json file.json: write the frame time percentiles and triangle counts of -headless
+    //   -baseline file.json: compare with a previous -json result, fail if slower
+    //   -threshold n: tolerated slowdown against the baseline, in percent (default: 5)
+    //   -programcache dir|none: directory of the linked program binaries (default: ./shader/cache)
+    //   -nobatch: one draw call per terrain chunk or patch run, even with multi-draw indirect
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "-grid" && i + 2 < argc)
+        {
+            gridWidth = atoi(argv[++i]);
+            gridDepth = atoi(argv[++i]);
+        }
+        else if (arg == "-instanced")
+        {
+            gridLayout = LAYOUT_INSTANCED;
+        }
+        else if (arg == "-gpucull")
+        {
+            gridLayout = LAYOUT_LISTED;
+        }
+        else if (arg == "-hiz")
+        {
+            gridLayout = LAYOUT_LISTED;
+            isHiZOn = true;
+        }
+        else if (arg == "-fill")
+        {
+            isFillOn = true;
+        }
+        else if (arg == "-nocull")
+        {
+            isCullingOn = false;
+        }
+        else if (arg == "-metric" && i + 1 < argc)
+        {
+            string metric = argv[++i];
+            tessMetric = (metric == "distance") ? TESS_METRIC_DISTANCE : TESS_METRIC_SCREEN_ERROR;
+        }
+        else if (arg == "-pixels" && i + 1 < argc)
+        {
+            pixelsPerTriangle = glm::max(float(atof(argv[++i])), 0.1f);
+        }
+        else if (arg == "-error" && i + 1 < argc)
+        {
+            maxPixelError = glm::max(float(atof(argv[++i])), 0.01f);
+        }
+        else if (arg == "-measure")
+        {
+            isMeasureOn = true;
+        }
+        else if (arg == "-lodtarget" && i + 2 < argc)
+        {
+            string type = argv[++i];
+            lodTargetType = (type == "triangles") ? LOD_TARGET_TRIANGLES : LOD_TARGET_GPU_TIME;
+            lodTarget = glm::max(atof(argv[++i]), 0.0);
+        }
+        else if (arg == "-lodband" && i + 1 < argc)
+        {
+            lodBand = glm::clamp(atof(argv[++i]), 1.0, 100.0);
+        }
+        else if (arg == "-lodlog" && i + 1 < argc)
+        {
+            lodLogName = argv[++i];
+        }
+        else if (arg == "-clipmap" && i + 1 < argc)
+        {
+            clipSize = glm::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "-clipbudget" && i + 1 < argc)
+        {
+            clipBudget = size_t(glm::max(atoi(argv[++i]), 1));
+        }
+        else if (arg == "-terrain" && i + 1 < argc)
+        {
+            terrainSize = glm::max(float(atof(argv[++i])), 0.f);
+
+            // Above the hills, faster, and seeing farther
+            eyePoint.y = 30.f;
+            speed = 50.f;
+            nearPlane = 0.1f;
+            farPlane = 20000.f;
+        }
+        else if (arg == "-tiles" && i + 1 < argc)
+        {
+            tilesName = argv[++i];
+
+            eyePoint.y = 30.f;
+            speed = 50.f;
+            nearPlane = 0.1f;
+            farPlane = 20000.f;
+        }
+        else if (arg == "-budget" && i + 1 < argc)
+        {
+            tileBudget = size_t(glm::max(atoi(argv[++i]), 1));
+        }
+        else if (arg == "-capture" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            isCaptureOn = true;
+            captureFormat = (name == "png")   ? CAPTURE_PNG
+                            : (name == "raw") ? CAPTURE_RAW
+                            : (name == "y4m") ? CAPTURE_Y4M
+                                              : CAPTURE_BMP;
+        }
+        else if (arg == "-capturethreads" && i + 1 < argc)
+        {
+            captureThreads = glm::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "-headless" && i + 1 < argc)
+        {
+            isHeadless = true;
+            cameraPathName = argv[++i];
+        }
+        else if (arg == "-size" && i + 2 < argc)
+        {
+            frameWidth = glm::max(atoi(argv[++i]), 1);
+            frameHeight = glm::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-recordpath" && i + 1 < argc)
+        {
+            recordPathName = argv[++i];
+        }
+        else if (arg == "-profile" && i + 1 < argc)
+        {
+            profileName = argv[++i];
+        }
+        else if (arg == "-warmup" && i + 1 < argc)
+        {
+            nOfWarmupFrames = size_t(glm::max(atoi(argv[++i]), 0));
+        }
+        else if (arg == "-frames" && i + 1 < argc)
+        {
+            nOfMeasuredFrames = size_t(glm::max(atoi(argv[++i]), 0));
+        }
+        else if (arg == "-json" && i + 1 < argc)
+        {
+            benchName = argv[++i];
+        }
+        else if (arg == "-baseline" && i + 1 < argc)
+        {
+            baselineName = argv[++i];
+        }
+        else if (arg == "-threshold" && i + 1 < argc)
+        {
+            benchThreshold = glm::max(atof(argv[++i]), 0.0);
+        }
+        else if (arg == "-programcache" && i + 1 < argc)
+        {
+            programCacheName = argv[++i];
+            if (programCacheName == "none")
+            {
+                programCacheName = "";
+            }
+        }
+        else if (arg == "-nobatch")
+        {
+            isBatchOn = false;
+        }
+    }
+
+    // The camera path is read before any context is created
+    if (isHeadless && !loadCameraPath(cameraPathName, cameraPath))
+    {
+        return EXIT_FAILURE;
+    }
+    if (nOfMeasuredFrames == 0)
+    {
+        nOfMeasuredFrames = cameraPath.size();
+    }
+
     // Initialize everything
     init();
 
-    // A rough way to solve cursor position initialization problem
-    // Must call glfwPollEvents once to activate glfwSetCursorPos
-    // This is a glfw mechanism problem
-    glfwPollEvents();
-    glfwSetCursorPos(window, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
+    // Fixed camera poses instead of the interactive loop
+    size_t nOfFrames = 0;
+    if (isMeasureOn)
+    {
+        measurePrimitives();
+        if (!isHeadless)
+        {
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+        }
+        cameraPath.clear();
+        nOfWarmupFrames = nOfMeasuredFrames = 0;
+    }
+
+    // Times of the frames of the camera path
+    FrameBench bench;
+    if (isHeadless)
+    {
+        // Every frame is recorded, none dropped
+        saveTrigger = isCaptureOn;
+        capture->isBlocking = true;
+
+        bench.nOfWarmupFrames = nOfWarmupFrames;
+    }
+    else
+    {
+        // A rough way to solve cursor position initialization problem
+        // Must call glfwPollEvents once to activate glfwSetCursorPos
+        // This is a glfw mechanism problem
+        glfwPollEvents();
+        glfwSetCursorPos(window, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
+    }
 
-    // Show main window
-    while (!glfwWindowShouldClose(window))
+    // Profiled frames go to the benchmark and the level controller
+    profiler->onSample = [&](const ProfileSample &sample) {
+        if (isHeadless)
+        {
+            bench.addSample(sample);
+        }
+        if (lodController != NULL)
+        {
+            lodController->addSample(sample);
+        }
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // Show main window, or go through the camera path
+    while (isHeadless ? nOfFrames < nOfWarmupFrames + nOfMeasuredFrames : !glfwWindowShouldClose(window))
     {
+        auto frameStartTime = std::chrono::steady_clock::now();
+
         // Clear frame
         glClearColor(0.f, 0.f, 0.4f, 0.f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        // View control
-        computeMatricesFromInputs();
+        // View control, the path is replayed at one pose per frame
+        if (isHeadless)
+        {
+            setCameraPose(cameraPath[nOfFrames % cameraPath.size()]);
+        }
+        else
+        {
+            computeMatricesFromInputs();
+            if (!recordPathName.empty())
+            {
+                recordedPath.push_back({eyePoint, verticalAngle, horizontalAngle});
+            }
+        }
+        float lodScale = (lodController != NULL) ? lodController->beginFrame(profiler->frame) : 1.f;
+        frameUniforms->update(view, projection, eyePoint, lightColor, lightPosition, lodScale);
 
         // Compute transformation matrices for quad
         mat4 tempModel = translate(mat4(1.f), vec3(0.f, 0.f, 0.f));
         // tempModel = rotate(tempModel, -3.14f / 2.0f, vec3(1, 0, 0));
         tempModel = scale(tempModel, vec3(10, 10, 10));
 
-        // Draw quad
-        quad->draw(tempModel, view, projection, eyePoint, lightColor, lightPosition, 15);
+        // Draw the terrain chunks needed for this view
+        if (terrain != NULL)
+        {
+            if (streamer != NULL)
+            {
+                streamer->update(vec2(eyePoint.x, -eyePoint.z) / terrain->texelSize);
+            }
+            terrain->select(view, projection, eyePoint);
+            profiler->begin();
+            terrain->draw(15);
+            profiler->end();
+        }
+        // Draw the patches listed by the compute pass
+        else if (gpuCuller != NULL)
+        {
+            if (clipmap != NULL)
+            {
+                clipmap->update(getQuadUv(tempModel, eyePoint));
+                clipmap->setUniform();
+            }
+            profiler->begin();
+            gpuCuller->update(tempModel, view, projection, isCullingOn);
+            quad->drawIndirect(tempModel, 15, gpuCuller->commandBuffer);
 
-        // Draw point light
-        glUseProgram(pointShader);
-        glUniformMatrix4fv(uniPointM, 1, GL_FALSE, value_ptr(model));
-        glUniformMatrix4fv(uniPointV, 1, GL_FALSE, value_ptr(view));
-        glUniformMatrix4fv(uniPointP, 1, GL_FALSE, value_ptr(projection));
-        drawPoints(pts);
+            // Depth of this frame, for the occlusion test of the next one
+            if (depthPyramid != NULL)
+            {
+                int fbWidth, fbHeight;
+                getFramebufferSize(fbWidth, fbHeight);
+                depthPyramid->build(projection * view, fbWidth, fbHeight);
+            }
+            profiler->end();
+        }
+        // Draw quad, only the patches inside the view frustum
+        else if (isCullingOn)
+        {
+            if (clipmap != NULL)
+            {
+                clipmap->update(getQuadUv(tempModel, eyePoint));
+                clipmap->setUniform();
+            }
+            culler->update(tempModel, view, projection);
+            profiler->begin();
+            quad->draw(tempModel, 15, &culler->runs);
+            profiler->end();
+        }
+        else
+        {
+            if (clipmap != NULL)
+            {
+                clipmap->update(getQuadUv(tempModel, eyePoint));
+                clipmap->setUniform();
+            }
+            profiler->begin();
+            quad->draw(tempModel, 15);
+            profiler->end();
+        }
+
+        // Culling statistics of this frame, and the GPU time
+        // of the draws (refreshed twice a second)
+        static size_t lastDrawn = ~size_t(0);
+        static double lastTitleTime = 0.0;
+        size_t nOfDrawn = (terrain != NULL) ? terrain->chunks.size()
+                                            : (isCullingOn ? culler->nOfDrawn : culler->nOfPatches);
+        if (gpuCuller != NULL)
+        {
+            // Only known on the GPU, read back with the title
+            nOfDrawn = lastDrawn;
+        }
+        if (!isHeadless && (nOfDrawn != lastDrawn || glfwGetTime() - lastTitleTime > 0.5))
+        {
+            if (gpuCuller != NULL)
+            {
+                gpuCuller->readStats();
+                nOfDrawn = gpuCuller->nOfDrawn;
+            }
+
+            const ProfileSample *sample = profiler->getLastSample();
+            double gpuTime = (sample != NULL) ? sample->gpuTime : 0.0;
+
+            char title[160];
+            if (terrain != NULL)
+            {
+                snprintf(title, sizeof(title), "With normal mapping - chunks: %zu, patches: %zu, gpu: %.2f ms",
+                         nOfDrawn, terrain->getNumPatches(), gpuTime);
+            }
+            else
+            {
+                snprintf(title, sizeof(title),
+                         "With normal mapping - patches drawn: %zu, culled: %zu, gpu: %.2f ms", nOfDrawn,
+                         culler->nOfPatches - nOfDrawn, gpuTime);
+            }
+            glfwSetWindowTitle(window, title);
+            lastDrawn = nOfDrawn;
+            lastTitleTime = glfwGetTime();
+        }
+
+        // Draw point light (and any point added during the frame)
+        pointRenderer->add(pts);
+        pointRenderer->flush(model, view, projection);
+
+        // Graph of the GPU time and of the work of each stage
+        profiler->drawOverlay();
+
+        // Record frame, read back a few frames later
+        if (saveTrigger)
+        {
+            int fbWidth, fbHeight;
+            getFramebufferSize(fbWidth, fbHeight);
+            capture->readFrame(fbWidth, fbHeight);
+        }
+        capture->poll();
+
+        if (isHeadless)
+        {
+            // Nothing to swap, the frame is over when the GPU is done
+            auto submitTime = std::chrono::steady_clock::now();
+            glFinish();
+            auto frameEndTime = std::chrono::steady_clock::now();
+
+            // The frame is done, its counters can be read without waiting
+            if (gpuCuller != NULL)
+            {
+                gpuCuller->readStats();
+            }
+
+            bench.addFrame(nOfFrames, std::chrono::duration<double, std::milli>(submitTime - frameStartTime).count(),
+                           std::chrono::duration<double, std::milli>(frameEndTime - frameStartTime).count());
+            nOfFrames++;
+            continue;
+        }
 
         // Update frame
         glfwSwapBuffers(window);
 
         // Handle events
         glfwPollEvents();
+    }
 
-        // Save frame
-        if (saveTrigger)
+    // Results of the camera path, the last frame is done (glFinish)
+    bool isBenchPassed = true;
+    if (isHeadless && nOfFrames > 0)
+    {
+        auto endTime = std::chrono::steady_clock::now();
+        std::cout << "headless: " << nOfFrames << " frames in "
+                  << std::chrono::duration<double>(endTime - startTime).count() << " s" << '\n';
+
+        profiler->collect();
+        profiler->printStats();
+        bench.print();
+        if (gpuCuller != NULL)
         {
-            string dir = "./result/output";
-            // Zero padding
-            // e.g. "output0001.bmp"
-            string num = to_string(frameNumber);
-            num = string(4 - num.length(), '0') + num;
-            string output = dir + num + ".bmp";
+            gpuCuller->printStats();
+        }
+        if (lodController != NULL)
+        {
+            lodController->printStats();
+        }
+        std::cout << "draw calls: " << double(drawCounters.nOfDrawCalls) / nOfFrames
+                  << " per frame, uniform updates: " << double(drawCounters.nOfStateChanges) / nOfFrames
+                  << " per frame" << '\n';
 
-            // Must use WINDOW_WIDTH * 2 and WINDOW_HEIGHT * 2 on macOS, don't know why
-            FIBITMAP *outputImage = FreeImage_AllocateT(FIT_UINT32, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2);
-            glReadPixels(0, 0, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
-                         (GLvoid *)FreeImage_GetBits(outputImage));
-            FreeImage_Save(FIF_BMP, outputImage, output.c_str(), 0);
-            std::cout << output << " saved." << '\n';
-            frameNumber++;
+        if (!benchName.empty())
+        {
+            int fbWidth, fbHeight;
+            getFramebufferSize(fbWidth, fbHeight);
+            bench.writeJson(benchName, (const char *)glGetString(GL_RENDERER), fbWidth, fbHeight);
+        }
+        if (!baselineName.empty())
+        {
+            isBenchPassed = bench.compare(baselineName, benchThreshold);
         }
     }
+    if (!recordPathName.empty() && saveCameraPath(recordPathName, recordedPath))
+    {
+        std::cout << recordPathName << ": " << recordedPath.size() << " poses saved" << std::endl;
+    }
 
     // Release resources
-    glfwTerminate();
+    delete capture;
+    delete profiler;
+    delete pointRenderer;
+    delete frameUniforms;
+    delete gpuCuller;
+    delete depthPyramid;
+    delete lodController;
+    delete programCache;
+    programCache = NULL;
+    if (isHeadless)
+    {
+        headless.destroy();
+    }
+    else
+    {
+        glfwTerminate();
+    }
     FreeImage_DeInitialise();
+    delete terrain;
+    delete streamer;
+    delete clipmap;
+    delete culler;
     delete quad;
 
-    return EXIT_SUCCESS;
+    return isBenchPassed ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 // =======================================================
@@ -149,9 +660,6 @@ void computeMatricesFromInputs()
     // Right vector
     vec3 right = vec3(cos(horizontalAngle - 3.14 / 2.f), 0.f, sin(horizontalAngle - 3.14 / 2.f));
 
-    // New up vector
-    vec3 newUp = cross(right, direction);
-
     // Move forward
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
     {
@@ -174,13 +682,154 @@ void computeMatricesFromInputs()
     }
 
     // Update transformation matrices
-    projection = perspective(initialFoV, 1.f * WINDOW_WIDTH / WINDOW_HEIGHT, nearPlane, farPlane);
-    view = lookAt(eyePoint, eyePoint + direction, newUp);
+    projection = perspective(initialFoV, 1.f * frameWidth / frameHeight, nearPlane, farPlane);
+    view = getViewMatrix(eyePoint, verticalAngle, horizontalAngle);
 
     // For the next frame, the "last time" will be "now"
     lastTime = currentTime;
 }
 
+// =======================================================
+// Recompute transformation matrices from a pose of the
+// camera path (-headless)
+// Parameters:
+//   pose: eye point and angles of this frame
+// =======================================================
+void setCameraPose(const CameraPose &pose)
+{
+    eyePoint = pose.eye;
+    verticalAngle = pose.verticalAngle;
+    horizontalAngle = pose.horizontalAngle;
+
+    projection = perspective(initialFoV, 1.f * frameWidth / frameHeight, nearPlane, farPlane);
+    view = getViewMatrix(eyePoint, verticalAngle, horizontalAngle);
+}
+
+// =======================================================
+// Get the size of the framebuffer drawn into
+// Parameters:
+//   1. width: width, in pixels
+//   2. height: height, in pixels
+// Remarks: the framebuffer of the window is twice its
+//   size on retina displays
+// =======================================================
+void getFramebufferSize(int &width, int &height)
+{
+    if (isHeadless)
+    {
+        width = headless.width;
+        height = headless.height;
+    }
+    else
+    {
+        glfwGetFramebufferSize(window, &width, &height);
+    }
+}
+
+// =======================================================
+// Compute the view matrix of a camera
+// Parameters:
+//   1. eye: eye point
+//   2. vAngle, hAngle: vertical and horizontal angles
+// Return: view matrix
+// =======================================================
+mat4 getViewMatrix(vec3 eye, float vAngle, float hAngle)
+{
+    // Same conventions as computeMatricesFromInputs
+    vec3 direction = vec3(sin(vAngle) * cos(hAngle), cos(vAngle), sin(vAngle) * sin(hAngle));
+    vec3 right = vec3(cos(hAngle - 3.14 / 2.f), 0.f, sin(hAngle - 3.14 / 2.f));
+    vec3 newUp = cross(right, direction);
+
+    return lookAt(eye, eye + direction, newUp);
+}
+
+// =======================================================
+// Compute the uv of quad under a point
+// Parameters:
+//   1. M: model matrix of quad
+//   2. p: world position
+// Return: uv, as in quad.obj and Mesh::createGrid
+// =======================================================
+vec2 getQuadUv(mat4 M, vec3 p)
+{
+    vec3 local = vec3(inverse(M) * vec4(p, 1.f));
+
+    return vec2((local.x + 1.f) * 0.5f, (1.f - local.z) * 0.5f);
+}
+
+// =======================================================
+// Count the primitives generated by the tessellator
+// on fixed camera poses, with both tessellation metrics
+// Remarks: GL_PRIMITIVES_GENERATED counts the triangles
+//   coming out of the tessellator (there is no geometry
+//   shader), after frustum culling if it is on
+// =======================================================
+void measurePrimitives()
+{
+    // Eye point, vertical angle, horizontal angle
+    const float poses[4][5] = {
+        {-0.558788f, 2.681102f, 1.797832f, -2.07063f, 2.12426f}, // default camera
+        {0.f, 15.f, 15.f, 2.356f, -1.5708f},                     // overview, 45 degrees down
+        {0.f, 30.f, 0.01f, 3.1f, 0.f},                           // top view
+        {20.f, 8.f, 20.f, 1.855f, -2.356f},                      // far corner
+    };
+    const int metrics[2] = {TESS_METRIC_DISTANCE, TESS_METRIC_SCREEN_ERROR};
+
+    mat4 tempModel = scale(mat4(1.f), vec3(10, 10, 10));
+    projection = perspective(initialFoV, 1.f * frameWidth / frameHeight, nearPlane, farPlane);
+
+    GLuint query;
+    glGenQueries(1, &query);
+
+    std::cout << "pixelsPerTriangle: " << pixelsPerTriangle << ", maxPixelError: " << maxPixelError << '\n';
+
+    for (int p = 0; p < 4; p++)
+    {
+        vec3 eye = vec3(poses[p][0], poses[p][1], poses[p][2]);
+        view = getViewMatrix(eye, poses[p][3], poses[p][4]);
+        frameUniforms->update(view, projection, eye, lightColor, lightPosition,
+                              (lodController != NULL) ? lodController->scale : 1.f);
+
+        if (clipmap != NULL)
+        {
+            clipmap->reset(getQuadUv(tempModel, eye));
+            clipmap->setUniform();
+        }
+
+        GLuint nOfPrimitives[2];
+        for (int m = 0; m < 2; m++)
+        {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            quad->tessMetric = metrics[m];
+
+            glBeginQuery(GL_PRIMITIVES_GENERATED, query);
+            if (gpuCuller != NULL)
+            {
+                gpuCuller->update(tempModel, view, projection, isCullingOn);
+                quad->drawIndirect(tempModel, 15, gpuCuller->commandBuffer);
+            }
+            else if (isCullingOn)
+            {
+                culler->update(tempModel, view, projection);
+                quad->draw(tempModel, 15, &culler->runs);
+            }
+            else
+            {
+                quad->draw(tempModel, 15);
+            }
+            glEndQuery(GL_PRIMITIVES_GENERATED);
+
+            glGetQueryObjectuiv(query, GL_QUERY_RESULT, &nOfPrimitives[m]);
+        }
+
+        std::cout << "pose " << p << ": distance " << nOfPrimitives[0] << ", screen error " << nOfPrimitives[1]
+                  << " primitives (" << 100.0 * nOfPrimitives[1] / glm::max(nOfPrimitives[0], 1u) << "%)" << '\n';
+    }
+
+    glDeleteQueries(1, &query);
+    quad->tessMetric = tessMetric;
+}
+
 // ===================================================================
 // Keyboard callback function
 // - GLFW keyboard callback reference:
@@ -205,13 +854,74 @@ void keyCallback(GLFWwindow *keyWnd, int key, int scancode, int action, int mods
                 std::cout << "eyePoint: " << to_string(eyePoint) << '\n';
                 std::cout << "verticleAngle: " << fmod(verticalAngle, 6.28f) << ", "
                           << "horizontalAngle: " << fmod(horizontalAngle, 6.28f) << endl;
+                if (gpuCuller != NULL)
+                {
+                    gpuCuller->readStats();
+                    gpuCuller->printStats();
+                }
+                else
+                {
+                    culler->printStats();
+                }
+                if (terrain != NULL)
+                {
+                    terrain->printStats();
+                }
+                if (streamer != NULL)
+                {
+                    streamer->printStats();
+                }
+                if (clipmap != NULL)
+                {
+                    clipmap->printStats();
+                }
+                profiler->printStats();
+                if (lodController != NULL)
+                {
+                    lodController->printStats();
+                }
+                std::cout << "draw calls: " << drawCounters.nOfDrawCalls
+                          << ", uniform updates: " << drawCounters.nOfStateChanges << " since start" << endl;
+                break;
+            }
+            // P: GPU profiler overlay on/off
+            case GLFW_KEY_P:
+            {
+                profiler->isOverlayOn = !profiler->isOverlayOn;
+                break;
+            }
+            // T: tessellation metric (distance bands / screen-space error)
+            case GLFW_KEY_T:
+            {
+                quad->tessMetric = (quad->tessMetric == TESS_METRIC_DISTANCE) ? TESS_METRIC_SCREEN_ERROR
+                                                                              : TESS_METRIC_DISTANCE;
+                std::cout << "tessellation metric: "
+                          << (quad->tessMetric == TESS_METRIC_DISTANCE ? "distance" : "screen error") << endl;
+                break;
+            }
+            // F: filled triangles / wireframe
+            case GLFW_KEY_F:
+            {
+                isFillOn = !isFillOn;
+                glPolygonMode(GL_FRONT_AND_BACK, isFillOn ? GL_FILL : GL_LINE);
+                break;
+            }
+            // C: frustum culling on/off
+            case GLFW_KEY_C:
+            {
+                isCullingOn = !isCullingOn;
+                std::cout << "frustum culling: " << (isCullingOn ? "on" : "off") << endl;
                 break;
             }
-            // Y: save frame on/off
+            // Y: record frames on/off
             case GLFW_KEY_Y:
             {
                 saveTrigger = !saveTrigger;
-                frameNumber = 0;
+                std::cout << "recording: " << (saveTrigger ? "on" : "off") << endl;
+                if (!saveTrigger)
+                {
+                    capture->printStats();
+                }
                 break;
             }
             default:
@@ -228,6 +938,16 @@ void init()
     // OpenGL context
     initGL();
 
+    // The compute pass of LAYOUT_LISTED needs OpenGL 4.3
+    if (gridLayout == LAYOUT_LISTED && !GpuPatchCuller::isSupported())
+    {
+        std::cout << "-gpucull: no OpenGL 4.3, patches are culled on the CPU" << std::endl;
+        gridLayout = LAYOUT_INSTANCED;
+    }
+
+    // Shader programs, compiled concurrently or loaded from the cache
+    initPrograms();
+
     // Third-party libraries
     initOther();
 
@@ -239,10 +959,25 @@ void init()
 
     // Initialize transformation matrices
     initMatrix();
+
+    // Initialize terrain
+    initTerrain();
+
+    programCache->printStats();
 }
 
 void initGL()
 {
+    if (isHeadless)
+    {
+        initHeadlessGL();
+        return;
+    }
+
+    // The window decides the size of the frames
+    frameWidth = WINDOW_WIDTH;
+    frameHeight = WINDOW_HEIGHT;
+
     // Initialise GLFW
     if (!glfwInit())
     {
@@ -287,6 +1022,43 @@ void initGL()
         exit(EXIT_FAILURE);
     }
 
+    initGLState();
+}
+
+// ================================================
+// Initialize an offscreen context (-headless)
+// ================================================
+void initHeadlessGL()
+{
+    // Tessellation shaders need OpenGL 4.0, 4.1 is the
+    // latest one on macOS, as with the window
+    if (!headless.create(4, 1))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Without a GLX display (EGL), GLEW stops after loading
+    // the core functions, which is all this program needs
+    glewExperimental = GL_TRUE;
+    GLenum status = glewInit();
+    if (status != GLEW_OK && status != GLEW_ERROR_NO_GLX_DISPLAY)
+    {
+        fprintf(stderr, "Failed to initialize GLEW\n");
+        exit(EXIT_FAILURE);
+    }
+
+    headless.initFramebuffer(frameWidth, frameHeight);
+    std::cout << "headless: " << (const char *)glGetString(GL_RENDERER) << ", " << frameWidth << " x "
+              << frameHeight << ", " << nOfWarmupFrames + nOfMeasuredFrames << " frames" << std::endl;
+
+    initGLState();
+}
+
+// ================================================
+// Set the pipeline state shared by both contexts
+// ================================================
+void initGLState()
+{
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST); // must enable depth test!!
 
@@ -296,7 +1068,48 @@ void initGL()
     // to enable tessellation
     glPatchParameteri(GL_PATCH_VERTICES, 4);
 
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    glPolygonMode(GL_FRONT_AND_BACK, isFillOn ? GL_FILL : GL_LINE);
+}
+
+// ================================================
+// Submit every shader program of the run at once
+// ================================================
+void initPrograms()
+{
+    programCache = new ProgramCache();
+    programCache->init(programCacheName);
+
+    // Uniforms shared by the programs, bound once
+    frameUniforms = new FrameUniformBuffer();
+    frameUniforms->init();
+
+    // The programs buildShader will ask for, in any order:
+    // they compile while the meshes and textures are loaded
+    programCache->submit("./shader/vsOverlay.glsl", "./shader/fsOverlay.glsl");
+    programCache->submit("./shader/vsPoint.glsl", "./shader/fsPoint.glsl");
+
+    bool isQuadGrid = gridWidth > 0 && gridDepth > 0;
+    if (isQuadGrid && gridLayout == LAYOUT_LISTED)
+    {
+        programCache->submit("./shader/vsPhongListed.glsl", "./shader/fsPhong.glsl", "./shader/tcsQuadListed.glsl",
+                             "./shader/tesQuad.glsl");
+    }
+    else
+    {
+        bool isQuadInstanced = isQuadGrid && gridLayout == LAYOUT_INSTANCED;
+        programCache->submit(isQuadInstanced ? "./shader/vsPhongInstanced.glsl" : "./shader/vsPhong.glsl",
+                             "./shader/fsPhong.glsl", "./shader/tcsQuad.glsl", "./shader/tesQuad.glsl");
+    }
+
+    // The terrain draws an instanced patch grid, with its own program
+    if (terrainSize > 0.f || !tilesName.empty())
+    {
+        programCache->submit("./shader/vsPhongInstanced.glsl", "./shader/fsPhong.glsl", "./shader/tcsQuad.glsl",
+                             "./shader/tesQuad.glsl");
+        bool isTerrainBatched = isBatchOn && DrawBatch::isSupported();
+        programCache->submit(isTerrainBatched ? "./shader/vsTerrainBatched.glsl" : "./shader/vsTerrain.glsl",
+                             "./shader/fsPhong.glsl", "./shader/tcsTerrain.glsl", "./shader/tesTerrain.glsl");
+    }
 }
 
 // ================================================
@@ -306,6 +1119,39 @@ void initOther()
 {
     // FreeImage
     FreeImage_Initialise(true);
+
+    // Frame recording, files in ./result
+    capture = new FrameCapture();
+    capture->open("./result/output", captureFormat, captureThreads);
+
+    // GPU profiler, the overlay stays out of headless frames
+    profiler = new GpuProfiler();
+    profiler->init();
+    profiler->initOverlay();
+    profiler->isOverlayOn = !isHeadless;
+    if (!profileName.empty())
+    {
+        profiler->openCsv(profileName);
+    }
+
+    // Level controller, fed by the profiler; the terrain picks
+    // its own levels per chunk
+    if (lodTargetType >= 0)
+    {
+        if (terrainSize > 0.f || !tilesName.empty())
+        {
+            std::cout << "-lodtarget: ignored with -terrain" << std::endl;
+        }
+        else
+        {
+            lodController = new LodController(lodTargetType, lodTarget);
+            lodController->band = lodBand * 0.01;
+            if (!lodLogName.empty())
+            {
+                lodController->openLog(lodLogName);
+            }
+        }
+    }
 }
 
 // ================================================
@@ -319,14 +1165,9 @@ void initPointLight()
     p.color = vec3(1.f);
     pts.push_back(p);
 
-    // Set point light shader
-    pointShader = buildShader("./shader/vsPoint.glsl", "./shader/fsPoint.glsl", "", "");
-
-    // Set uniforms
-    glUseProgram(pointShader);
-    uniPointM = myGetUniformLocation(pointShader, "M");
-    uniPointV = myGetUniformLocation(pointShader, "V");
-    uniPointP = myGetUniformLocation(pointShader, "P");
+    // Points are drawn in a single batch per frame
+    pointRenderer = new PointRenderer();
+    pointRenderer->init();
 }
 
 // ================================================
@@ -336,7 +1177,7 @@ void initMatrix()
 {
     model = translate(mat4(1.f), vec3(0.f, 0.f, 0.f));
     view = lookAt(eyePoint, eyeDirection, up);
-    projection = perspective(initialFoV, 1.f * WINDOW_WIDTH / WINDOW_HEIGHT, nearPlane, farPlane);
+    projection = perspective(initialFoV, 1.f * frameWidth / frameHeight, nearPlane, farPlane);
 }
 
 // ================================================
@@ -344,9 +1185,124 @@ void initMatrix()
 // ================================================
 void initQuad()
 {
-    // Load mesh
-    quad = new Mesh("./mesh/quad.obj", QUAD);
+    // Load mesh, or build the patch grid in memory
+    if (gridWidth > 0 && gridDepth > 0)
+    {
+        quad = Mesh::createGrid(gridWidth, gridDepth, gridLayout);
+    }
+    else
+    {
+        quad = new Mesh("./mesh/quad.obj", QUAD, LAYOUT_INDEXED);
+    }
+
+    // Patch runs of the culler in one multi-draw
+    quad->isBatched = isBatchOn && DrawBatch::isSupported();
 
     // Set height map
-    quad->setTexture(quad->tboHeight, 15, "./res/height.png", FIF_PNG);
+    quad->setHeightTexture(quad->tboHeight, 15, "./res/height.png", FIF_PNG);
+
+    // Height range of each patch, from the same image
+    heightMap.load("./res/height.png", FIF_PNG);
+    heightPyramid.build(heightMap);
+    culler = new PatchCuller(*quad, &heightPyramid);
+
+    // Roughness of the height map, read by tcsQuad.glsl
+    computeRoughness(heightMap, roughnessMap);
+    roughnessPyramid.build(roughnessMap);
+    roughnessPyramid.setTexture(quad->tboRoughness, 14);
+    glUseProgram(quad->shader);
+    glUniform1i(quad->uniTexRoughness, 14);
+
+    // Culling and levels of LAYOUT_LISTED, on the GPU
+    if (quad->layout == LAYOUT_LISTED)
+    {
+        gpuCuller = new GpuPatchCuller(*culler);
+        if (!gpuCuller->init(15, 14))
+        {
+            std::cout << "Failed to build the culling pass." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        // Filled after the first frame
+        if (isHiZOn)
+        {
+            depthPyramid = new DepthPyramid();
+            if (!depthPyramid->init())
+            {
+                std::cout << "Failed to build the depth pyramid." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            gpuCuller->depthPyramid = depthPyramid;
+        }
+    }
+
+    // Clipmap of the height map, filled around the eye point
+    // (same model matrix as in the main loop)
+    if (clipSize > 0)
+    {
+        clipmap = new HeightClipmap();
+        if (clipmap->build(heightMap, clipSize))
+        {
+            clipmap->maxTexelsPerUpdate = clipBudget * 1024 / sizeof(float);
+            clipmap->initTexture(CLIPMAP_UNIT);
+            clipmap->initUniform(quad->shader);
+            clipmap->reset(getQuadUv(scale(mat4(1.f), vec3(10, 10, 10)), eyePoint));
+            clipmap->setUniform();
+        }
+        else
+        {
+            delete clipmap;
+            clipmap = NULL;
+        }
+    }
+
+    // Tessellation metric, in framebuffer pixels
+    int fbWidth, fbHeight;
+    getFramebufferSize(fbWidth, fbHeight);
+    quad->tessMetric = tessMetric;
+    quad->viewport = vec2(fbWidth, fbHeight);
+    quad->pixelsPerTriangle = pixelsPerTriangle;
+    quad->maxPixelError = maxPixelError;
+}
+
+// ================================================
+// Initialize terrain
+// ================================================
+void initTerrain()
+{
+    // A streamed map covers the terrain once by default
+    if (!tilesName.empty())
+    {
+        streamer = new HeightStreamer();
+        if (!streamer->open(tilesName, tileBudget * 1024 * 1024))
+        {
+            delete streamer;
+            streamer = NULL;
+        }
+        else if (terrainSize <= 0.f)
+        {
+            terrainSize = float(streamer->header.width);
+        }
+    }
+
+    if (terrainSize <= 0.f)
+    {
+        return;
+    }
+
+    // Shares texHeight (unit 15) and its pyramid with quad
+    terrain = new Terrain(&heightPyramid, terrainSize);
+    terrain->isBatched = isBatchOn;
+    terrain->initShader();
+    terrain->initUniform();
+
+    if (streamer != NULL)
+    {
+        streamer->initTextures(STREAM_UNIT_TILES, STREAM_UNIT_INDIRECTION, STREAM_UNIT_OVERVIEW);
+        terrain->setStreamer(streamer);
+    }
+
+    int fbWidth, fbHeight;
+    getFramebufferSize(fbWidth, fbHeight);
+    terrain->initRanges(projection, vec2(fbWidth, fbHeight));
 }
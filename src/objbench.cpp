@@ -0,0 +1,224 @@
+// Benchmark of the .obj loader.
+// It writes a synthetic terrain (a grid of quad faces) and compares
+// Mesh::loadObjQuad with the former ifstream token loop.
+// With -weld, it also reports the memory saved by LAYOUT_INDEXED
+// (e.g. -faces 262144 -weld for a 512x512 patch grid).
+//
+// Usage:
+//   ./objbench [-faces n] [-file synthetic.obj] [-repeat n] [-weld]
+#include "common.h"
+
+// ========================================================
+// Write a grid of nx * nz quad faces in [-1, 1]
+// ========================================================
+void writeGridObj(const string fileName, int nx, int nz)
+{
+    std::ofstream fout;
+    fout.open(fileName.c_str());
+
+    char line[128];
+
+    for (int j = 0; j <= nz; j++)
+    {
+        for (int i = 0; i <= nx; i++)
+        {
+            snprintf(line, sizeof(line), "v %f %f %f\n", -1.f + 2.f * i / nx, 0.f, -1.f + 2.f * j / nz);
+            fout << line;
+        }
+    }
+
+    for (int j = 0; j <= nz; j++)
+    {
+        for (int i = 0; i <= nx; i++)
+        {
+            snprintf(line, sizeof(line), "vt %f %f\n", float(i) / nx, 1.f - float(j) / nz);
+            fout << line;
+        }
+    }
+
+    fout << "vn 0.0000 1.0000 0.0000\n";
+
+    // Same corner order as quad.obj
+    for (int j = 0; j < nz; j++)
+    {
+        for (int i = 0; i < nx; i++)
+        {
+            int i0 = j * (nx + 1) + i + 1;
+            int i1 = i0 + 1;
+            int i2 = i1 + (nx + 1);
+            int i3 = i2 - 1;
+            snprintf(line, sizeof(line), "f %d/%d/1 %d/%d/1 %d/%d/1 %d/%d/1\n", i3, i3, i2, i2, i1, i1, i0, i0);
+            fout << line;
+        }
+    }
+
+    fout.close();
+}
+
+// ========================================================
+// The former Mesh::loadObjQuad, kept as the reference
+// ========================================================
+void loadObjQuadLegacy(Mesh &mesh, const string fileName)
+{
+    std::ifstream fin;
+    fin.open(fileName.c_str());
+
+    while (fin.peek() != EOF)
+    {
+        std::string s;
+        fin >> s;
+
+        if ("v" == s)
+        {
+            float x, y, z;
+            fin >> x >> y >> z;
+            mesh.vertices.push_back(glm::vec3(x, y, z));
+        }
+        else if ("vt" == s)
+        {
+            float u, v;
+            fin >> u >> v;
+            mesh.uvs.push_back(glm::vec2(u, v));
+        }
+        else if ("vn" == s)
+        {
+            float x, y, z;
+            fin >> x >> y >> z;
+            mesh.faceNormals.push_back(glm::vec3(x, y, z));
+        }
+        else if ("f" == s)
+        {
+            Face f;
+            GLuint *vs[4] = {&f.v1, &f.v2, &f.v3, &f.v4};
+            GLuint *vts[4] = {&f.vt1, &f.vt2, &f.vt3, &f.vt4};
+            GLuint *vns[4] = {&f.vn1, &f.vn2, &f.vn3, &f.vn4};
+
+            for (int k = 0; k < 4; k++)
+            {
+                fin >> *vs[k];
+                fin.ignore(1);
+                fin >> *vts[k];
+                fin.ignore(1);
+                fin >> *vns[k];
+                *vs[k] -= 1;
+                *vts[k] -= 1;
+                *vns[k] -= 1;
+            }
+
+            mesh.faces.push_back(f);
+        }
+    }
+
+    fin.close();
+}
+
+// ========================================================
+// Compare two loaded meshes
+// ========================================================
+bool isSameMesh(const Mesh &a, const Mesh &b)
+{
+    if (a.vertices != b.vertices || a.uvs != b.uvs || a.faceNormals != b.faceNormals ||
+        a.faces.size() != b.faces.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.faces.size(); i++)
+    {
+        const Face &fa = a.faces[i];
+        const Face &fb = b.faces[i];
+        if (fa.v1 != fb.v1 || fa.v2 != fb.v2 || fa.v3 != fb.v3 || fa.v4 != fb.v4 || fa.vt1 != fb.vt1 ||
+            fa.vt2 != fb.vt2 || fa.vt3 != fb.vt3 || fa.vt4 != fb.vt4 || fa.vn1 != fb.vn1 || fa.vn2 != fb.vn2 ||
+            fa.vn3 != fb.vn3 || fa.vn4 != fb.vn4)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// ========================================================
+// Main function
+// ========================================================
+int main(int argc, char const *argv[])
+{
+    int nOfFaces = 1000000;
+    int nOfRepeats = 3;
+    string fileName = "./synthetic.obj";
+    bool isWeldOn = false;
+
+    // Parse arguments
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "-faces" && i + 1 < argc)
+        {
+            nOfFaces = glm::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-file" && i + 1 < argc)
+        {
+            fileName = argv[++i];
+        }
+        else if (arg == "-repeat" && i + 1 < argc)
+        {
+            nOfRepeats = glm::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-weld")
+        {
+            isWeldOn = true;
+        }
+        else
+        {
+            std::cout << "unknown argument : " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Square grid with at least nOfFaces faces
+    int n = int(std::ceil(std::sqrt(double(nOfFaces))));
+    writeGridObj(fileName, n, n);
+    std::cout << fileName << ": " << n * n << " faces" << std::endl;
+
+    double legacyBest = 1e30, mappedBest = 1e30;
+    bool same = true;
+
+    for (int r = 0; r < nOfRepeats; r++)
+    {
+        Mesh legacy, mapped;
+
+        auto t0 = std::chrono::steady_clock::now();
+        loadObjQuadLegacy(legacy, fileName);
+        auto t1 = std::chrono::steady_clock::now();
+        mapped.loadObjQuad(fileName);
+        auto t2 = std::chrono::steady_clock::now();
+
+        legacyBest = glm::min(legacyBest, std::chrono::duration<double>(t1 - t0).count());
+        mappedBest = glm::min(mappedBest, std::chrono::duration<double>(t2 - t1).count());
+        same = same && isSameMesh(legacy, mapped);
+    }
+
+    std::cout << "ifstream loop: " << legacyBest * 1000.0 << " ms" << '\n';
+    std::cout << "mmap + from_chars (" << getNumThreads() << " threads): " << mappedBest * 1000.0 << " ms" << '\n';
+    std::cout << "speedup: " << legacyBest / mappedBest << "x" << '\n';
+    std::cout << "results " << (same ? "match" : "DIFFER") << std::endl;
+
+    // Indexed, interleaved layout
+    if (isWeldOn)
+    {
+        Mesh mesh;
+        mesh.loadObjQuad(fileName);
+
+        vector<Vertex> vtxs;
+        vector<GLuint> indices;
+        auto t0 = std::chrono::steady_clock::now();
+        mesh.weldVertices(4, vtxs, indices);
+        auto t1 = std::chrono::steady_clock::now();
+
+        printWeldStats(indices.size(), vtxs.size());
+        std::cout << "  weld time: " << std::chrono::duration<double>(t1 - t0).count() * 1000.0 << " ms" << std::endl;
+    }
+
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
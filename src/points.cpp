@@ -0,0 +1,205 @@
+#include "points.h"
+
+// ================================================
+// PointRenderer class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (no GL object yet)
+// ---------------------------------------------------------
+PointRenderer::PointRenderer()
+{
+    shader = 0;
+    vao = 0;
+    vbo = 0;
+    uniModel = uniView = uniProjection = -1;
+
+    capacity = 0;
+    region = 0;
+    for (int i = 0; i < POINT_FRAMES; i++)
+    {
+        fences[i] = NULL;
+    }
+
+    mapped = NULL;
+    points = NULL;
+    nOfPoints = 0;
+    isRegionReady = false;
+
+    nOfDropped = 0;
+    nOfWaits = 0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+PointRenderer::~PointRenderer()
+{
+    for (int i = 0; i < POINT_FRAMES; i++)
+    {
+        if (fences[i] != NULL)
+        {
+            glDeleteSync(fences[i]);
+        }
+    }
+
+    if (vbo != 0)
+    {
+        if (mapped != NULL)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        glDeleteBuffers(1, &vbo);
+        glDeleteVertexArrays(1, &vao);
+    }
+
+    glDeleteProgram(shader);
+}
+
+// ---------------------------------------------------------
+// Create the shader, the buffer and its vertex array
+// Parameters:
+//   maxPoints: points of a frame at most, the others are
+//     dropped
+// ---------------------------------------------------------
+void PointRenderer::init(size_t maxPoints)
+{
+    capacity = glm::max(maxPoints, size_t(1));
+    GLsizeiptr bufferBytes = GLsizeiptr(POINT_FRAMES * capacity * sizeof(PointVertex));
+
+    shader = buildShader("./shader/vsPoint.glsl", "./shader/fsPoint.glsl", "", "");
+    uniModel = myGetUniformLocation(shader, "M");
+    uniView = myGetUniformLocation(shader, "V");
+    uniProjection = myGetUniformLocation(shader, "P");
+
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (hasGLExtension("GL_ARB_buffer_storage"))
+    {
+        // Coherent: writes are seen by the GPU without a flush
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, bufferBytes, NULL, flags);
+        mapped = (PointVertex *)glMapBufferRange(GL_ARRAY_BUFFER, 0, bufferBytes, flags);
+        if (mapped == NULL)
+        {
+            // The storage is immutable: glBufferData needs a new buffer
+            glDeleteBuffers(1, &vbo);
+            glGenBuffers(1, &vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        }
+    }
+    if (mapped == NULL)
+    {
+        glBufferData(GL_ARRAY_BUFFER, bufferBytes, NULL, GL_DYNAMIC_DRAW);
+        staging.resize(capacity);
+    }
+
+    // Interleaved: position, color (normalized bytes)
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PointVertex), (void *)offsetof(PointVertex, pos));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PointVertex), (void *)offsetof(PointVertex, color));
+    glEnableVertexAttribArray(1);
+}
+
+// ---------------------------------------------------------
+// Append a point to the current frame
+// Parameters:
+//   1. pos: position, in model space of flush
+//   2. color: RGB in [0, 1]
+// Return: false if the frame already has capacity points
+// ---------------------------------------------------------
+bool PointRenderer::add(vec3 pos, vec3 color)
+{
+    if (nOfPoints >= capacity)
+    {
+        nOfDropped++;
+        return false;
+    }
+    if (!isRegionReady)
+    {
+        waitRegion();
+    }
+
+    uvec3 rgb = uvec3(glm::clamp(color, 0.f, 1.f) * 255.f + 0.5f);
+    PointVertex &p = points[nOfPoints++];
+    p.pos = pos;
+    p.color = rgb.r | (rgb.g << 8) | (rgb.b << 16) | (255u << 24);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Append points to the current frame
+// Parameters:
+//   pts: points (position and color)
+// ---------------------------------------------------------
+void PointRenderer::add(const vector<Point> &pts)
+{
+    for (size_t i = 0; i < pts.size(); i++)
+    {
+        add(pts[i].pos, pts[i].color);
+    }
+}
+
+// ---------------------------------------------------------
+// Draw the points of the frame, and move to the next region
+// Parameters:
+//   1. M: model matrix
+//   2. V: view matrix
+//   3. P: projection matrix
+// ---------------------------------------------------------
+void PointRenderer::flush(mat4 M, mat4 V, mat4 P)
+{
+    if (nOfPoints == 0 || vao == 0)
+    {
+        return;
+    }
+
+    GLint first = GLint(region * capacity);
+    glBindVertexArray(vao);
+    if (mapped == NULL)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(PointVertex), nOfPoints * sizeof(PointVertex),
+                        staging.data());
+    }
+
+    glUseProgram(shader);
+    glUniformMatrix4fv(uniModel, 1, GL_FALSE, value_ptr(M));
+    glUniformMatrix4fv(uniView, 1, GL_FALSE, value_ptr(V));
+    glUniformMatrix4fv(uniProjection, 1, GL_FALSE, value_ptr(P));
+    glDrawArrays(GL_POINTS, first, GLsizei(nOfPoints));
+
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    region = (region + 1) % POINT_FRAMES;
+    nOfPoints = 0;
+    isRegionReady = false;
+}
+
+// ---------------------------------------------------------
+// Wait until the GPU is done with the current region
+// Remarks: with POINT_FRAMES regions, this only waits when
+//   the GPU is more than two frames behind
+// ---------------------------------------------------------
+void PointRenderer::waitRegion()
+{
+    if (fences[region] != NULL)
+    {
+        if (glClientWaitSync(fences[region], 0, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            nOfWaits++;
+            while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            {
+            }
+        }
+        glDeleteSync(fences[region]);
+        fences[region] = NULL;
+    }
+
+    points = (mapped != NULL) ? mapped + region * capacity : staging.data();
+    isRegionReady = true;
+}
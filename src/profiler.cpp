@@ -0,0 +1,394 @@
+#include "profiler.h"
+
+// ARB_pipeline_statistics_query (core in OpenGL 4.6)
+#ifndef GL_VERTEX_SHADER_INVOCATIONS_ARB
+#define GL_VERTEX_SHADER_INVOCATIONS_ARB 0x82F0
+#define GL_TESS_CONTROL_SHADER_PATCHES_ARB 0x82F1
+#define GL_TESS_EVALUATION_SHADER_INVOCATIONS_ARB 0x82F2
+#define GL_FRAGMENT_SHADER_INVOCATIONS_ARB 0x82F4
+#define GL_CLIPPING_INPUT_PRIMITIVES_ARB 0x82F6
+#define GL_CLIPPING_OUTPUT_PRIMITIVES_ARB 0x82F7
+#endif
+
+// Query target of every counter
+static const GLenum profileTargets[PROFILE_COUNTERS] = {
+    GL_PRIMITIVES_GENERATED,           GL_VERTEX_SHADER_INVOCATIONS_ARB, GL_TESS_CONTROL_SHADER_PATCHES_ARB,
+    GL_TESS_EVALUATION_SHADER_INVOCATIONS_ARB, GL_CLIPPING_INPUT_PRIMITIVES_ARB, GL_CLIPPING_OUTPUT_PRIMITIVES_ARB,
+    GL_FRAGMENT_SHADER_INVOCATIONS_ARB};
+
+// Column names of the CSV file, and of printStats
+static const char *profileNames[PROFILE_COUNTERS] = {"primitives",      "vs_invocations", "tcs_patches",
+                                                     "tes_invocations", "clip_inputs",    "clip_outputs",
+                                                     "fs_invocations"};
+
+// Full scale of the time graph of the overlay, in milliseconds
+#define OVERLAY_TIME_SCALE 33.3f
+
+// ================================================
+// GpuProfiler class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (no query yet)
+// ---------------------------------------------------------
+GpuProfiler::GpuProfiler()
+{
+    hasPipelineStats = false;
+
+    memset(queries, 0, sizeof(queries));
+    for (int i = 0; i < PROFILER_FRAMES; i++)
+    {
+        slotFrames[i] = 0;
+        isSlotBusy[i] = false;
+    }
+    currentSlot = -1;
+    frame = 0;
+
+    nOfSamples = 0;
+    nOfSkipped = 0;
+    csv = NULL;
+
+    isOverlayOn = true;
+    overlayShader = 0;
+    vaoOverlay = 0;
+    vboOverlay = 0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+GpuProfiler::~GpuProfiler()
+{
+    if (queries[0][0] != 0)
+    {
+        glDeleteQueries(PROFILER_FRAMES * (PROFILE_COUNTERS + 1), &queries[0][0]);
+    }
+    if (vaoOverlay != 0)
+    {
+        glDeleteBuffers(1, &vboOverlay);
+        glDeleteVertexArrays(1, &vaoOverlay);
+        glDeleteProgram(overlayShader);
+    }
+    if (csv != NULL)
+    {
+        fclose(csv);
+    }
+}
+
+// ---------------------------------------------------------
+// Create the queries
+// Remarks: needs a current context
+// ---------------------------------------------------------
+void GpuProfiler::init()
+{
+    hasPipelineStats = hasGLExtension("GL_ARB_pipeline_statistics_query");
+    glGenQueries(PROFILER_FRAMES * (PROFILE_COUNTERS + 1), &queries[0][0]);
+
+    if (!hasPipelineStats)
+    {
+        std::cout << "no ARB_pipeline_statistics_query: timer and primitives only" << std::endl;
+    }
+}
+
+// ---------------------------------------------------------
+// Write every sample to a CSV file
+// Parameters:
+//   fileName: output file, one line per profiled frame
+// Return: false if the file cannot be written
+// ---------------------------------------------------------
+bool GpuProfiler::openCsv(const string fileName)
+{
+    csv = fopen(fileName.c_str(), "w");
+    if (csv == NULL)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+
+    fprintf(csv, "frame,gpu_ms");
+    for (int c = 0; c < PROFILE_COUNTERS; c++)
+    {
+        fprintf(csv, ",%s", profileNames[c]);
+    }
+    fprintf(csv, "\n");
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Start the queries of a frame
+// Remarks: if the queries of PROFILER_FRAMES frames ago
+//   are still busy, this frame is not profiled
+// ---------------------------------------------------------
+void GpuProfiler::begin()
+{
+    collect();
+
+    int slot = int(frame % PROFILER_FRAMES);
+    frame++;
+    if (isSlotBusy[slot])
+    {
+        nOfSkipped++;
+        return;
+    }
+
+    glBeginQuery(GL_TIME_ELAPSED, queries[slot][0]);
+    int nOfCounters = hasPipelineStats ? PROFILE_COUNTERS : 1;
+    for (int c = 0; c < nOfCounters; c++)
+    {
+        glBeginQuery(profileTargets[c], queries[slot][c + 1]);
+    }
+
+    slotFrames[slot] = frame - 1;
+    currentSlot = slot;
+}
+
+// ---------------------------------------------------------
+// End the queries of the frame
+// ---------------------------------------------------------
+void GpuProfiler::end()
+{
+    if (currentSlot < 0)
+    {
+        return;
+    }
+
+    glEndQuery(GL_TIME_ELAPSED);
+    int nOfCounters = hasPipelineStats ? PROFILE_COUNTERS : 1;
+    for (int c = 0; c < nOfCounters; c++)
+    {
+        glEndQuery(profileTargets[c]);
+    }
+
+    isSlotBusy[currentSlot] = true;
+    currentSlot = -1;
+}
+
+// ---------------------------------------------------------
+// Read the results that are available, oldest frame first
+// Remarks: never waits; a frame is read when all its
+//   queries are done
+// ---------------------------------------------------------
+void GpuProfiler::collect()
+{
+    int nOfCounters = hasPipelineStats ? PROFILE_COUNTERS : 1;
+
+    while (true)
+    {
+        // Oldest busy slot
+        int slot = -1;
+        for (int i = 0; i < PROFILER_FRAMES; i++)
+        {
+            if (isSlotBusy[i] && (slot < 0 || slotFrames[i] < slotFrames[slot]))
+            {
+                slot = i;
+            }
+        }
+        if (slot < 0)
+        {
+            return;
+        }
+
+        for (int q = 0; q <= nOfCounters; q++)
+        {
+            GLuint isAvailable = 0;
+            glGetQueryObjectuiv(queries[slot][q], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+            if (!isAvailable)
+            {
+                return;
+            }
+        }
+
+        ProfileSample sample;
+        sample.frame = slotFrames[slot];
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &nanoseconds);
+        sample.gpuTime = double(nanoseconds) * 1e-6;
+
+        for (int c = 0; c < PROFILE_COUNTERS; c++)
+        {
+            sample.counters[c] = 0;
+            if (c < nOfCounters)
+            {
+                glGetQueryObjectui64v(queries[slot][c + 1], GL_QUERY_RESULT, &sample.counters[c]);
+            }
+        }
+        isSlotBusy[slot] = false;
+
+        history.push_back(sample);
+        if (history.size() > PROFILER_HISTORY)
+        {
+            history.pop_front();
+        }
+        nOfSamples++;
+
+        if (onSample)
+        {
+            onSample(sample);
+        }
+
+        if (csv != NULL)
+        {
+            fprintf(csv, "%zu,%.4f", sample.frame, sample.gpuTime);
+            for (int c = 0; c < PROFILE_COUNTERS; c++)
+            {
+                fprintf(csv, ",%llu", (unsigned long long)sample.counters[c]);
+            }
+            fprintf(csv, "\n");
+        }
+    }
+}
+
+// ---------------------------------------------------------
+// Get the latest results
+// Return: NULL until a frame has been read
+// ---------------------------------------------------------
+const ProfileSample *GpuProfiler::getLastSample() const
+{
+    return history.empty() ? NULL : &history.back();
+}
+
+// ---------------------------------------------------------
+// Build the program and buffers of the overlay
+// ---------------------------------------------------------
+void GpuProfiler::initOverlay()
+{
+    overlayShader = buildShader("./shader/vsOverlay.glsl", "./shader/fsOverlay.glsl", "", "");
+
+    glGenVertexArrays(1, &vaoOverlay);
+    glBindVertexArray(vaoOverlay);
+
+    // Interleaved: position (NDC), color
+    glGenBuffers(1, &vboOverlay);
+    glBindBuffer(GL_ARRAY_BUFFER, vboOverlay);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void *)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void *)(2 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(1);
+}
+
+// ---------------------------------------------------------
+// Draw the graph of the history in the bottom-left corner
+// Remarks:
+//   - Yellow: GPU time, full scale OVERLAY_TIME_SCALE ms
+//     (the green line is 60 fps)
+//   - Orange: TCS patches; cyan: TES invocations and
+//     magenta: primitives, on the same scale, so the
+//     share of the work of each stage can be compared
+// ---------------------------------------------------------
+void GpuProfiler::drawOverlay()
+{
+    if (!isOverlayOn || vaoOverlay == 0 || history.size() < 2)
+    {
+        return;
+    }
+
+    const float x0 = -0.98f, y0 = -0.98f, w = 0.9f, h = 0.4f;
+    overlayVertices.clear();
+
+    auto addLine = [&](vec2 a, vec2 b, vec3 color) {
+        GLfloat line[10] = {a.x, a.y, color.r, color.g, color.b, b.x, b.y, color.r, color.g, color.b};
+        overlayVertices.insert(overlayVertices.end(), line, line + 10);
+    };
+    auto addGraph = [&](function<double(const ProfileSample &)> value, double scale, vec3 color) {
+        if (scale <= 0.0)
+        {
+            return;
+        }
+        for (size_t i = 1; i < history.size(); i++)
+        {
+            float xa = x0 + w * float(i - 1) / (PROFILER_HISTORY - 1);
+            float xb = x0 + w * float(i) / (PROFILER_HISTORY - 1);
+            float ya = y0 + h * float(glm::min(value(history[i - 1]) / scale, 1.0));
+            float yb = y0 + h * float(glm::min(value(history[i]) / scale, 1.0));
+            addLine(vec2(xa, ya), vec2(xb, yb), color);
+        }
+    };
+
+    // Frame and 60 fps line
+    vec3 grey(0.6f);
+    addLine(vec2(x0, y0), vec2(x0 + w, y0), grey);
+    addLine(vec2(x0 + w, y0), vec2(x0 + w, y0 + h), grey);
+    addLine(vec2(x0 + w, y0 + h), vec2(x0, y0 + h), grey);
+    addLine(vec2(x0, y0 + h), vec2(x0, y0), grey);
+    float y60 = y0 + h * (1000.f / 60.f) / OVERLAY_TIME_SCALE;
+    addLine(vec2(x0, y60), vec2(x0 + w, y60), vec3(0.f, 0.6f, 0.f));
+
+    // Counters, on the scale of the largest one shown
+    double maxCount = 0.0;
+    for (size_t i = 0; i < history.size(); i++)
+    {
+        maxCount = glm::max(maxCount, double(history[i].counters[PROFILE_PRIMITIVES]));
+        maxCount = glm::max(maxCount, double(history[i].counters[PROFILE_TES_INVOCATIONS]));
+        maxCount = glm::max(maxCount, double(history[i].counters[PROFILE_TCS_PATCHES]));
+    }
+    addGraph([](const ProfileSample &s) { return double(s.counters[PROFILE_TCS_PATCHES]); }, maxCount,
+             vec3(1.f, 0.5f, 0.f));
+    addGraph([](const ProfileSample &s) { return double(s.counters[PROFILE_TES_INVOCATIONS]); }, maxCount,
+             vec3(0.f, 1.f, 1.f));
+    addGraph([](const ProfileSample &s) { return double(s.counters[PROFILE_PRIMITIVES]); }, maxCount,
+             vec3(1.f, 0.f, 1.f));
+    addGraph([](const ProfileSample &s) { return s.gpuTime; }, OVERLAY_TIME_SCALE, vec3(1.f, 1.f, 0.f));
+
+    // Over everything else
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(overlayShader);
+    glBindVertexArray(vaoOverlay);
+    glBindBuffer(GL_ARRAY_BUFFER, vboOverlay);
+    glBufferData(GL_ARRAY_BUFFER, overlayVertices.size() * sizeof(GLfloat), overlayVertices.data(),
+                 GL_STREAM_DRAW);
+    glDrawArrays(GL_LINES, 0, GLsizei(overlayVertices.size() / 5));
+    glEnable(GL_DEPTH_TEST);
+}
+
+// ---------------------------------------------------------
+// Print the latest results, and the averages of the history
+// ---------------------------------------------------------
+void GpuProfiler::printStats()
+{
+    const ProfileSample *last = getLastSample();
+    if (last == NULL)
+    {
+        std::cout << "profiler: no result yet" << std::endl;
+        return;
+    }
+
+    double meanTime = 0.0, maxTime = 0.0;
+    double means[PROFILE_COUNTERS] = {};
+    for (size_t i = 0; i < history.size(); i++)
+    {
+        meanTime += history[i].gpuTime;
+        maxTime = glm::max(maxTime, history[i].gpuTime);
+        for (int c = 0; c < PROFILE_COUNTERS; c++)
+        {
+            means[c] += double(history[i].counters[c]);
+        }
+    }
+    meanTime /= double(history.size());
+    for (int c = 0; c < PROFILE_COUNTERS; c++)
+    {
+        means[c] /= double(history.size());
+    }
+
+    std::cout << "profiler: frame " << last->frame << ", gpu " << last->gpuTime << " ms (last " << history.size()
+              << " frames: mean " << meanTime << " ms, max " << maxTime << " ms), " << nOfSkipped
+              << " frames skipped" << '\n';
+
+    int nOfCounters = hasPipelineStats ? PROFILE_COUNTERS : 1;
+    for (int c = 0; c < nOfCounters; c++)
+    {
+        std::cout << "  " << profileNames[c] << ": " << last->counters[c] << " (mean " << means[c] << ")" << '\n';
+    }
+
+    // Where the work goes: vertices generated per patch, and
+    // fragments per primitive
+    if (hasPipelineStats && means[PROFILE_TCS_PATCHES] > 0.0)
+    {
+        std::cout << "  tes invocations per patch: " << means[PROFILE_TES_INVOCATIONS] / means[PROFILE_TCS_PATCHES]
+                  << ", primitives per patch: " << means[PROFILE_PRIMITIVES] / means[PROFILE_TCS_PATCHES]
+                  << ", fragments per primitive: "
+                  << means[PROFILE_FS_INVOCATIONS] / glm::max(means[PROFILE_PRIMITIVES], 1.0) << '\n';
+    }
+    std::cout << std::flush;
+}
@@ -0,0 +1,399 @@
+#include "pyramid.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// ================================================
+// HeightPyramid class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (empty pyramid)
+// ---------------------------------------------------------
+HeightPyramid::HeightPyramid()
+{
+    heightMap = NULL;
+    maxHeightMap = NULL;
+    nOfLevels = 0;
+    nOfThreads = 1;
+    seconds = 0.0;
+}
+
+// ---------------------------------------------------------
+// Build every level from the height map
+// Parameters:
+//   1. hm: height map, must outlive the pyramid (level 0)
+//   2. threads: number of threads, 0 means one per core
+// Remarks: each level is split into rows over the threads,
+//   and a level only starts once the previous one is done
+// ---------------------------------------------------------
+void HeightPyramid::build(const HeightMap &hm, int threads)
+{
+    build(hm, hm, threads);
+}
+
+// ---------------------------------------------------------
+// Build every level from separate min and max maps
+// Parameters:
+//   1. minHm, maxHm: lower and upper bounds of every texel,
+//      same size, must outlive the pyramid (level 0)
+//   2. threads: number of threads, 0 means one per core
+// Remarks: e.g. the range of every tile of a height map
+//   that does not fit in memory
+// ---------------------------------------------------------
+void HeightPyramid::build(const HeightMap &minHm, const HeightMap &maxHm, int threads)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    heightMap = &minHm;
+    maxHeightMap = &maxHm;
+    nOfThreads = getNumThreads(threads);
+    levelSizes.clear();
+    mins.clear();
+    maxs.clear();
+    nOfLevels = 0;
+
+    if (minHm.texels.empty())
+    {
+        return;
+    }
+
+    // Halve (rounding up) until a single cell is left
+    levelSizes.assign(1, ivec2(minHm.width, minHm.height));
+    while (levelSizes.back().x > 1 || levelSizes.back().y > 1)
+    {
+        ivec2 size = levelSizes.back();
+        levelSizes.push_back(ivec2((size.x + 1) / 2, (size.y + 1) / 2));
+    }
+    nOfLevels = int(levelSizes.size());
+
+    mins.resize(nOfLevels);
+    maxs.resize(nOfLevels);
+
+    for (int k = 1; k < nOfLevels; k++)
+    {
+        ivec2 srcSize = levelSizes[k - 1];
+        ivec2 dstSize = levelSizes[k];
+        mins[k].resize(size_t(dstSize.x) * dstSize.y);
+        maxs[k].resize(size_t(dstSize.x) * dstSize.y);
+
+        // Level 1 reduces the texels in both planes
+        const float *srcMins = (k == 1) ? minHm.texels.data() : mins[k - 1].data();
+        const float *srcMaxs = (k == 1) ? maxHm.texels.data() : maxs[k - 1].data();
+
+        parallelFor(
+            dstSize.y,
+            [&](size_t begin, size_t end) {
+                reduceMin2x2(srcMins, srcSize.x, srcSize.y, mins[k].data(), int(begin), int(end));
+                reduceMax2x2(srcMaxs, srcSize.x, srcSize.y, maxs[k].data(), int(begin), int(end));
+            },
+            nOfThreads);
+    }
+
+    auto endTime = std::chrono::steady_clock::now();
+    seconds = std::chrono::duration<double>(endTime - startTime).count();
+}
+
+// ---------------------------------------------------------
+// Get the bounds of one cell
+// Parameters:
+//   1. level: pyramid level
+//   2. x, y: cell coordinate in that level
+// Return: (min, max) of the 2^level x 2^level texels
+//   of the cell, in O(1)
+// ---------------------------------------------------------
+vec2 HeightPyramid::getBounds(int level, int x, int y) const
+{
+    ivec2 size = levelSizes[level];
+    size_t idx = size_t(y) * size.x + x;
+
+    if (level == 0)
+    {
+        return vec2(heightMap->texels[idx], maxHeightMap->texels[idx]);
+    }
+
+    return vec2(mins[level][idx], maxs[level][idx]);
+}
+
+// ---------------------------------------------------------
+// Get the bounds of a rectangle of texels
+// Parameters:
+//   x0, y0, x1, y1: inclusive texel rectangle,
+//   inside the height map
+// Return: (min, max) of the texels
+// Remarks: the level whose cells are at least as large as
+//   the rectangle is used, so at most 2 x 2 cells are read
+// ---------------------------------------------------------
+vec2 HeightPyramid::getTexelRange(int x0, int y0, int x1, int y1) const
+{
+    int span = glm::max(x1 - x0, y1 - y0) + 1;
+    int level = 0;
+    while ((1 << level) < span && level < nOfLevels - 1)
+    {
+        level++;
+    }
+
+    vec2 range(FLT_MAX, -FLT_MAX);
+    for (int y = y0 >> level; y <= (y1 >> level); y++)
+    {
+        for (int x = x0 >> level; x <= (x1 >> level); x++)
+        {
+            vec2 bounds = getBounds(level, x, y);
+            range.x = glm::min(range.x, bounds.x);
+            range.y = glm::max(range.y, bounds.y);
+        }
+    }
+
+    return range;
+}
+
+// ---------------------------------------------------------
+// Get the range of HeightMap::sample over a uv rectangle
+// Parameters:
+//   uvMin, uvMax: corners of the rectangle
+// Return: (min, max) of the filtered value
+// Remarks:
+//   - Same texel footprint as HeightMap::getRange
+//     (GL_LINEAR reads the 2 x 2 texels around a sample),
+//     without visiting every texel
+//   - With GL_REPEAT, a rectangle crossing the border is
+//     split in up to 2 x 2 texel rectangles
+// ---------------------------------------------------------
+vec2 HeightPyramid::getRange(vec2 uvMin, vec2 uvMax) const
+{
+    if (nOfLevels == 0)
+    {
+        return vec2(0.f);
+    }
+
+    ivec2 size = levelSizes[0];
+    int lo[2] = {int(std::floor(uvMin.x * size.x - 0.5f)), int(std::floor(uvMin.y * size.y - 0.5f))};
+    int hi[2] = {int(std::floor(uvMax.x * size.x - 0.5f)) + 1, int(std::floor(uvMax.y * size.y - 0.5f)) + 1};
+
+    // Wrapped intervals along each axis
+    ivec2 intervals[2][2];
+    int nOfIntervals[2];
+    for (int a = 0; a < 2; a++)
+    {
+        if (hi[a] - lo[a] + 1 >= size[a])
+        {
+            intervals[a][0] = ivec2(0, size[a] - 1);
+            nOfIntervals[a] = 1;
+            continue;
+        }
+
+        int begin = ((lo[a] % size[a]) + size[a]) % size[a];
+        int end = begin + (hi[a] - lo[a]);
+        if (end < size[a])
+        {
+            intervals[a][0] = ivec2(begin, end);
+            nOfIntervals[a] = 1;
+        }
+        else
+        {
+            intervals[a][0] = ivec2(begin, size[a] - 1);
+            intervals[a][1] = ivec2(0, end - size[a]);
+            nOfIntervals[a] = 2;
+        }
+    }
+
+    vec2 range(FLT_MAX, -FLT_MAX);
+    for (int j = 0; j < nOfIntervals[1]; j++)
+    {
+        for (int i = 0; i < nOfIntervals[0]; i++)
+        {
+            vec2 r = getTexelRange(intervals[0][i].x, intervals[1][j].x, intervals[0][i].y, intervals[1][j].y);
+            range.x = glm::min(range.x, r.x);
+            range.y = glm::max(range.y, r.y);
+        }
+    }
+
+    return range;
+}
+
+// ---------------------------------------------------------
+// Upload the pyramid as an RG32F texture
+// Parameters:
+//   1. tbo: texture object
+//   2. texUnit: texture unit
+// Remarks:
+//   - Mip level i holds pyramid level i + 1 (level 0 is
+//     texHeight itself), r = min and g = max
+//   - Mip sizes are powers of two, so the chain is complete
+//     for any height map size; a level only fills the
+//     bottom-left corner of its mip if it is smaller
+//   - Read it with texelFetch, cells are not filtered
+// ---------------------------------------------------------
+void HeightPyramid::setTexture(GLuint &tbo, int texUnit) const
+{
+    if (nOfLevels < 2)
+    {
+        return;
+    }
+
+    // Select a texture unit
+    glActiveTexture(GL_TEXTURE0 + texUnit);
+
+    glGenTextures(1, &tbo);
+    glBindTexture(GL_TEXTURE_2D, tbo);
+
+    // Power-of-two size of mip level 0
+    ivec2 mipSize(1, 1);
+    while (mipSize.x < levelSizes[1].x)
+    {
+        mipSize.x *= 2;
+    }
+    while (mipSize.y < levelSizes[1].y)
+    {
+        mipSize.y *= 2;
+    }
+
+    vector<vec2> texels;
+    for (int k = 1; k < nOfLevels; k++)
+    {
+        // Interleave the two planes
+        texels.resize(mins[k].size());
+        for (size_t i = 0; i < texels.size(); i++)
+        {
+            texels[i] = vec2(mins[k][i], maxs[k][i]);
+        }
+
+        glTexImage2D(GL_TEXTURE_2D, k - 1, GL_RG32F, mipSize.x, mipSize.y, 0, GL_RG, GL_FLOAT, NULL);
+        glTexSubImage2D(GL_TEXTURE_2D, k - 1, 0, 0, levelSizes[k].x, levelSizes[k].y, GL_RG, GL_FLOAT,
+                        (void *)texels.data());
+
+        mipSize = glm::max(mipSize / 2, ivec2(1));
+    }
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, nOfLevels - 2);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+// ---------------------------------------------------------
+// Print statistics of the last build
+// ---------------------------------------------------------
+void HeightPyramid::printStats()
+{
+    size_t nOfCells = 0;
+    for (int k = 1; k < nOfLevels; k++)
+    {
+        nOfCells += mins[k].size();
+    }
+
+    ivec2 size = (nOfLevels > 0) ? levelSizes[0] : ivec2(0);
+    std::cout << "pyramid: " << size.x << " x " << size.y << ", " << nOfLevels << " levels, "
+              << nOfCells * 2 * sizeof(float) / 1024.0 / 1024.0 << " MB" << '\n';
+    std::cout << "time: " << seconds * 1000.0 << " ms on " << nOfThreads << " thread(s)" << std::endl;
+}
+
+// ================================================
+// Pyramid utilities
+// ================================================
+
+// ---------------------------------------------------------
+// Reduce 2 x 2 blocks of a plane
+// Parameters:
+//   1. src, srcWidth, srcHeight: source plane
+//   2. dst: destination plane, (srcWidth + 1) / 2 wide
+//   3. rowBegin, rowEnd: destination rows to fill
+// Remarks: an odd last row/column is reduced with itself
+// ---------------------------------------------------------
+template <bool isMin>
+static void reduce2x2(const float *src, int srcWidth, int srcHeight, float *dst, int rowBegin, int rowEnd)
+{
+    int dstWidth = (srcWidth + 1) / 2;
+
+    for (int y = rowBegin; y < rowEnd; y++)
+    {
+        const float *row0 = src + size_t(2 * y) * srcWidth;
+        const float *row1 = src + size_t(glm::min(2 * y + 1, srcHeight - 1)) * srcWidth;
+        float *out = dst + size_t(y) * dstWidth;
+        int x = 0;
+
+#if defined(__SSE2__)
+        // 4 destination cells from 2 x 8 source values
+        for (; 2 * x + 8 <= srcWidth; x += 4)
+        {
+            __m128 a0 = _mm_loadu_ps(row0 + 2 * x);
+            __m128 a1 = _mm_loadu_ps(row0 + 2 * x + 4);
+            __m128 b0 = _mm_loadu_ps(row1 + 2 * x);
+            __m128 b1 = _mm_loadu_ps(row1 + 2 * x + 4);
+            __m128 v0 = isMin ? _mm_min_ps(a0, b0) : _mm_max_ps(a0, b0);
+            __m128 v1 = isMin ? _mm_min_ps(a1, b1) : _mm_max_ps(a1, b1);
+            __m128 even = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 odd = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(out + x, isMin ? _mm_min_ps(even, odd) : _mm_max_ps(even, odd));
+        }
+#elif defined(__ARM_NEON)
+        // vld2q splits even and odd columns
+        for (; 2 * x + 8 <= srcWidth; x += 4)
+        {
+            float32x4x2_t a = vld2q_f32(row0 + 2 * x);
+            float32x4x2_t b = vld2q_f32(row1 + 2 * x);
+            float32x4_t v = isMin ? vminq_f32(vminq_f32(a.val[0], a.val[1]), vminq_f32(b.val[0], b.val[1]))
+                                  : vmaxq_f32(vmaxq_f32(a.val[0], a.val[1]), vmaxq_f32(b.val[0], b.val[1]));
+            vst1q_f32(out + x, v);
+        }
+#endif
+
+        // Remaining cells
+        for (; x < dstWidth; x++)
+        {
+            int x0 = 2 * x;
+            int x1 = glm::min(2 * x + 1, srcWidth - 1);
+            out[x] = isMin ? glm::min(glm::min(row0[x0], row0[x1]), glm::min(row1[x0], row1[x1]))
+                           : glm::max(glm::max(row0[x0], row0[x1]), glm::max(row1[x0], row1[x1]));
+        }
+    }
+}
+
+void reduceMin2x2(const float *src, int srcWidth, int srcHeight, float *dst, int rowBegin, int rowEnd)
+{
+    reduce2x2<true>(src, srcWidth, srcHeight, dst, rowBegin, rowEnd);
+}
+
+void reduceMax2x2(const float *src, int srcWidth, int srcHeight, float *dst, int rowBegin, int rowEnd)
+{
+    reduce2x2<false>(src, srcWidth, srcHeight, dst, rowBegin, rowEnd);
+}
+
+// ---------------------------------------------------------
+// Compute the roughness map of a height map
+// Parameters:
+//   1. hm: height map
+//   2. roughness: roughness map (output), same size
+//   3. threads: number of threads, 0 means one per core
+// Remarks: a texel is how far it is from the chords of its
+//   opposite neighbours (half the second difference, the
+//   largest of the 4 directions), so slopes are not rough
+// ---------------------------------------------------------
+void computeRoughness(const HeightMap &hm, HeightMap &roughness, int threads)
+{
+    roughness.width = hm.width;
+    roughness.height = hm.height;
+    roughness.texels.resize(hm.texels.size());
+
+    parallelFor(
+        hm.height,
+        [&](size_t begin, size_t end) {
+            for (int y = int(begin); y < int(end); y++)
+            {
+                for (int x = 0; x < hm.width; x++)
+                {
+                    float h2 = 2.f * hm.texel(x, y);
+                    float r = glm::abs(hm.texel(x - 1, y) + hm.texel(x + 1, y) - h2);
+                    r = glm::max(r, glm::abs(hm.texel(x, y - 1) + hm.texel(x, y + 1) - h2));
+                    r = glm::max(r, glm::abs(hm.texel(x - 1, y - 1) + hm.texel(x + 1, y + 1) - h2));
+                    r = glm::max(r, glm::abs(hm.texel(x - 1, y + 1) + hm.texel(x + 1, y - 1) - h2));
+
+                    roughness.texels[size_t(y) * hm.width + x] = r * 0.5f;
+                }
+            }
+        },
+        threads);
+}
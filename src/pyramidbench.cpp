@@ -0,0 +1,146 @@
+// Benchmark of the min/max height pyramid.
+// It fills a synthetic height map, builds HeightPyramid on all cores,
+// and checks it against texel loops:
+// - a cell of HeightPyramid::getBounds must match its texels exactly
+// - HeightPyramid::getRange must contain HeightMap::getRange
+//   (it reads whole cells, so it is conservative)
+//
+// Usage:
+//   ./pyramidbench [-size n] [-threads n] [-repeat n] [-queries n]
+#include "pyramid.h"
+
+// ========================================================
+// Fill an n x n height map with a few octaves of waves
+// ========================================================
+void fillHeightMap(HeightMap &heightMap, int n)
+{
+    heightMap.width = n;
+    heightMap.height = n;
+    heightMap.texels.resize(size_t(n) * n);
+
+    parallelFor(n, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++)
+        {
+            for (int x = 0; x < n; x++)
+            {
+                float u = float(x) / n, v = float(y) / n, h = 0.f, amplitude = 0.25f;
+                for (int o = 1; o <= 16; o *= 2)
+                {
+                    h += amplitude * std::sin(6.2831853f * o * u + o) * std::cos(6.2831853f * o * v - o);
+                    amplitude *= 0.5f;
+                }
+                heightMap.texels[y * n + x] = 0.5f + h;
+            }
+        }
+    });
+}
+
+// ========================================================
+// Main function
+// ========================================================
+int main(int argc, char const *argv[])
+{
+    int size = 16384;
+    int nOfThreads = 0;
+    int nOfRepeats = 3;
+    int nOfQueries = 10000;
+
+    // Parse arguments
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "-size" && i + 1 < argc)
+        {
+            size = glm::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-threads" && i + 1 < argc)
+        {
+            nOfThreads = atoi(argv[++i]);
+        }
+        else if (arg == "-repeat" && i + 1 < argc)
+        {
+            nOfRepeats = glm::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-queries" && i + 1 < argc)
+        {
+            nOfQueries = glm::max(atoi(argv[++i]), 0);
+        }
+        else
+        {
+            std::cout << "unknown argument : " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    HeightMap heightMap;
+    fillHeightMap(heightMap, size);
+
+    HeightPyramid pyramid;
+    double best = 1e30;
+    for (int r = 0; r < nOfRepeats; r++)
+    {
+        pyramid.build(heightMap, nOfThreads);
+        best = glm::min(best, pyramid.seconds);
+    }
+    pyramid.printStats();
+    std::cout << "best: " << best * 1000.0 << " ms" << '\n';
+
+    // Random rectangles, some crossing the border (GL_REPEAT)
+    uint32_t seed = 12345;
+    auto random = [&]() {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) / 16777216.f;
+    };
+
+    // Cells must match their texels
+    int nOfMismatches = 0;
+    for (int q = 0; q < nOfQueries; q++)
+    {
+        int level = int(random() * pyramid.nOfLevels) % pyramid.nOfLevels;
+        ivec2 levelSize = pyramid.levelSizes[level];
+        int x = int(random() * levelSize.x) % levelSize.x;
+        int y = int(random() * levelSize.y) % levelSize.y;
+
+        // Small cells only, or the texel loop takes forever
+        if (level > 8)
+        {
+            continue;
+        }
+
+        int x1 = glm::min((x + 1) << level, size) - 1;
+        int y1 = glm::min((y + 1) << level, size) - 1;
+        vec2 slow = heightMap.getRange(vec2((x << level) + 1.f, (y << level) + 1.f) / float(size),
+                                       vec2(x1 + 0.f, y1 + 0.f) / float(size));
+        nOfMismatches += (pyramid.getBounds(level, x, y) != slow);
+    }
+
+    // Random rectangles, some crossing the border (GL_REPEAT)
+    double pyramidSeconds = 0.0, loopSeconds = 0.0, looseness = 0.0;
+    for (int q = 0; q < nOfQueries; q++)
+    {
+        vec2 uvMin(random() * 1.2f - 0.1f, random() * 1.2f - 0.1f);
+        vec2 uvMax = uvMin + vec2(random(), random()) * ((q % 2) ? 0.001f : 0.01f);
+
+        auto t0 = std::chrono::steady_clock::now();
+        vec2 fast = pyramid.getRange(uvMin, uvMax);
+        auto t1 = std::chrono::steady_clock::now();
+        vec2 slow = heightMap.getRange(uvMin, uvMax);
+        auto t2 = std::chrono::steady_clock::now();
+
+        pyramidSeconds += std::chrono::duration<double>(t1 - t0).count();
+        loopSeconds += std::chrono::duration<double>(t2 - t1).count();
+        looseness += (fast.y - fast.x) - (slow.y - slow.x);
+        nOfMismatches += (fast.x > slow.x || fast.y < slow.y);
+    }
+
+    if (nOfQueries > 0)
+    {
+        std::cout << "query: " << pyramidSeconds / nOfQueries * 1e9 << " ns (texel loop: "
+                  << loopSeconds / nOfQueries * 1e9 << " ns), range wider by "
+                  << looseness / nOfQueries << " on average" << '\n';
+    }
+    std::cout << "results " << (nOfMismatches == 0 ? "match" : "DIFFER") << std::endl;
+
+    return (nOfMismatches == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
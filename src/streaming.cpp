@@ -0,0 +1,563 @@
+#include "streaming.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// ================================================
+// HeightStreamer class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor (nothing opened)
+// ---------------------------------------------------------
+HeightStreamer::HeightStreamer()
+{
+    memset(&header, 0, sizeof(header));
+    tileTexels = 0;
+    tileBytes = 0;
+    nOfSlots = 0;
+    frame = 0;
+    maxUploadsPerUpdate = 16;
+    isStopping = false;
+
+    tboTiles = 0;
+    tboIndirection = 0;
+    tboOverview = 0;
+    unitTiles = 0;
+    unitIndirection = 0;
+    unitOverview = 0;
+
+    nOfWanted = 0;
+    nOfUploads = 0;
+    nOfEvictions = 0;
+    nOfMisses = 0;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+HeightStreamer::~HeightStreamer()
+{
+    close();
+}
+
+// ---------------------------------------------------------
+// Open a tiled height map and start the I/O thread
+// Parameters:
+//   1. fileName: .htile file (see writeHeightTiles)
+//   2. budget: bytes of tile atlas
+// Return: true if succeeded
+// Remarks: only the header, the tile ranges and the overview
+//   are read here, tiles are read on demand by update
+// ---------------------------------------------------------
+bool HeightStreamer::open(const string fileName, size_t budget)
+{
+    close();
+
+    if (!file.open(fileName) || file.size < sizeof(HtileHeader))
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+
+    if (header.magic != HTILE_MAGIC || header.version != HTILE_VERSION || header.tileSize <= 0 ||
+        header.nOfTilesX <= 0 || header.nOfTilesY <= 0 || header.overviewWidth <= 0 || header.overviewHeight <= 0)
+    {
+        std::cout << "not a tiled height map : " << fileName << std::endl;
+        file.close();
+        return false;
+    }
+
+    tileTexels = header.tileSize + 2 * header.border;
+    tileBytes = size_t(tileTexels) * tileTexels * sizeof(uint16_t);
+    size_t nOfTiles = size_t(header.nOfTilesX) * header.nOfTilesY;
+
+    if (header.tileOffset + nOfTiles * tileBytes > file.size ||
+        header.rangeOffset + nOfTiles * 2 * sizeof(float) > file.size ||
+        header.overviewOffset + size_t(header.overviewWidth) * header.overviewHeight * sizeof(uint16_t) > file.size)
+    {
+        std::cout << "truncated tiled height map : " << fileName << std::endl;
+        file.close();
+        return false;
+    }
+
+    // Tiles are read in any order
+    madvise((void *)file.data, file.size, MADV_RANDOM);
+
+    // Range of every tile, one texel per tile
+    const float *ranges = (const float *)(file.data + header.rangeOffset);
+    tileMins.width = tileMaxs.width = header.nOfTilesX;
+    tileMins.height = tileMaxs.height = header.nOfTilesY;
+    tileMins.texels.resize(nOfTiles);
+    tileMaxs.texels.resize(nOfTiles);
+    for (size_t i = 0; i < nOfTiles; i++)
+    {
+        tileMins.texels[i] = ranges[i * 2];
+        tileMaxs.texels[i] = ranges[i * 2 + 1];
+    }
+    tilePyramid.build(tileMins, tileMaxs);
+
+    // Atlas slots, the rest falls back to the overview
+    nOfSlots = int(glm::clamp(budget / tileBytes, size_t(1), size_t(2048)));
+    slotTiles.assign(nOfSlots, -1);
+    slotLastWanted.assign(nOfSlots, 0);
+    tileSlots.assign(nOfTiles, -1);
+    tileLastWanted.assign(nOfTiles, 0);
+    tileStates.assign(nOfTiles, TILE_ABSENT);
+    frame = 0;
+
+    isStopping = false;
+    ioThread = std::thread(&HeightStreamer::readTiles, this);
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Stop the I/O thread, release the textures and the file
+// ---------------------------------------------------------
+void HeightStreamer::close()
+{
+    if (ioThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(ioMutex);
+            isStopping = true;
+        }
+        ioCondition.notify_all();
+        ioThread.join();
+    }
+    requests.clear();
+    loadedTiles.clear();
+
+    if (tboTiles != 0)
+    {
+        glDeleteTextures(1, &tboTiles);
+        glDeleteTextures(1, &tboIndirection);
+        glDeleteTextures(1, &tboOverview);
+        tboTiles = tboIndirection = tboOverview = 0;
+    }
+
+    file.close();
+}
+
+// ---------------------------------------------------------
+// Create the textures read by tesTerrain.glsl
+// Parameters:
+//   1. tilesUnit: texture unit of the tile atlas (texTiles)
+//   2. indirectionUnit: texture unit of the slot of every tile
+//      (texIndirection)
+//   3. overviewUnit: texture unit of the overview (texOverview)
+// ---------------------------------------------------------
+void HeightStreamer::initTextures(int tilesUnit, int indirectionUnit, int overviewUnit)
+{
+    unitTiles = tilesUnit;
+    unitIndirection = indirectionUnit;
+    unitOverview = overviewUnit;
+
+    GLint maxLayers;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    if (nOfSlots > maxLayers)
+    {
+        nOfSlots = maxLayers;
+        slotTiles.resize(nOfSlots);
+        slotLastWanted.resize(nOfSlots);
+    }
+
+    // Rows of uint16 are not always 4-byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+
+    // One tile per layer, borders included
+    glActiveTexture(GL_TEXTURE0 + unitTiles);
+    glGenTextures(1, &tboTiles);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tboTiles);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, tileTexels, tileTexels, nOfSlots, 0, GL_RED, GL_UNSIGNED_SHORT,
+                 NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+
+    // Nothing resident yet
+    vector<int16_t> slots(tileSlots.size(), -1);
+    glActiveTexture(GL_TEXTURE0 + unitIndirection);
+    glGenTextures(1, &tboIndirection);
+    glBindTexture(GL_TEXTURE_2D, tboIndirection);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16I, header.nOfTilesX, header.nOfTilesY, 0, GL_RED_INTEGER, GL_SHORT,
+                 (void *)slots.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glActiveTexture(GL_TEXTURE0 + unitOverview);
+    glGenTextures(1, &tboOverview);
+    glBindTexture(GL_TEXTURE_2D, tboOverview);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, header.overviewWidth, header.overviewHeight, 0, GL_RED,
+                 GL_UNSIGNED_SHORT, (void *)(file.data + header.overviewOffset));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+// ---------------------------------------------------------
+// Page in the tiles around the camera
+// Parameters:
+//   center: camera position, in texels of the height map
+//     (wrapped, the map repeats)
+// Remarks:
+//   - The closest tiles, up to 3/4 of the slots, are wanted;
+//     missing ones are queued closest first, and requests
+//     that are no longer wanted are dropped
+//   - At most maxUploadsPerUpdate tiles read by the I/O
+//     thread are uploaded
+// ---------------------------------------------------------
+void HeightStreamer::update(vec2 center)
+{
+    if (tileStates.empty())
+    {
+        return;
+    }
+
+    frame++;
+    int tileSize = header.tileSize;
+    ivec2 nOfTiles(header.nOfTilesX, header.nOfTilesY);
+
+    // Tiles of a square window around the center, closest first
+    int maxWanted = glm::max(nOfSlots * 3 / 4, 1);
+    int radius = int(std::ceil(std::sqrt(float(maxWanted)) * 0.5f)) + 1;
+    ivec2 centerTile(int(std::floor(center.x / tileSize)), int(std::floor(center.y / tileSize)));
+
+    vector<std::pair<float, int>> candidates;
+    for (int dy = -radius; dy <= radius; dy++)
+    {
+        for (int dx = -radius; dx <= radius; dx++)
+        {
+            ivec2 t = centerTile + ivec2(dx, dy);
+            vec2 rectMin = vec2(t) * float(tileSize);
+            vec2 closest = clamp(center, rectMin, rectMin + float(tileSize));
+
+            ivec2 wrapped((t.x % nOfTiles.x + nOfTiles.x) % nOfTiles.x, (t.y % nOfTiles.y + nOfTiles.y) % nOfTiles.y);
+            candidates.push_back(std::make_pair(distance(center, closest), wrapped.y * nOfTiles.x + wrapped.x));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    // A small map repeats in the window
+    vector<int> wanted;
+    for (size_t i = 0; i < candidates.size() && int(wanted.size()) < maxWanted; i++)
+    {
+        int tile = candidates[i].second;
+        if (tileLastWanted[tile] != frame)
+        {
+            tileLastWanted[tile] = frame;
+            wanted.push_back(tile);
+        }
+    }
+
+    nOfWanted = wanted.size();
+    nOfMisses = 0;
+    for (size_t i = 0; i < wanted.size(); i++)
+    {
+        int slot = tileSlots[wanted[i]];
+        if (slot >= 0)
+        {
+            slotLastWanted[slot] = frame;
+        }
+        else
+        {
+            nOfMisses++;
+        }
+    }
+
+    // New requests, and the tiles read since the last update
+    vector<LoadedTile> uploads;
+    {
+        std::lock_guard<std::mutex> lock(ioMutex);
+
+        for (size_t i = 0; i < requests.size(); i++)
+        {
+            tileStates[requests[i]] = TILE_ABSENT;
+        }
+        requests.clear();
+
+        for (size_t i = 0; i < wanted.size(); i++)
+        {
+            if (tileStates[wanted[i]] == TILE_ABSENT)
+            {
+                tileStates[wanted[i]] = TILE_QUEUED;
+                requests.push_back(wanted[i]);
+            }
+        }
+
+        while (!loadedTiles.empty() && int(uploads.size()) < maxUploadsPerUpdate)
+        {
+            uploads.push_back(std::move(loadedTiles.front()));
+            loadedTiles.pop_front();
+        }
+    }
+    ioCondition.notify_one();
+
+    for (size_t i = 0; i < uploads.size(); i++)
+    {
+        uploadTile(uploads[i]);
+    }
+}
+
+// ---------------------------------------------------------
+// Move a tile read by the I/O thread into the atlas
+// Parameters:
+//   loaded: tile and its texels
+// Remarks: dropped if every slot holds a wanted tile
+// ---------------------------------------------------------
+void HeightStreamer::uploadTile(LoadedTile &loaded)
+{
+    int slot = findSlot();
+    if (slot < 0)
+    {
+        tileStates[loaded.tile] = TILE_ABSENT;
+        return;
+    }
+
+    glActiveTexture(GL_TEXTURE0 + unitIndirection);
+    glBindTexture(GL_TEXTURE_2D, tboIndirection);
+
+    // Evict the previous tile of the slot
+    int evicted = slotTiles[slot];
+    if (evicted >= 0)
+    {
+        int16_t none = -1;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, evicted % header.nOfTilesX, evicted / header.nOfTilesX, 1, 1,
+                        GL_RED_INTEGER, GL_SHORT, (void *)&none);
+        tileSlots[evicted] = -1;
+        tileStates[evicted] = TILE_ABSENT;
+        nOfEvictions++;
+    }
+
+    int16_t value = int16_t(slot);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, loaded.tile % header.nOfTilesX, loaded.tile / header.nOfTilesX, 1, 1,
+                    GL_RED_INTEGER, GL_SHORT, (void *)&value);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glActiveTexture(GL_TEXTURE0 + unitTiles);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tboTiles);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, slot, tileTexels, tileTexels, 1, GL_RED, GL_UNSIGNED_SHORT,
+                    (void *)loaded.texels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    slotTiles[slot] = loaded.tile;
+    slotLastWanted[slot] = tileLastWanted[loaded.tile];
+    tileSlots[loaded.tile] = slot;
+    tileStates[loaded.tile] = TILE_RESIDENT;
+    nOfUploads++;
+}
+
+// ---------------------------------------------------------
+// Find a slot for a new tile
+// Return: a free slot, or the least recently wanted one
+//   (not wanted in this update), -1 if there is none
+// ---------------------------------------------------------
+int HeightStreamer::findSlot()
+{
+    int best = -1;
+    for (int i = 0; i < nOfSlots; i++)
+    {
+        if (slotTiles[i] < 0)
+        {
+            return i;
+        }
+
+        if (slotLastWanted[i] < frame && (best < 0 || slotLastWanted[i] < slotLastWanted[best]))
+        {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// ---------------------------------------------------------
+// Body of the I/O thread
+// Remarks: reading the mapped tile is where the disk is
+//   hit, so it stays off the main thread; its pages are
+//   dropped afterwards, the atlas is the only copy kept
+// ---------------------------------------------------------
+void HeightStreamer::readTiles()
+{
+    size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+
+    while (true)
+    {
+        int tile;
+        {
+            std::unique_lock<std::mutex> lock(ioMutex);
+            ioCondition.wait(lock, [&]() { return isStopping || !requests.empty(); });
+            if (isStopping)
+            {
+                return;
+            }
+
+            tile = requests.front();
+            requests.pop_front();
+            tileStates[tile] = TILE_LOADING;
+        }
+
+        LoadedTile loaded;
+        loaded.tile = tile;
+        loaded.texels.resize(size_t(tileTexels) * tileTexels);
+
+        size_t offset = header.tileOffset + size_t(tile) * tileBytes;
+        memcpy(loaded.texels.data(), file.data + offset, tileBytes);
+
+        // Whole pages of the tile only
+        size_t pageBegin = (offset + pageSize - 1) / pageSize * pageSize;
+        size_t pageEnd = (offset + tileBytes) / pageSize * pageSize;
+        if (pageEnd > pageBegin)
+        {
+            madvise((void *)(file.data + pageBegin), pageEnd - pageBegin, MADV_DONTNEED);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(ioMutex);
+            tileStates[tile] = TILE_LOADED;
+            loadedTiles.push_back(std::move(loaded));
+        }
+    }
+}
+
+// ---------------------------------------------------------
+// Print statistics of the last update
+// ---------------------------------------------------------
+void HeightStreamer::printStats()
+{
+    size_t nOfResident = 0;
+    for (int i = 0; i < nOfSlots; i++)
+    {
+        nOfResident += (slotTiles[i] >= 0);
+    }
+
+    std::cout << "height tiles: " << header.nOfTilesX << " x " << header.nOfTilesY << " of " << header.tileSize
+              << "^2, resident: " << nOfResident << " / " << nOfSlots << " ("
+              << nOfSlots * tileBytes / (1024.0 * 1024.0) << " MB), wanted: " << nOfWanted
+              << ", missing: " << nOfMisses << ", uploads: " << nOfUploads << ", evictions: " << nOfEvictions
+              << std::endl;
+}
+
+// ================================================
+// Streaming utilities
+// ================================================
+
+// ---------------------------------------------------------
+// Write a tiled height map (.htile)
+// Parameters:
+//   1. fileName: output file
+//   2. width, height: size in texels, multiples of tileSize
+//   3. tileSize: texels per tile side, a multiple of 4
+//   4. texelAt: height in [0, 1] of texel (x, y), called
+//      from several threads
+//   5. threads: number of threads, 0 means one per core
+// Return: true if succeeded
+// Remarks: written one row of tiles at a time, so the map
+//   never has to fit in memory
+// ---------------------------------------------------------
+bool writeHeightTiles(const string fileName, int width, int height, int tileSize, function<float(int, int)> texelAt,
+                      int threads)
+{
+    if (tileSize < 4 || tileSize % 4 != 0 || width % tileSize != 0 || height % tileSize != 0)
+    {
+        std::cout << "the size must be a multiple of the tile size (a multiple of 4)" << std::endl;
+        return false;
+    }
+
+    HtileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HTILE_MAGIC;
+    header.version = HTILE_VERSION;
+    header.width = width;
+    header.height = height;
+    header.tileSize = tileSize;
+    header.border = 1;
+    header.nOfTilesX = width / tileSize;
+    header.nOfTilesY = height / tileSize;
+    header.overviewStep = tileSize / 4;
+    header.overviewWidth = width / header.overviewStep;
+    header.overviewHeight = height / header.overviewStep;
+
+    int tileTexels = tileSize + 2 * header.border;
+    size_t tileCount = size_t(tileTexels) * tileTexels;
+    size_t nOfTiles = size_t(header.nOfTilesX) * header.nOfTilesY;
+    header.tileOffset = sizeof(HtileHeader);
+    header.rangeOffset = header.tileOffset + nOfTiles * tileCount * sizeof(uint16_t);
+    header.overviewOffset = header.rangeOffset + nOfTiles * 2 * sizeof(float);
+
+    std::ofstream out(fileName, std::ios::binary);
+    if (!out)
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+    out.write((const char *)&header, sizeof(header));
+
+    vector<float> ranges(nOfTiles * 2);
+    vector<double> overviewSums(size_t(header.overviewWidth) * header.overviewHeight, 0.0);
+    vector<uint16_t> tileRow(size_t(header.nOfTilesX) * tileCount);
+
+    for (int ty = 0; ty < header.nOfTilesY; ty++)
+    {
+        // Each tile only adds to its own overview texels
+        parallelFor(
+            header.nOfTilesX,
+            [&](size_t begin, size_t end) {
+                for (size_t tx = begin; tx < end; tx++)
+                {
+                    uint16_t *texels = &tileRow[tx * tileCount];
+                    uint16_t lo = 0xFFFF, hi = 0;
+
+                    for (int j = 0; j < tileTexels; j++)
+                    {
+                        int y = ty * tileSize + j - header.border;
+                        for (int i = 0; i < tileTexels; i++)
+                        {
+                            int x = int(tx) * tileSize + i - header.border;
+                            float h = glm::clamp(texelAt((x + width) % width, (y + height) % height), 0.f, 1.f);
+
+                            uint16_t q = uint16_t(h * 65535.f + 0.5f);
+                            texels[size_t(j) * tileTexels + i] = q;
+                            lo = glm::min(lo, q);
+                            hi = glm::max(hi, q);
+
+                            bool isBorder = (i < header.border || i >= tileSize + header.border ||
+                                             j < header.border || j >= tileSize + header.border);
+                            if (!isBorder)
+                            {
+                                overviewSums[size_t(y / header.overviewStep) * header.overviewWidth +
+                                             x / header.overviewStep] += q;
+                            }
+                        }
+                    }
+
+                    size_t tile = size_t(ty) * header.nOfTilesX + tx;
+                    ranges[tile * 2] = lo / 65535.f;
+                    ranges[tile * 2 + 1] = hi / 65535.f;
+                }
+            },
+            threads);
+
+        out.write((const char *)tileRow.data(), tileRow.size() * sizeof(uint16_t));
+    }
+
+    // Box-filtered overview
+    vector<uint16_t> overview(overviewSums.size());
+    double nOfSummed = double(header.overviewStep) * header.overviewStep;
+    for (size_t i = 0; i < overview.size(); i++)
+    {
+        overview[i] = uint16_t(overviewSums[i] / nOfSummed + 0.5);
+    }
+
+    out.write((const char *)ranges.data(), ranges.size() * sizeof(float));
+    out.write((const char *)overview.data(), overview.size() * sizeof(uint16_t));
+
+    return out.good();
+}
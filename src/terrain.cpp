@@ -0,0 +1,406 @@
+#include "terrain.h"
+
+// ================================================
+// Terrain class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor
+// Parameters:
+//   1. hp: min/max pyramid of texHeight, NULL means a flat terrain
+//   2. s: world size of the terrain (x and z), rounded up
+//      so the root node is a power of 2 of leaf nodes
+//   3. ts: world size of a height map texel
+//   4. hs: heights are (h * 2 - 1) * hs, as in tesQuad.glsl
+// Remarks: leaf nodes have one grid cell per texel,
+//   OpenGL resources are created by initShader
+// ---------------------------------------------------------
+Terrain::Terrain(const HeightPyramid *hp, float s, float ts, float hs)
+{
+    heightPyramid = hp;
+    texelSize = glm::max(ts, 1e-6f);
+    heightScale = hs;
+
+    patchesPerNode = 8;
+    tessLevel = 8;
+    pixelsPerCell = 8.f;
+    morphStartRatio = 0.7f;
+
+    // Levels up to a root that covers the whole terrain
+    float leafSize = float(patchesPerNode * tessLevel) * texelSize;
+    nOfLevels = 1;
+    while (leafSize * float(1 << (nOfLevels - 1)) < s && nOfLevels < 24)
+    {
+        nOfLevels++;
+    }
+    size = leafSize * float(1 << (nOfLevels - 1));
+
+    nodeSizes.resize(nOfLevels);
+    for (int k = 0; k < nOfLevels; k++)
+    {
+        nodeSizes[k] = leafSize * float(1 << k);
+    }
+
+    // Without a height map, the texture covers the terrain once
+    if (heightPyramid != NULL && heightPyramid->nOfLevels > 0)
+    {
+        uvScale = vec2(1.f) / (texelSize * vec2(heightPyramid->levelSizes[0]));
+    }
+    else
+    {
+        uvScale = vec2(1.f / size);
+    }
+
+    initRanges(perspective(45.f, 1.f * WINDOW_WIDTH / WINDOW_HEIGHT, 0.01f, 1000.f),
+               vec2(WINDOW_WIDTH, WINDOW_HEIGHT));
+
+    streamer = NULL;
+
+    nOfVisited = 0;
+    nOfCulled = 0;
+    seconds = 0.0;
+
+    grid = NULL;
+    shader = 0;
+    isBatched = false;
+    batch = NULL;
+}
+
+// ---------------------------------------------------------
+// Destructor
+// ---------------------------------------------------------
+Terrain::~Terrain()
+{
+    if (shader != 0)
+    {
+        glDeleteProgram(shader);
+    }
+
+    delete batch;
+    delete grid;
+}
+
+// ---------------------------------------------------------
+// Compute the selection and morph ranges of every level
+// Parameters:
+//   1. P: projection matrix
+//   2. viewport: viewport size, in pixels
+// Remarks:
+//   - Beyond ranges[k], cells of level k + 1 are at most
+//     pixelsPerCell on screen, so level k is not needed
+//   - Ranges double from level to level, and ranges[0] is at
+//     least the node diagonal over morphStartRatio: a node never
+//     reaches the morph range of the next level, which keeps
+//     the vertices of a coarser neighbour unmorphed
+// ---------------------------------------------------------
+void Terrain::initRanges(mat4 P, vec2 viewport)
+{
+    // Pixels per world unit at a distance of 1
+    float pixelsPerUnit = P[1][1] * viewport.y * 0.5f;
+    float cellSize = nodeSizes[0] / float(patchesPerNode * tessLevel);
+
+    float diagonal = length(vec3(nodeSizes[0], 2.f * heightScale, nodeSizes[0]));
+    float range = glm::max(2.f * cellSize * pixelsPerUnit / pixelsPerCell, diagonal / morphStartRatio);
+
+    ranges.resize(nOfLevels);
+    morphRanges.resize(nOfLevels);
+    for (int k = 0; k < nOfLevels; k++)
+    {
+        float prevRange = (k == 0) ? 0.f : ranges[k - 1];
+        ranges[k] = range;
+        morphRanges[k] = vec2(prevRange + (range - prevRange) * morphStartRatio, range);
+        range *= 2.f;
+    }
+
+    // The root covers everything, and has no coarser level to morph to
+    ranges[nOfLevels - 1] = FLT_MAX;
+    morphRanges[nOfLevels - 1] = vec2(1e30f, 2e30f);
+}
+
+// ---------------------------------------------------------
+// Initialize the patch grid and the shaders
+// ---------------------------------------------------------
+void Terrain::initShader()
+{
+    grid = Mesh::createGrid(patchesPerNode, patchesPerNode, LAYOUT_INSTANCED);
+
+    isBatched = isBatched && DrawBatch::isSupported();
+    string vsFile = isBatched ? "./shader/vsTerrainBatched.glsl" : "./shader/vsTerrain.glsl";
+    shader = buildShader(vsFile, "./shader/fsPhong.glsl", "./shader/tcsTerrain.glsl", "./shader/tesTerrain.glsl");
+
+    if (isBatched)
+    {
+        batch = new DrawBatch();
+        batch->init(grid->vao, GLuint(patchesPerNode * patchesPerNode), sizeof(TerrainDrawRecord));
+    }
+}
+
+// ---------------------------------------------------------
+// Initialize uniforms
+// ---------------------------------------------------------
+void Terrain::initUniform()
+{
+    uniTexHeight = myGetUniformLocation(shader, "texHeight");
+    uniGridSize = myGetUniformLocation(shader, "gridSize");
+    uniUvScale = myGetUniformLocation(shader, "uvScale");
+    uniHeightScale = myGetUniformLocation(shader, "heightScale");
+    uniChunkOrigin = myGetUniformLocation(shader, "chunkOrigin");
+    uniChunkSize = myGetUniformLocation(shader, "chunkSize");
+    uniTessLevel = myGetUniformLocation(shader, "tessLevel");
+    uniMorphRange = myGetUniformLocation(shader, "morphRange");
+    uniIsStreamed = myGetUniformLocation(shader, "isStreamed");
+    uniTexTiles = myGetUniformLocation(shader, "texTiles");
+    uniTexIndirection = myGetUniformLocation(shader, "texIndirection");
+    uniTexOverview = myGetUniformLocation(shader, "texOverview");
+    uniNumTiles = myGetUniformLocation(shader, "nOfTiles");
+    uniTileSize = myGetUniformLocation(shader, "tileSize");
+    uniTileBorder = myGetUniformLocation(shader, "tileBorder");
+
+    bindFrameUniforms(shader);
+}
+
+// ---------------------------------------------------------
+// Read heights from a streamed tiled height map
+// Parameters:
+//   hs: opened streamer, its textures already created
+// Remarks: selection uses the height range of every tile,
+//   and texelSize still is the world size of a texel
+// ---------------------------------------------------------
+void Terrain::setStreamer(HeightStreamer *hs)
+{
+    streamer = hs;
+    heightPyramid = &streamer->tilePyramid;
+    uvScale = vec2(1.f) / (texelSize * vec2(streamer->header.width, streamer->header.height));
+}
+
+// ---------------------------------------------------------
+// Select the chunks to draw
+// Parameters:
+//   1. V, P: transformation matrices (as passed to draw)
+//   2. eye: eye point
+// Remarks: only nodes in range and inside the view frustum
+//   are visited, so the cost follows what is visible,
+//   not the size of the terrain
+// ---------------------------------------------------------
+void Terrain::select(mat4 V, mat4 P, vec3 eye)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    vec4 planes[6];
+    getFrustumPlanes(P * V, planes);
+
+    chunks.clear();
+    nOfVisited = 0;
+    nOfCulled = 0;
+    selectNode(nOfLevels - 1, 0, 0, planes, eye);
+
+    auto endTime = std::chrono::steady_clock::now();
+    seconds = std::chrono::duration<double>(endTime - startTime).count();
+}
+
+// ---------------------------------------------------------
+// Select the chunks of a node
+// Parameters:
+//   1. level, x, z: node
+//   2. planes: frustum planes from getFrustumPlanes
+//   3. eye: eye point
+// Return: false if the node is out of its range,
+//   then its parent draws the area at its own level
+// ---------------------------------------------------------
+bool Terrain::selectNode(int level, int x, int z, const vec4 *planes, vec3 eye)
+{
+    vec3 boxMin, boxMax;
+    getNodeBounds(level, x, z, boxMin, boxMax);
+    nOfVisited++;
+
+    if (!isBoxInRange(boxMin, boxMax, eye, ranges[level]))
+    {
+        return false;
+    }
+
+    // Handled, nothing to draw
+    if (isBoxOutside(planes, boxMin, boxMax))
+    {
+        nOfCulled++;
+        return true;
+    }
+
+    // The whole node at this level
+    if (level == 0 || !isBoxInRange(boxMin, boxMax, eye, ranges[level - 1]))
+    {
+        addChunk(vec2(boxMin.x, boxMin.z), nodeSizes[level], level, tessLevel);
+        return true;
+    }
+
+    // Children in range are refined, the others are drawn
+    // at this level, with half the cells of a whole node
+    for (int i = 0; i < 4; i++)
+    {
+        int cx = 2 * x + (i & 1);
+        int cz = 2 * z + (i >> 1);
+
+        if (selectNode(level - 1, cx, cz, planes, eye))
+        {
+            continue;
+        }
+
+        vec3 childMin, childMax;
+        getNodeBounds(level - 1, cx, cz, childMin, childMax);
+        if (isBoxOutside(planes, childMin, childMax))
+        {
+            nOfCulled++;
+            continue;
+        }
+
+        addChunk(vec2(childMin.x, childMin.z), nodeSizes[level - 1], level, tessLevel / 2);
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------
+// Compute the world-space AABB of a node
+// Parameters:
+//   1. level, x, z: node
+//   2. boxMin, boxMax: corners of the AABB (output)
+// Remarks: uv = (x, -z) * uvScale, so the height map has
+//   the same orientation as on quad.obj
+// ---------------------------------------------------------
+void Terrain::getNodeBounds(int level, int x, int z, vec3 &boxMin, vec3 &boxMax) const
+{
+    float s = nodeSizes[level];
+    vec2 origin = vec2(-0.5f * size) + vec2(x, z) * s;
+
+    vec2 range(0.5f);
+    if (heightPyramid != NULL)
+    {
+        range = heightPyramid->getRange(vec2(origin.x, -origin.y - s) * uvScale,
+                                        vec2(origin.x + s, -origin.y) * uvScale);
+    }
+
+    boxMin = vec3(origin.x, (range.x * 2.f - 1.f) * heightScale, origin.y);
+    boxMax = vec3(origin.x + s, (range.y * 2.f - 1.f) * heightScale, origin.y + s);
+}
+
+// ---------------------------------------------------------
+// Add a chunk to the selection
+// Parameters:
+//   1. origin: world xz of the (x0, z0) corner
+//   2. s: world size
+//   3. level: LOD level
+//   4. tl: tessellation level of its patches
+// ---------------------------------------------------------
+void Terrain::addChunk(vec2 origin, float s, int level, int tl)
+{
+    TerrainChunk chunk;
+    chunk.origin = origin;
+    chunk.size = s;
+    chunk.level = level;
+    chunk.tessLevel = tl;
+
+    chunks.push_back(chunk);
+}
+
+// ---------------------------------------------------------
+// Draw the chunks of the last selection
+// Parameters:
+//   uniHeight: height map uniform (unless streamed)
+// Remarks:
+//   - One instanced draw of the patch grid per chunk, or
+//     all of them in one indirect draw (isBatched)
+//   - V, P, the eye point and the light come from the
+//     uniform block Frame
+// ---------------------------------------------------------
+void Terrain::draw(int uniHeight)
+{
+    glUseProgram(shader);
+
+    glUniform1i(uniTexHeight, uniHeight);
+    glUniform2i(uniGridSize, grid->gridSize.x, grid->gridSize.y);
+    glUniform2fv(uniUvScale, 1, value_ptr(uvScale));
+    glUniform1f(uniHeightScale, heightScale);
+
+    // Samplers of different types must not share a unit,
+    // even when they are not read
+    glUniform1i(uniIsStreamed, streamer != NULL);
+    glUniform1i(uniTexTiles, (streamer != NULL) ? streamer->unitTiles : STREAM_UNIT_TILES);
+    glUniform1i(uniTexIndirection, (streamer != NULL) ? streamer->unitIndirection : STREAM_UNIT_INDIRECTION);
+    glUniform1i(uniTexOverview, (streamer != NULL) ? streamer->unitOverview : STREAM_UNIT_OVERVIEW);
+    drawCounters.nOfStateChanges += 9;
+    if (streamer != NULL)
+    {
+        const HtileHeader &header = streamer->header;
+        glUniform2i(uniNumTiles, header.nOfTilesX, header.nOfTilesY);
+        glUniform1i(uniTileSize, header.tileSize);
+        glUniform1i(uniTileBorder, header.border);
+        drawCounters.nOfStateChanges += 3;
+    }
+
+    // The patch size (4) is set by glPatchParameteri
+    glBindVertexArray(grid->vao);
+    drawCounters.nOfStateChanges++;
+    GLuint nOfInstances = GLuint(patchesPerNode * patchesPerNode);
+    if (isBatched)
+    {
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            const TerrainChunk &chunk = chunks[i];
+            TerrainDrawRecord record = {chunk.origin, chunk.size, chunk.tessLevel, morphRanges[chunk.level], vec2(0.f)};
+            batch->add(grid->nOfDrawVtxs, nOfInstances, 0, batch->addRecord(&record));
+        }
+        batch->flush(GL_PATCHES);
+
+        return;
+    }
+
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        const TerrainChunk &chunk = chunks[i];
+
+        glUniform2fv(uniChunkOrigin, 1, value_ptr(chunk.origin));
+        glUniform1f(uniChunkSize, chunk.size);
+        glUniform1i(uniTessLevel, chunk.tessLevel);
+        glUniform2fv(uniMorphRange, 1, value_ptr(morphRanges[chunk.level]));
+
+        glDrawArraysInstanced(GL_PATCHES, 0, grid->nOfDrawVtxs, nOfInstances);
+    }
+    drawCounters.nOfStateChanges += 4 * chunks.size();
+    drawCounters.nOfDrawCalls += chunks.size();
+}
+
+// ---------------------------------------------------------
+// Get the number of patches of the last selection
+// ---------------------------------------------------------
+size_t Terrain::getNumPatches() const
+{
+    return chunks.size() * size_t(patchesPerNode * patchesPerNode);
+}
+
+// ---------------------------------------------------------
+// Print statistics of the last selection
+// ---------------------------------------------------------
+void Terrain::printStats()
+{
+    std::cout << "terrain: " << size << " x " << size << ", levels: " << nOfLevels << ", chunks: " << chunks.size()
+              << ", patches: " << getNumPatches() << ", nodes visited: " << nOfVisited << ", culled: " << nOfCulled
+              << ", time: " << seconds * 1000.0 << " ms" << std::endl;
+}
+
+// ================================================
+// Terrain utilities
+// ================================================
+
+// ---------------------------------------------------------
+// Test an AABB against a sphere
+// Parameters:
+//   1. boxMin, boxMax: corners of the AABB
+//   2. center, radius: sphere
+// Return: true if a point of the box is within radius of center
+// ---------------------------------------------------------
+bool isBoxInRange(vec3 boxMin, vec3 boxMax, vec3 center, float radius)
+{
+    // Closest point of the box
+    vec3 d = center - clamp(center, boxMin, boxMax);
+
+    return dot(d, d) <= radius * radius;
+}
@@ -0,0 +1,183 @@
+// Benchmark of the CDLOD terrain selection.
+// It selects the chunks of terrains of growing size from fixed
+// camera poses, and checks the selection is crack-free:
+// - neighbouring chunks are at most one level apart
+// - on their shared edge, the finer chunk is fully morphed,
+//   and the coarser one is not morphed at all
+//
+// Usage:
+//   ./terrainbench [-size n] [-repeat n]
+#include "terrain.h"
+
+// ========================================================
+// Fill an n x n height map with a few octaves of waves
+// ========================================================
+void fillHeightMap(HeightMap &heightMap, int n)
+{
+    heightMap.width = n;
+    heightMap.height = n;
+    heightMap.texels.resize(size_t(n) * n);
+
+    for (int y = 0; y < n; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            float u = float(x) / n, v = float(y) / n, h = 0.f, amplitude = 0.25f;
+            for (int o = 1; o <= 16; o *= 2)
+            {
+                h += amplitude * std::sin(6.2831853f * o * u + o) * std::cos(6.2831853f * o * v - o);
+                amplitude *= 0.5f;
+            }
+            heightMap.texels[y * n + x] = 0.5f + h;
+        }
+    }
+}
+
+// ========================================================
+// Distance from the eye to an unmorphed vertex,
+// as computed in tesTerrain.glsl
+// ========================================================
+float getVertexDistance(const Terrain &terrain, const HeightMap &heightMap, vec2 xz, vec3 eye)
+{
+    float h = (heightMap.sample(vec2(xz.x, -xz.y) * terrain.uvScale) * 2.f - 1.f) * terrain.heightScale;
+
+    return distance(eye, vec3(xz.x, h, xz.y));
+}
+
+// ========================================================
+// Count the cracks on the edges shared by two chunks
+// ========================================================
+int countCracks(const Terrain &terrain, const HeightMap &heightMap, vec3 eye)
+{
+    const vector<TerrainChunk> &chunks = terrain.chunks;
+    int nOfCracks = 0;
+
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        for (size_t j = 0; j < chunks.size(); j++)
+        {
+            const TerrainChunk &fine = chunks[i];
+            const TerrainChunk &coarse = chunks[j];
+            if (fine.level >= coarse.level)
+            {
+                continue;
+            }
+
+            // Shared edge, along z (a = 0) or along x (a = 1)
+            for (int a = 0; a < 2; a++)
+            {
+                int b = 1 - a;
+                bool isTouching = (fine.origin[b] + fine.size == coarse.origin[b]) ||
+                                  (coarse.origin[b] + coarse.size == fine.origin[b]);
+                float begin = glm::max(fine.origin[a], coarse.origin[a]);
+                float end = glm::min(fine.origin[a] + fine.size, coarse.origin[a] + coarse.size);
+                if (!isTouching || begin >= end)
+                {
+                    continue;
+                }
+
+                if (coarse.level != fine.level + 1)
+                {
+                    nOfCracks++;
+                    continue;
+                }
+
+                float edge = (fine.origin[b] + fine.size == coarse.origin[b]) ? coarse.origin[b] : fine.origin[b];
+                float cellSize = fine.size / float(terrain.patchesPerNode * fine.tessLevel);
+                for (float t = begin; t <= end; t += cellSize)
+                {
+                    vec2 xz;
+                    xz[a] = t;
+                    xz[b] = edge;
+                    float dist = getVertexDistance(terrain, heightMap, xz, eye);
+
+                    // Every other vertex is also a vertex of the coarser chunk
+                    bool isFineMorphed = dist >= terrain.morphRanges[fine.level].y;
+                    bool isCoarseStill = dist <= terrain.morphRanges[coarse.level].x;
+                    nOfCracks += !isFineMorphed || !isCoarseStill;
+                }
+            }
+        }
+    }
+
+    return nOfCracks;
+}
+
+// ========================================================
+// Main function
+// ========================================================
+int main(int argc, char const *argv[])
+{
+    vector<float> sizes = {1024.f, 16384.f, 262144.f, 4194304.f};
+    int nOfRepeats = 10;
+
+    // Parse arguments
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "-size" && i + 1 < argc)
+        {
+            sizes.assign(1, glm::max(float(atof(argv[++i])), 1.f));
+        }
+        else if (arg == "-repeat" && i + 1 < argc)
+        {
+            nOfRepeats = glm::max(atoi(argv[++i]), 1);
+        }
+        else
+        {
+            std::cout << "unknown argument : " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    HeightMap heightMap;
+    fillHeightMap(heightMap, 256);
+    HeightPyramid pyramid;
+    pyramid.build(heightMap);
+
+    // Eye point, and a point to look at
+    const float poses[4][6] = {
+        {0.f, 30.f, 0.f, 100.f, 20.f, 100.f},     // near the ground
+        {0.f, 30.f, 0.f, -100.f, 0.f, 30.f},      // near the ground, other way
+        {500.f, 300.f, 500.f, 0.f, 0.f, 0.f},     // above, looking down
+        {0.f, 3000.f, 0.f, 1.f, 0.f, 1.f},        // high above
+    };
+
+    int nOfCracks = 0;
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        Terrain terrain(&pyramid, sizes[s]);
+        mat4 P = perspective(45.f, 1.f * WINDOW_WIDTH / WINDOW_HEIGHT, 0.1f, 4.f * terrain.size);
+        terrain.initRanges(P, vec2(WINDOW_WIDTH, WINDOW_HEIGHT));
+
+        // Patches of a single grid at the finest level
+        double nOfFlatPatches = std::pow(double(terrain.size) / (terrain.tessLevel * terrain.texelSize), 2.0);
+        std::cout << "terrain " << terrain.size << " x " << terrain.size << ", " << terrain.nOfLevels
+                  << " levels, " << nOfFlatPatches << " patches at full resolution" << '\n';
+
+        for (int p = 0; p < 4; p++)
+        {
+            vec3 eye(poses[p][0], poses[p][1], poses[p][2]);
+            mat4 V = lookAt(eye, vec3(poses[p][3], poses[p][4], poses[p][5]), vec3(0.f, 1.f, 0.f));
+
+            double best = 1e30;
+            for (int r = 0; r < nOfRepeats; r++)
+            {
+                terrain.select(V, P, eye);
+                best = glm::min(best, terrain.seconds);
+            }
+
+            int poseCracks = countCracks(terrain, heightMap, eye);
+            nOfCracks += poseCracks;
+
+            std::cout << "  pose " << p << ": chunks " << terrain.chunks.size() << ", patches "
+                      << terrain.getNumPatches() << ", nodes visited " << terrain.nOfVisited << ", culled "
+                      << terrain.nOfCulled << ", select " << best * 1000.0 << " ms, cracks " << poseCracks << '\n';
+        }
+    }
+
+    std::cout << "results " << (nOfCracks == 0 ? "crack-free" : "HAVE CRACKS") << std::endl;
+
+    return (nOfCracks == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,985 @@
+#include "tessellator.h"
+#include "pyramid.h"
+
+// ================================================
+// HeightMap class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor
+// ---------------------------------------------------------
+HeightMap::HeightMap()
+{
+    width = 0;
+    height = 0;
+}
+
+// ---------------------------------------------------------
+// Load height map image
+// Parameters:
+//   1. texDir: height map image file
+//   2. imgType: image type
+// Return: true if succeeded
+// Remarks: read by loadHeightImage, as Mesh::setHeightTexture,
+//   so values match what the shader reads from .r
+// ---------------------------------------------------------
+bool HeightMap::load(const string texDir, FREE_IMAGE_FORMAT imgType)
+{
+    GLenum format;
+
+    return loadHeightImage(texDir, imgType, width, height, texels, format);
+}
+
+// ---------------------------------------------------------
+// Get a texel with GL_REPEAT wrapping
+// Parameters:
+//   x, y: texel coordinate
+// Return: texel value
+// ---------------------------------------------------------
+float HeightMap::texel(int x, int y) const
+{
+    x %= width;
+    y %= height;
+    x += (x < 0) ? width : 0;
+    y += (y < 0) ? height : 0;
+
+    return texels[size_t(y) * width + x];
+}
+
+// ---------------------------------------------------------
+// Sample the height map like texture() with GL_LINEAR
+// Parameters:
+//   uv: texture coordinate
+// Return: filtered value
+// ---------------------------------------------------------
+float HeightMap::sample(vec2 uv) const
+{
+    if (texels.empty())
+    {
+        return 0.f;
+    }
+
+    // Texel centers are at (i + 0.5) / size
+    float x = uv.x * width - 0.5f;
+    float y = uv.y * height - 0.5f;
+    float x0 = std::floor(x);
+    float y0 = std::floor(y);
+    float fx = x - x0;
+    float fy = y - y0;
+    int ix = int(x0);
+    int iy = int(y0);
+
+    float bottom = mix(texel(ix, iy), texel(ix + 1, iy), fx);
+    float top = mix(texel(ix, iy + 1), texel(ix + 1, iy + 1), fx);
+
+    return mix(bottom, top, fy);
+}
+
+// ---------------------------------------------------------
+// Get the range of sample() over a uv rectangle
+// Parameters:
+//   uvMin, uvMax: corners of the rectangle
+// Return: (min, max) of the filtered value
+// Remarks: a GL_LINEAR sample is a weighted average of
+//   the 2 x 2 texels around it, so the range of the texels
+//   touched by the rectangle bounds every sample inside
+// ---------------------------------------------------------
+vec2 HeightMap::getRange(vec2 uvMin, vec2 uvMax) const
+{
+    if (texels.empty())
+    {
+        return vec2(0.f);
+    }
+
+    int x0 = int(std::floor(uvMin.x * width - 0.5f));
+    int y0 = int(std::floor(uvMin.y * height - 0.5f));
+    int x1 = int(std::floor(uvMax.x * width - 0.5f)) + 1;
+    int y1 = int(std::floor(uvMax.y * height - 0.5f)) + 1;
+
+    // Past one full period, every texel is touched
+    x1 = glm::min(x1, x0 + width - 1);
+    y1 = glm::min(y1, y0 + height - 1);
+
+    vec2 range(FLT_MAX, -FLT_MAX);
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            float h = texel(x, y);
+            range.x = glm::min(range.x, h);
+            range.y = glm::max(range.y, h);
+        }
+    }
+
+    return range;
+}
+
+// ---------------------------------------------------------
+// Build the mipmaps of the height map
+// Parameters:
+//   1. mips: mips[k] is mip level k (output), mips[0] is left
+//      empty, level 0 being the height map itself
+//   2. nOfLevels: number of levels, 0 means down to 1 x 1
+//   3. threads: number of threads, 0 means one per core
+// Remarks: 2 x 2 box filter, as glGenerateMipmap does for
+//   power-of-2 sizes
+// ---------------------------------------------------------
+void HeightMap::buildMips(vector<HeightMap> &mips, int nOfLevels, int threads) const
+{
+    if (nOfLevels <= 0)
+    {
+        nOfLevels = 1;
+        while ((width >> (nOfLevels - 1)) > 1 || (height >> (nOfLevels - 1)) > 1)
+        {
+            nOfLevels++;
+        }
+    }
+
+    mips.assign(nOfLevels, HeightMap());
+    for (int k = 1; k < nOfLevels; k++)
+    {
+        const HeightMap &src = (k == 1) ? *this : mips[k - 1];
+        HeightMap &dst = mips[k];
+        dst.width = glm::max(src.width / 2, 1);
+        dst.height = glm::max(src.height / 2, 1);
+        dst.texels.resize(size_t(dst.width) * dst.height);
+
+        // A 1-texel side is averaged with itself
+        int dx = (src.width > 1) ? 1 : 0;
+        int dy = (src.height > 1) ? 1 : 0;
+
+        parallelFor(
+            dst.height,
+            [&](size_t begin, size_t end) {
+                for (size_t y = begin; y < end; y++)
+                {
+                    for (int x = 0; x < dst.width; x++)
+                    {
+                        int sx = 2 * x, sy = 2 * int(y);
+                        dst.texels[y * dst.width + x] = (src.texel(sx, sy) + src.texel(sx + dx, sy) +
+                                                         src.texel(sx, sy + dy) + src.texel(sx + dx, sy + dy)) *
+                                                        0.25f;
+                    }
+                }
+            },
+            threads);
+    }
+}
+
+// ---------------------------------------------------------
+// Sample the height map like textureLod() with
+// GL_LINEAR_MIPMAP_LINEAR
+// Parameters:
+//   1. mips: mipmaps from buildMips
+//   2. uv: texture coordinate
+//   3. lod: mip level, clamped to the existing levels
+// Return: filtered value
+// ---------------------------------------------------------
+float HeightMap::sampleLod(const vector<HeightMap> &mips, vec2 uv, float lod) const
+{
+    int maxLevel = glm::max(int(mips.size()) - 1, 0);
+    lod = glm::clamp(lod, 0.f, float(maxLevel));
+
+    int k = int(std::floor(lod));
+    float f = lod - float(k);
+    float h = (k == 0) ? sample(uv) : mips[k].sample(uv);
+    if (f == 0.f || k >= maxLevel)
+    {
+        return h;
+    }
+
+    return mix(h, mips[k + 1].sample(uv), f);
+}
+
+// ================================================
+// Tessellation utilities
+// ================================================
+
+// ------------------------------------------------------------
+// Compute tessellation level based on some distance
+// Parameters:
+//   1. dist0, dist1: generally, eye-to-adjacent-vertex distances
+//   2. lodScale: factor of the level
+// Return: tessellation level, times lodScale
+// Remarks: must be kept identical to tcsQuad.glsl
+// ------------------------------------------------------------
+float getTessLevel(float dist0, float dist1, float lodScale)
+{
+    float avgDist = (dist0 + dist1) / 2.f;
+
+    float level;
+    if (avgDist <= 2.f)
+    {
+        level = 32.f;
+    }
+    else if (avgDist <= 4.f)
+    {
+        level = 16.f;
+    }
+    else if (avgDist <= 8.f)
+    {
+        level = 8.f;
+    }
+    else if (avgDist <= 16.f)
+    {
+        level = 4.f;
+    }
+    else if (avgDist <= 32.f)
+    {
+        level = 2.f;
+    }
+    else
+    {
+        level = 1.f;
+    }
+
+    return glm::clamp(level * lodScale, 1.f, float(MAX_TESS_LEVEL));
+}
+
+// ------------------------------------------------------------
+// Check the order of two end points
+// Parameters:
+//   a, b: world positions
+// Return: true if a comes first (x, then y, then z)
+// ------------------------------------------------------------
+static bool isBefore(vec3 a, vec3 b)
+{
+    return a.x < b.x || (a.x == b.x && (a.y < b.y || (a.y == b.y && a.z < b.z)));
+}
+
+// Control points of the edge of each outer level
+static const int quadEdges[4][2] = {{3, 0}, {0, 1}, {1, 2}, {2, 3}};
+
+// ------------------------------------------------------------
+// Get the end points of an edge, in the order both patches
+// of the edge take them (getEdgeLevel in tcsQuad.glsl)
+// Parameters:
+//   1. worldPos: world positions of the 4 control points
+//   2. e: outer level
+//   3. i, j: control points (output)
+// ------------------------------------------------------------
+static void getEdgeEnds(const vec3 *worldPos, int e, int &i, int &j)
+{
+    i = quadEdges[e][0];
+    j = quadEdges[e][1];
+    if (isBefore(worldPos[j], worldPos[i]))
+    {
+        std::swap(i, j);
+    }
+}
+
+// ------------------------------------------------------------
+// Compute tessellation levels of a quad patch
+// Parameters:
+//   1. worldPos: world positions of the 4 control points
+//   2. eye: eye point
+//   3. lodScale: factor of every level
+// Return: outer and inner levels, as assigned in tcsQuad.glsl
+// ------------------------------------------------------------
+TessLevels computeTessLevels(const vec3 *worldPos, vec3 eye, float lodScale)
+{
+    TessLevels tl;
+
+    for (int e = 0; e < 4; e++)
+    {
+        int i, j;
+        getEdgeEnds(worldPos, e, i, j);
+        tl.outer[e] = getTessLevel(distance(eye, worldPos[i]), distance(eye, worldPos[j]), lodScale);
+    }
+
+    float avg = (tl.outer[0] + tl.outer[1] + tl.outer[2] + tl.outer[3]) * 0.25f;
+
+    tl.inner[0] = avg;
+    tl.inner[1] = avg;
+
+    return tl;
+}
+
+// ------------------------------------------------------------
+// Get the maximum roughness over a uv rectangle
+// Parameters:
+//   1. roughness: min/max pyramid of the roughness map
+//   2. uvMin, uvMax: corners of the rectangle
+// Return: roughness, in height map units per texel
+// Remarks: must be kept identical to tcsQuad.glsl, which
+//   reads the same cells from the mip levels of texRoughness
+// ------------------------------------------------------------
+float getRoughness(const HeightPyramid &roughness, vec2 uvMin, vec2 uvMax)
+{
+    if (roughness.nOfLevels < 2)
+    {
+        return 0.f;
+    }
+
+    ivec2 size = roughness.levelSizes[0];
+    ivec2 t0 = clamp(ivec2(floor(uvMin * vec2(size) - 0.5f)), ivec2(0), size - 1);
+    ivec2 t1 = clamp(ivec2(floor(uvMax * vec2(size) - 0.5f)) + 1, ivec2(0), size - 1);
+
+    // ceil(log2(span)), at least 1 (the first mip level)
+    int span = glm::max(t1.x - t0.x, t1.y - t0.y) + 1;
+    int level = 1;
+    while ((1 << level) < span && level < roughness.nOfLevels - 1)
+    {
+        level++;
+    }
+
+    float r = 0.f;
+    for (int y = t0.y >> level; y <= (t1.y >> level); y++)
+    {
+        for (int x = t0.x >> level; x <= (t1.x >> level); x++)
+        {
+            r = glm::max(r, roughness.getBounds(level, x, y).y);
+        }
+    }
+
+    return r;
+}
+
+// ------------------------------------------------------------
+// Compute tessellation level from the screen-space error
+// Parameters:
+//   1. p0, p1: world positions of the end points (not displaced)
+//   2. uv0, uv1: uvs of the end points
+//   3. roughness: from getRoughness
+//   4. eye: eye point
+//   5. sse: metric inputs
+// Return: tessellation level
+// Remarks: must be kept identical to tcsQuad.glsl
+// ------------------------------------------------------------
+float getScreenErrorLevel(vec3 p0, vec3 p1, vec2 uv0, vec2 uv1, float roughness, vec3 eye,
+                          const ScreenErrorMetric &sse)
+{
+    vec2 size(1.f);
+    if (sse.heightMap != NULL && !sse.heightMap->texels.empty())
+    {
+        size = vec2(sse.heightMap->width, sse.heightMap->height);
+        p0.y += (sse.heightMap->sample(uv0) * 2.f - 1.f) * sse.heightScale;
+        p1.y += (sse.heightMap->sample(uv1) * 2.f - 1.f) * sse.heightScale;
+    }
+
+    // Pixels per world unit at the center of the edge
+    float dist = glm::max(distance(eye, (p0 + p1) * 0.5f), 1e-3f);
+    float pixelsPerUnit = sse.P[1][1] * sse.viewport.y * 0.5f / dist;
+
+    float lengthLevel = distance(p0, p1) * pixelsPerUnit / sse.pixelsPerTriangle;
+
+    float texels = length((uv1 - uv0) * size);
+    float error = roughness * 2.f * sse.heightScale * pixelsPerUnit;
+    float errorLevel = texels * std::sqrt(error / (4.f * sse.maxPixelError));
+
+    return glm::clamp(glm::min(glm::min(lengthLevel, errorLevel) * sse.lodScale, texels), 1.f, float(MAX_TESS_LEVEL));
+}
+
+// ------------------------------------------------------------
+// Compute tessellation levels of a quad patch
+// from the screen-space error
+// Parameters:
+//   1. worldPos: world positions of the 4 control points
+//   2. uvs: uvs of the 4 control points
+//   3. eye: eye point
+//   4. sse: metric inputs
+// Return: outer and inner levels, as assigned in tcsQuad.glsl
+// ------------------------------------------------------------
+TessLevels computeTessLevels(const vec3 *worldPos, const vec2 *uvs, vec3 eye, const ScreenErrorMetric &sse)
+{
+    TessLevels tl;
+
+    // Roughness of an edge or of the whole patch
+    auto roughnessOf = [&](vec2 uvMin, vec2 uvMax) {
+        return (sse.roughness != NULL) ? getRoughness(*sse.roughness, uvMin, uvMax) : 0.f;
+    };
+
+    for (int e = 0; e < 4; e++)
+    {
+        int i, j;
+        getEdgeEnds(worldPos, e, i, j);
+        float r = roughnessOf(min(uvs[i], uvs[j]), max(uvs[i], uvs[j]));
+        tl.outer[e] = getScreenErrorLevel(worldPos[i], worldPos[j], uvs[i], uvs[j], r, eye, sse);
+    }
+
+    // Interior: mid lines of the patch, with the roughness of the whole patch
+    vec2 uvMin = min(min(uvs[0], uvs[1]), min(uvs[2], uvs[3]));
+    vec2 uvMax = max(max(uvs[0], uvs[1]), max(uvs[2], uvs[3]));
+    float r = roughnessOf(uvMin, uvMax);
+
+    float innerU = getScreenErrorLevel((worldPos[3] + worldPos[0]) * 0.5f, (worldPos[1] + worldPos[2]) * 0.5f,
+                                       (uvs[3] + uvs[0]) * 0.5f, (uvs[1] + uvs[2]) * 0.5f, r, eye, sse);
+    float innerV = getScreenErrorLevel((worldPos[0] + worldPos[1]) * 0.5f, (worldPos[2] + worldPos[3]) * 0.5f,
+                                       (uvs[0] + uvs[1]) * 0.5f, (uvs[2] + uvs[3]) * 0.5f, r, eye, sse);
+
+    tl.inner[0] = glm::max(innerU, glm::max(tl.outer[1], tl.outer[3]));
+    tl.inner[1] = glm::max(innerV, glm::max(tl.outer[0], tl.outer[2]));
+
+    return tl;
+}
+
+// ------------------------------------------------------------
+// Round tessellation levels (equal_spacing)
+// Parameters:
+//   1. tl: levels written by the TCS
+//   2. outer, inner: integer levels (output)
+// Return: false if the patch is discarded
+// ------------------------------------------------------------
+bool roundTessLevels(const TessLevels &tl, int *outer, int *inner)
+{
+    // A patch with an outer level <= 0 (or NaN) is discarded
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(tl.outer[i] > 0.f))
+        {
+            return false;
+        }
+
+        outer[i] = int(std::ceil(glm::clamp(tl.outer[i], 1.f, float(MAX_TESS_LEVEL))));
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        float level = tl.inner[i];
+        level = (level > 0.f) ? level : 1.f;
+        inner[i] = int(std::ceil(glm::clamp(level, 1.f, float(MAX_TESS_LEVEL))));
+    }
+
+    return true;
+}
+
+// ------------------------------------------------------------
+// Check the "two triangles" special case of quad tessellation
+// Parameters:
+//   outer, inner: rounded levels
+// Return: true if all levels are 1
+// ------------------------------------------------------------
+static bool isTrivialQuad(const int *outer, const int *inner)
+{
+    return outer[0] == 1 && outer[1] == 1 && outer[2] == 1 && outer[3] == 1 && inner[0] == 1 && inner[1] == 1;
+}
+
+// ------------------------------------------------------------
+// Count the vertices and triangles of a tessellated quad
+// Parameters:
+//   1. outer, inner: rounded levels
+//   2. nOfVtxs, nOfTris: counts (output)
+// Remarks: the triangulation between rings is up to the
+//   implementation, but these counts are not
+// ------------------------------------------------------------
+void countQuadDomain(const int *outer, const int *inner, size_t &nOfVtxs, size_t &nOfTris)
+{
+    if (isTrivialQuad(outer, inner))
+    {
+        nOfVtxs = 4;
+        nOfTris = 2;
+        return;
+    }
+
+    // An inner level of 1 is treated as 1 + epsilon, i.e. 2
+    size_t a = glm::max(inner[0], 2);
+    size_t b = glm::max(inner[1], 2);
+    size_t nOfBoundary = outer[0] + outer[1] + outer[2] + outer[3];
+
+    nOfVtxs = nOfBoundary + (a - 1) * (b - 1);
+    nOfTris = nOfBoundary + 2 * (a - 1) * (b - 1) - 2;
+}
+
+// ------------------------------------------------------------
+// Triangulate the strip between an outer edge and an inner edge
+// Parameters:
+//   1. outerIdx: n + 1 vertex indices along the outer edge
+//   2. innerIdx: m + 1 vertex indices along the inner edge
+//   3. tris: triangle list (output, appended)
+// ------------------------------------------------------------
+static void stitchStrip(const vector<GLuint> &outerIdx, const vector<GLuint> &innerIdx, vector<GLuint> &tris)
+{
+    size_t n = outerIdx.size() - 1;
+    size_t m = innerIdx.size() - 1;
+    size_t i = 0, j = 0;
+
+    while (i < n || j < m)
+    {
+        // Advance on the edge whose next vertex comes first
+        bool advanceOuter = (j == m) || (i < n && (i + 1) * m <= (j + 1) * n);
+
+        if (advanceOuter)
+        {
+            tris.push_back(outerIdx[i]);
+            tris.push_back(outerIdx[i + 1]);
+            tris.push_back(innerIdx[j]);
+            i++;
+        }
+        else
+        {
+            tris.push_back(outerIdx[i]);
+            tris.push_back(innerIdx[j + 1]);
+            tris.push_back(innerIdx[j]);
+            j++;
+        }
+    }
+}
+
+// ------------------------------------------------------------
+// Tessellate the quad domain
+// Parameters:
+//   1. outer, inner: rounded levels
+//   2. coords: (u, v) of the generated vertices (output)
+//   3. tris: counter-clockwise triangles (output)
+// Remarks: vertex positions follow equal_spacing exactly,
+//   the outer ring comes first, then the inner grid
+// ------------------------------------------------------------
+void tessellateQuadDomain(const int *outer, const int *inner, vector<vec2> &coords, vector<GLuint> &tris)
+{
+    coords.clear();
+    tris.clear();
+
+    if (isTrivialQuad(outer, inner))
+    {
+        coords.push_back(vec2(0.f, 0.f));
+        coords.push_back(vec2(1.f, 0.f));
+        coords.push_back(vec2(1.f, 1.f));
+        coords.push_back(vec2(0.f, 1.f));
+
+        GLuint quadTris[6] = {0, 1, 2, 0, 2, 3};
+        tris.assign(quadTris, quadTris + 6);
+        return;
+    }
+
+    int a = glm::max(inner[0], 2);
+    int b = glm::max(inner[1], 2);
+
+    // Outer ring, counter-clockwise from (0, 0)
+    // Side 0: v = 0 (outer[1]), side 1: u = 1 (outer[2]),
+    // side 2: v = 1 (outer[3]), side 3: u = 0 (outer[0])
+    int sideLevels[4] = {outer[1], outer[2], outer[3], outer[0]};
+    vec2 corners[5] = {vec2(0.f, 0.f), vec2(1.f, 0.f), vec2(1.f, 1.f), vec2(0.f, 1.f), vec2(0.f, 0.f)};
+    GLuint sideStart[5];
+
+    for (int s = 0; s < 4; s++)
+    {
+        sideStart[s] = coords.size();
+        for (int i = 0; i < sideLevels[s]; i++)
+        {
+            coords.push_back(mix(corners[s], corners[s + 1], float(i) / sideLevels[s]));
+        }
+    }
+    sideStart[4] = 0;
+
+    // Inner grid, (a - 1) x (b - 1) vertices
+    GLuint innerStart = coords.size();
+    for (int j = 1; j < b; j++)
+    {
+        for (int i = 1; i < a; i++)
+        {
+            coords.push_back(vec2(float(i) / a, float(j) / b));
+        }
+    }
+
+    auto innerIdx = [&](int i, int j) { return GLuint(innerStart + (j - 1) * (a - 1) + (i - 1)); };
+
+    // Inner grid quads
+    for (int j = 1; j < b - 1; j++)
+    {
+        for (int i = 1; i < a - 1; i++)
+        {
+            GLuint i0 = innerIdx(i, j), i1 = innerIdx(i + 1, j);
+            GLuint i2 = innerIdx(i + 1, j + 1), i3 = innerIdx(i, j + 1);
+            GLuint quadTris[6] = {i0, i1, i2, i0, i2, i3};
+            tris.insert(tris.end(), quadTris, quadTris + 6);
+        }
+    }
+
+    // Stitch each side of the outer ring to the inner rectangle
+    vector<GLuint> outerEdge, innerEdge;
+    for (int s = 0; s < 4; s++)
+    {
+        outerEdge.clear();
+        innerEdge.clear();
+
+        for (int i = 0; i < sideLevels[s]; i++)
+        {
+            outerEdge.push_back(sideStart[s] + i);
+        }
+        outerEdge.push_back(sideStart[s + 1]);
+
+        if (s == 0)
+        {
+            for (int i = 1; i < a; i++)
+                innerEdge.push_back(innerIdx(i, 1));
+        }
+        else if (s == 1)
+        {
+            for (int j = 1; j < b; j++)
+                innerEdge.push_back(innerIdx(a - 1, j));
+        }
+        else if (s == 2)
+        {
+            for (int i = a - 1; i > 0; i--)
+                innerEdge.push_back(innerIdx(i, b - 1));
+        }
+        else
+        {
+            for (int j = b - 1; j > 0; j--)
+                innerEdge.push_back(innerIdx(1, j));
+        }
+
+        stitchStrip(outerEdge, innerEdge, tris);
+    }
+}
+
+// ------------------------------------------------------------
+// Get the mip level of texHeight at a domain vertex
+// Parameters:
+//   1. uvs: uvs of the 4 control points
+//   2. outer, inner: rounded levels
+//   3. coord: domain coordinate (gl_TessCoord)
+//   4. size: size of the height map, in texels
+// Return: log2 of the texels between neighbouring vertices
+// Remarks: same as getHeightLod() in tesQuad.glsl
+// ------------------------------------------------------------
+float getHeightLod(const vec2 *uvs, const int *outer, const int *inner, vec2 coord, vec2 size)
+{
+    bool isOnU = (coord.x == 0.f || coord.x == 1.f);
+    bool isOnV = (coord.y == 0.f || coord.y == 1.f);
+    if (isOnU && isOnV)
+    {
+        return 0.f;
+    }
+
+    float spacing;
+    if (coord.x == 0.f)
+    {
+        spacing = length((uvs[3] - uvs[0]) * size) / float(outer[0]);
+    }
+    else if (coord.y == 0.f)
+    {
+        spacing = length((uvs[1] - uvs[0]) * size) / float(outer[1]);
+    }
+    else if (coord.x == 1.f)
+    {
+        spacing = length((uvs[2] - uvs[1]) * size) / float(outer[2]);
+    }
+    else if (coord.y == 1.f)
+    {
+        spacing = length((uvs[3] - uvs[2]) * size) / float(outer[3]);
+    }
+    else
+    {
+        float spacingU = length((uvs[1] + uvs[2] - uvs[0] - uvs[3]) * 0.5f * size) / float(inner[0]);
+        float spacingV = length((uvs[3] + uvs[2] - uvs[0] - uvs[1]) * 0.5f * size) / float(inner[1]);
+        spacing = glm::max(spacingU, spacingV);
+    }
+
+    return glm::max(std::log2(glm::max(spacing, 1e-6f)), 0.f);
+}
+
+// ------------------------------------------------------------
+// Bilinear interpolation of the 4 control points
+// Remarks: same as interpolate() in tesQuad.glsl
+// ------------------------------------------------------------
+template <typename T> static T interpolate(const T &v0, const T &v1, const T &v2, const T &v3, vec2 coord)
+{
+    float u = coord.x;
+    float v = coord.y;
+
+    return v0 * ((1.f - u) * (1.f - v)) + v1 * (u * (1.f - v)) + v2 * (u * v) + v3 * ((1.f - u) * v);
+}
+
+// ================================================
+// Tessellator class definition
+// ================================================
+
+// ---------------------------------------------------------
+// Constructor
+// Parameters:
+//   1. m: quad mesh (loaded by loadObjQuad)
+//   2. hm: height map, NULL means no displacement
+// ---------------------------------------------------------
+Tessellator::Tessellator(const Mesh &m, const HeightMap *hm) : mesh(m)
+{
+    heightMap = hm;
+
+    if (heightMap != NULL)
+    {
+        heightMap->buildMips(heightMips);
+    }
+
+    // Same as "scale" in tesQuad.glsl
+    heightScale = 10.f;
+    keepVertices = true;
+    lodScale = 1.f;
+
+    // Same defaults as Mesh
+    metric = TESS_METRIC_SCREEN_ERROR;
+    screenError.P = perspective(45.f, 1.f * WINDOW_WIDTH / WINDOW_HEIGHT, 0.01f, 1000.f);
+    screenError.viewport = vec2(WINDOW_WIDTH, WINDOW_HEIGHT);
+    screenError.pixelsPerTriangle = 64.f;
+    screenError.maxPixelError = 350.f;
+    screenError.heightMap = hm;
+    screenError.roughness = NULL;
+    screenError.lodScale = 1.f;
+
+    nOfPatches = nOfVertices = nOfTriangles = 0;
+    nOfThreads = 1;
+    seconds = 0.0;
+}
+
+// ---------------------------------------------------------
+// Tessellate every patch of the mesh
+// Parameters:
+//   1. M: model matrix (as passed to Mesh::draw)
+//   2. eye: eye point
+//   3. threads: number of threads, 0 means one per core
+// ---------------------------------------------------------
+void Tessellator::run(mat4 M, vec3 eye, int threads)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    nOfThreads = getNumThreads(threads);
+    nOfPatches = mesh.faces.size();
+    levels.resize(nOfPatches);
+    screenError.heightScale = heightScale;
+    screenError.lodScale = lodScale;
+    vtxOffsets.assign(nOfPatches + 1, 0);
+    triOffsets.assign(nOfPatches + 1, 0);
+
+    // Same transformations as vsPhong.glsl
+    mat4 invM = inverse(M);
+    auto toWorldPos = [&](GLuint idx) { return vec3(M * vec4(mesh.vertices[idx], 1.f)); };
+    auto toWorldN = [&](GLuint idx) { return normalize(vec3(vec4(mesh.faceNormals[idx], 1.f) * invM)); };
+
+    // Pass 1: tessellation levels and output sizes
+    parallelFor(
+        nOfPatches,
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                const Face &f = mesh.faces[i];
+                vec3 worldPos[4] = {toWorldPos(f.v1), toWorldPos(f.v2), toWorldPos(f.v3), toWorldPos(f.v4)};
+                vec2 uvs[4] = {mesh.uvs[f.vt1], mesh.uvs[f.vt2], mesh.uvs[f.vt3], mesh.uvs[f.vt4]};
+                levels[i] = (metric == TESS_METRIC_DISTANCE) ? computeTessLevels(worldPos, eye, lodScale)
+                                                             : computeTessLevels(worldPos, uvs, eye, screenError);
+
+                int outer[4], inner[2];
+                size_t nOfVtxs = 0, nOfTris = 0;
+                if (roundTessLevels(levels[i], outer, inner))
+                {
+                    countQuadDomain(outer, inner, nOfVtxs, nOfTris);
+                }
+                vtxOffsets[i + 1] = nOfVtxs;
+                triOffsets[i + 1] = nOfTris;
+            }
+        },
+        nOfThreads);
+
+    // Prefix sums give where each patch writes
+    for (size_t i = 0; i < nOfPatches; i++)
+    {
+        vtxOffsets[i + 1] += vtxOffsets[i];
+        triOffsets[i + 1] += triOffsets[i];
+    }
+    nOfVertices = vtxOffsets[nOfPatches];
+    nOfTriangles = triOffsets[nOfPatches];
+
+    if (keepVertices)
+    {
+        positions.resize(nOfVertices);
+        uvs.resize(nOfVertices);
+        normals.resize(nOfVertices);
+        indices.resize(nOfTriangles * 3);
+    }
+
+    // Pass 2: evaluate every domain vertex (the TES part)
+    std::mutex boundsMutex;
+    boundsMin = vec3(FLT_MAX);
+    boundsMax = vec3(-FLT_MAX);
+    parallelFor(
+        nOfPatches,
+        [&](size_t begin, size_t end) {
+            vector<vec2> coords;
+            vector<GLuint> tris;
+            vec3 chunkMin(FLT_MAX), chunkMax(-FLT_MAX);
+
+            for (size_t i = begin; i < end; i++)
+            {
+                int outer[4], inner[2];
+                if (!roundTessLevels(levels[i], outer, inner))
+                {
+                    continue;
+                }
+                tessellateQuadDomain(outer, inner, coords, tris);
+
+                const Face &f = mesh.faces[i];
+                vec3 p0 = toWorldPos(f.v1), p1 = toWorldPos(f.v2), p2 = toWorldPos(f.v3), p3 = toWorldPos(f.v4);
+                vec3 n0 = toWorldN(f.vn1), n1 = toWorldN(f.vn2), n2 = toWorldN(f.vn3), n3 = toWorldN(f.vn4);
+                const vec2 &t0 = mesh.uvs[f.vt1], &t1 = mesh.uvs[f.vt2];
+                const vec2 &t2 = mesh.uvs[f.vt3], &t3 = mesh.uvs[f.vt4];
+                const vec2 patchUvs[4] = {t0, t1, t2, t3};
+
+                size_t vtxBase = vtxOffsets[i];
+                for (size_t k = 0; k < coords.size(); k++)
+                {
+                    vec3 worldPos = interpolate(p0, p1, p2, p3, coords[k]);
+                    vec2 uv = interpolate(t0, t1, t2, t3, coords[k]);
+
+                    if (heightMap != NULL)
+                    {
+                        vec2 size(heightMap->width, heightMap->height);
+                        float lod = getHeightLod(patchUvs, outer, inner, coords[k], size);
+                        float offset = heightMap->sampleLod(heightMips, uv, lod) * 2.f - 1.f;
+                        worldPos.y += offset * heightScale;
+                    }
+
+                    chunkMin = min(chunkMin, worldPos);
+                    chunkMax = max(chunkMax, worldPos);
+
+                    if (keepVertices)
+                    {
+                        positions[vtxBase + k] = worldPos;
+                        uvs[vtxBase + k] = uv;
+                        normals[vtxBase + k] = interpolate(n0, n1, n2, n3, coords[k]);
+                    }
+                }
+
+                if (keepVertices)
+                {
+                    size_t triBase = triOffsets[i] * 3;
+                    for (size_t k = 0; k < tris.size(); k++)
+                    {
+                        indices[triBase + k] = GLuint(vtxBase + tris[k]);
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(boundsMutex);
+            boundsMin = min(boundsMin, chunkMin);
+            boundsMax = max(boundsMax, chunkMax);
+        },
+        nOfThreads);
+
+    auto endTime = std::chrono::steady_clock::now();
+    seconds = std::chrono::duration<double>(endTime - startTime).count();
+}
+
+// ---------------------------------------------------------
+// Print statistics of the last run
+// ---------------------------------------------------------
+void Tessellator::printStats()
+{
+    double safeSeconds = glm::max(seconds, 1e-9);
+
+    std::cout << "patches: " << nOfPatches << ", vertices: " << nOfVertices << ", triangles: " << nOfTriangles
+              << '\n';
+    std::cout << "bounds: " << to_string(boundsMin) << " - " << to_string(boundsMax) << '\n';
+    std::cout << "time: " << seconds * 1000.0 << " ms on " << nOfThreads << " thread(s)" << '\n';
+    std::cout << "patches/s: " << nOfPatches / safeSeconds << ", vertices/s: " << nOfVertices / safeSeconds
+              << std::endl;
+}
+
+// ---------------------------------------------------------
+// Compare the outer levels of the last run across the edges
+// shared by two patches
+// Return: number of shared edges whose levels differ
+// Remarks:
+//   - Edges are matched by the model-space positions of
+//     their end points, so duplicated vertices (.obj files)
+//     still match
+//   - Levels must be equal bit for bit, before rounding:
+//     that is what fractional spacings need, and it implies
+//     the same rounded level with equal_spacing
+// ---------------------------------------------------------
+size_t Tessellator::checkSharedEdges()
+{
+    // One record per patch edge, its first end point first
+    struct EdgeRecord
+    {
+        vec3 a, b;
+        float level;
+    };
+    auto keyOf = [](const EdgeRecord &r) { return std::tie(r.a.x, r.a.y, r.a.z, r.b.x, r.b.y, r.b.z); };
+
+    vector<EdgeRecord> edges;
+    edges.reserve(levels.size() * 4);
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        const Face &f = mesh.faces[i];
+        vec3 pos[4] = {mesh.vertices[f.v1], mesh.vertices[f.v2], mesh.vertices[f.v3], mesh.vertices[f.v4]};
+        for (int e = 0; e < 4; e++)
+        {
+            vec3 a = pos[quadEdges[e][0]], b = pos[quadEdges[e][1]];
+            edges.push_back({isBefore(a, b) ? a : b, isBefore(a, b) ? b : a, levels[i].outer[e]});
+        }
+    }
+
+    std::sort(edges.begin(), edges.end(),
+              [&](const EdgeRecord &r0, const EdgeRecord &r1) { return keyOf(r0) < keyOf(r1); });
+
+    size_t nOfShared = 0, nOfMismatched = 0;
+    float maxDiff = 0.f;
+    for (size_t i = 1; i < edges.size(); i++)
+    {
+        if (keyOf(edges[i]) != keyOf(edges[i - 1]))
+        {
+            continue;
+        }
+
+        nOfShared++;
+        if (std::memcmp(&edges[i].level, &edges[i - 1].level, sizeof(float)) != 0)
+        {
+            nOfMismatched++;
+            maxDiff = glm::max(maxDiff, std::fabs(edges[i].level - edges[i - 1].level));
+        }
+    }
+
+    std::cout << "shared edges: " << nOfShared << ", mismatched levels: " << nOfMismatched;
+    if (nOfMismatched > 0)
+    {
+        std::cout << " (up to " << maxDiff << " apart)";
+    }
+    std::cout << std::endl;
+
+    return nOfMismatched;
+}
+
+// ---------------------------------------------------------
+// Save the tessellated surface
+// Parameters:
+//   fileName: output .obj file
+// Return: true if succeeded
+// ---------------------------------------------------------
+bool Tessellator::saveObj(const string fileName)
+{
+    std::ofstream fout;
+    fout.open(fileName.c_str());
+
+    if (!(fout.good()))
+    {
+        std::cout << "failed to open file : " << fileName << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        fout << "v " << positions[i].x << " " << positions[i].y << " " << positions[i].z << '\n';
+    }
+    for (size_t i = 0; i < uvs.size(); i++)
+    {
+        fout << "vt " << uvs[i].x << " " << uvs[i].y << '\n';
+    }
+    for (size_t i = 0; i < normals.size(); i++)
+    {
+        fout << "vn " << normals[i].x << " " << normals[i].y << " " << normals[i].z << '\n';
+    }
+
+    // v/vt/vn share the same index, starting from 1
+    for (size_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+        fout << "f";
+        for (int k = 0; k < 3; k++)
+        {
+            GLuint idx = indices[i + k] + 1;
+            fout << " " << idx << "/" << idx << "/" << idx;
+        }
+        fout << '\n';
+    }
+
+    fout.close();
+
+    return true;
+}
@@ -0,0 +1,153 @@
+// CPU reference tessellation of the terrain.
+// It reproduces tcsQuad.glsl and tesQuad.glsl without a GPU,
+// so triangle counts and vertex positions can be predicted
+// and regression-tested on machines without a display.
+//
+// Usage:
+//   ./tessref [-mesh file.obj | -grid nx nz] [-height file.png]
+//             [-eye x y z] [-metric distance|error] [-pixels n]
+//             [-error n] [-lodscale n] [-threads n] [-repeat n]
+//             [-checkedges] [-o output.obj]
+#include "pyramid.h"
+
+// ========================================================
+// Main function
+// ========================================================
+int main(int argc, char const *argv[])
+{
+    // Same defaults as main.cpp
+    string meshFile = "./mesh/quad.obj";
+    string heightFile = "./res/height.png";
+    string outputFile = "";
+    vec3 eyePoint = vec3(-0.558788, 2.681102, 1.797832);
+    int nOfThreads = 0;
+    int nOfRepeats = 1;
+    int metric = TESS_METRIC_SCREEN_ERROR;
+    float pixelsPerTriangle = 64.f, maxPixelError = 350.f;
+    float lodScale = 1.f;
+    ivec2 gridSize(0, 0);
+    bool isEdgeCheck = false;
+
+    // Parse arguments
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "-mesh" && i + 1 < argc)
+        {
+            meshFile = argv[++i];
+        }
+        else if (arg == "-grid" && i + 2 < argc)
+        {
+            gridSize.x = glm::max(atoi(argv[++i]), 1);
+            gridSize.y = glm::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-height" && i + 1 < argc)
+        {
+            heightFile = argv[++i];
+        }
+        else if (arg == "-eye" && i + 3 < argc)
+        {
+            eyePoint.x = atof(argv[++i]);
+            eyePoint.y = atof(argv[++i]);
+            eyePoint.z = atof(argv[++i]);
+        }
+        else if (arg == "-metric" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            metric = (name == "distance") ? TESS_METRIC_DISTANCE : TESS_METRIC_SCREEN_ERROR;
+        }
+        else if (arg == "-pixels" && i + 1 < argc)
+        {
+            pixelsPerTriangle = glm::max(float(atof(argv[++i])), 0.1f);
+        }
+        else if (arg == "-error" && i + 1 < argc)
+        {
+            maxPixelError = glm::max(float(atof(argv[++i])), 0.01f);
+        }
+        else if (arg == "-lodscale" && i + 1 < argc)
+        {
+            lodScale = glm::max(float(atof(argv[++i])), 0.01f);
+        }
+        else if (arg == "-threads" && i + 1 < argc)
+        {
+            nOfThreads = atoi(argv[++i]);
+        }
+        else if (arg == "-repeat" && i + 1 < argc)
+        {
+            nOfRepeats = glm::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-checkedges")
+        {
+            isEdgeCheck = true;
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            outputFile = argv[++i];
+        }
+        else
+        {
+            std::cout << "unknown argument : " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Load mesh, or fill the grid of -grid (no OpenGL context needed)
+    Mesh mesh;
+    if (gridSize.x > 0)
+    {
+        mesh.buildGrid(gridSize.x, gridSize.y);
+    }
+    else
+    {
+        mesh.loadObjQuad(meshFile);
+    }
+
+    // Load height map, an empty name means a flat terrain
+    FreeImage_Initialise(true);
+    HeightMap heightMap;
+    if (heightFile != "" && !heightMap.load(heightFile, FreeImage_GetFileType(heightFile.c_str())))
+    {
+        FreeImage_DeInitialise();
+        return EXIT_FAILURE;
+    }
+
+    // Same model matrix as main.cpp
+    mat4 model = scale(mat4(1.f), vec3(10, 10, 10));
+
+    // Only keep vertices when they are written out
+    Tessellator tessellator(mesh, heightFile != "" ? &heightMap : NULL);
+    tessellator.keepVertices = (outputFile != "");
+
+    // Same metric as tcsQuad.glsl, with the roughness texture of main.cpp
+    HeightMap roughnessMap;
+    HeightPyramid roughnessPyramid;
+    if (heightFile != "")
+    {
+        computeRoughness(heightMap, roughnessMap, nOfThreads);
+        roughnessPyramid.build(roughnessMap, nOfThreads);
+        tessellator.screenError.roughness = &roughnessPyramid;
+    }
+    tessellator.metric = metric;
+    tessellator.lodScale = lodScale;
+    tessellator.screenError.pixelsPerTriangle = pixelsPerTriangle;
+    tessellator.screenError.maxPixelError = maxPixelError;
+
+    for (int i = 0; i < nOfRepeats; i++)
+    {
+        tessellator.run(model, eyePoint, nOfThreads);
+        tessellator.printStats();
+    }
+
+    if (outputFile != "" && tessellator.saveObj(outputFile))
+    {
+        std::cout << outputFile << " saved." << '\n';
+    }
+
+    // Two patches sharing an edge must agree on its level
+    size_t nOfMismatched = isEdgeCheck ? tessellator.checkSharedEdges() : 0;
+
+    FreeImage_DeInitialise();
+
+    return (nOfMismatched == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}